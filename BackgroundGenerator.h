@@ -0,0 +1,280 @@
+#pragma once
+#include "HeightfieldQuery.h"
+#include "SurfaceBuilder.h"
+#include "TerrainLod.h"
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace Terrain
+{
+	/// What a background generate hands over: the map, its query quadtree, the heights and normals of its vertices
+	/// and, when asked for, its splat map and geomipmap. The vertices are laid out for the grid the request was made with.
+	struct GeneratedSurface
+	{
+		Heightfield map;
+		std::vector<TerrainVertex> vertices; //the float layout
+		std::vector<CompactTerrainVertex> compactVertices; //or the compact one, the other stays empty
+		std::vector<uint8_t> splat; //empty when the settings had no splat rules
+		HeightfieldQuery query; //over map
+		GeoMipmap lod;
+		bool lodBuilt = false;
+		float min = 0.0f;
+		float max = 0.0f;
+		float heightScale = 0.0f; //what min and max were scaled by
+		unsigned seed = 0; //what the map was generated from
+		TerrainGenerator::Algorithm algorithm = TerrainGenerator::MidpointDisplacement;
+		unsigned request = 0; //what Request returned for it
+
+		//grid the vertices' coordinates were laid out for
+		int cellsX = -1;
+		int cellsZ = -1;
+		float spacingX = 0.0f;
+		float spacingZ = 0.0f;
+		bool compact = false;
+
+		bool IsLaidOut(int otherCellsX, int otherCellsZ, float otherSpacingX, float otherSpacingZ, bool otherCompact) const
+		{
+			return cellsX == otherCellsX && cellsZ == otherCellsZ && spacingX == otherSpacingX && spacingZ == otherSpacingZ && compact == otherCompact;
+		}
+
+		/// Exchanges the buffers rather than copying them.
+		void Swap(GeneratedSurface &other)
+		{
+			std::swap(map, other.map);
+			vertices.swap(other.vertices);
+			compactVertices.swap(other.compactVertices);
+			splat.swap(other.splat);
+			query.Swap(other.query);
+			query.Attach(map);
+			other.query.Attach(other.map);
+			std::swap(lod, other.lod);
+			std::swap(lodBuilt, other.lodBuilt);
+			std::swap(min, other.min);
+			std::swap(max, other.max);
+			std::swap(heightScale, other.heightScale);
+			std::swap(seed, other.seed);
+			std::swap(algorithm, other.algorithm);
+			std::swap(request, other.request);
+			std::swap(cellsX, other.cellsX);
+			std::swap(cellsZ, other.cellsZ);
+			std::swap(spacingX, other.spacingX);
+			std::swap(spacingZ, other.spacingZ);
+			std::swap(compact, other.compact);
+		}
+	};
+
+	/// Generates surfaces on a thread of its own, so whoever asks for one, e.g. the render loop, never waits on
+	/// it. A new request supersedes the one in flight, which stops at its next tile or step. A finished surface
+	/// waits in the back buffer until TakeResult swaps it out, typically at the start of a frame.
+	/// The generator the settings come from is only read during Request, the work runs on a copy.
+	class BackgroundGenerator
+	{
+	public:
+		struct Job
+		{
+			SurfaceBuilder::Settings settings;
+			bool compactVertices;
+			int lodPatchCells; //zero for no geomipmap
+		};
+
+	private:
+		TerrainGenerator generator; //the worker's own, with its own threads
+		TerrainGenerator pendingSettings; //copied in by Request, never generates
+		SurfaceBuilder builder;
+		GeneratedSurface back;
+		TerrainProgress progress;
+
+		mutable std::mutex lock;
+		std::condition_variable wake;
+		std::condition_variable idle;
+		Job pendingJob;
+		bool hasPending = false;
+		bool running = false;
+		bool ready = false;
+		bool stopping = false;
+		unsigned requests = 0;
+
+		std::thread worker;
+
+		//one core is left to the thread drawing while the rest generate
+		static int GetDefaultWorkerCount()
+		{
+			int workers = ThreadPool::DefaultWorkerCount();
+			return workers > 0 ? workers - 1 : 0;
+		}
+
+		//lays out the back buffer's grid if the job's differs, otherwise only heights and normals are rewritten
+		void LayOut(const Job &job)
+		{
+			int cellsX = generator.GetCellsX();
+			int cellsZ = generator.GetCellsZ();
+			const SurfaceBuilder::Settings &settings = job.settings;
+			if (back.IsLaidOut(cellsX, cellsZ, settings.spacingX, settings.spacingZ, job.compactVertices))
+				return;
+
+			size_t vertexCount = (size_t)TerrainMeshBuilder::GetVertexCount(cellsX, cellsZ);
+			if (job.compactVertices)
+			{
+				back.vertices.clear();
+				back.compactVertices.resize(vertexCount);
+				CompactVertexPacker::BuildPlane(cellsX, cellsZ, &back.compactVertices[0]);
+			}
+			else
+			{
+				back.compactVertices.clear();
+				back.vertices.resize(vertexCount);
+				TerrainMeshBuilder::BuildPlane(cellsX, cellsZ, settings.spacingX, settings.spacingZ, &back.vertices[0], nullptr);
+			}
+
+			back.cellsX = cellsX;
+			back.cellsZ = cellsZ;
+			back.spacingX = settings.spacingX;
+			back.spacingZ = settings.spacingZ;
+			back.compact = job.compactVertices;
+		}
+
+		bool Build(const Job &job)
+		{
+			LayOut(job);
+
+			TerrainVertex *vertices = job.compactVertices ? nullptr : &back.vertices[0];
+			CompactTerrainVertex *compactVertices = job.compactVertices ? &back.compactVertices[0] : nullptr;
+			if (!builder.Build(generator, job.settings, back.map, vertices, compactVertices, back.min, back.max, &back.splat, &progress))
+				return false;
+
+			back.heightScale = job.settings.heightScale;
+			back.seed = generator.GetSeed();
+			back.algorithm = job.settings.algorithm;
+			back.query.Build(back.map, job.settings.heightScale, job.settings.spacingX, job.settings.spacingZ, generator.GetThreadPool());
+			back.lodBuilt = job.lodPatchCells > 0 &&
+				back.lod.Build(back.map, job.lodPatchCells, job.settings.spacingX, job.settings.heightScale, generator.GetThreadPool());
+			return true;
+		}
+
+		void WorkerLoop()
+		{
+			for (;;)
+			{
+				Job job;
+				unsigned request;
+				{
+					std::unique_lock<std::mutex> guard(lock);
+					wake.wait(guard, [this] { return stopping || hasPending; });
+					if (stopping)
+						return;
+
+					generator.CopySettings(pendingSettings);
+					job = pendingJob;
+					request = requests;
+					hasPending = false;
+					running = true;
+					progress.cancelled = false;
+					progress.done = 0;
+					progress.total = 0;
+				}
+
+				//the back buffer is the worker's alone while it runs, ready is false until it is done
+				bool finished = Build(job);
+
+				{
+					std::lock_guard<std::mutex> guard(lock);
+					running = false;
+					if (finished && !progress.cancelled)
+					{
+						back.request = request;
+						ready = true;
+					}
+				}
+				idle.notify_all();
+			}
+		}
+
+	public:
+		explicit BackgroundGenerator(int workerCount = GetDefaultWorkerCount()) :
+			generator(0, 0, workerCount),
+			pendingSettings(0, 0, 0)
+		{
+			worker = std::thread(&BackgroundGenerator::WorkerLoop, this);
+		}
+
+		~BackgroundGenerator()
+		{
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				stopping = true;
+				progress.cancelled = true;
+			}
+			wake.notify_all();
+			worker.join();
+		}
+
+		/// Starts generating with settings' dimensions, seed and parameters, superseding whatever is in flight and
+		/// any finished surface not yet taken. Returns a number that increases with every request.
+		unsigned Request(const TerrainGenerator &settings, const Job &job)
+		{
+			unsigned request;
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				pendingSettings.CopySettings(settings);
+				pendingJob = job;
+				hasPending = true;
+				ready = false;
+				progress.cancelled = true;
+				request = ++requests;
+			}
+			wake.notify_all();
+			return request;
+		}
+
+		/// Abandons the request in flight, and a finished surface not yet taken.
+		void Cancel()
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			hasPending = false;
+			ready = false;
+			progress.cancelled = true;
+		}
+
+		/// True from a Request until its surface is ready or cancelled.
+		bool IsBusy() const
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			return hasPending || running;
+		}
+
+		/// How far the latest request has got, from 0 to 1. Tiled algorithms count tiles, the others steps.
+		float GetProgress() const
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			if (ready)
+				return 1.0f;
+			if (hasPending || !running)
+				return 0.0f;
+			return progress.GetFraction();
+		}
+
+		/// Swaps a finished surface with surface, whose buffers are reused for the next request. Never waits,
+		/// false when nothing new is ready.
+		bool TakeResult(GeneratedSurface &surface)
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			if (!ready)
+				return false;
+
+			back.Swap(surface);
+			ready = false;
+			return true;
+		}
+
+		/// Blocks until nothing is in flight, for tools and tests that want the result before carrying on.
+		void Wait()
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			idle.wait(guard, [this] { return !hasPending && !running; });
+		}
+	};
+}
@@ -0,0 +1,175 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace Terrain
+{
+	/// Byte oriented LZ77 for blocks of up to 64KB, in the manner of LZ4: no entropy coding, so decoding is
+	/// a copy loop. A block is a run of sequences, each a token byte, its literals and, unless the sequence
+	/// finishes the block, a match:
+	///
+	///   token           high nibble literal count, low nibble match length - 4, 15 in either means more follows
+	///   [255]* n        the rest of a count of 15 or more, added up
+	///   literals
+	///   offset          2 bytes little endian, 1 to 65535 back from the end of the output so far
+	///   [255]* n        the rest of the match length
+	///
+	/// Matches may overlap the bytes they produce, so runs cost a handful of bytes.
+	struct BlockCodec
+	{
+		static const int minMatch = 4;
+		static const int hashBits = 12;
+		static const size_t maxBlockSize = 65535;
+
+		/// Most bytes Compress can produce from size bytes.
+		static size_t GetBound(size_t size) { return size + size / 255 + 16; }
+
+	private:
+		static uint32_t Read32(const uint8_t *p)
+		{
+			uint32_t value;
+			memcpy(&value, p, sizeof(value));
+			return value;
+		}
+
+		static uint32_t Hash(uint32_t value) { return (value * 2654435761u) >> (32 - hashBits); }
+
+		static uint8_t *PutLength(uint8_t *out, size_t length)
+		{
+			for (; length >= 255; length -= 255)
+				*out++ = 255;
+			*out++ = (uint8_t)length;
+			return out;
+		}
+
+		static uint8_t *PutSequence(uint8_t *out, const uint8_t *literals, size_t literalCount, size_t offset, size_t matchLength)
+		{
+			uint8_t *token = out++;
+			*token = (uint8_t)((literalCount < 15 ? literalCount : 15) << 4);
+			if (literalCount >= 15)
+				out = PutLength(out, literalCount - 15);
+			if (literalCount > 0)
+				memcpy(out, literals, literalCount);
+			out += literalCount;
+			if (matchLength == 0)
+				return out;
+
+			*out++ = (uint8_t)offset;
+			*out++ = (uint8_t)(offset >> 8);
+			size_t length = matchLength - minMatch;
+			*token |= (uint8_t)(length < 15 ? length : 15);
+			if (length >= 15)
+				out = PutLength(out, length - 15);
+			return out;
+		}
+
+		static bool GetLength(const uint8_t *&in, const uint8_t *end, size_t &length)
+		{
+			uint8_t next;
+			do
+			{
+				if (in == end)
+					return false;
+				next = *in++;
+				length += next;
+			} while (next == 255);
+			return true;
+		}
+
+	public:
+		/// Compresses size bytes, at most maxBlockSize, into out, which must hold GetBound(size) bytes.
+		/// Returns the compressed size.
+		static size_t Compress(const uint8_t *source, size_t size, uint8_t *out)
+		{
+			//positions + 1 of the last four bytes seen with each hash, 0 for none
+			uint16_t table[1 << hashBits];
+			memset(table, 0, sizeof(table));
+
+			uint8_t *start = out;
+			size_t anchor = 0;
+			size_t position = 0;
+			while (size >= minMatch && position <= size - minMatch)
+			{
+				uint32_t sequence = Read32(source + position);
+				uint32_t hash = Hash(sequence);
+				size_t candidate = table[hash];
+				table[hash] = (uint16_t)(position + 1);
+				if (candidate == 0 || Read32(source + candidate - 1) != sequence)
+				{
+					++position;
+					continue;
+				}
+
+				size_t match = candidate - 1;
+				size_t length = minMatch;
+				while (position + length < size && source[match + length] == source[position + length])
+					++length;
+
+				out = PutSequence(out, source + anchor, position - anchor, position - match, length);
+				position += length;
+				anchor = position;
+			}
+
+			if (anchor < size || out == start)
+				out = PutSequence(out, source + anchor, size - anchor, 0, 0);
+			return out - start;
+		}
+
+		/// Expands a block Compress made into exactly size bytes at out. False, with out partly written,
+		/// if the block is malformed or does not decode to exactly size bytes.
+		static bool Decompress(const uint8_t *source, size_t sourceSize, uint8_t *out, size_t size)
+		{
+			const uint8_t *in = source;
+			const uint8_t *inEnd = source + sourceSize;
+			uint8_t *outStart = out;
+			uint8_t *outEnd = out + size;
+			if (size == 0)
+				return sourceSize == 0 || (sourceSize == 1 && source[0] == 0);
+
+			while (in < inEnd)
+			{
+				uint8_t token = *in++;
+				size_t literalCount = token >> 4;
+				if (literalCount == 15 && !GetLength(in, inEnd, literalCount))
+					return false;
+				if (literalCount > (size_t)(inEnd - in) || literalCount > (size_t)(outEnd - out))
+					return false;
+				if (literalCount > 0)
+					memcpy(out, in, literalCount);
+				in += literalCount;
+				out += literalCount;
+				if (out == outEnd)
+					return in == inEnd;
+
+				if (inEnd - in < 2)
+					return false;
+				size_t offset = in[0] | ((size_t)in[1] << 8);
+				in += 2;
+				size_t length = (token & 15);
+				if (length == 15 && !GetLength(in, inEnd, length))
+					return false;
+				length += minMatch;
+				if (offset == 0 || offset > (size_t)(out - outStart) || length > (size_t)(outEnd - out))
+					return false;
+
+				//byte by byte so an overlapping match repeats what it has just written
+				const uint8_t *match = out - offset;
+				if (offset >= length)
+				{
+					memcpy(out, match, length);
+					out += length;
+				}
+				else
+				{
+					for (size_t i = 0; i < length; ++i)
+						*out++ = match[i];
+				}
+				if (out == outEnd)
+					return in == inEnd;
+			}
+			return false;
+		}
+	};
+}
@@ -0,0 +1,132 @@
+#pragma once
+#include "TerrainMesh.h"
+#include "TerrainNormals.h"
+
+#include <cassert>
+#include <cstdint>
+
+namespace Terrain
+{
+	/// Eight byte terrain vertex, a quarter of TerrainVertex. x and z are the grid coordinate, from which the shader
+	/// rebuilds the position and uv. The height is quantised against the map's range, which the shaders already get
+	/// as heightRange, and the normal is octahedral at 8 bits a component. shaders/CompactTerrain.vs unpacks it.
+	struct CompactTerrainVertex
+	{
+		uint16_t x;
+		uint16_t height;
+		uint16_t z;
+		uint8_t normal[2];
+	};
+
+	/// Packs and unpacks CompactTerrainVertex arrays laid out like TerrainMeshBuilder::BuildPlane.
+	class CompactVertexPacker
+	{
+		static uint8_t Quantise(float value)
+		{
+			return (uint8_t)(int)((value * 0.5f + 0.5f) * 255.0f + 0.5f);
+		}
+
+	public:
+		/// Largest grid the 16-bit coordinates can address.
+		static const int MaxCells = 65535;
+
+		/// Grid coordinates with a flat height and an up normal.
+		static void BuildPlane(int cellsX, int cellsZ, CompactTerrainVertex *vertices)
+		{
+			TERRAIN_PROFILE_SCOPE("plane");
+			assert(cellsX <= MaxCells && cellsZ <= MaxCells);
+
+			CompactTerrainVertex *vertex = vertices;
+			for (int z = 0; z <= cellsZ; ++z)
+			{
+				for (int x = 0; x <= cellsX; ++x, ++vertex)
+				{
+					vertex->x = (uint16_t)x;
+					vertex->height = 0;
+					vertex->z = (uint16_t)z;
+					vertex->normal[0] = Quantise(0.0f);
+					vertex->normal[1] = Quantise(0.0f);
+				}
+			}
+		}
+
+		static void WriteHeights(const Heightfield &map, float heightScale, CompactTerrainVertex *vertices, float &min, float &max)
+		{
+			WriteHeights(map.GetData(), map.GetWidth(), map.GetDepth(), map.GetStride(), heightScale, vertices, min, max);
+		}
+
+		/// Scales the heights, finds their range and stores each one as a 16-bit fraction of it.
+		/// min and max come out the same as TerrainMeshBuilder::WriteHeights gives for the float layout.
+		static void WriteHeights(const float *heights, int width, int depth, int stride, float heightScale, CompactTerrainVertex *vertices, float &min, float &max)
+		{
+			{
+				TERRAIN_PROFILE_SCOPE("range");
+				min = 999999.0f;
+				max = -999999.0f;
+				for (int z = 0; z < depth; ++z)
+				{
+					const float *row = heights + (size_t)z * stride;
+					for (int x = 0; x < width; ++x)
+					{
+						float height = row[x] * heightScale;
+						min = height < min ? height : min;
+						max = height > max ? height : max;
+					}
+				}
+			}
+
+			TERRAIN_PROFILE_SCOPE("heights");
+			float range = max - min;
+			float toUnit = range > 0.0f ? 65535.0f / range : 0.0f;
+			for (int z = 0; z < depth; ++z)
+				QuantiseRow(heights + (size_t)z * stride, width, heightScale, min, toUnit, vertices + (size_t)z * width);
+		}
+
+		/// Stores a row of scaled heights as 16-bit fractions of a range, toUnit being 65535 / (max - min).
+		static void QuantiseRow(const float *row, int width, float heightScale, float min, float toUnit, CompactTerrainVertex *vertices)
+		{
+			for (int x = 0; x < width; ++x)
+			{
+				int quantised = (int)((row[x] * heightScale - min) * toUnit + 0.5f);
+				vertices[x].height = (uint16_t)(quantised < 65535 ? quantised : 65535);
+			}
+		}
+
+		/// Narrows the 16-bit octahedral pairs NormalGenerator::ComputeOctahedral writes.
+		static void WriteNormals(const uint16_t *octahedral, int count, CompactTerrainVertex *vertices)
+		{
+			for (int i = 0; i < count; ++i, octahedral += 2)
+			{
+				vertices[i].normal[0] = (uint8_t)((octahedral[0] * 255u + 32767u) / 65535u);
+				vertices[i].normal[1] = (uint8_t)((octahedral[1] * 255u + 32767u) / 65535u);
+			}
+		}
+
+		/// Encodes unit normals, three floats per vertex.
+		static void WriteNormals(const float *normals, int count, CompactTerrainVertex *vertices)
+		{
+			for (int i = 0; i < count; ++i, normals += 3)
+			{
+				uint16_t octahedral[2];
+				NormalGenerator::EncodeOctahedral(normals, octahedral);
+				WriteNormals(octahedral, 1, vertices + i);
+			}
+		}
+
+		/// The vertex as CompactTerrain.vs sees it. spacing is the distance between samples, uvStep the uv
+		/// change per sample and min/max the heightRange the heights were quantised against.
+		static void Unpack(const CompactTerrainVertex &vertex, float spacingX, float spacingZ, float uvStepX, float uvStepZ, float min, float max, TerrainVertex &out)
+		{
+			out.pos[0] = vertex.x * spacingX;
+			out.pos[1] = min + vertex.height / 65535.0f * (max - min);
+			out.pos[2] = vertex.z * spacingZ;
+
+			//the 8-bit pair widened back to the 16-bit encoding DecodeOctahedral expects
+			uint16_t octahedral[2] = { (uint16_t)(vertex.normal[0] * 257u), (uint16_t)(vertex.normal[1] * 257u) };
+			NormalGenerator::DecodeOctahedral(octahedral, out.normal);
+
+			out.uv[0] = vertex.x * uvStepX;
+			out.uv[1] = vertex.z * uvStepZ;
+		}
+	};
+}
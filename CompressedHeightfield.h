@@ -0,0 +1,676 @@
+#pragma once
+#include "BlockCodec.h"
+#include "Heightfield.h"
+#include "ThreadPool.h"
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#if !defined(_WIN32)
+#include <sys/types.h>
+#endif
+
+namespace Terrain
+{
+	/// On-disk layout of a heightfield snapshot, in the byte order of the host that saved it. Load reads the structs
+	/// as they are, so a snapshot from a host of the other order fails its version check.
+	///
+	///   CompressedHeightfieldHeader
+	///   CompressedTileEntry[tilesX * tilesZ]   row major
+	///   tile data                              dataSize bytes, entry offsets are from its start
+	struct CompressedHeightfieldHeader
+	{
+		char magic[4];
+		uint32_t version;
+		uint32_t headerSize;
+		uint32_t width;
+		uint32_t depth;
+		uint32_t tileSize;
+		float minHeight;
+		float maxHeight;
+		uint32_t seed;
+		uint32_t algorithm;
+		float sampleSpacing;
+		float heightScale;
+		uint64_t indexOffset;
+		uint64_t dataOffset;
+		uint64_t dataSize;
+	};
+
+	struct CompressedTileEntry
+	{
+		uint64_t offset;
+		uint32_t size; //bytes stored, equal to streamSize when the block codec did not help
+		uint32_t streamSize; //bytes of residuals before the block codec
+		uint32_t predictor; //CompressedHeightfield::Predictor
+		uint32_t reserved;
+	};
+
+	/// A heightfield held in a third to a tenth of the memory, depending on how rough the ground is, and decoded
+	/// a tile at a time. Heights are quantised to 16 bits across the map's range, so every sample comes back within
+	/// about GetMaxError() of what went in. Each tile of tileSize x tileSize samples is coded on its own: a sample
+	/// is predicted from its left, upper and upper left neighbours, with whichever predictor suits the tile better,
+	/// the residuals are Rice coded with a parameter chosen per row, and BlockCodec squeezes flat stretches out of that.
+	/// Rough noise such as many octave fBm is close to incompressible below its finest octave, so it stays near 3x.
+	class CompressedHeightfield
+	{
+	public:
+		static const uint32_t version = 1;
+		static const int defaultTileSize = 64;
+		static const int maxTileSize = 256;
+
+		/// Carried along in snapshots for whatever loads them, not used by the coding.
+		uint32_t seed = 0;
+		uint32_t algorithm = 0;
+		float sampleSpacing = 1.0f;
+		float heightScale = 1.0f;
+
+	private:
+		int width = 0;
+		int depth = 0;
+		int tileSize = defaultTileSize;
+		int tilesX = 0;
+		int tilesZ = 0;
+		float minHeight = 0.0f;
+		float maxHeight = 0.0f;
+
+		std::vector<CompressedTileEntry> tiles;
+		std::vector<uint8_t> data;
+
+		enum Predictor
+		{
+			MedianEdge, //LOCO-I's, follows ridges and cliffs
+			Planar //left + up - upLeft, exact on smooth slopes
+		};
+
+		//codes are at most this many bits of unary before they are sent whole
+		static const unsigned unaryLimit = 24;
+
+		//the median of left, up and the planar prediction, which is the edge detector without its branches
+		static int Predict(int left, int up, int upLeft)
+		{
+			int low = left < up ? left : up;
+			int high = left < up ? up : left;
+			int planar = left + up - upLeft;
+			int clamped = planar < high ? planar : high;
+			return clamped > low ? clamped : low;
+		}
+
+		//residuals wrap around 16 bits, so they always fit whatever the prediction was
+		static unsigned ZigZag(int value, int prediction)
+		{
+			int residual = (int16_t)(uint16_t)(value - prediction);
+			return (((unsigned)residual << 1) ^ (unsigned)(residual >> 15)) & 0xffff;
+		}
+
+		static int UnZigZag(unsigned code, int prediction)
+		{
+			int residual = (int)(code >> 1) ^ -(int)(code & 1);
+			return (uint16_t)(prediction + residual);
+		}
+
+		static int Predict(Predictor predictor, const uint16_t *row, const uint16_t *above, int x, int z)
+		{
+			if (z == 0)
+				return x > 0 ? row[x - 1] : 0;
+			if (x == 0)
+				return above[0];
+			if (predictor == Planar)
+				return row[x - 1] + above[x] - above[x - 1];
+			return Predict(row[x - 1], above[x], above[x - 1]);
+		}
+
+		//Rice parameter for a row of codes, whichever takes fewest bits of the three around log2 of their mean
+		static unsigned ChooseK(const unsigned *codes, int count)
+		{
+			unsigned sum = 0;
+			for (int i = 0; i < count; ++i)
+				sum += codes[i];
+			unsigned meanK = 0;
+			while (meanK < 15 && ((unsigned)count << (meanK + 1)) <= sum)
+				++meanK;
+
+			unsigned bestK = 0;
+			unsigned bestBits = ~0u;
+			for (unsigned k = meanK > 0 ? meanK - 1 : 0; k <= meanK + 1 && k < 16; ++k)
+			{
+				unsigned bits = 0;
+				for (int i = 0; i < count; ++i)
+				{
+					unsigned quotient = codes[i] >> k;
+					bits += quotient < unaryLimit ? quotient + 1 + k : unaryLimit + 16;
+				}
+				if (bits < bestBits)
+				{
+					bestBits = bits;
+					bestK = k;
+				}
+			}
+			return bestK;
+		}
+
+		//value must not be zero
+		static unsigned CountTrailingZeros(uint64_t value)
+		{
+#if defined(_MSC_VER) && defined(_M_X64)
+			unsigned long index;
+			_BitScanForward64(&index, value);
+			return (unsigned)index;
+#elif defined(_MSC_VER)
+			unsigned long index;
+			if (_BitScanForward(&index, (unsigned long)value))
+				return (unsigned)index;
+			_BitScanForward(&index, (unsigned long)(value >> 32));
+			return (unsigned)index + 32;
+#else
+			return (unsigned)__builtin_ctzll(value);
+#endif
+		}
+
+		//least significant bit first
+		struct BitWriter
+		{
+			std::vector<uint8_t> &out;
+			uint64_t bits = 0;
+			unsigned count = 0;
+
+			explicit BitWriter(std::vector<uint8_t> &out) : out(out)
+			{
+			}
+
+			void Put(unsigned value, unsigned bitCount)
+			{
+				bits |= (uint64_t)value << count;
+				count += bitCount;
+				while (count >= 8)
+				{
+					out.push_back((uint8_t)bits);
+					bits >>= 8;
+					count -= 8;
+				}
+			}
+
+			void Flush()
+			{
+				if (count > 0)
+					out.push_back((uint8_t)bits);
+				bits = 0;
+				count = 0;
+			}
+		};
+
+		//reads zeros past the end, Overran says whether it did
+		struct BitReader
+		{
+			const uint8_t *in;
+			const uint8_t *end;
+			uint64_t bits = 0;
+			unsigned count = 0;
+			unsigned overrun = 0;
+
+			BitReader(const uint8_t *in, size_t size) : in(in), end(in + size)
+			{
+			}
+
+			//whole bytes up to 57 or more bits, eight at a time away from the end (x86 and ARM are little endian)
+			void Refill()
+			{
+				if (end - in >= 8)
+				{
+					uint64_t word;
+					memcpy(&word, in, sizeof(word));
+					bits |= word << count;
+					in += (63 - count) >> 3;
+					count |= 56;
+					return;
+				}
+				while (count <= 56)
+				{
+					if (in < end)
+						bits |= (uint64_t)*in++ << count;
+					else
+						++overrun;
+					count += 8;
+				}
+			}
+
+			unsigned Get(unsigned bitCount)
+			{
+				if (count < bitCount)
+					Refill();
+				unsigned value = (unsigned)(bits & ((1ull << bitCount) - 1));
+				bits >>= bitCount;
+				count -= bitCount;
+				return value;
+			}
+
+			//the padding of the last byte is all a stream may leave unread
+			bool Overran() const { return overrun * 8 > count + 7; }
+		};
+
+		static void PutCode(BitWriter &writer, unsigned k, unsigned code)
+		{
+			unsigned quotient = code >> k;
+			if (quotient < unaryLimit)
+			{
+				writer.Put((1u << quotient) - 1, quotient + 1);
+				writer.Put(code & ((1u << k) - 1), k);
+			}
+			else
+			{
+				writer.Put((1u << unaryLimit) - 1, unaryLimit);
+				writer.Put(code, 16);
+			}
+		}
+
+		//one refill covers the longest code, the unary limit and 16 bits
+		static unsigned GetCode(BitReader &reader, unsigned k)
+		{
+			if (reader.count < unaryLimit + 16)
+				reader.Refill();
+
+			unsigned quotient = CountTrailingZeros(~reader.bits | (1ull << unaryLimit));
+			if (quotient < unaryLimit)
+			{
+				uint64_t rest = reader.bits >> (quotient + 1);
+				unsigned code = (quotient << k | (unsigned)(rest & ((1u << k) - 1))) & 0xffff;
+				reader.bits = rest >> k;
+				reader.count -= quotient + 1 + k;
+				return code;
+			}
+
+			uint64_t rest = reader.bits >> unaryLimit;
+			reader.bits = rest >> 16;
+			reader.count -= unaryLimit + 16;
+			return (unsigned)rest & 0xffff;
+		}
+
+		int GetTileWidth(int tileX) const { return tileX < tilesX - 1 ? tileSize : width - tileX * tileSize; }
+		int GetTileDepth(int tileZ) const { return tileZ < tilesZ - 1 ? tileSize : depth - tileZ * tileSize; }
+
+		//the tile's heights as 16 bit levels, row after row
+		void QuantiseTile(const Heightfield &map, int tileX, int tileZ, std::vector<uint16_t> &levels) const
+		{
+			int tileWidth = GetTileWidth(tileX);
+			int tileDepth = GetTileDepth(tileZ);
+			float range = maxHeight - minHeight;
+			float toLevels = range > 0.0f ? 65535.0f / range : 0.0f;
+			levels.resize((size_t)tileWidth * tileDepth);
+			for (int z = 0; z < tileDepth; ++z)
+			{
+				const float *heights = map.GetRow(tileZ * tileSize + z) + tileX * tileSize;
+				uint16_t *row = &levels[(size_t)z * tileWidth];
+				for (int x = 0; x < tileWidth; ++x)
+				{
+					float level = (heights[x] - minHeight) * toLevels + 0.5f;
+					row[x] = (uint16_t)(level <= 0.0f ? 0 : (level >= 65535.0f ? 65535 : (int)level));
+				}
+			}
+		}
+
+		//each row is its Rice parameter in 4 bits and then its codes
+		static void EncodeLevels(const std::vector<uint16_t> &levels, int tileWidth, int tileDepth, Predictor predictor, std::vector<unsigned> &codes, std::vector<uint8_t> &stream)
+		{
+			stream.clear();
+			codes.resize(tileWidth);
+			BitWriter writer(stream);
+			for (int z = 0; z < tileDepth; ++z)
+			{
+				const uint16_t *row = &levels[(size_t)z * tileWidth];
+				const uint16_t *above = z > 0 ? row - tileWidth : nullptr;
+				for (int x = 0; x < tileWidth; ++x)
+					codes[x] = ZigZag(row[x], Predict(predictor, row, above, x, z));
+
+				unsigned k = ChooseK(&codes[0], tileWidth);
+				writer.Put(k, 4);
+				for (int x = 0; x < tileWidth; ++x)
+					PutCode(writer, k, codes[x]);
+			}
+			writer.Flush();
+		}
+
+		template<Predictor predictor>
+		void DecodeRow(BitReader &reader, unsigned k, uint16_t *row, const uint16_t *above, int first, int last, float *heights, float toHeight) const
+		{
+			for (int x = first; x < last; ++x)
+			{
+				int left = row[x - 1];
+				int up = above[x];
+				int upLeft = above[x - 1];
+				int prediction = predictor == Planar ? left + up - upLeft : Predict(left, up, upLeft);
+				int value = UnZigZag(GetCode(reader, k), prediction);
+				row[x] = (uint16_t)value;
+				heights[x] = minHeight + value * toHeight;
+			}
+		}
+
+		bool DecodeStream(const uint8_t *stream, size_t streamSize, Predictor predictor, int tileWidth, int tileDepth, float *out, int stride, std::vector<uint16_t> &rows) const
+		{
+			float toHeight = (maxHeight - minHeight) / 65535.0f;
+			BitReader reader(stream, streamSize);
+			rows.resize(tileWidth * 2);
+
+			for (int z = 0; z < tileDepth; ++z)
+			{
+				uint16_t *row = &rows[(z & 1) * tileWidth];
+				const uint16_t *above = &rows[((z + 1) & 1) * tileWidth];
+				float *heights = out + (size_t)z * stride;
+				unsigned k = reader.Get(4);
+				int first = z == 0 ? tileWidth : 1;
+				for (int x = 0; x < first; ++x)
+				{
+					int value = UnZigZag(GetCode(reader, k), Predict(predictor, row, above, x, z));
+					row[x] = (uint16_t)value;
+					heights[x] = minHeight + value * toHeight;
+				}
+
+				//the bulk of the tile, with the predictor picked once rather than per sample
+				if (predictor == Planar)
+					DecodeRow<Planar>(reader, k, row, above, first, tileWidth, heights, toHeight);
+				else
+					DecodeRow<MedianEdge>(reader, k, row, above, first, tileWidth, heights, toHeight);
+
+				//a malformed stream stops at its end rather than decoding zeros past it
+				if (reader.Overran())
+					return false;
+			}
+			return true;
+		}
+
+		//fseek and ftell only reach 2 GB where long is 32 bits
+		static bool Seek(FILE *file, uint64_t offset, int origin)
+		{
+#if defined(_WIN32)
+			return _fseeki64(file, (__int64)offset, origin) == 0;
+#else
+			return fseeko(file, (off_t)offset, origin) == 0;
+#endif
+		}
+
+		static uint64_t GetLength(FILE *file)
+		{
+			if (!Seek(file, 0, SEEK_END))
+				return 0;
+#if defined(_WIN32)
+			__int64 length = _ftelli64(file);
+#else
+			off_t length = ftello(file);
+#endif
+			return length > 0 ? (uint64_t)length : 0;
+		}
+
+		bool Validate() const
+		{
+			if (width <= 0 || depth <= 0 || tileSize <= 0 || tileSize > maxTileSize || !(minHeight <= maxHeight))
+				return false;
+			if (tiles.size() != (size_t)tilesX * tilesZ)
+				return false;
+
+			//no sample codes to more than unaryLimit + 16 bits nor a row's parameter to more than a byte, so a bigger
+			//stream is corrupt, and decoding it would first allocate however much it claims
+			uint64_t maxStreamSize = (uint64_t)tileSize * tileSize * (unaryLimit + 16) / 8 + tileSize + 8;
+			for (size_t i = 0; i < tiles.size(); ++i)
+			{
+				const CompressedTileEntry &tile = tiles[i];
+				if (tile.offset > data.size() || tile.size > data.size() - tile.offset || tile.size > tile.streamSize || tile.streamSize > maxStreamSize || tile.predictor > Planar)
+					return false;
+			}
+			return true;
+		}
+
+	public:
+		CompressedHeightfield()
+		{
+		}
+
+		/// Compresses map with heights quantised across its own range.
+		void Compress(const Heightfield &map, ThreadPool &threadPool, int tileSize = defaultTileSize)
+		{
+			float min = 999999.0f;
+			float max = -999999.0f;
+			for (int z = 0; z < map.GetDepth(); ++z)
+			{
+				const float *row = map.GetRow(z);
+				for (int x = 0; x < map.GetWidth(); ++x)
+				{
+					min = row[x] < min ? row[x] : min;
+					max = row[x] > max ? row[x] : max;
+				}
+			}
+			Compress(map, min, max, threadPool, tileSize);
+		}
+
+		/// Compresses map with heights quantised across [min, max], e.g. the range generate found, divided by the
+		/// height scale. Heights outside it are clamped. tileSize is clamped to maxTileSize.
+		void Compress(const Heightfield &map, float min, float max, ThreadPool &threadPool, int tileSize = defaultTileSize)
+		{
+			width = map.GetWidth();
+			depth = map.GetDepth();
+			this->tileSize = tileSize < 1 ? 1 : (tileSize > maxTileSize ? maxTileSize : tileSize);
+			tilesX = (width + this->tileSize - 1) / this->tileSize;
+			tilesZ = (depth + this->tileSize - 1) / this->tileSize;
+			minHeight = min;
+			maxHeight = max > min ? max : min;
+
+			//each tile is coded into its own block, then the blocks are laid end to end
+			int tileCount = tilesX * tilesZ;
+			std::vector<std::vector<uint8_t>> blocks(tileCount);
+			tiles.resize(tileCount);
+			threadPool.ParallelFor(0, tileCount, threadPool.GetGrainSize(tileCount), [&](int first, int last)
+			{
+				std::vector<uint16_t> levels;
+				std::vector<unsigned> codes;
+				std::vector<uint8_t> stream;
+				std::vector<uint8_t> planarStream;
+				for (int i = first; i < last; ++i)
+				{
+					int tileX = i % tilesX;
+					int tileZ = i / tilesX;
+					QuantiseTile(map, tileX, tileZ, levels);
+
+					//both predictors are tried, smooth noise suits the planar one and ridged or eroded ground the other
+					EncodeLevels(levels, GetTileWidth(tileX), GetTileDepth(tileZ), MedianEdge, codes, stream);
+					EncodeLevels(levels, GetTileWidth(tileX), GetTileDepth(tileZ), Planar, codes, planarStream);
+					Predictor predictor = planarStream.size() < stream.size() ? Planar : MedianEdge;
+					if (predictor == Planar)
+						stream.swap(planarStream);
+
+					std::vector<uint8_t> &block = blocks[i];
+					size_t size = stream.size();
+					if (stream.size() <= BlockCodec::maxBlockSize)
+					{
+						block.resize(BlockCodec::GetBound(stream.size()));
+						size = BlockCodec::Compress(stream.empty() ? nullptr : &stream[0], stream.size(), &block[0]);
+					}
+					if (size >= stream.size())
+						block = stream;
+					else
+						block.resize(size);
+
+					CompressedTileEntry &tile = tiles[i];
+					tile.streamSize = (uint32_t)stream.size();
+					tile.size = (uint32_t)block.size();
+					tile.predictor = predictor;
+					tile.reserved = 0;
+				}
+			});
+
+			uint64_t offset = 0;
+			for (int i = 0; i < tileCount; ++i)
+			{
+				tiles[i].offset = offset;
+				offset += tiles[i].size;
+			}
+			data.resize((size_t)offset);
+			for (int i = 0; i < tileCount; ++i)
+			{
+				if (!blocks[i].empty())
+					memcpy(&data[(size_t)tiles[i].offset], &blocks[i][0], blocks[i].size());
+			}
+		}
+
+		void Clear()
+		{
+			width = depth = tilesX = tilesZ = 0;
+			tiles.clear();
+			data.clear();
+		}
+
+		bool IsEmpty() const { return tiles.empty(); }
+		int GetWidth() const { return width; }
+		int GetDepth() const { return depth; }
+		int GetTileSize() const { return tileSize; }
+		int GetTilesX() const { return tilesX; }
+		int GetTilesZ() const { return tilesZ; }
+		float GetMinHeight() const { return minHeight; }
+		float GetMaxHeight() const { return maxHeight; }
+
+		/// Furthest any decoded height can be from the one compressed, half a quantisation step.
+		float GetMaxError() const { return (maxHeight - minHeight) / 65535.0f * 0.5f; }
+
+		/// Bytes held, the tile data and its index.
+		size_t GetSizeInBytes() const { return data.size() + tiles.size() * sizeof(CompressedTileEntry); }
+
+		/// Decodes one tile into out, rows stride floats apart. The tile is tileSize square, less at the right and
+		/// bottom edges, and starts at sample (tileX * tileSize, tileZ * tileSize). scratch is reused between calls,
+		/// so threads decoding at the same time each need their own.
+		bool DecodeTile(int tileX, int tileZ, float *out, int stride, std::vector<uint8_t> &scratch, std::vector<uint16_t> &rows) const
+		{
+			if (tileX < 0 || tileZ < 0 || tileX >= tilesX || tileZ >= tilesZ)
+				return false;
+
+			const CompressedTileEntry &tile = tiles[(size_t)tileZ * tilesX + tileX];
+			const uint8_t *block = tile.size ? &data[(size_t)tile.offset] : nullptr;
+			Predictor predictor = (Predictor)tile.predictor;
+			if (tile.size == tile.streamSize)
+				return DecodeStream(block, tile.size, predictor, GetTileWidth(tileX), GetTileDepth(tileZ), out, stride, rows);
+
+			scratch.resize(tile.streamSize);
+			if (!BlockCodec::Decompress(block, tile.size, &scratch[0], scratch.size()))
+				return false;
+			return DecodeStream(&scratch[0], scratch.size(), predictor, GetTileWidth(tileX), GetTileDepth(tileZ), out, stride, rows);
+		}
+
+		/// As above, into a heightfield resized to the tile.
+		bool DecodeTile(int tileX, int tileZ, Heightfield &tile) const
+		{
+			if (tileX < 0 || tileZ < 0 || tileX >= tilesX || tileZ >= tilesZ)
+				return false;
+
+			std::vector<uint8_t> scratch;
+			std::vector<uint16_t> rows;
+			if (!tile.Resize(GetTileWidth(tileX), GetTileDepth(tileZ)))
+				return false;
+			return DecodeTile(tileX, tileZ, tile.GetData(), tile.GetStride(), scratch, rows);
+		}
+
+		/// Decodes every tile into map, resized to the whole map, rows of tiles in parallel.
+		bool Decompress(Heightfield &map, ThreadPool &threadPool) const
+		{
+			if (IsEmpty() || !map.Resize(width, depth))
+				return false;
+
+			std::atomic<bool> ok(true);
+			threadPool.ParallelFor(0, tilesZ, threadPool.GetGrainSize(tilesZ), [&](int first, int last)
+			{
+				std::vector<uint8_t> scratch;
+				std::vector<uint16_t> rows;
+				for (int tileZ = first; tileZ < last; ++tileZ)
+				{
+					for (int tileX = 0; tileX < tilesX; ++tileX)
+					{
+						float *origin = map.GetRow(tileZ * tileSize) + tileX * tileSize;
+						if (!DecodeTile(tileX, tileZ, origin, map.GetStride(), scratch, rows))
+							ok = false;
+					}
+				}
+			});
+			return ok;
+		}
+
+		/// Writes a snapshot, the tile data as it is held, so saving and loading cost no coding.
+		bool Save(const char *path) const
+		{
+			if (IsEmpty())
+				return false;
+
+			CompressedHeightfieldHeader header;
+			memset(&header, 0, sizeof(header));
+			memcpy(header.magic, "TTHC", 4);
+			header.version = version;
+			header.headerSize = sizeof(header);
+			header.width = width;
+			header.depth = depth;
+			header.tileSize = tileSize;
+			header.minHeight = minHeight;
+			header.maxHeight = maxHeight;
+			header.seed = seed;
+			header.algorithm = algorithm;
+			header.sampleSpacing = sampleSpacing;
+			header.heightScale = heightScale;
+			header.indexOffset = sizeof(header);
+			header.dataOffset = header.indexOffset + tiles.size() * sizeof(CompressedTileEntry);
+			header.dataSize = data.size();
+
+			FILE *file = fopen(path, "wb");
+			if (!file)
+				return false;
+
+			bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+			ok = ok && fwrite(&tiles[0], sizeof(CompressedTileEntry), tiles.size(), file) == tiles.size();
+			ok = ok && (data.empty() || fwrite(&data[0], 1, data.size(), file) == data.size());
+			return fclose(file) == 0 && ok;
+		}
+
+		/// Reads a snapshot Save wrote. False, leaving this empty, if the file is missing or malformed.
+		bool Load(const char *path)
+		{
+			Clear();
+			FILE *file = fopen(path, "rb");
+			if (!file)
+				return false;
+
+			CompressedHeightfieldHeader header;
+			uint64_t length = GetLength(file);
+			bool ok = Seek(file, 0, SEEK_SET) && fread(&header, sizeof(header), 1, file) == 1 && memcmp(header.magic, "TTHC", 4) == 0 &&
+				header.version == version && header.headerSize == sizeof(header) && header.tileSize > 0 && header.tileSize <= (uint32_t)maxTileSize &&
+				header.width > 0 && header.depth > 0 && header.width <= 1u << 20 && header.depth <= 1u << 20;
+
+			//the index and the data must both be in the file before anything is allocated for them, so a corrupt
+			//header is turned away rather than asking for terabytes
+			uint64_t tileCount = ok ? (uint64_t)((header.width + header.tileSize - 1) / header.tileSize) * ((header.depth + header.tileSize - 1) / header.tileSize) : 0;
+			ok = ok && header.indexOffset <= length && tileCount <= (length - header.indexOffset) / sizeof(CompressedTileEntry) &&
+				header.dataOffset <= length && header.dataSize <= length - header.dataOffset;
+			if (ok)
+			{
+				width = header.width;
+				depth = header.depth;
+				tileSize = header.tileSize;
+				tilesX = (width + tileSize - 1) / tileSize;
+				tilesZ = (depth + tileSize - 1) / tileSize;
+				minHeight = header.minHeight;
+				maxHeight = header.maxHeight;
+				seed = header.seed;
+				algorithm = header.algorithm;
+				sampleSpacing = header.sampleSpacing;
+				heightScale = header.heightScale;
+
+				tiles.resize((size_t)tilesX * tilesZ);
+				data.resize((size_t)header.dataSize);
+				ok = Seek(file, header.indexOffset, SEEK_SET) && fread(&tiles[0], sizeof(CompressedTileEntry), tiles.size(), file) == tiles.size();
+				ok = ok && Seek(file, header.dataOffset, SEEK_SET) && (data.empty() || fread(&data[0], 1, data.size(), file) == data.size());
+			}
+
+			ok = fclose(file) == 0 && ok && Validate();
+			if (!ok)
+				Clear();
+			return ok;
+		}
+	};
+}
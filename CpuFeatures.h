@@ -0,0 +1,89 @@
+#pragma once
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define TERRAIN_SIMD_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#else
+#define TERRAIN_SIMD_X86 0
+#endif
+
+//MSVC lets any function use any intrinsic, gcc and clang need the instruction set enabled per function
+#if TERRAIN_SIMD_X86 && !defined(_MSC_VER)
+#define TERRAIN_TARGET_SSE41 __attribute__((target("sse4.1")))
+#define TERRAIN_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TERRAIN_TARGET_SSE41
+#define TERRAIN_TARGET_AVX2
+#endif
+
+namespace Terrain
+{
+	/// Instruction sets available on the running CPU, queried once on first use.
+	class CpuFeatures
+	{
+	private:
+		bool sse41 = false;
+		bool avx2 = false;
+
+#if TERRAIN_SIMD_X86
+		static void CpuId(int leaf, int subLeaf, unsigned regs[4])
+		{
+#if defined(_MSC_VER)
+			int info[4];
+			__cpuidex(info, leaf, subLeaf);
+			for (int i = 0; i < 4; ++i)
+				regs[i] = (unsigned)info[i];
+#else
+			__cpuid_count(leaf, subLeaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+		}
+
+		static unsigned long long ReadXcr0()
+		{
+#if defined(_MSC_VER)
+			return _xgetbv(0);
+#else
+			unsigned lo, hi;
+			__asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+			return ((unsigned long long)hi << 32) | lo;
+#endif
+		}
+#endif
+
+		CpuFeatures()
+		{
+#if TERRAIN_SIMD_X86
+			unsigned regs[4];
+			CpuId(0, 0, regs);
+			unsigned maxLeaf = regs[0];
+
+			CpuId(1, 0, regs);
+			sse41 = (regs[2] & (1u << 19)) != 0;
+
+			//AVX state must also be enabled by the OS before ymm registers can be used
+			bool osxsave = (regs[2] & (1u << 27)) != 0;
+			bool avx = (regs[2] & (1u << 28)) != 0;
+			if (maxLeaf >= 7 && osxsave && avx && (ReadXcr0() & 6) == 6)
+			{
+				CpuId(7, 0, regs);
+				avx2 = (regs[1] & (1u << 5)) != 0;
+			}
+#endif
+		}
+
+	public:
+		static const CpuFeatures &Get()
+		{
+			static CpuFeatures features;
+			return features;
+		}
+
+		bool HasSse41() const { return sse41; }
+		bool HasAvx2() const { return avx2; }
+	};
+}
@@ -1,46 +1,80 @@
 #pragma once
 #include "../../octet.h"
-#include "PerlinNoiseGenerator.h"
+#include "TerrainGenerator.h"
+#include "TerrainMesh.h"
+#include "TileStore.h"
+#include "TerrainLod.h"
+#include "TerrainNormals.h"
+#include "CompactVertex.h"
+#include "SplatMap.h"
+#include "BackgroundGenerator.h"
+#include "TextureLayerLoader.h"
+#include "CompressedHeightfield.h"
+#include "HeightfieldQuery.h"
+#include "TerrainSurface.h"
 
 #include <ctime>
-#include <unordered_map>
+#include <deque>
+#include <memory>
 
 namespace Terrain
 {
 	class CustomTerrain : public octet::mesh
 	{
-		typedef void (CustomTerrain::*pMemberFunc_t)(std::vector<std::vector<float>> &map);
-
 	public:
-		enum Algorithm
-		{
-			MidpointDisplacement,
-			DiamondSquare,
-			PerlinNoise,
-			FractionalBrownianMotion,
-			MultiFractal
-		};
+		typedef TerrainGenerator::Algorithm Algorithm;
 
 	private:
 
-		octet::random rand;
-		PerlinNoiseGenerator noise;
+		TerrainGenerator generator;
 
 		octet::ivec3 dimensions;
 		octet::vec3 size;
 
-		std::vector<std::vector<float>> heightMap;
-		std::unordered_map<Algorithm, pMemberFunc_t> algorithmToFunction;
+		//the map on show and its query, geomipmap, splat texels and body
+		TerrainSurface surface;
+		SurfaceBuilder builder;
 		
 		octet::material *customMaterial;
 
 		octet::ref<octet::param_uniform> heightRange;
+		octet::ref<octet::param_uniform> gridScale;
+		octet::ref<octet::param_uniform> splatScale;
+
+		//shows the surface's splat texels, the shader falls back to height bands without them
+		octet::ref<octet::image> splatImage;
 
 
 		octet::dynarray<vertex> vertices;
 		octet::dynarray<uint32_t> indices;
+		octet::dynarray<uint16_t> shortIndices;
+
+		//with compact vertices only these go to the mesh, vertices stays empty
+		//after applyGenerated the mesh holds the background's vertices, the arrays here are rewritten in full by generate
+		bool compactVertices;
+		octet::dynarray<CompactTerrainVertex> packedVertices;
+
+		//layout the vertex and index buffers were last built for, only heights and normals change between generates
+		int planeCellsX = -1;
+		int planeCellsZ = -1;
+		float planeDeltaX = 0.0f;
+		float planeDeltaZ = 0.0f;
+		bool planeIndices = false;
 
 		octet::dynarray<octet::ref<octet::image>> terrainLayers;
+		TextureLayerLoader layerLoader;
+
+		TileStore tileStore;
+
+		std::vector<uint32_t> lodIndices;
+		bool lodChanged = false;
+
+		//started by the first generateAsync, the surface it last handed over is given back for the next one
+		std::unique_ptr<BackgroundGenerator> background;
+		GeneratedSurface backgroundSurface;
+
+		//maps shown before this one, newest last, compressed as they are replaced so going back costs a decode
+		std::deque<CompressedHeightfield> history;
 
 	public:
 
@@ -48,60 +82,131 @@ namespace Terrain
 		float heightScale = 50.0f;
 		bool usePerlinRandom = false;
 
+		/// Draw the map as geomipmapped patches instead of one full resolution grid, UpdateLod picks their levels.
+		/// The cell counts must be multiples of lodPatchCells.
+		bool useLod = false;
+
+		/// Generate world continuous algorithms tile by tile with TerrainPipeline instead of one pass per step.
+		/// With analytic normals off the result is identical, the others always take the separate passes.
+		bool useTiledPipeline = false;
+
+		/// Perlin and fBm normals from the noise's analytic slope, written in the same pass as the heights.
+		/// They are exact where differences of neighbouring heights are not, along the map's edges in particular.
+		bool useAnalyticNormals = true;
+
+		/// Hydraulic and thermal erosion run over the map after the algorithm, none by default. An eroded map
+		/// always takes the separate passes. Maps loaded from a tile store and streamed chunks are left as they are.
+		ErosionSimulator::Settings erosion;
+
+		/// Bake which layer shows where into a texture with each map, by the rules below, rather than have the
+		/// shader blend fixed height bands. Tiles loaded from a store always take the bands.
+		bool useSplatMap = true;
+		std::vector<SplatRule> splatRules = SplatMapBaker::GetDefaultRules();
+
+		int lodPatchCells = 32;
+		float lodPixelError = 2.0f;
+
+		/// Maps ShowPrevious can go back through, the oldest are dropped beyond it. 0 keeps none.
+		int historyLength = 16;
+
+		/// Seeds every generator, the same seed always produces the same map.
+		unsigned GetSeed() const { return generator.GetSeed(); }
+		void SetSeed(unsigned seed) { generator.SetSeed(seed); }
+
 		octet::material* GetMaterial() { return customMaterial; }
 
-		void InitialiseAlgorithmDispatchMap()
+		/// Worker threads used by the noise generators, on top of the calling thread. Output does not depend on it.
+		int GetWorkerCount() const { return generator.GetWorkerCount(); }
+		void SetWorkerCount(int workerCount) { generator.SetWorkerCount(workerCount); }
+
+		TerrainGenerator &GetGenerator() { return generator; }
+
+		/// World distance between neighbouring samples, the same spacing buildPlane lays the grid out with.
+		float GetSampleSpacing() { return get_aabb().get_half_extent().x() / dimensions.x() * 2.0f; }
+
+		/// Where the layers' decoded texels are kept between launches, written the first time the images are decoded.
+		static const char *GetDefaultTexturePackPath() { return "src/examples/terrain-generation/textures/layers.ttp"; }
+
+		/// Sets the layers decoding, or loading from the texture pack, while the first map generates.
+		void StartImageLayers(const char *texturePackPath)
 		{
-			algorithmToFunction[Algorithm::MidpointDisplacement] = &CustomTerrain::MidpointDisplacementAlgorithm;
-			algorithmToFunction[Algorithm::DiamondSquare] = &CustomTerrain::DiamondSquareAlgorithm;
-			algorithmToFunction[Algorithm::PerlinNoise] = &CustomTerrain::PerlinNoiseAlgorithm;
-			algorithmToFunction[Algorithm::FractionalBrownianMotion] = &CustomTerrain::FractionalBrownianMotionAlgorithm;
-			algorithmToFunction[Algorithm::MultiFractal] = &CustomTerrain::MultiFractalAlgorithm;
+			static const char *const layerPaths[] =
+			{
+				"src/examples/terrain-generation/textures/water2.jpg",
+				"src/examples/terrain-generation/textures/sand2.jpg",
+				"src/examples/terrain-generation/textures/grass5.jpg",
+				"src/examples/terrain-generation/textures/rock.jpg",
+				"src/examples/terrain-generation/textures/snow.jpg",
+			};
+			layerLoader.Start(layerPaths, SplatMapBaker::layerCount, texturePackPath);
+
+			//replaced by uploadSplat with a texel per sample once there is a map
+			static const uint8_t noWeights[4] = { 0, 0, 0, 0 };
+			splatImage = new octet::image(noWeights, sizeof(noWeights), 1, 1, GL_RGBA, GL_UNSIGNED_BYTE);
+			customMaterial->add_sampler(5, octet::app_utils::get_atom("splat"), splatImage, new octet::sampler());
 		}
 
 		void InitialiseImageLayers()
 		{
-			octet::image *img0 = new octet::image("src/examples/terrain-generation/textures/water2.jpg");
-			customMaterial->add_sampler(0, octet::app_utils::get_atom("layer0"), img0, new octet::sampler());
-
-			octet::image *img1 = new octet::image("src/examples/terrain-generation/textures/sand2.jpg");
-			customMaterial->add_sampler(1, octet::app_utils::get_atom("layer1"), img1, new octet::sampler());
-			
-			octet::image *img2 = new octet::image("src/examples/terrain-generation/textures/grass5.jpg");
-			customMaterial->add_sampler(2, octet::app_utils::get_atom("layer2"), img2, new octet::sampler());
-
-			octet::image *img3 = new octet::image("src/examples/terrain-generation/textures/rock.jpg");
-			customMaterial->add_sampler(3, octet::app_utils::get_atom("layer3"), img3, new octet::sampler());
+			layerLoader.Finish();
+			if (layerLoader.WrotePack())
+				printf("Wrote the decoded textures to a texture pack, later launches load that instead\n");
 
-			octet::image *img4 = new octet::image("src/examples/terrain-generation/textures/snow.jpg");
-			customMaterial->add_sampler(4, octet::app_utils::get_atom("layer4"), img4, new octet::sampler());
+			const char *samplerNames[] = { "layer0", "layer1", "layer2", "layer3", "layer4" };
+			for (int layer = 0; layer < SplatMapBaker::layerCount; ++layer)
+			{
+				terrainLayers.push_back(layerLoader.GetImage(layer));
+				customMaterial->add_sampler(layer, octet::app_utils::get_atom(samplerNames[layer]), layerLoader.GetImage(layer), new octet::sampler());
+			}
 		}
 
-		CustomTerrain(octet::vec3 size, octet::ivec3 dimensions, Algorithm algorithmType)
+		/// compactVertices selects the eight byte CompactTerrainVertex layout over the 32 byte float one.
+		/// texturePackPath is where the texture layers are loaded from, or saved to after decoding, null for neither.
+		CustomTerrain(octet::vec3 size, octet::ivec3 dimensions, Algorithm algorithmType, bool compactVertices = false,
+			const char *texturePackPath = GetDefaultTexturePackPath()) :
+			generator(dimensions.x(), dimensions.z()),
+			compactVertices(compactVertices)
 		{
-			InitialiseAlgorithmDispatchMap();
-
 			this->algorithmType = algorithmType;
 			this->dimensions = dimensions;
 			this->size = size;
 
 			__int64 theTime = time(NULL);
-			printf("Time:%i", theTime);
-			rand = octet::random((unsigned)theTime);
+			printf("Seed:%u\n", (unsigned)theTime);
+			generator.SetSeed((unsigned)theTime);
 
-			set_default_attributes();
+			if (compactVertices)
+			{
+				clear_attributes();
+				add_attribute(octet::attribute_pos, 3, GL_UNSIGNED_SHORT, 0);
+				add_attribute(octet::attribute_normal, 2, GL_UNSIGNED_BYTE, 6, GL_TRUE);
+			}
+			else
+			{
+				set_default_attributes();
+			}
 			set_aabb(octet::aabb(octet::vec3(0, 0, 0), size));
 
-			heightMap.resize(dimensions.x() + 1, std::vector<float>(dimensions.z() + 1, 0.0f));
-
-			octet::param_shader* shader = new octet::param_shader("shaders/default.vs", "src/examples/terrain-generation/shaders/MultiLayerTerrain.fs");
+			const char *vertexShader = compactVertices ? "src/examples/terrain-generation/shaders/CompactTerrain.vs" : "shaders/default.vs";
+			octet::param_shader* shader = new octet::param_shader(vertexShader, "src/examples/terrain-generation/shaders/MultiLayerTerrain.fs");
 			customMaterial = new octet::material(octet::vec4(0, 1, 0, 1), shader);
-			InitialiseImageLayers();
+			StartImageLayers(texturePackPath);
 
 			octet::atom_t atom_heightRange = octet::app_utils::get_atom("heightRange");
 			heightRange = customMaterial->add_uniform(nullptr, atom_heightRange, GL_FLOAT_VEC2, 1, octet::param::stage_fragment);
 
+			octet::atom_t atom_splatScale = octet::app_utils::get_atom("splatScale");
+			splatScale = customMaterial->add_uniform(nullptr, atom_splatScale, GL_FLOAT_VEC4, 1, octet::param::stage_fragment);
+
+			if (compactVertices)
+			{
+				octet::atom_t atom_gridScale = octet::app_utils::get_atom("gridScale");
+				gridScale = customMaterial->add_uniform(nullptr, atom_gridScale, GL_FLOAT_VEC4, 1, octet::param::stage_vertex);
+			}
+
+			//the images decode on their own threads meanwhile
 			generate();
+			InitialiseImageLayers();
 		}
 
 		~CustomTerrain()
@@ -111,379 +216,458 @@ namespace Terrain
 
 		void generate()
 		{
-			buildPlane();
+			//a map still on its way from the background would replace this one when it landed
+			if (background)
+				background->Cancel();
 
-			//dispatch to correct algorithm
-			pMemberFunc_t algFunc = algorithmToFunction[algorithmType];
-			(this->*algFunc)(heightMap);
+			rememberMap();
+			bool rebuilt = buildPlane();
 
-			float min = 999999.0f;
-			float max = -999999.0f;
+			generator.usePerlinRandom = usePerlinRandom;
 
-			//Set points into the vertex structure
-			for (int x = 0; x <= dimensions.x(); ++x)
-			{
-				for (int z = 0; z <= dimensions.z(); ++z)
-				{
-					int index = x * (dimensions.z() + 1) + z;
+			float min, max;
+			TerrainVertex *meshVertices = compactVertices ? nullptr : GetMeshVertices();
+			surface.Build(builder, generator, GetBuildSettings(), useLod ? lodPatchCells : 0, meshVertices, compactVertices ? packedVertices.data() : nullptr, min, max);
+			lodChanged = surface.IsLodBuilt();
 
-					octet::vec3 pos(vertices[index].pos);
-					pos.y() = heightMap[x][z] * heightScale;
+			upload(min, max, rebuilt);
 
-					vertices[index].pos = octet::vec3p(pos.x(), pos.y(), pos.z());
+			//dump(octet::log(""));
 
-					min = pos.y() < min ? pos.y() : min;
-					max = pos.y() > max ? pos.y() : max;
-				}
-			}
+			//this->set_mode(GL_LINES);
+		}
 
-			for (int z = 0; z <= dimensions.z(); ++z)
+		/// Starts generate on a background thread and returns at once, superseding a generate still running there.
+		/// The old map stays up until applyGenerated swaps the new one in. Returns the request's number.
+		unsigned generateAsync()
+		{
+			//a new grid needs buffers of its size to land in, otherwise at most the indices changed
+			bool layoutChanged = !isPlaneLaidOut();
+			if (buildPlane())
 			{
-				for (int x = 0; x <= dimensions.x(); ++x)
-				{
-					/*
-					//calc cheap norms based on nearest neighbouring heights
-					//http://www.flipcode.com/archives/Calculating_Vertex_Normals_for_Height_Maps.shtml
-					float nX = heightMap[x < dimensions.x() ? x + 1 : x][z] - heightMap[x > 0 ? x - 1 : x][z];
-					if (x == 0 || x == dimensions.x())
-						nX *= 2;
-
-					float nZ = heightMap[x][z < dimensions.z() ? z + 1 : z] - heightMap[x][z > 0 ? z - 1 : z];
-					if (z == 0 || z == dimensions.z())
-						nZ *= 2;
-					*/
-			
-					int centre = x * (dimensions.z()+1) + z;
-					int east = (x <= (dimensions.x()+1) ? x + 1 : x) * (dimensions.z()+1) + z;
-					int south = x * (dimensions.z()+1) + ((z <= dimensions.z()+1) ? z + 1 : z);
-					int west = (x > 0 ? x - 1 : x) * (dimensions.z()+1) + z;
-					int north = x * (dimensions.z()+1) + (z > 0 ? z - 1 : z);
-					//int centre = (x & dimensions.x()) + (z & (dimensions.z())) * dimensions.x();
-					//int east = ((x+1) & (dimensions.x())) + (z & (dimensions.z())) * dimensions.x();
-					//int south = (x & (dimensions.x())) + ((z+1) & (dimensions.z())) * dimensions.x();
-					//int west = ((x-1) & (dimensions.x())) + (z & (dimensions.z())) * dimensions.x();
-					//int north = (x & (dimensions.x())) + ((z-1) & (dimensions.z())) * dimensions.x();
-					
-					//Averaged Normals
-					octet::vec3 centrePos = vertices[centre].pos;
-					octet::vec3 eastPos = vertices[east].pos;
-					octet::vec3 southPos = vertices[south].pos;
-					octet::vec3 westPos = vertices[west].pos;
-					octet::vec3 northPos = vertices[north].pos;
-
-					octet::vec3 v1 = northPos - centrePos;
-					octet::vec3 v2 = eastPos - centrePos;
-					octet::vec3 ne = cross(v1, v2);
-
-					v1 = eastPos - centrePos;
-					v2 = southPos - centrePos;
-					octet::vec3 se = cross(v1, v2);
-
-					v1 = southPos - centrePos;
-					v2 = westPos - centrePos;
-					octet::vec3 sw = cross(v1, v2);
-
-					v1 = northPos - centrePos;
-					v2 = westPos - centrePos;
-					octet::vec3 nw = cross(v1, v2);
-
-
-					//octet::vec3 norm(0.0f, 1.0f, 0.0f);
-					octet::vec3 norm = ne + nw + se + sw;
-					//octet::vec3 norm = ne;
-					//norm = norm.normalize();
-					vertices[centre].normal = octet::vec3p(norm);
-				}
+				if (layoutChanged && compactVertices)
+					set_vertices(packedVertices);
+				else if (layoutChanged)
+					set_vertices(vertices);
+				uploadIndices();
 			}
 
-			//pass min and max to shader for height colouring
-			octet::vec2 heights(min, max);
-			customMaterial->set_uniform(heightRange, &heights, sizeof(heights));
+			if (!background)
+				background.reset(new BackgroundGenerator());
 
-			set_vertices(vertices);
-			set_indices(indices);
+			generator.usePerlinRandom = usePerlinRandom;
+			BackgroundGenerator::Job job = { GetBuildSettings(), compactVertices, useLod ? lodPatchCells : 0 };
+			return background->Request(generator, job);
+		}
 
-			//dump(octet::log(""));
+		/// Call at a frame boundary. Swaps in the map a generateAsync finished, if there is one, and uploads it.
+		/// Never waits on the background, returns true when the map changed.
+		bool applyGenerated()
+		{
+			if (!background || !background->TakeResult(backgroundSurface))
+				return false;
 
-			//this->set_mode(GL_LINES);
+			//a map made for a grid that has since been replaced, e.g. by LoadTile, has nowhere to go
+			if (!backgroundSurface.IsLaidOut(planeCellsX, planeCellsZ, planeDeltaX, planeDeltaZ, compactVertices))
+				return false;
+
+			rememberMap();
+			surface.Take(backgroundSurface);
+			lodChanged = surface.IsLodBuilt();
+
+			uploadUniforms(backgroundSurface.min, backgroundSurface.max);
+			const void *source = compactVertices ? (const void*)&backgroundSurface.compactVertices[0] : (const void*)&backgroundSurface.vertices[0];
+			uploadRows(0, dimensions.z() + 1, source);
+			return true;
 		}
 
-		void buildPlane()
-		{
-			vertices.reserve((dimensions.x() + 1) * (dimensions.z() + 1));
+		/// Whether a generateAsync is still running, and how far it has got from 0 to 1.
+		bool IsGenerating() const { return background && background->IsBusy(); }
+		float GetGenerateProgress() const { return background ? background->GetProgress() : 0.0f; }
 
-			octet::vec3 dimf = (octet::vec3)(dimensions);
-			octet::aabb bb = get_aabb();
-			octet::vec3 bb_min = bb.get_min();
-			octet::vec3 bb_delta = bb.get_half_extent() / dimf * 2.0f;
-			bb_delta.y() = 0;
-			octet::vec3 uv_min = octet::vec3(0);
-			octet::vec3 uv_delta = octet::vec3(30.0f / dimf.x(), 30.0f / dimf.z(), 0);
+		/// Opens a tile store written by HeightmapTool. The file is mapped read-only, nothing is loaded yet.
+		bool OpenTileStore(const char *path)
+		{
+			return tileStore.Open(path);
+		}
 
-			float tiling = 0.1f;
+		/// Shows one mip level of a stored tile in place of a generated map.
+		/// Heights and normals go straight from the mapping into the vertex buffer.
+		bool LoadTile(int tileX, int tileZ, int level = 0)
+		{
+			TileStore::Level tile;
+			if (!tileStore.GetLevel(tileX, tileZ, level, tile))
+				return false;
+
+			if (background)
+				background->Cancel();
+			rememberMap();
+
+			//lay the grid out at the spacing the stored normals were built for
+			const TileStoreHeader &header = tileStore.GetHeader();
+			int cells = tile.size - 1;
+			float halfExtent = header.sampleSpacing * (1 << level) * cells * 0.5f;
+			dimensions = octet::ivec3(cells, 0, cells);
+			size = octet::vec3(halfExtent, 0.0f, halfExtent);
+			set_aabb(octet::aabb(octet::vec3(0, 0, 0), size));
+			generator.SetDimensions(cells, cells);
+			heightScale = header.heightScale;
 
-			float fTextureUStep = 1.0f / (dimensions.x() * tiling);
-			float fTextureVStep = 1.0f / (dimensions.z() * tiling);
+			bool rebuilt = buildPlane();
 
-			for (int x = 0; x <= dimensions.x(); ++x)
+			float min, max;
+			if (compactVertices)
 			{
-				for (int z = 0; z <= dimensions.z(); ++z)
-				{
-					octet::vec3 xz = octet::vec3((float)x, 0, (float)z) * bb_delta;
-					vertex vertex;
-					vertex.pos = octet::vec3p(xz);
-					vertex.normal = octet::vec3p(0.0f, 1.0f, 0.0f);
-					vertex.uv = octet::vec2p(x * fTextureUStep, z * fTextureVStep);
-					vertices.push_back(vertex);
-				}
+				CompactVertexPacker::WriteHeights(tile.heights, tile.size, tile.size, tile.stride, heightScale, packedVertices.data(), min, max);
+				CompactVertexPacker::WriteNormals(tile.normals, tile.size * tile.size, packedVertices.data());
 			}
-
-			indices.reserve(dimensions.x() * dimensions.z() * 6);
-
-			int stride = dimensions.x() + 1;
-			for (int x = 0; x < dimensions.x(); ++x)
+			else
 			{
-				for (int z = 0; z < dimensions.z(); ++z)
-				{
-					// 01 11
-					// 00 10
-					indices.push_back((x + 0) + (z + 0)*stride);
-					indices.push_back((x + 0) + (z + 1)*stride);
-					indices.push_back((x + 1) + (z + 0)*stride);
-					indices.push_back((x + 1) + (z + 0)*stride);
-					indices.push_back((x + 0) + (z + 1)*stride);
-					indices.push_back((x + 1) + (z + 1)*stride);
-				}
+				TerrainVertex *meshVertices = GetMeshVertices();
+				TerrainMeshBuilder::WriteHeights(tile.heights, tile.size, tile.size, tile.stride, heightScale, meshVertices, min, max);
+				TerrainMeshBuilder::WriteNormals(tile.normals, tile.size * tile.size, meshVertices);
 			}
+
+			//stored tiles are drawn at full resolution, with the height bands
+			surface.ShowTile(tile.heights, tile.size, tile.stride, planeDeltaX, heightScale, min, max);
+			upload(min, max, rebuilt);
+			return true;
+		}
+
+		/// Goes back to the map shown before this one, false when there is none left. Its seed and algorithm
+		/// become current again, the next generate carries on from there.
+		bool ShowPrevious()
+		{
+			if (history.empty())
+				return false;
+
+			CompressedHeightfield previous;
+			std::swap(previous, history.back());
+			history.pop_back();
+			return showSnapshot(previous);
+		}
+
+		/// Compresses the map on show into a snapshot file LoadSnapshot or HeightmapTool can read back.
+		/// False if there is no generated map on show, e.g. after LoadTile, or the file could not be written.
+		bool SaveSnapshot(const char *path)
+		{
+			CompressedHeightfield snapshot;
+			return compressMap(snapshot) && snapshot.Save(path);
 		}
 
-		int GetVertexIndex(const octet::vec2 posCoord)
+		/// Shows a snapshot in place of the current map, which goes into the history.
+		bool LoadSnapshot(const char *path)
 		{
-			return (int)(posCoord.x() * dimensions.z() + posCoord.y());
+			CompressedHeightfield snapshot;
+			if (!snapshot.Load(path))
+				return false;
+			rememberMap();
+			return showSnapshot(snapshot);
 		}
 
-		void MidpointDisplacementAlgorithm(std::vector<std::vector<float>> &map)
+		/// Selects a level per patch for an eye in the terrain's local space and swaps in the new indices if any
+		/// changed. pixelsPerRadian is viewportHeight / (2 tan(fovY / 2)).
+		void UpdateLod(const octet::vec3 &eye, float pixelsPerRadian)
 		{
-			int gridSize = ((dimensions.x() + 1 < dimensions.z() + 1) ? dimensions.x() + 1 : dimensions.z() + 1) - 1;
-			int offset = gridSize / 2;//offset is the width of the square we're working on
-			float rangeModifier = 0.7f; //modifier on the range to smooth
-			float randomScale = 1.0f;
-			bool isOddY, isOddX; //these are used to tell if we're working with a side or center
-
-			if (usePerlinRandom)
-				noise.RandomisePermutations();
-
-			//set the four corners
-			for (int i = 0; i < dimensions.z() + 1; i += gridSize)
-			{
-				for (int j = 0; j < dimensions.x() + 1; j += gridSize)
-				{
-					map[j][i] = rand.get(-1.0f, 1.0f);//GetRandom(i,j);
-				}
+			if (!useLod || !surface.IsLodBuilt())
+				return;
+
+			GeoMipmap &lod = surface.GetLod();
+			float eyePosition[3] = { eye.x(), eye.y(), eye.z() };
+			if (!lod.SelectLevels(eyePosition, pixelsPerRadian, lodPixelError) && !lodChanged)
+				return;
+			lodChanged = false;
+
+			lod.BuildIndices(lodIndices);
+			if (UseShortIndices())
+			{
+				shortIndices.resize((unsigned)lodIndices.size());
+				for (size_t i = 0; i < lodIndices.size(); ++i)
+					shortIndices[(unsigned)i] = (uint16_t)lodIndices[i];
 			}
-
-			while (offset > 0)
-			{
-				isOddY = false;
-
-				for (int y = 0; y < dimensions.z() + 1; y += offset, isOddY = !isOddY)
-				{
-					isOddX = false;
-
-					for (int x = 0; x < dimensions.x() + 1; x += offset, isOddX = !isOddX)
-					{
-						if (isOddX || isOddY)
-						{
-							float height = 0.0f;
-							
-							// center
-							if (isOddX && isOddY)
-							{
-								//average the four corners plus a small random amount (error)
-								height = (map[x - offset][y - offset] + map[x + offset][y - offset] + map[x - offset][y + offset] + map[x + offset][y + offset]) / 4 + GetRandom(x, y) * randomScale;
-							}
-							else
-							{
-								//side 
-								if (isOddX)
-								{
-									//average horizontal sides corners plus small random amount (error)
-									height = (map[x - offset][y] + map[x + offset][y]) / 2 + GetRandom(x,y) * randomScale;
-								}
-								else
-								{
-									//average this vertical side corners plus small random amount (error)
-									height = (map[x][y - offset] + map[x][y + offset]) / 2 + GetRandom(x, y) * randomScale;
-								}
-							}
-
-							//set the value
-							map[x][y] = height;
-						}
-					}
-				}
-
-				//adjust the range and offset
-				randomScale *= rangeModifier;
-				offset /= 2;
+			else
+			{
+				indices.resize((unsigned)lodIndices.size());
+				memcpy(indices.data(), lodIndices.data(), lodIndices.size() * sizeof(uint32_t));
 			}
+			planeIndices = false;
+			uploadIndices();
 		}
 
-		void DiamondSquareAlgorithm(std::vector<std::vector<float>> &vectorMap)
+		const GeoMipmap &GetLod() const { return surface.GetLod(); }
+
+		/// Height of the surface at (x, z) in the terrain's local space, clamped to its edges. Bilinear between
+		/// samples, 0 while a stored tile is shown.
+		float GetHeight(float x, float z) const { return surface.GetQuery().GetHeight(x, z); }
+
+		/// Unit normal at (x, z) in the terrain's local space, blended from the ones the mesh is shaded with.
+		octet::vec3 GetNormal(float x, float z) const
 		{
-			int gridSize = ((dimensions.x() + 1 < dimensions.z() + 1) ? dimensions.x() + 1 : dimensions.z() + 1) - 1;
-			int sampleSize = gridSize;//offset is the width of the square we're working on
-			float scale = 1.0f;	
+			float normal[3];
+			surface.GetQuery().GetNormal(x, z, normal);
+			return octet::vec3(normal[0], normal[1], normal[2]);
+		}
 
-			float* map = new float[dimensions.x() * dimensions.z()];
+		/// Where a ray in the terrain's local space first meets the surface within maxDistance multiples of direction.
+		bool Raycast(const octet::vec3 &origin, const octet::vec3 &direction, float maxDistance, HeightfieldQuery::RayHit &hit) const
+		{
+			HeightfieldQuery::Ray ray = { { origin.x(), origin.y(), origin.z() }, { direction.x(), direction.y(), direction.z() }, maxDistance };
+			return surface.GetQuery().Raycast(ray, hit);
+		}
 
-			if(usePerlinRandom)
-				noise.RandomisePermutations();
+		/// For batches of heights and rays, e.g. every agent's at once. Valid until the map next changes.
+		const HeightfieldQuery &GetQuery() const { return surface.GetQuery(); }
 
-			//Set four corners
-			for (int y = 0; y < dimensions.z() + 1; y += sampleSize)
-			{
-				for (int x = 0; x < dimensions.x() + 1; x += sampleSize)
-				{
-					SetSample(x, y, GetRandom(x,y), map);
-				}
-			}		
+#if OCTET_BULLET
+		/// Puts the terrain's static body in world, or takes it out with null, with the terrain's local space at
+		/// origin in the world's. The body stays with whatever map is on show, generated, swapped in or loaded.
+		void SetPhysicsWorld(btDynamicsWorld *world, const octet::vec3 &origin)
+		{
+			surface.GetCollision().SetOrigin(btVector3(origin.x(), origin.y(), origin.z()));
+			surface.GetCollision().SetWorld(world);
+		}
 
-			while (sampleSize > 1)
-			{
-				DiamondSquareCore(sampleSize, scale, map);
+		/// The shape over the heights on show. It is the same object for the terrain's lifetime.
+		const btHeightfieldTerrainShape *GetCollisionShape() const { return surface.GetCollision().GetShape(); }
+#endif
 
-				sampleSize /= 2;
-				scale /= 2.0f;
-			}
+		/// 16-bit indices whenever every vertex can be addressed with them.
+		bool IsCompact() const { return compactVertices; }
 
-			//Convert to vector map to fit in with other algorithms
-			for (int x = 0; x < dimensions.x() + 1; x++)
+		bool UseShortIndices() const
+		{
+			return TerrainMeshBuilder::GetVertexCount(dimensions.x(), dimensions.z()) <= 65536;
+		}
+
+		/// Sends the vertices to the mesh. A rebuilt layout replaces the buffers, otherwise the existing vertex
+		/// buffer is rewritten in place as only heights and normals have changed.
+		void upload(float min, float max, bool rebuilt)
+		{
+			uploadUniforms(min, max);
+
+			if (rebuilt)
 			{
-				for (int y = 0; y < dimensions.z() + 1; y++)
-				{
-					vectorMap[x][y] = Sample(x, y, map);
-				}
+				TERRAIN_PROFILE_SCOPE("upload");
+				if (compactVertices)
+					set_vertices(packedVertices);
+				else
+					set_vertices(vertices);
+				uploadIndices();
+			}
+			else
+			{
+				uploadRows(0, dimensions.z() + 1);
 			}
-
-			//cleanup
-			delete map;
 		}
 
-		void DiamondSquareCore(int stepSize, float scale, float* map)
+		void uploadUniforms(float min, float max)
 		{
-			int halfStep = stepSize / 2;
+			//pass min and max to shader for height colouring
+			octet::vec2 heights(min, max);
+			customMaterial->set_uniform(heightRange, &heights, sizeof(heights));
 
-			for (int y = halfStep; y < dimensions.z() + 1 + halfStep; y += stepSize)
+			if (compactVertices)
 			{
-				for (int x = halfStep; x < dimensions.x() + 1 + halfStep; x += stepSize)
-				{
-					SampleSquare(x, y, stepSize, GetRandom(x,y) * scale, map);
-				}
+				//the shader rebuilds positions and uvs from the grid coordinate
+				octet::vec4 scale(planeDeltaX, planeDeltaZ, TerrainMeshBuilder::GetUvStep(dimensions.x()), TerrainMeshBuilder::GetUvStep(dimensions.z()));
+				customMaterial->set_uniform(gridScale, &scale, sizeof(scale));
 			}
 
-			for (int y = 0; y < dimensions.z() + 1; y += stepSize)
+			uploadSplat();
+		}
+
+		/// Sends the splat map to its texture and tells the shader where a sample's texel is, or with no splat map
+		/// for the current grid turns it off, leaving the shader to blend the layers by height.
+		void uploadSplat()
+		{
+			int width = dimensions.x() + 1;
+			int depth = dimensions.z() + 1;
+			octet::vec4 scale(0.0f, 0.0f, 0.0f, 0.0f);
+			const std::vector<uint8_t> &splatTexels = surface.GetSplat();
+			if (useSplatMap && splatTexels.size() == (size_t)width * depth * 4)
 			{
-				for (int x = 0; x < dimensions.x() + 1; x += stepSize)
-				{
-					SampleDiamond(x + halfStep, y, stepSize, GetRandom(x,y) * scale, map);
-					SampleDiamond(x, y + halfStep, stepSize, GetRandom(x,y) * scale, map);
-				}
+				TERRAIN_PROFILE_SCOPE("upload");
+				glBindTexture(GL_TEXTURE_2D, splatImage->get_gl_texture());
+				glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, depth, 0, GL_RGBA, GL_UNSIGNED_BYTE, &splatTexels[0]);
+				glGenerateMipmap(GL_TEXTURE_2D);
+
+				//model x and z to the centre of the sample's texel
+				scale = octet::vec4(1.0f / (planeDeltaX * width), 1.0f / (planeDeltaZ * depth), 0.5f / width, 0.5f / depth);
 			}
+			customMaterial->set_uniform(splatScale, &scale, sizeof(scale));
 		}
 
-		float Sample(int x, int y, float* map)
+		/// How generate and generateAsync build the map, for the grid buildPlane last laid out.
+		SurfaceBuilder::Settings GetBuildSettings() const
 		{
-			return map[(x & (dimensions.x() - 1)) + (y & (dimensions.z() - 1)) * dimensions.x()];
+			SurfaceBuilder::Settings settings = { algorithmType, heightScale, planeDeltaX, planeDeltaZ, useTiledPipeline, useAnalyticNormals, erosion,
+				useSplatMap ? splatRules : std::vector<SplatRule>() };
+			return settings;
 		}
 
-		void SetSample(int x, int y, float value, float* map)
+		/// Copies rows of vertices into the mesh's existing vertex buffer, leaving the rest untouched.
+		/// source is a whole map's vertices in the current layout, by default the ones generate wrote.
+		void uploadRows(int firstRow, int rowCount, const void *source = nullptr)
 		{
-			map[(x & (dimensions.x() - 1)) + (y & (dimensions.z() - 1)) * dimensions.x()] = value;
+			TERRAIN_PROFILE_SCOPE("upload");
+			size_t rowBytes = (size_t)(dimensions.x() + 1) * (compactVertices ? sizeof(CompactTerrainVertex) : sizeof(vertex));
+			if (!source)
+				source = compactVertices ? (const void*)packedVertices.data() : (const void*)vertices.data();
+			octet::gl_resource::wolock lock(get_vertices());
+			memcpy(lock.u8() + firstRow * rowBytes, (const uint8_t*)source + firstRow * rowBytes, rowCount * rowBytes);
 		}
 
-		void SampleSquare(int x, int y, int size, float value, float* map)
+		void uploadIndices()
 		{
-			int halfSize = size / 2;
-
-			float topLeft = Sample(x - halfSize, y - halfSize, map);
-			float topRight = Sample(x + halfSize, y - halfSize, map);
-			float bottomLeft = Sample(x - halfSize, y + halfSize, map);
-			float bottomRight = Sample(x + halfSize, y + halfSize, map);
-
-			SetSample(x, y, ((topLeft + topRight + bottomLeft + bottomRight) / 4.0f) + value, map);
+			if (UseShortIndices())
+				set_indices(shortIndices);
+			else
+				set_indices(indices);
 		}
 
-		void SampleDiamond(int x, int y, int size, float value, float* map)
+		/// Compresses the map on show with what it was made with, false if a stored tile is on show instead.
+		bool compressMap(CompressedHeightfield &snapshot)
 		{
-			int halfSize = size / 2;
+			if (!surface.IsMapShown())
+				return false;
+
+			//the settings may already be the next map's, e.g. a new seed and algorithm, or a grid laid out for it
+			TERRAIN_PROFILE_SCOPE("snapshot.compress");
+			snapshot.Compress(surface.GetMap(), generator.GetThreadPool());
+			snapshot.seed = surface.GetSeed();
+			snapshot.algorithm = (uint32_t)surface.GetAlgorithm();
+			snapshot.sampleSpacing = surface.GetSpacingX();
+			snapshot.heightScale = surface.GetHeightScale();
+			return true;
+		}
 
-			float left = Sample(x - halfSize, y, map);
-			float right = Sample(x + halfSize, y, map);
-			float top = Sample(x, y - halfSize, map);
-			float bottom = Sample(x, y + halfSize, map);
+		/// Puts the map on show into the history before something replaces it.
+		void rememberMap()
+		{
+			if (historyLength <= 0)
+				return;
 
-			SetSample(x, y, ((left + right + top + bottom) / 4.0f) + value, map);
+			history.push_back(CompressedHeightfield());
+			if (!compressMap(history.back()))
+			{
+				history.pop_back();
+				return;
+			}
+			while ((int)history.size() > historyLength)
+				history.pop_front();
 		}
 
-		void PerlinNoiseAlgorithm(std::vector<std::vector<float>> &map)
+		/// Decodes a snapshot into the surface, lays the grid out at its spacing and rebuilds the mesh from it.
+		bool showSnapshot(const CompressedHeightfield &snapshot)
 		{
-			noise.RandomisePermutations();
-			float frequency = 5.0f / (float)(dimensions.x() + 1);
+			if (snapshot.IsEmpty() || snapshot.GetWidth() < 2 || snapshot.GetDepth() < 2 || snapshot.algorithm > (uint32_t)TerrainGenerator::MultiFractal)
+				return false;
+
+			if (background)
+				background->Cancel();
 
-			for (int y = 0; y < dimensions.x() + 1; y++)
 			{
-				for (int x = 0; x < dimensions.x() + 1; x++)
-				{
-					float noiseValue = noise.GenerateNoise((float)x * frequency, (float)y * frequency);
-					map[x][y] = noiseValue;
-				}
+				TERRAIN_PROFILE_SCOPE("snapshot.decompress");
+				if (!surface.Decompress(snapshot, generator.GetThreadPool()))
+					return false;
 			}
+
+			int cellsX = snapshot.GetWidth() - 1;
+			int cellsZ = snapshot.GetDepth() - 1;
+			dimensions = octet::ivec3(cellsX, 0, cellsZ);
+			size = octet::vec3(snapshot.sampleSpacing * cellsX * 0.5f, 0.0f, snapshot.sampleSpacing * cellsZ * 0.5f);
+			set_aabb(octet::aabb(octet::vec3(0, 0, 0), size));
+			generator.SetDimensions(cellsX, cellsZ);
+			generator.SetSeed(snapshot.seed);
+			algorithmType = (Algorithm)snapshot.algorithm;
+			heightScale = snapshot.heightScale;
+
+			bool rebuilt = buildPlane();
+
+			float min, max;
+			TerrainVertex *meshVertices = compactVertices ? nullptr : GetMeshVertices();
+			surface.BuildFromMap(builder, GetBuildSettings(), snapshot.seed, useLod ? lodPatchCells : 0, meshVertices, compactVertices ? packedVertices.data() : nullptr,
+				min, max, generator.GetThreadPool());
+			lodChanged = surface.IsLodBuilt();
+
+			upload(min, max, rebuilt);
+			return true;
 		}
 
-		void FractionalBrownianMotionAlgorithm(std::vector<std::vector<float>> &map)
+		/// Lays out the grid and its indices when the dimensions or spacing changed, or the LOD replaced the indices.
+		/// Returns true when the buffers were rebuilt and the mesh needs them in full.
+		bool buildPlane()
 		{
-			float gain = 0.65f;
-			float lacunarity = 2.0f;
-			unsigned octaves = 16;
-			noise.RandomisePermutations();
+			octet::vec3 bb_delta = getPlaneDelta();
+			bool layoutChanged = !isPlaneLaidOut();
+
+			//with the LOD on the indices are its business, the ones it last picked still fit an unchanged layout
+			if (!layoutChanged && (planeIndices || useLod))
+				return false;
 
-			for (int y = 0; y < dimensions.z() + 1; y++)
+			if (layoutChanged)
 			{
-				for (int x = 0; x < dimensions.x() + 1; x++)
+				unsigned vertexCount = TerrainMeshBuilder::GetVertexCount(dimensions.x(), dimensions.z());
+				if (compactVertices)
 				{
-					//for each pixel, get the value
-					float total = 0.0f;
-					float frequency = 1.0f / (float)(dimensions.x() + 1);
-					float amplitude = gain;
-
-					for (unsigned i = 0; i < octaves; ++i)
-					{
-						total += noise.GenerateNoise((float)x * frequency, (float)y * frequency) * amplitude;
-						frequency *= lacunarity;
-						amplitude *= gain;
-					}
-
-					//now that we have the value, put it in
-					map[x][y] = total;
+					packedVertices.resize(vertexCount);
+					CompactVertexPacker::BuildPlane(dimensions.x(), dimensions.z(), packedVertices.data());
 				}
+				else
+				{
+					vertices.resize(vertexCount);
+					TerrainMeshBuilder::BuildPlane(dimensions.x(), dimensions.z(), bb_delta.x(), bb_delta.z(), GetMeshVertices(), nullptr);
+				}
+
+				planeCellsX = dimensions.x();
+				planeCellsZ = dimensions.z();
+				planeDeltaX = bb_delta.x();
+				planeDeltaZ = bb_delta.z();
+			}
+
+			unsigned indexCount = TerrainMeshBuilder::GetIndexCount(dimensions.x(), dimensions.z());
+			if (UseShortIndices())
+			{
+				shortIndices.resize(indexCount);
+				TerrainMeshBuilder::BuildIndices(dimensions.x(), dimensions.z(), shortIndices.data());
+				indices.resize(0);
+			}
+			else
+			{
+				indices.resize(indexCount);
+				TerrainMeshBuilder::BuildIndices(dimensions.x(), dimensions.z(), indices.data());
+				shortIndices.resize(0);
 			}
+			planeIndices = true;
+			return true;
 		}
 
-		void MultiFractalAlgorithm(std::vector<std::vector<float>> &map)
+		//world distance between samples along x and z
+		octet::vec3 getPlaneDelta()
 		{
+			octet::vec3 dimf = (octet::vec3)(dimensions);
+			return get_aabb().get_half_extent() / dimf * 2.0f;
+		}
 
-
+		/// Whether the vertex and index buffers are laid out for the current dimensions and extent.
+		bool isPlaneLaidOut()
+		{
+			octet::vec3 delta = getPlaneDelta();
+			return dimensions.x() == planeCellsX && dimensions.z() == planeCellsZ && delta.x() == planeDeltaX && delta.z() == planeDeltaZ;
 		}
 
-		float GetRandom(int x, int y)
+		TerrainVertex *GetMeshVertices()
 		{
-			float frequency = 7.0f / (float)(dimensions.x() + 1);
+			static_assert(sizeof(vertex) == sizeof(TerrainVertex), "TerrainVertex must match the octet mesh vertex");
+			return (TerrainVertex*)vertices.data();
+		}
 
-			if (usePerlinRandom)
-				return noise.GenerateNoise((float)x * frequency, (float)y * frequency);
-			else
-				return rand.get(-1.0f, 1.0f);
+		/// Index of the vertex nearest (x, z) in the terrain's local space, clamped to the grid.
+		int GetVertexIndex(const octet::vec2 position)
+		{
+			int x = std::min(std::max((int)std::floor(position.x() / planeDeltaX + 0.5f), 0), dimensions.x());
+			int z = std::min(std::max((int)std::floor(position.y() / planeDeltaZ + 0.5f), 0), dimensions.z());
+			return z * (dimensions.x() + 1) + x;
 		}
 	};
 }
@@ -0,0 +1,48 @@
+#pragma once
+
+namespace Terrain
+{
+	/// Stateless random numbers: each value is a hash of the seed and a (x, y, level) counter,
+	/// so samples can be drawn in any order, on any thread, and still come out the same.
+	class HashRandom
+	{
+	private:
+		unsigned seed;
+
+		//murmur3 finaliser, every input bit affects every output bit
+		static unsigned Mix(unsigned h)
+		{
+			h ^= h >> 16;
+			h *= 0x85ebca6bu;
+			h ^= h >> 13;
+			h *= 0xc2b2ae35u;
+			h ^= h >> 16;
+			return h;
+		}
+
+	public:
+		explicit HashRandom(unsigned seed = 0x9bac7615) : seed(seed)
+		{
+		}
+
+		unsigned GetSeed() const { return seed; }
+		void SetSeed(unsigned newSeed) { seed = newSeed; }
+
+		unsigned GetBits(int x, int y, int level) const
+		{
+			unsigned h = Mix(seed ^ 0x9e3779b9u);
+			h = Mix(h ^ ((unsigned)x * 0x8da6b343u));
+			h = Mix(h ^ ((unsigned)y * 0xd8163841u));
+			h = Mix(h ^ ((unsigned)level * 0xcb1ab31fu));
+			return h;
+		}
+
+		/// Uniform in [min, max), same shape as octet::random::get.
+		float Get(int x, int y, int level, float min, float max) const
+		{
+			//top 24 bits fill a float mantissa exactly
+			float unit = (float)(GetBits(x, y, level) >> 8) * (1.0f / 16777216.0f);
+			return min + unit * (max - min);
+		}
+	};
+}
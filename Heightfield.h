@@ -0,0 +1,182 @@
+#pragma once
+#include "TerrainProfiler.h"
+
+#include <cassert>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <utility>
+
+#if defined(_MSC_VER)
+#include <malloc.h>
+#endif
+
+namespace Terrain
+{
+	/// Rectangular window into a heightfield. Does not own its data.
+	struct HeightfieldTile
+	{
+		float *origin;
+		int x;
+		int z;
+		int width;
+		int depth;
+		int stride;
+
+		float &operator()(int localX, int localZ) const { return origin[localZ * stride + localX]; }
+		float *GetRow(int localZ) const { return origin + localZ * stride; }
+	};
+
+	/// Contiguous grid of heights stored row by row (x contiguous, z selects the row).
+	/// Rows are padded out to a whole number of cache lines so that every row starts 64 byte aligned.
+	class Heightfield
+	{
+	public:
+		static const size_t alignment = 64;
+		static const int floatsPerLine = (int)(alignment / sizeof(float));
+
+	private:
+		float *data = nullptr;
+		int width = 0;
+		int depth = 0;
+		int stride = 0;
+
+		static float *AllocateAligned(size_t count)
+		{
+			if (count == 0 || count > SIZE_MAX / sizeof(float))
+				return nullptr;
+			TERRAIN_PROFILE_ALLOCATION(count * sizeof(float));
+#if defined(_MSC_VER)
+			return (float*)_aligned_malloc(count * sizeof(float), alignment);
+#else
+			void *ptr = nullptr;
+			if (posix_memalign(&ptr, alignment, count * sizeof(float)) != 0)
+				return nullptr;
+			return (float*)ptr;
+#endif
+		}
+
+		static void FreeAligned(float *ptr)
+		{
+#if defined(_MSC_VER)
+			_aligned_free(ptr);
+#else
+			free(ptr);
+#endif
+		}
+
+	public:
+		Heightfield()
+		{
+		}
+
+		Heightfield(int width, int depth, float value = 0.0f)
+		{
+			Resize(width, depth);
+			Fill(value);
+		}
+
+		Heightfield(const Heightfield &other)
+		{
+			*this = other;
+		}
+
+		Heightfield(Heightfield &&other)
+		{
+			*this = std::move(other);
+		}
+
+		~Heightfield()
+		{
+			FreeAligned(data);
+		}
+
+		Heightfield &operator=(const Heightfield &other)
+		{
+			if (this != &other)
+			{
+				if (Resize(other.width, other.depth) && data)
+					memcpy(data, other.data, GetSizeInBytes());
+			}
+			return *this;
+		}
+
+		Heightfield &operator=(Heightfield &&other)
+		{
+			if (this != &other)
+			{
+				FreeAligned(data);
+				data = other.data;
+				width = other.width;
+				depth = other.depth;
+				stride = other.stride;
+				other.data = nullptr;
+				other.width = other.depth = other.stride = 0;
+			}
+			return *this;
+		}
+
+		/// Reallocates only when the dimensions change. Contents are undefined afterwards. Returns false, the
+		/// heightfield left as it was, when the dimensions are negative or the memory for them cannot be had.
+		bool Resize(int newWidth, int newDepth)
+		{
+			if (newWidth == width && newDepth == depth && data)
+				return true;
+			if (newWidth < 0 || newDepth < 0 || newWidth > INT_MAX - floatsPerLine)
+				return false;
+
+			int newStride = (newWidth + floatsPerLine - 1) / floatsPerLine * floatsPerLine;
+			size_t count = (size_t)newStride * newDepth;
+			if (newDepth != 0 && count / newDepth != (size_t)newStride)
+				return false;
+			float *newData = AllocateAligned(count);
+			if (!newData && count != 0)
+				return false;
+
+			FreeAligned(data);
+			data = newData;
+			width = newWidth;
+			depth = newDepth;
+			stride = newStride;
+			return true;
+		}
+
+		void Fill(float value)
+		{
+			for (int z = 0; z < depth; ++z)
+				std::fill(GetRow(z), GetRow(z) + width, value);
+		}
+
+		int GetWidth() const { return width; }
+		int GetDepth() const { return depth; }
+		int GetStride() const { return stride; }
+		size_t GetSizeInBytes() const { return (size_t)stride * depth * sizeof(float); }
+
+		float *GetData() { return data; }
+		const float *GetData() const { return data; }
+
+		float *GetRow(int z) { return data + (size_t)z * stride; }
+		const float *GetRow(int z) const { return data + (size_t)z * stride; }
+
+		/// Unchecked access, x along the row and z down the rows.
+		float &operator()(int x, int z) { return data[(size_t)z * stride + x]; }
+		float operator()(int x, int z) const { return data[(size_t)z * stride + x]; }
+
+		/// Checked access for debug builds.
+		float &At(int x, int z)
+		{
+			assert(x >= 0 && x < width && z >= 0 && z < depth);
+			return (*this)(x, z);
+		}
+
+		HeightfieldTile GetTile(int x, int z, int tileWidth, int tileDepth)
+		{
+			assert(x >= 0 && z >= 0 && x + tileWidth <= width && z + tileDepth <= depth);
+			HeightfieldTile tile = { data + (size_t)z * stride + x, x, z, tileWidth, tileDepth, stride };
+			return tile;
+		}
+	};
+}
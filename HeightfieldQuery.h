@@ -0,0 +1,594 @@
+#pragma once
+#include "CpuFeatures.h"
+#include "Heightfield.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+namespace Terrain
+{
+	/// Height, normal and ray queries against a map laid out like TerrainMeshBuilder::BuildPlane, sample (x, z) at
+	/// (x * spacingX, height * heightScale, z * spacingZ). Between samples the surface is the bilinear patch through
+	/// the cell's corners. It meets the drawn triangles at every sample and never leaves the corners' range.
+	///
+	/// Rays descend a min/max quadtree over the cells, built by Build, opening only the nodes whose height range
+	/// they pass through, so a ray costs O(log n) nodes plus the few cells it grazes instead of a test per triangle.
+	/// The ground is solid, a ray starting below the surface hits where it starts.
+	/// The map is read, not copied: it must stay put and unchanged until the next Build, or Attach after a swap.
+	class HeightfieldQuery
+	{
+	public:
+		struct Ray
+		{
+			float origin[3];
+			float direction[3]; //need not be unit length, distances are in multiples of it
+			float maxDistance;
+		};
+
+		struct RayHit
+		{
+			bool hit;
+			float distance;
+			float position[3];
+			float normal[3];
+		};
+
+	private:
+		//the leaves are blocks of 2x2 cells, whose cells are tested straight from the map
+		static const int leafCells = 2;
+		static const int maxLevels = 32;
+
+		struct Level
+		{
+			int nodesX;
+			int nodesZ;
+			std::vector<float> ranges; //min and max of each node's heights, unscaled, row major
+		};
+
+		struct Node
+		{
+			int level;
+			int x;
+			int z;
+		};
+
+		//a ray in grid units: one per sample along x and z, unscaled heights along y
+		struct GridRay
+		{
+			float origin[3];
+			float direction[3];
+			float inverseX;
+			float inverseZ;
+			int nearX; //which half of a node the ray reaches first
+			int nearZ;
+		};
+
+		const Heightfield *map = nullptr;
+		int cellsX = 0;
+		int cellsZ = 0;
+		float spacingX = 1.0f;
+		float spacingZ = 1.0f;
+		float heightScale = 1.0f;
+		float inverseSpacingX = 1.0f;
+		float inverseSpacingZ = 1.0f;
+		std::vector<Level> levels;
+		bool useAvx2 = CpuFeatures::Get().HasAvx2();
+
+		//the rows a leaf spans are folded into column ranges first, which vectorises, then each leaf takes its columns
+		void MeasureLeafRow(int z, std::vector<float> &columnMin, std::vector<float> &columnMax)
+		{
+			Level &level = levels[0];
+			int width = cellsX + 1;
+			int z0 = z * leafCells;
+			int z1 = std::min(z0 + leafCells, cellsZ);
+			columnMin.assign(map->GetRow(z0), map->GetRow(z0) + width);
+			columnMax.assign(map->GetRow(z0), map->GetRow(z0) + width);
+			for (int sampleZ = z0 + 1; sampleZ <= z1; ++sampleZ)
+			{
+				const float *row = map->GetRow(sampleZ);
+				for (int x = 0; x < width; ++x)
+				{
+					columnMin[x] = std::min(columnMin[x], row[x]);
+					columnMax[x] = std::max(columnMax[x], row[x]);
+				}
+			}
+
+			float *ranges = &level.ranges[(size_t)z * level.nodesX * 2];
+			for (int x = 0; x < level.nodesX; ++x)
+			{
+				int x0 = x * leafCells;
+				int x1 = std::min(x0 + leafCells, cellsX);
+				float min = columnMin[x0];
+				float max = columnMax[x0];
+				for (int column = x0 + 1; column <= x1; ++column)
+				{
+					min = std::min(min, columnMin[column]);
+					max = std::max(max, columnMax[column]);
+				}
+				ranges[x * 2] = min;
+				ranges[x * 2 + 1] = max;
+			}
+		}
+
+		//a node's range covers its children's, those past the edge of an odd sized level are left out
+		void MergeLevel(int index)
+		{
+			const Level &below = levels[index - 1];
+			Level &level = levels[index];
+			for (int z = 0; z < level.nodesZ; ++z)
+			{
+				for (int x = 0; x < level.nodesX; ++x)
+				{
+					float min = below.ranges[((size_t)(z * 2) * below.nodesX + x * 2) * 2];
+					float max = below.ranges[((size_t)(z * 2) * below.nodesX + x * 2) * 2 + 1];
+					for (int childZ = z * 2; childZ < std::min(z * 2 + 2, below.nodesZ); ++childZ)
+					{
+						for (int childX = x * 2; childX < std::min(x * 2 + 2, below.nodesX); ++childX)
+						{
+							min = std::min(min, below.ranges[((size_t)childZ * below.nodesX + childX) * 2]);
+							max = std::max(max, below.ranges[((size_t)childZ * below.nodesX + childX) * 2 + 1]);
+						}
+					}
+					level.ranges[((size_t)z * level.nodesX + x) * 2] = min;
+					level.ranges[((size_t)z * level.nodesX + x) * 2 + 1] = max;
+				}
+			}
+		}
+
+		//where the ray is inside the box of cells [x0, x1] x [z0, z1] within [tMin, tMax], false if it misses it
+		static bool Clip(const GridRay &ray, float x0, float x1, float z0, float z1, float tMin, float tMax, float &enter, float &exit)
+		{
+			float tx0 = (x0 - ray.origin[0]) * ray.inverseX;
+			float tx1 = (x1 - ray.origin[0]) * ray.inverseX;
+			float tz0 = (z0 - ray.origin[2]) * ray.inverseZ;
+			float tz1 = (z1 - ray.origin[2]) * ray.inverseZ;
+			enter = std::max(tMin, std::max(std::min(tx0, tx1), std::min(tz0, tz1)));
+			exit = std::min(tMax, std::min(std::max(tx0, tx1), std::max(tz0, tz1)));
+			return enter <= exit;
+		}
+
+		//lowest and highest the ray gets between enter and exit
+		static void GetHeightRange(const GridRay &ray, float enter, float exit, float &low, float &high)
+		{
+			float yEnter = ray.origin[1] + ray.direction[1] * enter;
+			float yExit = ray.origin[1] + ray.direction[1] * exit;
+			low = std::min(yEnter, yExit);
+			high = std::max(yEnter, yExit);
+		}
+
+		/// First t in [tMin, tMax] where the ray meets the bilinear patch of cell (x, z). A ray entering the cell
+		/// below the surface meets it where it enters.
+		bool IntersectCell(const GridRay &ray, int x, int z, float tMin, float tMax, float &t) const
+		{
+			float enter, exit;
+			if (!Clip(ray, (float)x, (float)(x + 1), (float)z, (float)(z + 1), tMin, tMax, enter, exit))
+				return false;
+
+			const float *row = map->GetRow(z);
+			const float *next = map->GetRow(z + 1);
+			float h00 = row[x];
+			float h10 = row[x + 1];
+			float h01 = next[x];
+			float h11 = next[x + 1];
+			float low, high;
+			GetHeightRange(ray, enter, exit, low, high);
+			if (low > std::max(std::max(h00, h10), std::max(h01, h11)))
+				return false;
+
+			//height above the patch along the ray is quadratic, a s^2 + b s + c from s = 0 where the ray enters
+			float u = ray.origin[0] + ray.direction[0] * enter - x;
+			float v = ray.origin[2] + ray.direction[2] * enter - z;
+			float slopeU = h10 - h00;
+			float slopeV = h01 - h00;
+			float twist = h00 - h10 - h01 + h11;
+			float dx = ray.direction[0];
+			float dz = ray.direction[2];
+			float a = -twist * dx * dz;
+			float b = ray.direction[1] - (slopeU * dx + slopeV * dz + twist * (u * dz + v * dx));
+			float c = ray.origin[1] + ray.direction[1] * enter - (h00 + slopeU * u + slopeV * v + twist * u * v);
+			float length = exit - enter;
+			if (c <= 0.0f)
+			{
+				t = enter;
+				return true;
+			}
+
+			float s = length + 1.0f;
+			if (std::fabs(a) < 1e-12f)
+			{
+				if (b < 0.0f)
+					s = -c / b;
+			}
+			else
+			{
+				float discriminant = b * b - 4.0f * a * c;
+				if (discriminant >= 0.0f)
+				{
+					//the stable pair, q / a and c / q, neither subtracting nearly equal values
+					float q = -0.5f * (b + (b < 0.0f ? -std::sqrt(discriminant) : std::sqrt(discriminant)));
+					float r0 = q != 0.0f ? c / q : -1.0f;
+					float r1 = q / a;
+					if (r0 >= 0.0f)
+						s = r0;
+					if (r1 >= 0.0f && r1 < s)
+						s = r1;
+				}
+			}
+
+			//rounding can lose a root that only just reaches the far side
+			if (s > length && a * length * length + b * length + c <= 0.0f)
+				s = length;
+			if (s > length)
+				return false;
+			t = enter + s;
+			return true;
+		}
+
+		//smallest node holding all of the ray up to tMax that lies over the map, so short rays skip the levels above
+		Node GetStartNode(const GridRay &ray, float tMax) const
+		{
+			int top = (int)levels.size() - 1;
+			Node root = { top, 0, 0 };
+			float endX = ray.origin[0] + ray.direction[0] * tMax;
+			float endZ = ray.origin[2] + ray.direction[2] * tMax;
+			if (!(std::fabs(endX) < 1e9f && std::fabs(endZ) < 1e9f))
+				return root;
+
+			float limitX = (float)(cellsX - 1);
+			float limitZ = (float)(cellsZ - 1);
+			int firstX = (int)std::min(std::max(std::min(ray.origin[0], endX), 0.0f), limitX) / leafCells;
+			int lastX = (int)std::min(std::max(std::max(ray.origin[0], endX), 0.0f), limitX) / leafCells;
+			int firstZ = (int)std::min(std::max(std::min(ray.origin[2], endZ), 0.0f), limitZ) / leafCells;
+			int lastZ = (int)std::min(std::max(std::max(ray.origin[2], endZ), 0.0f), limitZ) / leafCells;
+
+			//leaves i and j share their ancestor at the first level where i >> level == j >> level
+			int level = 0;
+			for (int differ = (firstX ^ lastX) | (firstZ ^ lastZ); differ != 0; differ >>= 1)
+				++level;
+			if (level >= top)
+				return root;
+			Node start = { level, firstX >> level, firstZ >> level };
+			return start;
+		}
+
+		bool IntersectGrid(const GridRay &ray, float tMin, float tMax, float &t) const
+		{
+			Node stack[maxLevels * 3 + 1];
+			int depth = 0;
+			stack[depth++] = GetStartNode(ray, tMax);
+
+			//children and leaf cells go on the stack far first, so the nearest comes off first and the first hit
+			//found is the nearest. A ray crosses at most one of the two off diagonal quarters, so their order is moot.
+			int order[4][2] =
+			{
+				{ 1 - ray.nearX, 1 - ray.nearZ },
+				{ 1 - ray.nearX, ray.nearZ },
+				{ ray.nearX, 1 - ray.nearZ },
+				{ ray.nearX, ray.nearZ }
+			};
+
+			while (depth > 0)
+			{
+				Node node = stack[--depth];
+				const Level &level = levels[node.level];
+				int nodeCells = leafCells << node.level;
+				float x0 = (float)(node.x * nodeCells);
+				float z0 = (float)(node.z * nodeCells);
+				float x1 = (float)std::min((node.x + 1) * nodeCells, cellsX);
+				float z1 = (float)std::min((node.z + 1) * nodeCells, cellsZ);
+
+				float enter, exit;
+				if (!Clip(ray, x0, x1, z0, z1, tMin, tMax, enter, exit))
+					continue;
+				//above the node's highest point it misses, below its lowest it is inside the ground from the start
+				const float *range = &level.ranges[((size_t)node.z * level.nodesX + node.x) * 2];
+				float low, high;
+				GetHeightRange(ray, enter, exit, low, high);
+				if (low > range[1])
+					continue;
+				if (high < range[0])
+				{
+					t = enter;
+					return true;
+				}
+
+				if (node.level == 0)
+				{
+					for (int i = 3; i >= 0; --i)
+					{
+						int cellX = node.x * leafCells + order[i][0];
+						int cellZ = node.z * leafCells + order[i][1];
+						if (cellX < cellsX && cellZ < cellsZ && IntersectCell(ray, cellX, cellZ, enter, exit, t))
+							return true;
+					}
+					continue;
+				}
+
+				const Level &children = levels[node.level - 1];
+				for (int i = 0; i < 4; ++i)
+				{
+					Node child = { node.level - 1, node.x * 2 + order[i][0], node.z * 2 + order[i][1] };
+					if (child.x < children.nodesX && child.z < children.nodesZ)
+						stack[depth++] = child;
+				}
+			}
+			return false;
+		}
+
+		//normal of the map at a sample, central differences inside and one-sided along the edges as NormalGenerator does
+		void SampleNormal(int x, int z, float normal[3]) const
+		{
+			int left = x > 0 ? x - 1 : x;
+			int right = x < cellsX ? x + 1 : x;
+			int above = z > 0 ? z - 1 : z;
+			int below = z < cellsZ ? z + 1 : z;
+			float dx = ((*map)(right, z) - (*map)(left, z)) * heightScale / ((right - left) * spacingX);
+			float dz = ((*map)(x, below) - (*map)(x, above)) * heightScale / ((below - above) * spacingZ);
+			float inverseLength = 1.0f / std::sqrt(dx * dx + 1.0f + dz * dz);
+			normal[0] = -dx * inverseLength;
+			normal[1] = inverseLength;
+			normal[2] = -dz * inverseLength;
+		}
+
+		//cell and position within it, clamped to the map, shared by the single and batched height queries
+		void Locate(float x, float z, int &cellX, int &cellZ, float &u, float &v) const
+		{
+			float gridX = std::min(std::max(x * inverseSpacingX, 0.0f), (float)cellsX);
+			float gridZ = std::min(std::max(z * inverseSpacingZ, 0.0f), (float)cellsZ);
+			cellX = std::min((int)gridX, cellsX - 1);
+			cellZ = std::min((int)gridZ, cellsZ - 1);
+			u = gridX - (float)cellX;
+			v = gridZ - (float)cellZ;
+		}
+
+		float Interpolate(int cellX, int cellZ, float u, float v) const
+		{
+			const float *row = map->GetRow(cellZ);
+			const float *next = map->GetRow(cellZ + 1);
+			float top = row[cellX] + (row[cellX + 1] - row[cellX]) * u;
+			float bottom = next[cellX] + (next[cellX + 1] - next[cellX]) * u;
+			return (top + (bottom - top) * v) * heightScale;
+		}
+
+#if TERRAIN_SIMD_X86
+		//eight at a time with the corners gathered, the same operations in the same order as Locate and Interpolate
+		TERRAIN_TARGET_AVX2 int GetHeightsAvx2(const float *x, const float *z, int count, float *heights) const
+		{
+			__m256 zero = _mm256_setzero_ps();
+			__m256 inverseX = _mm256_set1_ps(inverseSpacingX);
+			__m256 inverseZ = _mm256_set1_ps(inverseSpacingZ);
+			__m256 limitX = _mm256_set1_ps((float)cellsX);
+			__m256 limitZ = _mm256_set1_ps((float)cellsZ);
+			__m256i lastX = _mm256_set1_epi32(cellsX - 1);
+			__m256i lastZ = _mm256_set1_epi32(cellsZ - 1);
+			__m256i stride = _mm256_set1_epi32(map->GetStride());
+			__m256i one = _mm256_set1_epi32(1);
+			__m256 scale = _mm256_set1_ps(heightScale);
+			const float *data = map->GetData();
+
+			int i = 0;
+			for (; i + 8 <= count; i += 8)
+			{
+				__m256 gridX = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(_mm256_loadu_ps(x + i), inverseX), zero), limitX);
+				__m256 gridZ = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(_mm256_loadu_ps(z + i), inverseZ), zero), limitZ);
+				__m256i cellX = _mm256_min_epi32(_mm256_cvttps_epi32(gridX), lastX);
+				__m256i cellZ = _mm256_min_epi32(_mm256_cvttps_epi32(gridZ), lastZ);
+				__m256 u = _mm256_sub_ps(gridX, _mm256_cvtepi32_ps(cellX));
+				__m256 v = _mm256_sub_ps(gridZ, _mm256_cvtepi32_ps(cellZ));
+
+				__m256i index = _mm256_add_epi32(_mm256_mullo_epi32(cellZ, stride), cellX);
+				__m256i nextIndex = _mm256_add_epi32(index, stride);
+				__m256 h00 = _mm256_i32gather_ps(data, index, 4);
+				__m256 h10 = _mm256_i32gather_ps(data, _mm256_add_epi32(index, one), 4);
+				__m256 h01 = _mm256_i32gather_ps(data, nextIndex, 4);
+				__m256 h11 = _mm256_i32gather_ps(data, _mm256_add_epi32(nextIndex, one), 4);
+
+				__m256 top = _mm256_add_ps(h00, _mm256_mul_ps(_mm256_sub_ps(h10, h00), u));
+				__m256 bottom = _mm256_add_ps(h01, _mm256_mul_ps(_mm256_sub_ps(h11, h01), u));
+				__m256 height = _mm256_add_ps(top, _mm256_mul_ps(_mm256_sub_ps(bottom, top), v));
+				_mm256_storeu_ps(heights + i, _mm256_mul_ps(height, scale));
+			}
+			return i;
+		}
+#endif
+
+	public:
+		HeightfieldQuery()
+		{
+		}
+
+		/// Builds the quadtree over map. False, leaving nothing to query, for a map under 2x2 samples or a
+		/// scale or spacing that is not positive.
+		bool Build(const Heightfield &map, float heightScale, float spacingX, float spacingZ, ThreadPool &threadPool)
+		{
+			TERRAIN_PROFILE_SCOPE("query");
+			Clear();
+			if (map.GetWidth() < 2 || map.GetDepth() < 2 || !(heightScale > 0.0f) || !(spacingX > 0.0f) || !(spacingZ > 0.0f))
+				return false;
+
+			this->map = &map;
+			cellsX = map.GetWidth() - 1;
+			cellsZ = map.GetDepth() - 1;
+			this->heightScale = heightScale;
+			this->spacingX = spacingX;
+			this->spacingZ = spacingZ;
+			inverseSpacingX = 1.0f / spacingX;
+			inverseSpacingZ = 1.0f / spacingZ;
+
+			//up to a single root, the vectors are reused while the size stays the same
+			int levelCount = 0;
+			int nodesX = (cellsX + leafCells - 1) / leafCells;
+			int nodesZ = (cellsZ + leafCells - 1) / leafCells;
+			for (;;)
+			{
+				if ((int)levels.size() <= levelCount)
+					levels.push_back(Level());
+				Level &level = levels[levelCount++];
+				level.nodesX = nodesX;
+				level.nodesZ = nodesZ;
+				level.ranges.resize((size_t)nodesX * nodesZ * 2);
+				if (nodesX == 1 && nodesZ == 1)
+					break;
+				nodesX = (nodesX + 1) / 2;
+				nodesZ = (nodesZ + 1) / 2;
+			}
+			levels.resize(levelCount);
+
+			int leafRows = levels[0].nodesZ;
+			threadPool.ParallelFor(0, leafRows, threadPool.GetGrainSize(leafRows), [&](int first, int last)
+			{
+				std::vector<float> columnMin, columnMax;
+				for (int z = first; z < last; ++z)
+					MeasureLeafRow(z, columnMin, columnMax);
+			});
+			for (int level = 1; level < levelCount; ++level)
+				MergeLevel(level);
+			return true;
+		}
+
+		/// Forgets the map, queries find nothing until the next Build. The quadtree's memory is kept for it.
+		void Clear()
+		{
+			map = nullptr;
+			cellsX = cellsZ = 0;
+		}
+
+		/// Points the queries at map after the one they were built over was moved or swapped into it unchanged.
+		void Attach(const Heightfield &map)
+		{
+			if (this->map)
+				this->map = &map;
+		}
+
+		/// Exchanges the quadtrees rather than copying them, Attach each to its map afterwards.
+		void Swap(HeightfieldQuery &other)
+		{
+			std::swap(map, other.map);
+			std::swap(cellsX, other.cellsX);
+			std::swap(cellsZ, other.cellsZ);
+			std::swap(spacingX, other.spacingX);
+			std::swap(spacingZ, other.spacingZ);
+			std::swap(heightScale, other.heightScale);
+			std::swap(inverseSpacingX, other.inverseSpacingX);
+			std::swap(inverseSpacingZ, other.inverseSpacingZ);
+			levels.swap(other.levels);
+		}
+
+		bool IsBuilt() const { return map != nullptr; }
+		int GetLevelCount() const { return map ? (int)levels.size() : 0; }
+
+		/// Scaled height of the surface at (x, z), clamped to the map's edges. 0 with nothing built.
+		float GetHeight(float x, float z) const
+		{
+			if (!map)
+				return 0.0f;
+
+			int cellX, cellZ;
+			float u, v;
+			Locate(x, z, cellX, cellZ, u, v);
+			return Interpolate(cellX, cellZ, u, v);
+		}
+
+		/// Unit normal at (x, z), clamped to the map's edges: the sample normals the mesh is shaded with,
+		/// blended bilinearly. Straight up with nothing built.
+		void GetNormal(float x, float z, float normal[3]) const
+		{
+			normal[0] = 0.0f;
+			normal[1] = 1.0f;
+			normal[2] = 0.0f;
+			if (!map)
+				return;
+
+			int cellX, cellZ;
+			float u, v;
+			Locate(x, z, cellX, cellZ, u, v);
+			float corners[4][3];
+			SampleNormal(cellX, cellZ, corners[0]);
+			SampleNormal(cellX + 1, cellZ, corners[1]);
+			SampleNormal(cellX, cellZ + 1, corners[2]);
+			SampleNormal(cellX + 1, cellZ + 1, corners[3]);
+
+			float blended[3];
+			for (int i = 0; i < 3; ++i)
+			{
+				float top = corners[0][i] + (corners[1][i] - corners[0][i]) * u;
+				float bottom = corners[2][i] + (corners[3][i] - corners[2][i]) * u;
+				blended[i] = top + (bottom - top) * v;
+			}
+			float inverseLength = 1.0f / std::sqrt(blended[0] * blended[0] + blended[1] * blended[1] + blended[2] * blended[2]);
+			for (int i = 0; i < 3; ++i)
+				normal[i] = blended[i] * inverseLength;
+		}
+
+		/// Heights at count points, exactly as GetHeight gives them, eight at a time where AVX2 can gather them.
+		void GetHeights(const float *x, const float *z, int count, float *heights) const
+		{
+			if (!map)
+			{
+				std::fill(heights, heights + count, 0.0f);
+				return;
+			}
+
+			int i = 0;
+#if TERRAIN_SIMD_X86
+			if (useAvx2)
+				i = GetHeightsAvx2(x, z, count, heights);
+#endif
+			for (; i < count; ++i)
+				heights[i] = GetHeight(x[i], z[i]);
+		}
+
+		/// Nearest point within ray.maxDistance where the ray meets the surface, false if it passes over the map.
+		bool Raycast(const Ray &ray, RayHit &hit) const
+		{
+			hit.hit = false;
+			if (!map || !(ray.maxDistance >= 0.0f))
+				return false;
+
+			GridRay grid;
+			grid.origin[0] = ray.origin[0] * inverseSpacingX;
+			grid.origin[1] = ray.origin[1] / heightScale;
+			grid.origin[2] = ray.origin[2] * inverseSpacingZ;
+			grid.direction[0] = ray.direction[0] * inverseSpacingX;
+			grid.direction[1] = ray.direction[1] / heightScale;
+			grid.direction[2] = ray.direction[2] * inverseSpacingZ;
+
+			//a ray parallel to an axis never leaves the slab it starts in, a huge inverse keeps that true
+			grid.inverseX = grid.direction[0] != 0.0f ? 1.0f / grid.direction[0] : 1e30f;
+			grid.inverseZ = grid.direction[2] != 0.0f ? 1.0f / grid.direction[2] : 1e30f;
+			grid.nearX = grid.direction[0] < 0.0f ? 1 : 0;
+			grid.nearZ = grid.direction[2] < 0.0f ? 1 : 0;
+
+			float t;
+			if (!IntersectGrid(grid, 0.0f, ray.maxDistance, t))
+				return false;
+
+			hit.hit = true;
+			hit.distance = t;
+			for (int i = 0; i < 3; ++i)
+				hit.position[i] = ray.origin[i] + ray.direction[i] * t;
+			GetNormal(hit.position[0], hit.position[2], hit.normal);
+			return true;
+		}
+
+		/// The segment from start to end, distance is the fraction of the way along it.
+		bool IntersectSegment(const float start[3], const float end[3], RayHit &hit) const
+		{
+			Ray ray = { { start[0], start[1], start[2] }, { end[0] - start[0], end[1] - start[1], end[2] - start[2] }, 1.0f };
+			return Raycast(ray, hit);
+		}
+
+		/// Casts count rays, spread over the pool's threads. Agents' rays rarely share a path down the tree, so each
+		/// descends on its own and the batch gains from the threads rather than from packets.
+		void Raycast(const Ray *rays, int count, RayHit *hits, ThreadPool &threadPool) const
+		{
+			threadPool.ParallelFor(0, count, threadPool.GetGrainSize(count, 64), [&](int first, int last)
+			{
+				for (int i = first; i < last; ++i)
+					Raycast(rays[i], hits[i]);
+			});
+		}
+	};
+}
@@ -0,0 +1,538 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Headless heightmap generator. Runs the terrain algorithms without octet or a
+// GL context and writes the result to disk.
+//
+//   HeightmapTool -a fbm -s 4096x4096 --seed 1234 -o terrain.png
+//
+// A .tts output is written as a tile store instead, generated a tile at a time
+// so the whole map never has to fit in memory.
+//
+//   HeightmapTool -a fbm -s 65536x65536 --tile-cells 64 --mips 4 -o world.tts
+//
+// A .thc output is a compressed snapshot, which the app shows with --snapshot.
+//
+// Diamond-square tiles are generated together, each in a heightfield of its
+// own, so the world has to fit in memory but never in one allocation.
+//
+
+//every heap allocation is counted towards the stage it was made in, for --profile
+#define TERRAIN_PROFILE_COUNT_NEW
+#include "TerrainProfiler.h"
+#include "TerrainErosion.h"
+#include "TerrainGenerator.h"
+#include "HeightmapWriter.h"
+#include "SplatMap.h"
+#include "CompressedHeightfield.h"
+#include "TileStore.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace
+{
+	typedef std::chrono::high_resolution_clock Clock;
+
+	double MillisecondsSince(Clock::time_point start)
+	{
+		return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+	}
+
+	struct AlgorithmName
+	{
+		const char *name;
+		Terrain::TerrainGenerator::Algorithm algorithm;
+	};
+
+	const AlgorithmName algorithmNames[] =
+	{
+		{ "midpoint", Terrain::TerrainGenerator::MidpointDisplacement },
+		{ "diamond", Terrain::TerrainGenerator::DiamondSquare },
+		{ "perlin", Terrain::TerrainGenerator::PerlinNoise },
+		{ "fbm", Terrain::TerrainGenerator::FractionalBrownianMotion },
+		{ "multifractal", Terrain::TerrainGenerator::MultiFractal },
+	};
+
+	void PrintUsage()
+	{
+		printf(
+			"usage: HeightmapTool [options] -o <file>\n"
+			"  -a, --algorithm <name>   midpoint, diamond, perlin, fbm, multifractal (default fbm)\n"
+			"  -s, --size <X>x<Z>       grid cells, the map has (X+1)x(Z+1) samples (default 128x128)\n"
+			"      --seed <n>           seed, the same seed always produces the same map (default 0)\n"
+			"      --octaves <n>        fBm octaves (default 16)\n"
+			"      --gain <f>           fBm amplitude gain per octave (default 0.65)\n"
+			"      --lacunarity <f>     fBm frequency multiplier per octave (default 2)\n"
+			"      --mf-type <type>     multifractal variant, ridged or hybrid (default ridged)\n"
+			"      --mf-octaves <n>     multifractal octaves (default 8)\n"
+			"      --mf-lacunarity <f>  multifractal frequency multiplier per octave (default 2)\n"
+			"      --mf-gain <f>        ridged weighting of each octave by the one below (default 2)\n"
+			"      --mf-offset <f>      multifractal offset (default 1, around 0.7 suits hybrid)\n"
+			"      --mf-h <f>           multifractal amplitude falls by lacunarity^-h an octave (default 1)\n"
+			"      --octave-limit <f>   skip octaves finer than this many noise cells a sample, 0 keeps all (default 0.5)\n"
+			"      --fade-last-octave   fade the last fBm/multifractal octave out ahead of that limit\n"
+			"      --perlin-random      displace midpoint/diamond-square with Perlin noise\n"
+			"      --erode <n>          hydraulic erosion iterations run over the map (default 0)\n"
+			"      --thermal <n>        thermal erosion iterations, after the hydraulic ones (default 0)\n"
+			"      --splat <file>       also bake the app's default splat map, as an RGBA PNG of layer 1 to 4 weights\n"
+			"  -j, --threads <n>        worker threads on top of the main thread (default all cores)\n"
+			"  -f, --format <fmt>       raw, pgm, png, npy, tts or thc (default from the file extension, else raw)\n"
+			"  -o, --output <file>      output path\n"
+			"      --profile <file>     print each stage's time and allocations, and write them as a Chrome trace\n"
+			"tile store (tts) options, diamond, perlin, fbm and multifractal only:\n"
+			"      --tile-cells <n>     cells along a tile edge, X and Z must be multiples of it (default 64)\n"
+			"      --mips <n>           mip levels per tile, tile cells must divide by 2^(n-1) (default 4)\n"
+			"      --spacing <f>        world distance between samples the normals, erosion and splat map work with (default 1)\n"
+			"      --height-scale <f>   height scale the normals, erosion and splat map work with (default 50)\n");
+	}
+
+	bool ParseAlgorithm(const char *name, Terrain::TerrainGenerator::Algorithm &algorithm)
+	{
+		for (size_t i = 0; i < sizeof(algorithmNames) / sizeof(algorithmNames[0]); ++i)
+		{
+			if (strcmp(name, algorithmNames[i].name) == 0)
+			{
+				algorithm = algorithmNames[i].algorithm;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	bool ParseFormat(const char *name, Terrain::HeightmapWriter::Format &format)
+	{
+		if (strcmp(name, "raw") == 0)
+			format = Terrain::HeightmapWriter::RawFloat32;
+		else if (strcmp(name, "pgm") == 0)
+			format = Terrain::HeightmapWriter::Pgm16;
+		else if (strcmp(name, "png") == 0)
+			format = Terrain::HeightmapWriter::Png16;
+		else if (strcmp(name, "npy") == 0)
+			format = Terrain::HeightmapWriter::Npy;
+		else
+			return false;
+		return true;
+	}
+
+	bool HasExtension(const std::string &path, const char *extension)
+	{
+		size_t dot = path.rfind('.');
+		return dot != std::string::npos && path.compare(dot + 1, std::string::npos, extension) == 0;
+	}
+
+	/// Generates the map tile by tile into a tile store, flushing the index after every row of tiles
+	/// so an interrupted run still leaves a readable file.
+	//diamond-square is not world continuous, so its tiles are made together, each in its own heightfield, and
+	//their borders copied from the neighbouring tiles, clamped to the world's edge
+	bool WriteDiamondSquareTiles(Terrain::TileStoreWriter &writer, Terrain::TerrainGenerator &generator, int tileCells, int tilesX, int tilesZ)
+	{
+		std::vector<Terrain::Heightfield> tiles((size_t)tilesX * tilesZ);
+		if (!generator.GenerateDiamondSquareTiles(tileCells, &tiles[0]))
+			return false;
+
+		int border = writer.GetBorder();
+		int samples = tileCells + 1 + border * 2;
+		Terrain::Heightfield bordered;
+		if (!bordered.Resize(samples, samples))
+			return false;
+		for (int tileZ = 0; tileZ < tilesZ; ++tileZ)
+		{
+			for (int tileX = 0; tileX < tilesX; ++tileX)
+			{
+				for (int z = 0; z < samples; ++z)
+				{
+					int worldZ = std::min(std::max(tileZ * tileCells + z - border, 0), tilesZ * tileCells);
+					int sourceZ = std::min(worldZ / tileCells, tilesZ - 1);
+					for (int x = 0; x < samples; ++x)
+					{
+						int worldX = std::min(std::max(tileX * tileCells + x - border, 0), tilesX * tileCells);
+						int sourceX = std::min(worldX / tileCells, tilesX - 1);
+						bordered(x, z) = tiles[(size_t)sourceZ * tilesX + sourceX](worldX - sourceX * tileCells, worldZ - sourceZ * tileCells);
+					}
+				}
+				if (!writer.WriteTile(tileX, tileZ, bordered))
+					return false;
+			}
+			if (!writer.Flush())
+				return false;
+		}
+		return writer.Close();
+	}
+
+	bool WriteTileStore(const std::string &path, Terrain::TerrainGenerator &generator, Terrain::TerrainGenerator::Algorithm algorithm,
+		int tileCells, int mipLevels, float spacing, float heightScale)
+	{
+		int tilesX = generator.GetCellsX() / tileCells;
+		int tilesZ = generator.GetCellsZ() / tileCells;
+
+		Terrain::TileStoreWriter writer;
+		if (!writer.Open(path.c_str(), tileCells, mipLevels, 0, 0, tilesX, tilesZ, spacing, heightScale))
+			return false;
+
+		if (algorithm == Terrain::TerrainGenerator::DiamondSquare)
+			return WriteDiamondSquareTiles(writer, generator, tileCells, tilesX, tilesZ);
+
+		for (int tileZ = 0; tileZ < tilesZ; ++tileZ)
+		{
+			for (int tileX = 0; tileX < tilesX; ++tileX)
+			{
+				if (!writer.GenerateTile(generator, algorithm, tileX, tileZ))
+					return false;
+			}
+			if (!writer.Flush())
+				return false;
+		}
+		return writer.Close();
+	}
+
+	void PrintOctavePlan(const Terrain::TerrainGenerator::OctavePlan &plan)
+	{
+		if (plan.count == 0)
+			return;
+
+		printf("  octaves  %u, %u past the sampling limit skipped", plan.count, plan.skipped);
+		if (plan.lastWeight < 1.0f)
+			printf(", the last at %.2f", plan.lastWeight);
+		printf("\n");
+	}
+
+	//the stage table, and the trace for chrome://tracing at path, when --profile asked for them
+	bool WriteProfile(const char *path)
+	{
+		if (!path)
+			return true;
+
+		Terrain::Profiler &profiler = Terrain::Profiler::Get();
+		printf("\n");
+		profiler.Print(stdout);
+		if (!profiler.WriteChromeTrace(path))
+		{
+			fprintf(stderr, "failed to write %s\n", path);
+			return false;
+		}
+		return true;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	Terrain::TerrainGenerator::Algorithm algorithm = Terrain::TerrainGenerator::FractionalBrownianMotion;
+	int cellsX = 128;
+	int cellsZ = 128;
+	unsigned seed = 0;
+	unsigned octaves = 16;
+	float gain = 0.65f;
+	float lacunarity = 2.0f;
+	Terrain::TerrainGenerator::MultiFractalType multiFractalType = Terrain::TerrainGenerator::RidgedMultiFractal;
+	unsigned multiFractalOctaves = 8;
+	float multiFractalLacunarity = 2.0f;
+	float multiFractalGain = 2.0f;
+	float multiFractalOffset = 1.0f;
+	float multiFractalH = 1.0f;
+	float maxOctaveFrequency = 0.5f;
+	bool fadeLastOctave = false;
+	bool usePerlinRandom = false;
+	int threads = -1;
+	bool formatGiven = false;
+	bool tileStore = false;
+	bool snapshot = false;
+	Terrain::HeightmapWriter::Format format = Terrain::HeightmapWriter::RawFloat32;
+	std::string output;
+	int tileCells = 64;
+	int mipLevels = 4;
+	float spacing = 1.0f;
+	float heightScale = 50.0f;
+	Terrain::ErosionSimulator::Settings erosion;
+	const char *profilePath = nullptr;
+	const char *splatPath = nullptr;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string arg = argv[i];
+		const char *value = i + 1 < argc ? argv[i + 1] : nullptr;
+		bool takesValue = true;
+
+		if (arg == "-h" || arg == "--help")
+		{
+			PrintUsage();
+			return 0;
+		}
+		else if (arg == "--perlin-random")
+		{
+			usePerlinRandom = true;
+			takesValue = false;
+		}
+		else if (arg == "--fade-last-octave")
+		{
+			fadeLastOctave = true;
+			takesValue = false;
+		}
+		else if (!value)
+		{
+			fprintf(stderr, "missing value for %s\n", arg.c_str());
+			return 1;
+		}
+		else if (arg == "-a" || arg == "--algorithm")
+		{
+			if (!ParseAlgorithm(value, algorithm))
+			{
+				fprintf(stderr, "unknown algorithm '%s'\n", value);
+				return 1;
+			}
+		}
+		else if (arg == "-s" || arg == "--size")
+		{
+			if (sscanf(value, "%dx%d", &cellsX, &cellsZ) != 2 || cellsX < 1 || cellsZ < 1)
+			{
+				fprintf(stderr, "bad size '%s', expected e.g. 512x512\n", value);
+				return 1;
+			}
+		}
+		else if (arg == "--seed")
+			seed = (unsigned)strtoul(value, nullptr, 0);
+		else if (arg == "--octaves")
+			octaves = (unsigned)atoi(value);
+		else if (arg == "--gain")
+			gain = (float)atof(value);
+		else if (arg == "--lacunarity")
+			lacunarity = (float)atof(value);
+		else if (arg == "--mf-type")
+		{
+			if (strcmp(value, "ridged") == 0)
+				multiFractalType = Terrain::TerrainGenerator::RidgedMultiFractal;
+			else if (strcmp(value, "hybrid") == 0)
+				multiFractalType = Terrain::TerrainGenerator::HybridMultiFractal;
+			else
+			{
+				fprintf(stderr, "unknown multifractal type '%s'\n", value);
+				return 1;
+			}
+		}
+		else if (arg == "--mf-octaves")
+			multiFractalOctaves = (unsigned)atoi(value);
+		else if (arg == "--mf-lacunarity")
+			multiFractalLacunarity = (float)atof(value);
+		else if (arg == "--mf-gain")
+			multiFractalGain = (float)atof(value);
+		else if (arg == "--mf-offset")
+			multiFractalOffset = (float)atof(value);
+		else if (arg == "--mf-h")
+			multiFractalH = (float)atof(value);
+		else if (arg == "--octave-limit")
+			maxOctaveFrequency = (float)atof(value);
+		else if (arg == "--erode")
+			erosion.hydraulicIterations = atoi(value);
+		else if (arg == "--thermal")
+			erosion.thermalIterations = atoi(value);
+		else if (arg == "-j" || arg == "--threads")
+			threads = atoi(value);
+		else if (arg == "-f" || arg == "--format")
+		{
+			if (strcmp(value, "tts") == 0)
+				tileStore = true;
+			else if (strcmp(value, "thc") == 0)
+				snapshot = true;
+			else if (!ParseFormat(value, format))
+			{
+				fprintf(stderr, "unknown format '%s'\n", value);
+				return 1;
+			}
+			formatGiven = true;
+		}
+		else if (arg == "-o" || arg == "--output")
+			output = value;
+		else if (arg == "--profile")
+			profilePath = value;
+		else if (arg == "--splat")
+			splatPath = value;
+		else if (arg == "--tile-cells")
+			tileCells = atoi(value);
+		else if (arg == "--mips")
+			mipLevels = atoi(value);
+		else if (arg == "--spacing")
+			spacing = (float)atof(value);
+		else if (arg == "--height-scale")
+			heightScale = (float)atof(value);
+		else
+		{
+			fprintf(stderr, "unknown option %s\n", arg.c_str());
+			PrintUsage();
+			return 1;
+		}
+
+		if (takesValue)
+			++i;
+	}
+
+	if (output.empty())
+	{
+		PrintUsage();
+		return 1;
+	}
+
+	if (!formatGiven)
+	{
+		tileStore = HasExtension(output, "tts");
+		snapshot = HasExtension(output, "thc");
+		format = Terrain::HeightmapWriter::GetFormatFromPath(output);
+	}
+
+	if (tileStore)
+	{
+		if (!Terrain::TerrainGenerator::IsWorldContinuous(algorithm) && algorithm != Terrain::TerrainGenerator::DiamondSquare)
+		{
+			fprintf(stderr, "tile stores can only be generated with diamond, perlin, fbm or multifractal\n");
+			return 1;
+		}
+		if (algorithm == Terrain::TerrainGenerator::DiamondSquare && (tileCells < 2 || (tileCells & (tileCells - 1)) != 0))
+		{
+			fprintf(stderr, "diamond tile stores need a power of two --tile-cells\n");
+			return 1;
+		}
+		if (erosion.IsEnabled())
+		{
+			fprintf(stderr, "erosion needs the whole map at once, tile stores are generated a tile at a time\n");
+			return 1;
+		}
+		if (splatPath)
+		{
+			fprintf(stderr, "splat maps are baked from the whole map, not from tile stores\n");
+			return 1;
+		}
+		if (tileCells < 1 || cellsX % tileCells != 0 || cellsZ % tileCells != 0)
+		{
+			fprintf(stderr, "size %dx%d is not a whole number of %d cell tiles\n", cellsX, cellsZ, tileCells);
+			return 1;
+		}
+	}
+
+	Terrain::Profiler::Get().SetEnabled(profilePath != nullptr);
+	Clock::time_point start = Clock::now();
+
+	Terrain::TerrainGenerator generator(cellsX, cellsZ);
+	if (threads >= 0)
+		generator.SetWorkerCount(threads);
+	generator.SetSeed(seed);
+	generator.usePerlinRandom = usePerlinRandom;
+	generator.octaves = octaves;
+	generator.gain = gain;
+	generator.lacunarity = lacunarity;
+	generator.multiFractalType = multiFractalType;
+	generator.multiFractalOctaves = multiFractalOctaves;
+	generator.multiFractalLacunarity = multiFractalLacunarity;
+	generator.multiFractalGain = multiFractalGain;
+	generator.multiFractalOffset = multiFractalOffset;
+	generator.multiFractalH = multiFractalH;
+	generator.maxOctaveFrequency = maxOctaveFrequency;
+	generator.fadeLastOctave = fadeLastOctave;
+	Terrain::TerrainGenerator::OctavePlan octavePlan = generator.GetOctavePlan(algorithm);
+	double setupTime = MillisecondsSince(start);
+
+	if (tileStore)
+	{
+		Clock::time_point stageStart = Clock::now();
+		if (!WriteTileStore(output, generator, algorithm, tileCells, mipLevels, spacing, heightScale))
+		{
+			fprintf(stderr, "failed to write %s\n", output.c_str());
+			return 1;
+		}
+		double generateTime = MillisecondsSince(stageStart);
+
+		double samples = (double)cellsX * cellsZ;
+		printf("%dx%d tiles of %d cells, %d mips, seed %u, %d threads\n", cellsX / tileCells, cellsZ / tileCells, tileCells, mipLevels, seed, generator.GetWorkerCount() + 1);
+		PrintOctavePlan(octavePlan);
+		printf("  setup    %10.3f ms\n", setupTime);
+		printf("  generate %10.3f ms  (%.2f ns/sample, including the writes)\n", generateTime, generateTime * 1e6 / samples);
+		printf("  total    %10.3f ms\n", MillisecondsSince(start));
+		return WriteProfile(profilePath) ? 0 : 1;
+	}
+
+	Terrain::Heightfield map;
+	Clock::time_point stageStart = Clock::now();
+	if (!generator.Generate(algorithm, map))
+	{
+		fprintf(stderr, "not enough memory for a %dx%d map\n", cellsX + 1, cellsZ + 1);
+		return 1;
+	}
+	double generateTime = MillisecondsSince(stageStart);
+
+	stageStart = Clock::now();
+	Terrain::ErosionSimulator simulator;
+	if (!simulator.Erode(map, erosion, heightScale, spacing, generator.GetThreadPool()))
+	{
+		fprintf(stderr, "not enough memory to erode a %dx%d map\n", cellsX + 1, cellsZ + 1);
+		return 1;
+	}
+	double erodeTime = MillisecondsSince(stageStart);
+
+	//a snapshot carries what the app needs to lay the map out as it was made
+	stageStart = Clock::now();
+	Terrain::CompressedHeightfield compressed;
+	if (snapshot)
+	{
+		compressed.Compress(map, generator.GetThreadPool());
+		compressed.seed = seed;
+		compressed.algorithm = (uint32_t)algorithm;
+		compressed.sampleSpacing = spacing;
+		compressed.heightScale = heightScale;
+	}
+	bool written = snapshot ? compressed.Save(output.c_str()) : Terrain::HeightmapWriter::Write(output, map, format);
+	if (!written)
+	{
+		fprintf(stderr, "failed to write %s\n", output.c_str());
+		return 1;
+	}
+	double writeTime = MillisecondsSince(stageStart);
+
+	//the weights are of the heights' range as drawn, which is what the app bakes them against
+	stageStart = Clock::now();
+	if (splatPath)
+	{
+		float min = 999999.0f;
+		float max = -999999.0f;
+		for (int z = 0; z < map.GetDepth(); ++z)
+		{
+			const float *row = map.GetRow(z);
+			for (int x = 0; x < map.GetWidth(); ++x)
+			{
+				min = std::min(min, row[x] * heightScale);
+				max = std::max(max, row[x] * heightScale);
+			}
+		}
+
+		std::vector<uint8_t> splat((size_t)map.GetWidth() * map.GetDepth() * 4);
+		Terrain::SplatMapBaker baker;
+		baker.Bake(map, heightScale, spacing, spacing, min, max, generator.GetThreadPool(), &splat[0]);
+		if (!Terrain::HeightmapWriter::WriteRgbaPng(splatPath, &splat[0], map.GetWidth(), map.GetDepth()))
+		{
+			fprintf(stderr, "failed to write %s\n", splatPath);
+			return 1;
+		}
+	}
+	double splatTime = MillisecondsSince(stageStart);
+
+	double samples = (double)map.GetWidth() * map.GetDepth();
+	printf("%dx%d samples, seed %u, %d threads\n", map.GetWidth(), map.GetDepth(), seed, generator.GetWorkerCount() + 1);
+	PrintOctavePlan(octavePlan);
+	printf("  setup    %10.3f ms\n", setupTime);
+	printf("  generate %10.3f ms  (%.2f ns/sample)\n", generateTime, generateTime * 1e6 / samples);
+	if (erosion.IsEnabled())
+	{
+		int iterations = erosion.hydraulicIterations + erosion.thermalIterations;
+		printf("  erode    %10.3f ms  (%d hydraulic, %d thermal iterations, %.2f ns/sample an iteration)\n",
+			erodeTime, erosion.hydraulicIterations, erosion.thermalIterations, erodeTime * 1e6 / (samples * iterations));
+	}
+	if (snapshot)
+		printf("  write    %10.3f ms  (compressed %.2fx, to %u bytes)\n", writeTime, samples * sizeof(float) / compressed.GetSizeInBytes(), (unsigned)compressed.GetSizeInBytes());
+	else
+		printf("  write    %10.3f ms\n", writeTime);
+	if (splatPath)
+		printf("  splat    %10.3f ms  (%.2f ns/sample, including the write)\n", splatTime, splatTime * 1e6 / samples);
+	printf("  total    %10.3f ms\n", MillisecondsSince(start));
+	return WriteProfile(profilePath) ? 0 : 1;
+}
@@ -0,0 +1,275 @@
+#pragma once
+#include "Heightfield.h"
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace Terrain
+{
+	/// Saves a heightfield to disk for use outside the app.
+	/// Float formats keep the heights as generated, 16-bit formats map [min, max] onto [0, 65535].
+	class HeightmapWriter
+	{
+	public:
+		enum Format
+		{
+			RawFloat32,
+			Pgm16,
+			Png16,
+			Npy
+		};
+
+	private:
+		static void PutBigEndian32(std::vector<unsigned char> &out, unsigned value)
+		{
+			out.push_back((unsigned char)(value >> 24));
+			out.push_back((unsigned char)(value >> 16));
+			out.push_back((unsigned char)(value >> 8));
+			out.push_back((unsigned char)value);
+		}
+
+		static unsigned Crc32(const unsigned char *data, size_t length, unsigned crc = 0)
+		{
+			static unsigned table[256];
+			static bool tableBuilt = false;
+			if (!tableBuilt)
+			{
+				for (unsigned n = 0; n < 256; ++n)
+				{
+					unsigned c = n;
+					for (int k = 0; k < 8; ++k)
+						c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+					table[n] = c;
+				}
+				tableBuilt = true;
+			}
+
+			crc = ~crc;
+			for (size_t i = 0; i < length; ++i)
+				crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+			return ~crc;
+		}
+
+		static void PutPngChunk(FILE *file, const char *type, const std::vector<unsigned char> &data)
+		{
+			std::vector<unsigned char> chunk;
+			PutBigEndian32(chunk, (unsigned)data.size());
+			chunk.insert(chunk.end(), type, type + 4);
+			chunk.insert(chunk.end(), data.begin(), data.end());
+			PutBigEndian32(chunk, Crc32(&chunk[4], chunk.size() - 4));
+			fwrite(&chunk[0], 1, chunk.size(), file);
+		}
+
+		static unsigned short Quantise(float value, float min, float scale)
+		{
+			float q = (value - min) * scale + 0.5f;
+			return (unsigned short)(q < 0.0f ? 0.0f : (q > 65535.0f ? 65535.0f : q));
+		}
+
+		static void GetRange(const Heightfield &map, float &min, float &max)
+		{
+			min = 999999.0f;
+			max = -999999.0f;
+			for (int z = 0; z < map.GetDepth(); ++z)
+			{
+				const float *row = map.GetRow(z);
+				for (int x = 0; x < map.GetWidth(); ++x)
+				{
+					min = row[x] < min ? row[x] : min;
+					max = row[x] > max ? row[x] : max;
+				}
+			}
+		}
+
+		//one row of big endian 16-bit samples, the byte order both PGM and PNG use
+		static void QuantiseRow(const float *row, int width, float min, float scale, unsigned char *out)
+		{
+			for (int x = 0; x < width; ++x)
+			{
+				unsigned short q = Quantise(row[x], min, scale);
+				out[x * 2 + 0] = (unsigned char)(q >> 8);
+				out[x * 2 + 1] = (unsigned char)q;
+			}
+		}
+
+	public:
+		/// Picks a format from the file extension, defaulting to raw float32.
+		static Format GetFormatFromPath(const std::string &path)
+		{
+			size_t dot = path.rfind('.');
+			std::string extension = dot == std::string::npos ? "" : path.substr(dot + 1);
+			if (extension == "pgm")
+				return Pgm16;
+			if (extension == "png")
+				return Png16;
+			if (extension == "npy")
+				return Npy;
+			return RawFloat32;
+		}
+
+		static bool Write(const std::string &path, const Heightfield &map, Format format)
+		{
+			switch (format)
+			{
+			case Pgm16: return WritePgm(path, map);
+			case Png16: return WritePng(path, map);
+			case Npy: return WriteNpy(path, map);
+			default: return WriteRaw(path, map);
+			}
+		}
+
+		/// Rows of float32 in the host's byte order with no header or padding.
+		static bool WriteRaw(const std::string &path, const Heightfield &map)
+		{
+			FILE *file = fopen(path.c_str(), "wb");
+			if (!file)
+				return false;
+
+			bool ok = true;
+			for (int z = 0; z < map.GetDepth() && ok; ++z)
+				ok = fwrite(map.GetRow(z), sizeof(float), map.GetWidth(), file) == (size_t)map.GetWidth();
+
+			return fclose(file) == 0 && ok;
+		}
+
+		static bool WritePgm(const std::string &path, const Heightfield &map)
+		{
+			FILE *file = fopen(path.c_str(), "wb");
+			if (!file)
+				return false;
+
+			float min, max;
+			GetRange(map, min, max);
+			float scale = max > min ? 65535.0f / (max - min) : 0.0f;
+
+			fprintf(file, "P5\n%d %d\n65535\n", map.GetWidth(), map.GetDepth());
+
+			std::vector<unsigned char> row(map.GetWidth() * 2);
+			bool ok = true;
+			for (int z = 0; z < map.GetDepth() && ok; ++z)
+			{
+				QuantiseRow(map.GetRow(z), map.GetWidth(), min, scale, &row[0]);
+				ok = fwrite(&row[0], 1, row.size(), file) == row.size();
+			}
+
+			return fclose(file) == 0 && ok;
+		}
+
+		/// 16-bit greyscale PNG. The zlib stream uses stored blocks, so no compression library is needed.
+		static bool WritePng(const std::string &path, const Heightfield &map)
+		{
+			float min, max;
+			GetRange(map, min, max);
+			float scale = max > min ? 65535.0f / (max - min) : 0.0f;
+
+			//each scanline is a filter type byte (none) followed by the samples
+			size_t lineSize = 1 + (size_t)map.GetWidth() * 2;
+			std::vector<unsigned char> scanlines(lineSize * map.GetDepth());
+			for (int z = 0; z < map.GetDepth(); ++z)
+			{
+				scanlines[z * lineSize] = 0;
+				QuantiseRow(map.GetRow(z), map.GetWidth(), min, scale, &scanlines[z * lineSize + 1]);
+			}
+			return WritePngScanlines(path, map.GetWidth(), map.GetDepth(), 16, 0, scanlines);
+		}
+
+		/// 8-bit RGBA PNG of width x depth texels four bytes apart, e.g. a splat map.
+		static bool WriteRgbaPng(const std::string &path, const unsigned char *texels, int width, int depth)
+		{
+			size_t rowSize = (size_t)width * 4;
+			std::vector<unsigned char> scanlines((1 + rowSize) * depth);
+			for (int z = 0; z < depth; ++z)
+			{
+				scanlines[z * (1 + rowSize)] = 0;
+				memcpy(&scanlines[z * (1 + rowSize) + 1], texels + z * rowSize, rowSize);
+			}
+			return WritePngScanlines(path, width, depth, 8, 6, scanlines);
+		}
+
+		/// A PNG of unfiltered scanlines, each led by its filter type byte, in the given bit depth and colour type.
+		static bool WritePngScanlines(const std::string &path, int width, int depth, unsigned char bitDepth, unsigned char colourType,
+			const std::vector<unsigned char> &scanlines)
+		{
+			FILE *file = fopen(path.c_str(), "wb");
+			if (!file)
+				return false;
+
+			static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+			fwrite(signature, 1, sizeof(signature), file);
+
+			std::vector<unsigned char> header;
+			PutBigEndian32(header, (unsigned)width);
+			PutBigEndian32(header, (unsigned)depth);
+			header.push_back(bitDepth);
+			header.push_back(colourType); //0 greyscale, 6 RGBA
+			header.push_back(0); //deflate
+			header.push_back(0); //adaptive filtering
+			header.push_back(0); //no interlace
+			PutPngChunk(file, "IHDR", header);
+
+			std::vector<unsigned char> zlib;
+			zlib.push_back(0x78);
+			zlib.push_back(0x01);
+
+			unsigned adlerA = 1, adlerB = 0;
+			size_t offset = 0;
+			do
+			{
+				size_t blockSize = scanlines.size() - offset < 65535 ? scanlines.size() - offset : 65535;
+				bool last = offset + blockSize == scanlines.size();
+				zlib.push_back(last ? 1 : 0);
+				zlib.push_back((unsigned char)blockSize);
+				zlib.push_back((unsigned char)(blockSize >> 8));
+				zlib.push_back((unsigned char)~blockSize);
+				zlib.push_back((unsigned char)(~blockSize >> 8));
+				zlib.insert(zlib.end(), scanlines.begin() + offset, scanlines.begin() + offset + blockSize);
+
+				for (size_t i = offset; i < offset + blockSize; ++i)
+				{
+					adlerA = (adlerA + scanlines[i]) % 65521;
+					adlerB = (adlerB + adlerA) % 65521;
+				}
+				offset += blockSize;
+			} while (offset < scanlines.size());
+			PutBigEndian32(zlib, (adlerB << 16) | adlerA);
+
+			PutPngChunk(file, "IDAT", zlib);
+			PutPngChunk(file, "IEND", std::vector<unsigned char>());
+
+			return fclose(file) == 0;
+		}
+
+		/// NumPy .npy v1.0, a float32 array of shape (depth, width) in the host's byte order, which the header names.
+		static bool WriteNpy(const std::string &path, const Heightfield &map)
+		{
+			FILE *file = fopen(path.c_str(), "wb");
+			if (!file)
+				return false;
+
+			//the samples go out as they are in memory, so the header says which end of a float comes first
+			const unsigned short one = 1;
+			char dict[128];
+			sprintf(dict, "{'descr': '%cf4', 'fortran_order': False, 'shape': (%d, %d), }", *(const unsigned char*)&one == 1 ? '<' : '>', map.GetDepth(), map.GetWidth());
+
+			//magic, version and header length take 10 bytes, the header is space padded so the data starts 64 byte aligned
+			std::string header(dict);
+			size_t total = 10 + header.size() + 1;
+			header.append((64 - total % 64) % 64, ' ');
+			header.push_back('\n');
+
+			unsigned short headerLength = (unsigned short)header.size();
+			fwrite("\x93NUMPY\x01\x00", 1, 8, file);
+			fputc(headerLength & 0xff, file);
+			fputc(headerLength >> 8, file);
+			fwrite(header.c_str(), 1, header.size(), file);
+
+			bool ok = true;
+			for (int z = 0; z < map.GetDepth() && ok; ++z)
+				ok = fwrite(map.GetRow(z), sizeof(float), map.GetWidth(), file) == (size_t)map.GetWidth();
+
+			return fclose(file) == 0 && ok;
+		}
+	};
+}
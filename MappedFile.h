@@ -0,0 +1,123 @@
+#pragma once
+
+#include <cstdint>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace Terrain
+{
+	/// Read-only memory mapping of a whole file. Pages are read from disk the first time they are touched,
+	/// so opening costs nothing up front however big the file is.
+	class MappedFile
+	{
+		const unsigned char *mapping = nullptr;
+		uint64_t mappingSize = 0;
+
+#if defined(_WIN32)
+		HANDLE file = INVALID_HANDLE_VALUE;
+		HANDLE fileMapping = nullptr;
+#else
+		int file = -1;
+#endif
+
+		bool Map(const char *path, bool randomAccess)
+		{
+#if defined(_WIN32)
+			DWORD flags = FILE_ATTRIBUTE_NORMAL | (randomAccess ? FILE_FLAG_RANDOM_ACCESS : FILE_FLAG_SEQUENTIAL_SCAN);
+			file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, flags, nullptr);
+			if (file == INVALID_HANDLE_VALUE)
+				return false;
+
+			LARGE_INTEGER size;
+			if (!GetFileSizeEx(file, &size) || size.QuadPart == 0)
+				return false;
+			mappingSize = (uint64_t)size.QuadPart;
+
+			fileMapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+			if (!fileMapping)
+				return false;
+
+			mapping = (const unsigned char*)MapViewOfFile(fileMapping, FILE_MAP_READ, 0, 0, 0);
+			return mapping != nullptr;
+#else
+			file = open(path, O_RDONLY);
+			if (file < 0)
+				return false;
+
+			struct stat status;
+			if (fstat(file, &status) != 0 || status.st_size == 0)
+				return false;
+			mappingSize = (uint64_t)status.st_size;
+
+			void *view = mmap(nullptr, (size_t)mappingSize, PROT_READ, MAP_SHARED, file, 0);
+			if (view == MAP_FAILED)
+				return false;
+			mapping = (const unsigned char*)view;
+			if (!randomAccess)
+				madvise(view, (size_t)mappingSize, MADV_SEQUENTIAL);
+			return true;
+#endif
+		}
+
+		MappedFile(const MappedFile &);
+		MappedFile &operator=(const MappedFile &);
+
+	public:
+		MappedFile()
+		{
+		}
+
+		~MappedFile()
+		{
+			Close();
+		}
+
+		/// randomAccess hints the OS that reads jump around the file, otherwise it reads ahead.
+		bool Open(const char *path, bool randomAccess = true)
+		{
+			Close();
+			if (!Map(path, randomAccess))
+			{
+				Close();
+				return false;
+			}
+			return true;
+		}
+
+		void Close()
+		{
+#if defined(_WIN32)
+			if (mapping)
+				UnmapViewOfFile(mapping);
+			if (fileMapping)
+				CloseHandle(fileMapping);
+			if (file != INVALID_HANDLE_VALUE)
+				CloseHandle(file);
+			fileMapping = nullptr;
+			file = INVALID_HANDLE_VALUE;
+#else
+			if (mapping)
+				munmap((void*)mapping, (size_t)mappingSize);
+			if (file >= 0)
+				close(file);
+			file = -1;
+#endif
+			mapping = nullptr;
+			mappingSize = 0;
+		}
+
+		bool IsOpen() const { return mapping != nullptr; }
+		const unsigned char *GetData() const { return mapping; }
+		uint64_t GetSize() const { return mappingSize; }
+	};
+}
@@ -0,0 +1,290 @@
+#pragma once
+#include "CpuFeatures.h"
+#include "PerlinNoiseGenerator.h"
+
+#include <cmath>
+
+namespace Terrain
+{
+	/// Per octave steps of Musgrave's ridged and hybrid multifractals over a chunk of noise values.
+	/// Each step adds the octave to out and works out the weight every sample gives the next octave, in one pass.
+	/// A sample whose weight falls below the threshold stops, its weight is left at -1, and each step returns
+	/// whether any sample is still going. The SIMD kernels mirror the scalar code so every kernel gives the same floats.
+	class MultiFractal
+	{
+	public:
+		typedef PerlinNoiseGenerator::Kernel Kernel;
+
+		struct Parameters
+		{
+			float offset;
+			float gain;
+			float threshold;
+		};
+
+	private:
+		static float Clamp(float value)
+		{
+			value = value > 0.0f ? value : 0.0f;
+			return value < 1.0f ? value : 1.0f;
+		}
+
+		static float Retire(float weight, float threshold)
+		{
+			return weight < threshold ? -1.0f : weight;
+		}
+
+	public:
+		/// First ridged octave, writes out rather than adding to it.
+		static bool RidgedFirst(const float *noise, int count, const Parameters &parameters, float *out, float *weight, Kernel kernel)
+		{
+			int i = 0;
+			bool active = false;
+#if TERRAIN_SIMD_X86
+			if (kernel == PerlinNoiseGenerator::Avx2)
+				i = RidgedAvx2(noise, count, 1.0f, parameters, out, weight, true, active);
+			else if (kernel == PerlinNoiseGenerator::Sse41)
+				i = RidgedSse41(noise, count, 1.0f, parameters, out, weight, true, active);
+#endif
+			for (; i < count; ++i)
+			{
+				float ridge = parameters.offset - std::fabs(noise[i]);
+				float signal = ridge * ridge;
+				out[i] = signal;
+				weight[i] = Retire(Clamp(signal * parameters.gain), parameters.threshold);
+				active = active || weight[i] >= 0.0f;
+			}
+			return active;
+		}
+
+		/// Later ridged octaves, each ridge is scaled by the weight the octave below gave it.
+		static bool RidgedOctave(const float *noise, int count, float amplitude, const Parameters &parameters, float *out, float *weight, Kernel kernel)
+		{
+			int i = 0;
+			bool active = false;
+#if TERRAIN_SIMD_X86
+			if (kernel == PerlinNoiseGenerator::Avx2)
+				i = RidgedAvx2(noise, count, amplitude, parameters, out, weight, false, active);
+			else if (kernel == PerlinNoiseGenerator::Sse41)
+				i = RidgedSse41(noise, count, amplitude, parameters, out, weight, false, active);
+#endif
+			for (; i < count; ++i)
+			{
+				float live = weight[i] > 0.0f ? weight[i] : 0.0f;
+				float ridge = parameters.offset - std::fabs(noise[i]);
+				float signal = ridge * ridge * live;
+				out[i] += signal * amplitude;
+
+				float next = Retire(Clamp(signal * parameters.gain), parameters.threshold);
+				weight[i] = weight[i] < 0.0f ? weight[i] : next;
+				active = active || weight[i] >= 0.0f;
+			}
+			return active;
+		}
+
+		/// First hybrid octave, writes out rather than adding to it.
+		static bool HybridFirst(const float *noise, int count, const Parameters &parameters, float *out, float *weight, Kernel kernel)
+		{
+			int i = 0;
+			bool active = false;
+#if TERRAIN_SIMD_X86
+			if (kernel == PerlinNoiseGenerator::Avx2)
+				i = HybridAvx2(noise, count, 1.0f, parameters, out, weight, true, active);
+			else if (kernel == PerlinNoiseGenerator::Sse41)
+				i = HybridSse41(noise, count, 1.0f, parameters, out, weight, true, active);
+#endif
+			for (; i < count; ++i)
+			{
+				float value = noise[i] + parameters.offset;
+				out[i] = value;
+				weight[i] = Retire(Clamp(value), parameters.threshold);
+				active = active || weight[i] >= 0.0f;
+			}
+			return active;
+		}
+
+		/// Later hybrid octaves, the weight is the running product of the octaves so far.
+		static bool HybridOctave(const float *noise, int count, float amplitude, const Parameters &parameters, float *out, float *weight, Kernel kernel)
+		{
+			int i = 0;
+			bool active = false;
+#if TERRAIN_SIMD_X86
+			if (kernel == PerlinNoiseGenerator::Avx2)
+				i = HybridAvx2(noise, count, amplitude, parameters, out, weight, false, active);
+			else if (kernel == PerlinNoiseGenerator::Sse41)
+				i = HybridSse41(noise, count, amplitude, parameters, out, weight, false, active);
+#endif
+			for (; i < count; ++i)
+			{
+				float live = weight[i] > 0.0f ? weight[i] : 0.0f;
+				float value = (noise[i] + parameters.offset) * amplitude;
+				out[i] += live * value;
+
+				float next = Retire(Clamp(live * value), parameters.threshold);
+				weight[i] = weight[i] < 0.0f ? weight[i] : next;
+				active = active || weight[i] >= 0.0f;
+			}
+			return active;
+		}
+
+	private:
+#if TERRAIN_SIMD_X86
+		//first is the first octave, which writes out and starts every weight afresh
+		TERRAIN_TARGET_SSE41 static int RidgedSse41(const float *noise, int count, float amplitude, const Parameters &parameters, float *out, float *weight, bool first, bool &active)
+		{
+			__m128 zero = _mm_setzero_ps();
+			__m128 one = _mm_set1_ps(1.0f);
+			__m128 retired = _mm_set1_ps(-1.0f);
+			__m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+			__m128 offset = _mm_set1_ps(parameters.offset);
+			__m128 gain = _mm_set1_ps(parameters.gain);
+			__m128 threshold = _mm_set1_ps(parameters.threshold);
+			__m128 amplitudes = _mm_set1_ps(amplitude);
+			int anyActive = 0;
+
+			int i = 0;
+			for (; i + 4 <= count; i += 4)
+			{
+				__m128 ridge = _mm_sub_ps(offset, _mm_and_ps(_mm_loadu_ps(noise + i), absMask));
+				__m128 signal = _mm_mul_ps(ridge, ridge);
+				__m128 current = first ? one : _mm_loadu_ps(weight + i);
+				if (first)
+				{
+					_mm_storeu_ps(out + i, signal);
+				}
+				else
+				{
+					signal = _mm_mul_ps(signal, _mm_max_ps(current, zero));
+					_mm_storeu_ps(out + i, _mm_add_ps(_mm_loadu_ps(out + i), _mm_mul_ps(signal, amplitudes)));
+				}
+
+				__m128 next = _mm_min_ps(_mm_max_ps(_mm_mul_ps(signal, gain), zero), one);
+				next = _mm_blendv_ps(next, retired, _mm_cmplt_ps(next, threshold));
+				next = _mm_blendv_ps(next, current, _mm_cmplt_ps(current, zero));
+				_mm_storeu_ps(weight + i, next);
+				anyActive |= _mm_movemask_ps(_mm_cmpge_ps(next, zero));
+			}
+			active = active || anyActive != 0;
+			return i;
+		}
+
+		TERRAIN_TARGET_SSE41 static int HybridSse41(const float *noise, int count, float amplitude, const Parameters &parameters, float *out, float *weight, bool first, bool &active)
+		{
+			__m128 zero = _mm_setzero_ps();
+			__m128 one = _mm_set1_ps(1.0f);
+			__m128 retired = _mm_set1_ps(-1.0f);
+			__m128 offset = _mm_set1_ps(parameters.offset);
+			__m128 threshold = _mm_set1_ps(parameters.threshold);
+			__m128 amplitudes = _mm_set1_ps(amplitude);
+			int anyActive = 0;
+
+			int i = 0;
+			for (; i + 4 <= count; i += 4)
+			{
+				__m128 value = _mm_add_ps(_mm_loadu_ps(noise + i), offset);
+				__m128 current = first ? one : _mm_loadu_ps(weight + i);
+				__m128 next;
+				if (first)
+				{
+					_mm_storeu_ps(out + i, value);
+					next = value;
+				}
+				else
+				{
+					__m128 live = _mm_max_ps(current, zero);
+					value = _mm_mul_ps(value, amplitudes);
+					_mm_storeu_ps(out + i, _mm_add_ps(_mm_loadu_ps(out + i), _mm_mul_ps(live, value)));
+					next = _mm_mul_ps(live, value);
+				}
+
+				next = _mm_min_ps(_mm_max_ps(next, zero), one);
+				next = _mm_blendv_ps(next, retired, _mm_cmplt_ps(next, threshold));
+				next = _mm_blendv_ps(next, current, _mm_cmplt_ps(current, zero));
+				_mm_storeu_ps(weight + i, next);
+				anyActive |= _mm_movemask_ps(_mm_cmpge_ps(next, zero));
+			}
+			active = active || anyActive != 0;
+			return i;
+		}
+
+		TERRAIN_TARGET_AVX2 static int RidgedAvx2(const float *noise, int count, float amplitude, const Parameters &parameters, float *out, float *weight, bool first, bool &active)
+		{
+			__m256 zero = _mm256_setzero_ps();
+			__m256 one = _mm256_set1_ps(1.0f);
+			__m256 retired = _mm256_set1_ps(-1.0f);
+			__m256 absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+			__m256 offset = _mm256_set1_ps(parameters.offset);
+			__m256 gain = _mm256_set1_ps(parameters.gain);
+			__m256 threshold = _mm256_set1_ps(parameters.threshold);
+			__m256 amplitudes = _mm256_set1_ps(amplitude);
+			int anyActive = 0;
+
+			int i = 0;
+			for (; i + 8 <= count; i += 8)
+			{
+				__m256 ridge = _mm256_sub_ps(offset, _mm256_and_ps(_mm256_loadu_ps(noise + i), absMask));
+				__m256 signal = _mm256_mul_ps(ridge, ridge);
+				__m256 current = first ? one : _mm256_loadu_ps(weight + i);
+				if (first)
+				{
+					_mm256_storeu_ps(out + i, signal);
+				}
+				else
+				{
+					signal = _mm256_mul_ps(signal, _mm256_max_ps(current, zero));
+					_mm256_storeu_ps(out + i, _mm256_add_ps(_mm256_loadu_ps(out + i), _mm256_mul_ps(signal, amplitudes)));
+				}
+
+				__m256 next = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(signal, gain), zero), one);
+				next = _mm256_blendv_ps(next, retired, _mm256_cmp_ps(next, threshold, _CMP_LT_OQ));
+				next = _mm256_blendv_ps(next, current, _mm256_cmp_ps(current, zero, _CMP_LT_OQ));
+				_mm256_storeu_ps(weight + i, next);
+				anyActive |= _mm256_movemask_ps(_mm256_cmp_ps(next, zero, _CMP_GE_OQ));
+			}
+			_mm256_zeroupper();
+			active = active || anyActive != 0;
+			return i;
+		}
+
+		TERRAIN_TARGET_AVX2 static int HybridAvx2(const float *noise, int count, float amplitude, const Parameters &parameters, float *out, float *weight, bool first, bool &active)
+		{
+			__m256 zero = _mm256_setzero_ps();
+			__m256 one = _mm256_set1_ps(1.0f);
+			__m256 retired = _mm256_set1_ps(-1.0f);
+			__m256 offset = _mm256_set1_ps(parameters.offset);
+			__m256 threshold = _mm256_set1_ps(parameters.threshold);
+			__m256 amplitudes = _mm256_set1_ps(amplitude);
+			int anyActive = 0;
+
+			int i = 0;
+			for (; i + 8 <= count; i += 8)
+			{
+				__m256 value = _mm256_add_ps(_mm256_loadu_ps(noise + i), offset);
+				__m256 current = first ? one : _mm256_loadu_ps(weight + i);
+				__m256 next;
+				if (first)
+				{
+					_mm256_storeu_ps(out + i, value);
+					next = value;
+				}
+				else
+				{
+					__m256 live = _mm256_max_ps(current, zero);
+					value = _mm256_mul_ps(value, amplitudes);
+					_mm256_storeu_ps(out + i, _mm256_add_ps(_mm256_loadu_ps(out + i), _mm256_mul_ps(live, value)));
+					next = _mm256_mul_ps(live, value);
+				}
+
+				next = _mm256_min_ps(_mm256_max_ps(next, zero), one);
+				next = _mm256_blendv_ps(next, retired, _mm256_cmp_ps(next, threshold, _CMP_LT_OQ));
+				next = _mm256_blendv_ps(next, current, _mm256_cmp_ps(current, zero, _CMP_LT_OQ));
+				_mm256_storeu_ps(weight + i, next);
+				anyActive |= _mm256_movemask_ps(_mm256_cmp_ps(next, zero, _CMP_GE_OQ));
+			}
+			_mm256_zeroupper();
+			active = active || anyActive != 0;
+			return i;
+		}
+#endif
+	};
+}
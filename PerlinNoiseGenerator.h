@@ -1,20 +1,40 @@
 #pragma once
 #define PI_DIV_4 0.785398163f
 
+#include <cmath>
 #include <random>
 
+#include "CpuFeatures.h"
+
 using uint32 = unsigned int;
 
 namespace Terrain
 {
 	class PerlinNoiseGenerator
 	{
+	public:
+		/// Implementation used by the batch entry points
+		enum Kernel
+		{
+			Scalar,
+			Sse41,
+			Avx2
+		};
+
 	private:
 		float gradients[8][2];
 		int permutations[256];
+
+		//gradient table split by component so SIMD kernels can index it per lane
+		float gradientsX[8];
+		float gradientsY[8];
+
+		Kernel kernel = Scalar;
 		std::mt19937 randomEngine{ std::random_device{}() };
 
-		uint32 GetRandom(uint32 min, uint32 max) { return std::uniform_int_distribution<uint32>{min, max}(randomEngine); }
+		//mt19937 output is fully specified by the standard, the distributions are not, so reduce it by hand
+		//to keep seeded tables identical across compilers
+		uint32 GetRandom(uint32 min, uint32 max) { return min + (uint32)(randomEngine() % (max - min + 1)); }
 
 		static float lerp(float a0, float a1, float t)
 		{
@@ -26,7 +46,13 @@ namespace Terrain
 			return t * t * t * (t * (t * 6 - 15) + 10);
 		}
 
-		static float dotProduct(float grad[], float x, float y)
+		//d/dt of fade, 30t^2(t - 1)^2
+		static float fadeDerivative(float t)
+		{
+			return 30 * t * t * (t * (t - 2) + 1);
+		}
+
+		static float dotProduct(const float grad[], float x, float y)
 		{
 			return(grad[0] * x + grad[1] * y);
 		}
@@ -35,26 +61,44 @@ namespace Terrain
 		
 		PerlinNoiseGenerator(std::mt19937::result_type seed) : randomEngine(seed)
 		{
-			PerlinNoiseGenerator();
+			Initialise();
 		}
 
 		PerlinNoiseGenerator()
+		{
+			Initialise();
+		}
+
+		~PerlinNoiseGenerator()
+		{
+
+		}
+
+		/// Restarts the permutation sequence, following RandomisePermutations calls repeat for the same seed.
+		void SetSeed(std::mt19937::result_type seed)
+		{
+			randomEngine.seed(seed);
+		}
+
+	private:
+		void Initialise()
 		{
 			//Create Gradient table
 			//8 equally distributed angles around unit circle
 			for (int i = 0; i < 8; i++)
 			{
-				gradients[i][0] = octet::cos(PI_DIV_4 * (float)i);
-				gradients[i][1] = octet::sin(PI_DIV_4 * (float)i);
+				gradients[i][0] = std::cos(PI_DIV_4 * (float)i);
+				gradients[i][1] = std::sin(PI_DIV_4 * (float)i);
+				gradientsX[i] = gradients[i][0];
+				gradientsY[i] = gradients[i][1];
 			}
 
+			kernel = GetBestKernel();
+
 			RandomisePermutations();
 		}
 
-		~PerlinNoiseGenerator()
-		{
-
-		}
+	public:
 
 		void RandomisePermutations()
 		{
@@ -73,7 +117,7 @@ namespace Terrain
 			}
 		}
 
-		float GenerateNoise(float x, float y)
+		float GenerateNoise(float x, float y) const
 		{
 			//Grid definition - get x,y indices relating to the on the grid
 			int x0 = (x > 0.0 ? (int)x : (int)x - 1);
@@ -109,5 +153,482 @@ namespace Terrain
 
 			return interpolatedXY;
 		}
+
+		/// GenerateNoise plus its analytic partial derivatives along x and y, in noise space.
+		/// The value is exactly what GenerateNoise returns.
+		float GenerateNoise(float x, float y, float &dx, float &dy) const
+		{
+			int x0 = (x > 0.0 ? (int)x : (int)x - 1);
+			int x1 = x0 + 1;
+			int y0 = (y > 0.0 ? (int)y : (int)y - 1);
+			int y1 = y0 + 1;
+
+			float fractionalX = x - (float)x0;
+			float fractionalY = y - (float)y0;
+
+			const float *grad11 = gradients[permutations[(x0 + permutations[y0 & 255]) & 255] & 7];
+			const float *grad12 = gradients[permutations[(x1 + permutations[y0 & 255]) & 255] & 7];
+			const float *grad21 = gradients[permutations[(x0 + permutations[y1 & 255]) & 255] & 7];
+			const float *grad22 = gradients[permutations[(x1 + permutations[y1 & 255]) & 255] & 7];
+
+			float noise11 = dotProduct(grad11, fractionalX, fractionalY);
+			float noise12 = dotProduct(grad12, fractionalX - 1.0f, fractionalY);
+			float noise21 = dotProduct(grad21, fractionalX, fractionalY - 1.0f);
+			float noise22 = dotProduct(grad22, fractionalX - 1.0f, fractionalY - 1.0f);
+
+			float u = fade(fractionalX);
+			float v = fade(fractionalY);
+			float du = fadeDerivative(fractionalX);
+			float dv = fadeDerivative(fractionalY);
+
+			float interpolatedX1 = lerp(noise11, noise12, u);
+			float interpolatedX2 = lerp(noise21, noise22, u);
+
+			//each corner's noise is a plane with its gradient as slope, the fades add the change in weighting
+			float dx1 = lerp(grad11[0], grad12[0], u) + du * (noise12 - noise11);
+			float dx2 = lerp(grad21[0], grad22[0], u) + du * (noise22 - noise21);
+			dx = lerp(dx1, dx2, v);
+			dy = lerp(lerp(grad11[1], grad12[1], u), lerp(grad21[1], grad22[1], u), v) + dv * (interpolatedX2 - interpolatedX1);
+
+			return lerp(interpolatedX1, interpolatedX2, v);
+		}
+
+		static Kernel GetBestKernel()
+		{
+			const CpuFeatures &cpu = CpuFeatures::Get();
+			if (cpu.HasAvx2())
+				return Avx2;
+			if (cpu.HasSse41())
+				return Sse41;
+			return Scalar;
+		}
+
+		Kernel GetKernel() const { return kernel; }
+
+		/// Force a kernel, falling back to the best supported one if the CPU lacks it.
+		void SetKernel(Kernel requested)
+		{
+			const CpuFeatures &cpu = CpuFeatures::Get();
+			if ((requested == Avx2 && !cpu.HasAvx2()) || (requested == Sse41 && !cpu.HasSse41()))
+				requested = GetBestKernel();
+			kernel = requested;
+		}
+
+		//The batch and row entry points only read the tables, so one generator can be shared by worker threads.
+
+		/// Evaluates count arbitrary sample positions, out[i] = GenerateNoise(xs[i], ys[i]).
+		void GenerateNoiseBatch(const float *xs, const float *ys, float *out, int count) const
+		{
+			int i = 0;
+#if TERRAIN_SIMD_X86
+			if (kernel == Avx2)
+				i = BatchAvx2(xs, ys, out, count);
+			else if (kernel == Sse41)
+				i = BatchSse41(xs, ys, out, count);
+#endif
+			for (; i < count; ++i)
+				out[i] = GenerateNoise(xs[i], ys[i]);
+		}
+
+		/// Evaluates a row of samples at x = (startX + i) * frequency, matching the scalar loops in CustomTerrain.
+		/// Writes out[i] = noise when accumulate is false, otherwise out[i] += noise * amplitude.
+		void GenerateNoiseRow(int startX, int count, float y, float frequency, float *out, float amplitude = 1.0f, bool accumulate = false) const
+		{
+			int i = 0;
+#if TERRAIN_SIMD_X86
+			if (kernel == Avx2)
+				i = RowAvx2(startX, count, y, frequency, out, amplitude, accumulate);
+			else if (kernel == Sse41)
+				i = RowSse41(startX, count, y, frequency, out, amplitude, accumulate);
+#endif
+			for (; i < count; ++i)
+			{
+				float value = GenerateNoise((float)(startX + i) * frequency, y);
+				out[i] = accumulate ? out[i] + value * amplitude : value;
+			}
+		}
+
+		void AccumulateNoiseRow(int startX, int count, float y, float frequency, float amplitude, float *out) const
+		{
+			GenerateNoiseRow(startX, count, y, frequency, out, amplitude, true);
+		}
+
+		/// GenerateNoiseRow that also writes the noise's derivatives per sample step, along the row to outDx and
+		/// per unit of y / frequency to outDy. They are scaled and accumulated like the values, and the values
+		/// are the same floats GenerateNoiseRow gives.
+		void GenerateNoiseRow(int startX, int count, float y, float frequency, float *out, float *outDx, float *outDy, float amplitude = 1.0f, bool accumulate = false) const
+		{
+			//per sample step rather than per unit of noise space
+			float slopeScale = frequency * amplitude;
+
+			int i = 0;
+#if TERRAIN_SIMD_X86
+			if (kernel == Avx2)
+				i = RowDerivativesAvx2(startX, count, y, frequency, out, outDx, outDy, amplitude, slopeScale, accumulate);
+			else if (kernel == Sse41)
+				i = RowDerivativesSse41(startX, count, y, frequency, out, outDx, outDy, amplitude, slopeScale, accumulate);
+#endif
+			for (; i < count; ++i)
+			{
+				float dx, dy;
+				float value = GenerateNoise((float)(startX + i) * frequency, y, dx, dy);
+				out[i] = accumulate ? out[i] + value * amplitude : value;
+				outDx[i] = accumulate ? outDx[i] + dx * slopeScale : dx * slopeScale;
+				outDy[i] = accumulate ? outDy[i] + dy * slopeScale : dy * slopeScale;
+			}
+		}
+
+		void AccumulateNoiseRow(int startX, int count, float y, float frequency, float amplitude, float *out, float *outDx, float *outDy) const
+		{
+			GenerateNoiseRow(startX, count, y, frequency, out, outDx, outDy, amplitude, true);
+		}
+
+	private:
+#if TERRAIN_SIMD_X86
+		//The kernels below mirror GenerateNoise operation for operation (no fused multiply-add)
+		//so they produce the same floats as the scalar path.
+
+		TERRAIN_TARGET_SSE41 static __m128 FadeSse41(__m128 t)
+		{
+			__m128 inner = _mm_sub_ps(_mm_mul_ps(t, _mm_set1_ps(6.0f)), _mm_set1_ps(15.0f));
+			inner = _mm_add_ps(_mm_mul_ps(t, inner), _mm_set1_ps(10.0f));
+			return _mm_mul_ps(_mm_mul_ps(_mm_mul_ps(t, t), t), inner);
+		}
+
+		TERRAIN_TARGET_SSE41 static __m128 LerpSse41(__m128 a0, __m128 a1, __m128 t)
+		{
+			return _mm_add_ps(a0, _mm_mul_ps(t, _mm_sub_ps(a1, a0)));
+		}
+
+		TERRAIN_TARGET_SSE41 __m128 GradientDotSse41(__m128i hash, __m128 x, __m128 y) const
+		{
+			//no gather before AVX2, look the gradient up one lane at a time
+			int h0 = _mm_extract_epi32(hash, 0), h1 = _mm_extract_epi32(hash, 1);
+			int h2 = _mm_extract_epi32(hash, 2), h3 = _mm_extract_epi32(hash, 3);
+			__m128 gx = _mm_setr_ps(gradientsX[h0], gradientsX[h1], gradientsX[h2], gradientsX[h3]);
+			__m128 gy = _mm_setr_ps(gradientsY[h0], gradientsY[h1], gradientsY[h2], gradientsY[h3]);
+			return _mm_add_ps(_mm_mul_ps(gx, x), _mm_mul_ps(gy, y));
+		}
+
+		TERRAIN_TARGET_SSE41 __m128i PermuteSse41(__m128i index) const
+		{
+			index = _mm_and_si128(index, _mm_set1_epi32(255));
+			return _mm_setr_epi32(permutations[_mm_extract_epi32(index, 0)], permutations[_mm_extract_epi32(index, 1)],
+				permutations[_mm_extract_epi32(index, 2)], permutations[_mm_extract_epi32(index, 3)]);
+		}
+
+		TERRAIN_TARGET_SSE41 __m128 NoiseSse41(__m128 x, __m128 y) const
+		{
+			//(int)x - 1 when x <= 0, as in GenerateNoise
+			__m128i x0 = _mm_add_epi32(_mm_cvttps_epi32(x), _mm_castps_si128(_mm_cmple_ps(x, _mm_setzero_ps())));
+			__m128i y0 = _mm_add_epi32(_mm_cvttps_epi32(y), _mm_castps_si128(_mm_cmple_ps(y, _mm_setzero_ps())));
+			__m128i one = _mm_set1_epi32(1);
+			__m128i x1 = _mm_add_epi32(x0, one);
+			__m128i y1 = _mm_add_epi32(y0, one);
+
+			__m128 fx = _mm_sub_ps(x, _mm_cvtepi32_ps(x0));
+			__m128 fy = _mm_sub_ps(y, _mm_cvtepi32_ps(y0));
+
+			__m128i seven = _mm_set1_epi32(7);
+			__m128i py0 = PermuteSse41(y0);
+			__m128i py1 = PermuteSse41(y1);
+			__m128i grad11 = _mm_and_si128(PermuteSse41(_mm_add_epi32(x0, py0)), seven);
+			__m128i grad12 = _mm_and_si128(PermuteSse41(_mm_add_epi32(x1, py0)), seven);
+			__m128i grad21 = _mm_and_si128(PermuteSse41(_mm_add_epi32(x0, py1)), seven);
+			__m128i grad22 = _mm_and_si128(PermuteSse41(_mm_add_epi32(x1, py1)), seven);
+
+			__m128 oneF = _mm_set1_ps(1.0f);
+			__m128 fx1 = _mm_sub_ps(fx, oneF);
+			__m128 fy1 = _mm_sub_ps(fy, oneF);
+			__m128 noise11 = GradientDotSse41(grad11, fx, fy);
+			__m128 noise12 = GradientDotSse41(grad12, fx1, fy);
+			__m128 noise21 = GradientDotSse41(grad21, fx, fy1);
+			__m128 noise22 = GradientDotSse41(grad22, fx1, fy1);
+
+			__m128 u = FadeSse41(fx);
+			__m128 v = FadeSse41(fy);
+			return LerpSse41(LerpSse41(noise11, noise12, u), LerpSse41(noise21, noise22, u), v);
+		}
+
+		TERRAIN_TARGET_SSE41 static __m128 FadeDerivativeSse41(__m128 t)
+		{
+			__m128 inner = _mm_add_ps(_mm_mul_ps(t, _mm_sub_ps(t, _mm_set1_ps(2.0f))), _mm_set1_ps(1.0f));
+			return _mm_mul_ps(_mm_mul_ps(_mm_mul_ps(_mm_set1_ps(30.0f), t), t), inner);
+		}
+
+		TERRAIN_TARGET_SSE41 void GradientSse41(__m128i hash, __m128 &gx, __m128 &gy) const
+		{
+			int h0 = _mm_extract_epi32(hash, 0), h1 = _mm_extract_epi32(hash, 1);
+			int h2 = _mm_extract_epi32(hash, 2), h3 = _mm_extract_epi32(hash, 3);
+			gx = _mm_setr_ps(gradientsX[h0], gradientsX[h1], gradientsX[h2], gradientsX[h3]);
+			gy = _mm_setr_ps(gradientsY[h0], gradientsY[h1], gradientsY[h2], gradientsY[h3]);
+		}
+
+		TERRAIN_TARGET_SSE41 __m128 NoiseDerivativesSse41(__m128 x, __m128 y, __m128 &dx, __m128 &dy) const
+		{
+			__m128i x0 = _mm_add_epi32(_mm_cvttps_epi32(x), _mm_castps_si128(_mm_cmple_ps(x, _mm_setzero_ps())));
+			__m128i y0 = _mm_add_epi32(_mm_cvttps_epi32(y), _mm_castps_si128(_mm_cmple_ps(y, _mm_setzero_ps())));
+			__m128i one = _mm_set1_epi32(1);
+			__m128i x1 = _mm_add_epi32(x0, one);
+			__m128i y1 = _mm_add_epi32(y0, one);
+
+			__m128 fx = _mm_sub_ps(x, _mm_cvtepi32_ps(x0));
+			__m128 fy = _mm_sub_ps(y, _mm_cvtepi32_ps(y0));
+
+			__m128i seven = _mm_set1_epi32(7);
+			__m128i py0 = PermuteSse41(y0);
+			__m128i py1 = PermuteSse41(y1);
+			__m128 gx11, gy11, gx12, gy12, gx21, gy21, gx22, gy22;
+			GradientSse41(_mm_and_si128(PermuteSse41(_mm_add_epi32(x0, py0)), seven), gx11, gy11);
+			GradientSse41(_mm_and_si128(PermuteSse41(_mm_add_epi32(x1, py0)), seven), gx12, gy12);
+			GradientSse41(_mm_and_si128(PermuteSse41(_mm_add_epi32(x0, py1)), seven), gx21, gy21);
+			GradientSse41(_mm_and_si128(PermuteSse41(_mm_add_epi32(x1, py1)), seven), gx22, gy22);
+
+			__m128 oneF = _mm_set1_ps(1.0f);
+			__m128 fx1 = _mm_sub_ps(fx, oneF);
+			__m128 fy1 = _mm_sub_ps(fy, oneF);
+			__m128 noise11 = _mm_add_ps(_mm_mul_ps(gx11, fx), _mm_mul_ps(gy11, fy));
+			__m128 noise12 = _mm_add_ps(_mm_mul_ps(gx12, fx1), _mm_mul_ps(gy12, fy));
+			__m128 noise21 = _mm_add_ps(_mm_mul_ps(gx21, fx), _mm_mul_ps(gy21, fy1));
+			__m128 noise22 = _mm_add_ps(_mm_mul_ps(gx22, fx1), _mm_mul_ps(gy22, fy1));
+
+			__m128 u = FadeSse41(fx);
+			__m128 v = FadeSse41(fy);
+			__m128 du = FadeDerivativeSse41(fx);
+			__m128 dv = FadeDerivativeSse41(fy);
+
+			__m128 interpolatedX1 = LerpSse41(noise11, noise12, u);
+			__m128 interpolatedX2 = LerpSse41(noise21, noise22, u);
+
+			__m128 dx1 = _mm_add_ps(LerpSse41(gx11, gx12, u), _mm_mul_ps(du, _mm_sub_ps(noise12, noise11)));
+			__m128 dx2 = _mm_add_ps(LerpSse41(gx21, gx22, u), _mm_mul_ps(du, _mm_sub_ps(noise22, noise21)));
+			dx = LerpSse41(dx1, dx2, v);
+			dy = _mm_add_ps(LerpSse41(LerpSse41(gy11, gy12, u), LerpSse41(gy21, gy22, u), v), _mm_mul_ps(dv, _mm_sub_ps(interpolatedX2, interpolatedX1)));
+
+			return LerpSse41(interpolatedX1, interpolatedX2, v);
+		}
+
+		TERRAIN_TARGET_SSE41 int RowDerivativesSse41(int startX, int count, float y, float frequency, float *out, float *outDx, float *outDy, float amplitude, float slopeScale, bool accumulate) const
+		{
+			__m128 freq = _mm_set1_ps(frequency);
+			__m128 amp = _mm_set1_ps(amplitude);
+			__m128 slope = _mm_set1_ps(slopeScale);
+			__m128 yv = _mm_set1_ps(y);
+			__m128i lane = _mm_add_epi32(_mm_set1_epi32(startX), _mm_setr_epi32(0, 1, 2, 3));
+
+			int i = 0;
+			for (; i + 4 <= count; i += 4, lane = _mm_add_epi32(lane, _mm_set1_epi32(4)))
+			{
+				__m128 dx, dy;
+				__m128 value = NoiseDerivativesSse41(_mm_mul_ps(_mm_cvtepi32_ps(lane), freq), yv, dx, dy);
+				dx = _mm_mul_ps(dx, slope);
+				dy = _mm_mul_ps(dy, slope);
+				if (accumulate)
+				{
+					value = _mm_add_ps(_mm_loadu_ps(out + i), _mm_mul_ps(value, amp));
+					dx = _mm_add_ps(_mm_loadu_ps(outDx + i), dx);
+					dy = _mm_add_ps(_mm_loadu_ps(outDy + i), dy);
+				}
+				_mm_storeu_ps(out + i, value);
+				_mm_storeu_ps(outDx + i, dx);
+				_mm_storeu_ps(outDy + i, dy);
+			}
+			return i;
+		}
+
+		TERRAIN_TARGET_SSE41 int BatchSse41(const float *xs, const float *ys, float *out, int count) const
+		{
+			int i = 0;
+			for (; i + 4 <= count; i += 4)
+				_mm_storeu_ps(out + i, NoiseSse41(_mm_loadu_ps(xs + i), _mm_loadu_ps(ys + i)));
+			return i;
+		}
+
+		TERRAIN_TARGET_SSE41 int RowSse41(int startX, int count, float y, float frequency, float *out, float amplitude, bool accumulate) const
+		{
+			__m128 freq = _mm_set1_ps(frequency);
+			__m128 amp = _mm_set1_ps(amplitude);
+			__m128 yv = _mm_set1_ps(y);
+			__m128i lane = _mm_add_epi32(_mm_set1_epi32(startX), _mm_setr_epi32(0, 1, 2, 3));
+
+			int i = 0;
+			for (; i + 4 <= count; i += 4, lane = _mm_add_epi32(lane, _mm_set1_epi32(4)))
+			{
+				__m128 value = NoiseSse41(_mm_mul_ps(_mm_cvtepi32_ps(lane), freq), yv);
+				if (accumulate)
+					value = _mm_add_ps(_mm_loadu_ps(out + i), _mm_mul_ps(value, amp));
+				_mm_storeu_ps(out + i, value);
+			}
+			return i;
+		}
+
+		TERRAIN_TARGET_AVX2 static __m256 FadeAvx2(__m256 t)
+		{
+			__m256 inner = _mm256_sub_ps(_mm256_mul_ps(t, _mm256_set1_ps(6.0f)), _mm256_set1_ps(15.0f));
+			inner = _mm256_add_ps(_mm256_mul_ps(t, inner), _mm256_set1_ps(10.0f));
+			return _mm256_mul_ps(_mm256_mul_ps(_mm256_mul_ps(t, t), t), inner);
+		}
+
+		TERRAIN_TARGET_AVX2 static __m256 LerpAvx2(__m256 a0, __m256 a1, __m256 t)
+		{
+			return _mm256_add_ps(a0, _mm256_mul_ps(t, _mm256_sub_ps(a1, a0)));
+		}
+
+		TERRAIN_TARGET_AVX2 __m256i PermuteAvx2(__m256i index) const
+		{
+			return _mm256_i32gather_epi32(permutations, _mm256_and_si256(index, _mm256_set1_epi32(255)), 4);
+		}
+
+		TERRAIN_TARGET_AVX2 __m256 NoiseAvx2(__m256 x, __m256 y) const
+		{
+			__m256 zero = _mm256_setzero_ps();
+			__m256i x0 = _mm256_add_epi32(_mm256_cvttps_epi32(x), _mm256_castps_si256(_mm256_cmp_ps(x, zero, _CMP_LE_OQ)));
+			__m256i y0 = _mm256_add_epi32(_mm256_cvttps_epi32(y), _mm256_castps_si256(_mm256_cmp_ps(y, zero, _CMP_LE_OQ)));
+			__m256i one = _mm256_set1_epi32(1);
+			__m256i x1 = _mm256_add_epi32(x0, one);
+			__m256i y1 = _mm256_add_epi32(y0, one);
+
+			__m256 fx = _mm256_sub_ps(x, _mm256_cvtepi32_ps(x0));
+			__m256 fy = _mm256_sub_ps(y, _mm256_cvtepi32_ps(y0));
+
+			__m256i seven = _mm256_set1_epi32(7);
+			__m256i py0 = PermuteAvx2(y0);
+			__m256i py1 = PermuteAvx2(y1);
+			__m256i grad11 = _mm256_and_si256(PermuteAvx2(_mm256_add_epi32(x0, py0)), seven);
+			__m256i grad12 = _mm256_and_si256(PermuteAvx2(_mm256_add_epi32(x1, py0)), seven);
+			__m256i grad21 = _mm256_and_si256(PermuteAvx2(_mm256_add_epi32(x0, py1)), seven);
+			__m256i grad22 = _mm256_and_si256(PermuteAvx2(_mm256_add_epi32(x1, py1)), seven);
+
+			//all 8 gradients fit in one register, so the lookup is a lane permute
+			__m256 gx = _mm256_loadu_ps(gradientsX);
+			__m256 gy = _mm256_loadu_ps(gradientsY);
+
+			__m256 oneF = _mm256_set1_ps(1.0f);
+			__m256 fx1 = _mm256_sub_ps(fx, oneF);
+			__m256 fy1 = _mm256_sub_ps(fy, oneF);
+			__m256 noise11 = _mm256_add_ps(_mm256_mul_ps(_mm256_permutevar8x32_ps(gx, grad11), fx), _mm256_mul_ps(_mm256_permutevar8x32_ps(gy, grad11), fy));
+			__m256 noise12 = _mm256_add_ps(_mm256_mul_ps(_mm256_permutevar8x32_ps(gx, grad12), fx1), _mm256_mul_ps(_mm256_permutevar8x32_ps(gy, grad12), fy));
+			__m256 noise21 = _mm256_add_ps(_mm256_mul_ps(_mm256_permutevar8x32_ps(gx, grad21), fx), _mm256_mul_ps(_mm256_permutevar8x32_ps(gy, grad21), fy1));
+			__m256 noise22 = _mm256_add_ps(_mm256_mul_ps(_mm256_permutevar8x32_ps(gx, grad22), fx1), _mm256_mul_ps(_mm256_permutevar8x32_ps(gy, grad22), fy1));
+
+			__m256 u = FadeAvx2(fx);
+			__m256 v = FadeAvx2(fy);
+			return LerpAvx2(LerpAvx2(noise11, noise12, u), LerpAvx2(noise21, noise22, u), v);
+		}
+
+		TERRAIN_TARGET_AVX2 static __m256 FadeDerivativeAvx2(__m256 t)
+		{
+			__m256 inner = _mm256_add_ps(_mm256_mul_ps(t, _mm256_sub_ps(t, _mm256_set1_ps(2.0f))), _mm256_set1_ps(1.0f));
+			return _mm256_mul_ps(_mm256_mul_ps(_mm256_mul_ps(_mm256_set1_ps(30.0f), t), t), inner);
+		}
+
+		TERRAIN_TARGET_AVX2 __m256 NoiseDerivativesAvx2(__m256 x, __m256 y, __m256 &dx, __m256 &dy) const
+		{
+			__m256 zero = _mm256_setzero_ps();
+			__m256i x0 = _mm256_add_epi32(_mm256_cvttps_epi32(x), _mm256_castps_si256(_mm256_cmp_ps(x, zero, _CMP_LE_OQ)));
+			__m256i y0 = _mm256_add_epi32(_mm256_cvttps_epi32(y), _mm256_castps_si256(_mm256_cmp_ps(y, zero, _CMP_LE_OQ)));
+			__m256i one = _mm256_set1_epi32(1);
+			__m256i x1 = _mm256_add_epi32(x0, one);
+			__m256i y1 = _mm256_add_epi32(y0, one);
+
+			__m256 fx = _mm256_sub_ps(x, _mm256_cvtepi32_ps(x0));
+			__m256 fy = _mm256_sub_ps(y, _mm256_cvtepi32_ps(y0));
+
+			__m256i seven = _mm256_set1_epi32(7);
+			__m256i py0 = PermuteAvx2(y0);
+			__m256i py1 = PermuteAvx2(y1);
+			__m256i grad11 = _mm256_and_si256(PermuteAvx2(_mm256_add_epi32(x0, py0)), seven);
+			__m256i grad12 = _mm256_and_si256(PermuteAvx2(_mm256_add_epi32(x1, py0)), seven);
+			__m256i grad21 = _mm256_and_si256(PermuteAvx2(_mm256_add_epi32(x0, py1)), seven);
+			__m256i grad22 = _mm256_and_si256(PermuteAvx2(_mm256_add_epi32(x1, py1)), seven);
+
+			__m256 gx = _mm256_loadu_ps(gradientsX);
+			__m256 gy = _mm256_loadu_ps(gradientsY);
+			__m256 gx11 = _mm256_permutevar8x32_ps(gx, grad11), gy11 = _mm256_permutevar8x32_ps(gy, grad11);
+			__m256 gx12 = _mm256_permutevar8x32_ps(gx, grad12), gy12 = _mm256_permutevar8x32_ps(gy, grad12);
+			__m256 gx21 = _mm256_permutevar8x32_ps(gx, grad21), gy21 = _mm256_permutevar8x32_ps(gy, grad21);
+			__m256 gx22 = _mm256_permutevar8x32_ps(gx, grad22), gy22 = _mm256_permutevar8x32_ps(gy, grad22);
+
+			__m256 oneF = _mm256_set1_ps(1.0f);
+			__m256 fx1 = _mm256_sub_ps(fx, oneF);
+			__m256 fy1 = _mm256_sub_ps(fy, oneF);
+			__m256 noise11 = _mm256_add_ps(_mm256_mul_ps(gx11, fx), _mm256_mul_ps(gy11, fy));
+			__m256 noise12 = _mm256_add_ps(_mm256_mul_ps(gx12, fx1), _mm256_mul_ps(gy12, fy));
+			__m256 noise21 = _mm256_add_ps(_mm256_mul_ps(gx21, fx), _mm256_mul_ps(gy21, fy1));
+			__m256 noise22 = _mm256_add_ps(_mm256_mul_ps(gx22, fx1), _mm256_mul_ps(gy22, fy1));
+
+			__m256 u = FadeAvx2(fx);
+			__m256 v = FadeAvx2(fy);
+			__m256 du = FadeDerivativeAvx2(fx);
+			__m256 dv = FadeDerivativeAvx2(fy);
+
+			__m256 interpolatedX1 = LerpAvx2(noise11, noise12, u);
+			__m256 interpolatedX2 = LerpAvx2(noise21, noise22, u);
+
+			__m256 dx1 = _mm256_add_ps(LerpAvx2(gx11, gx12, u), _mm256_mul_ps(du, _mm256_sub_ps(noise12, noise11)));
+			__m256 dx2 = _mm256_add_ps(LerpAvx2(gx21, gx22, u), _mm256_mul_ps(du, _mm256_sub_ps(noise22, noise21)));
+			dx = LerpAvx2(dx1, dx2, v);
+			dy = _mm256_add_ps(LerpAvx2(LerpAvx2(gy11, gy12, u), LerpAvx2(gy21, gy22, u), v), _mm256_mul_ps(dv, _mm256_sub_ps(interpolatedX2, interpolatedX1)));
+
+			return LerpAvx2(interpolatedX1, interpolatedX2, v);
+		}
+
+		TERRAIN_TARGET_AVX2 int RowDerivativesAvx2(int startX, int count, float y, float frequency, float *out, float *outDx, float *outDy, float amplitude, float slopeScale, bool accumulate) const
+		{
+			__m256 freq = _mm256_set1_ps(frequency);
+			__m256 amp = _mm256_set1_ps(amplitude);
+			__m256 slope = _mm256_set1_ps(slopeScale);
+			__m256 yv = _mm256_set1_ps(y);
+			__m256i lane = _mm256_add_epi32(_mm256_set1_epi32(startX), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+
+			int i = 0;
+			for (; i + 8 <= count; i += 8, lane = _mm256_add_epi32(lane, _mm256_set1_epi32(8)))
+			{
+				__m256 dx, dy;
+				__m256 value = NoiseDerivativesAvx2(_mm256_mul_ps(_mm256_cvtepi32_ps(lane), freq), yv, dx, dy);
+				dx = _mm256_mul_ps(dx, slope);
+				dy = _mm256_mul_ps(dy, slope);
+				if (accumulate)
+				{
+					value = _mm256_add_ps(_mm256_loadu_ps(out + i), _mm256_mul_ps(value, amp));
+					dx = _mm256_add_ps(_mm256_loadu_ps(outDx + i), dx);
+					dy = _mm256_add_ps(_mm256_loadu_ps(outDy + i), dy);
+				}
+				_mm256_storeu_ps(out + i, value);
+				_mm256_storeu_ps(outDx + i, dx);
+				_mm256_storeu_ps(outDy + i, dy);
+			}
+			_mm256_zeroupper();
+			return i;
+		}
+
+		TERRAIN_TARGET_AVX2 int BatchAvx2(const float *xs, const float *ys, float *out, int count) const
+		{
+			int i = 0;
+			for (; i + 8 <= count; i += 8)
+				_mm256_storeu_ps(out + i, NoiseAvx2(_mm256_loadu_ps(xs + i), _mm256_loadu_ps(ys + i)));
+			_mm256_zeroupper();
+			return i;
+		}
+
+		TERRAIN_TARGET_AVX2 int RowAvx2(int startX, int count, float y, float frequency, float *out, float amplitude, bool accumulate) const
+		{
+			__m256 freq = _mm256_set1_ps(frequency);
+			__m256 amp = _mm256_set1_ps(amplitude);
+			__m256 yv = _mm256_set1_ps(y);
+			__m256i lane = _mm256_add_epi32(_mm256_set1_epi32(startX), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+
+			int i = 0;
+			for (; i + 8 <= count; i += 8, lane = _mm256_add_epi32(lane, _mm256_set1_epi32(8)))
+			{
+				__m256 value = NoiseAvx2(_mm256_mul_ps(_mm256_cvtepi32_ps(lane), freq), yv);
+				if (accumulate)
+					value = _mm256_add_ps(_mm256_loadu_ps(out + i), _mm256_mul_ps(value, amp));
+				_mm256_storeu_ps(out + i, value);
+			}
+			_mm256_zeroupper();
+			return i;
+		}
+#endif
 	};
 }
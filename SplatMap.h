@@ -0,0 +1,139 @@
+#pragma once
+#include "Heightfield.h"
+#include "TerrainNormals.h"
+#include "ThreadPool.h"
+
+#include <cstdint>
+#include <vector>
+
+namespace Terrain
+{
+	/// Where one texture layer shows. Height is a fraction of the map's range, 0 the lowest sample and 1 the highest,
+	/// slope is 1 - normal.y, 0 flat and 1 vertical. Inside both bands the layer gets strength, and the weight
+	/// ramps down to nothing over fade beyond either end of a band. A fade of zero makes a hard edge.
+	struct SplatRule
+	{
+		int layer;
+		float minHeight;
+		float maxHeight;
+		float heightFade;
+		float minSlope;
+		float maxSlope;
+		float slopeFade;
+		float strength;
+	};
+
+	/// Bakes a texel per sample of how much each of the five terrain layers (layer0 to layer4 in the shader) shows,
+	/// from the height and the slope of the normal, so the fragment shader does one fetch and a blend instead of
+	/// working the layers out itself. The weights of layers 1 to 4 go in RGBA, layer 0 takes what they leave of
+	/// 255. Rows run in parallel, with the normals worked out a row at a time as they go.
+	class SplatMapBaker
+	{
+		NormalGenerator normals;
+
+		//1 inside [min, max], falling to 0 over fade beyond either end
+		static float Ramp(float value, float min, float max, float fade)
+		{
+			if (fade <= 0.0f)
+				return value >= min && value <= max ? 1.0f : 0.0f;
+
+			float rise = (value - (min - fade)) / fade;
+			float fall = ((max + fade) - value) / fade;
+			rise = rise < 0.0f ? 0.0f : (rise > 1.0f ? 1.0f : rise);
+			fall = fall < 0.0f ? 0.0f : (fall > 1.0f ? 1.0f : fall);
+			return rise * fall;
+		}
+
+	public:
+		static const int layerCount = 5;
+
+		/// Evaluated in order, a layer can have several rules and their weights add up.
+		std::vector<SplatRule> rules;
+
+		SplatMapBaker() : rules(GetDefaultRules())
+		{
+		}
+
+		/// Water, sand, grass, rock and snow in even bands blended into each other, as the shader used to draw them,
+		/// with rock taking over on slopes steeper than about 40 degrees.
+		static std::vector<SplatRule> GetDefaultRules()
+		{
+			SplatRule defaults[] =
+			{
+				{ 0, -1.0f, 0.0f, 0.25f, 0.0f, 1.0f, 0.0f, 1.0f },
+				{ 1, 0.25f, 0.25f, 0.25f, 0.0f, 1.0f, 0.0f, 1.0f },
+				{ 2, 0.5f, 0.5f, 0.25f, 0.0f, 1.0f, 0.0f, 1.0f },
+				{ 3, 0.75f, 0.75f, 0.25f, 0.0f, 1.0f, 0.0f, 1.0f },
+				{ 4, 1.0f, 2.0f, 0.25f, 0.0f, 1.0f, 0.0f, 1.0f },
+				{ 3, -1.0f, 2.0f, 0.0f, 0.35f, 1.0f, 0.15f, 2.0f },
+			};
+			return std::vector<SplatRule>(defaults, defaults + sizeof(defaults) / sizeof(defaults[0]));
+		}
+
+		/// Weights of the layers at a height and slope, adding up to 1. Where no rule applies layer 0 gets it all.
+		void Weigh(float height, float slope, float weights[layerCount]) const
+		{
+			for (int layer = 0; layer < layerCount; ++layer)
+				weights[layer] = 0.0f;
+
+			for (size_t i = 0; i < rules.size(); ++i)
+			{
+				const SplatRule &rule = rules[i];
+				if (rule.layer >= 0 && rule.layer < layerCount)
+					weights[rule.layer] += rule.strength * Ramp(height, rule.minHeight, rule.maxHeight, rule.heightFade) * Ramp(slope, rule.minSlope, rule.maxSlope, rule.slopeFade);
+			}
+
+			float sum = 0.0f;
+			for (int layer = 0; layer < layerCount; ++layer)
+				sum += weights[layer];
+
+			if (sum <= 0.0f)
+			{
+				weights[0] = 1.0f;
+				return;
+			}
+
+			float inverseSum = 1.0f / sum;
+			for (int layer = 0; layer < layerCount; ++layer)
+				weights[layer] *= inverseSum;
+		}
+
+		/// Stores layers 1 to 4 of weights in a texel's four bytes. They are rounded cumulatively, so together with
+		/// the implicit layer 0 they always add up to exactly 255.
+		static void Quantise(const float weights[layerCount], uint8_t *texel)
+		{
+			float cumulative = weights[0];
+			int previous = (int)(cumulative * 255.0f + 0.5f);
+			previous = previous < 255 ? previous : 255;
+			for (int layer = 1; layer < layerCount; ++layer)
+			{
+				cumulative += weights[layer];
+				int next = layer + 1 < layerCount ? (int)(cumulative * 255.0f + 0.5f) : 255;
+				next = next < previous ? previous : (next > 255 ? 255 : next);
+				texel[layer - 1] = (uint8_t)(next - previous);
+				previous = next;
+			}
+		}
+
+		/// Writes four bytes per sample at out + (z * width + x) * 4. heightScale, spacingX and spacingZ are the ones the
+		/// mesh is drawn with, min and max the range of the scaled heights, as TerrainMeshBuilder::WriteHeights finds it.
+		void Bake(const Heightfield &map, float heightScale, float spacingX, float spacingZ, float min, float max, ThreadPool &threadPool, uint8_t *out) const
+		{
+			TERRAIN_PROFILE_SCOPE("splat");
+			float range = max - min;
+			float toUnit = range > 0.0f ? 1.0f / range : 0.0f;
+			int width = map.GetWidth();
+			normals.Run(map, heightScale, spacingX, spacingZ, threadPool, [&](int z, const NormalGenerator::Row &row)
+			{
+				const float *heights = map.GetRow(z);
+				uint8_t *texels = out + (size_t)z * width * 4;
+				for (int x = 0; x < width; ++x)
+				{
+					float weights[layerCount];
+					Weigh((heights[x] * heightScale - min) * toUnit, 1.0f - row.y[x], weights);
+					Quantise(weights, texels + x * 4);
+				}
+			});
+		}
+	};
+}
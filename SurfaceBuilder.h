@@ -0,0 +1,147 @@
+#pragma once
+#include "CompactVertex.h"
+#include "SplatMap.h"
+#include "TerrainErosion.h"
+#include "TerrainGenerator.h"
+#include "TerrainMesh.h"
+#include "TerrainNormals.h"
+#include "TerrainPipeline.h"
+
+#include <vector>
+
+namespace Terrain
+{
+	/// Takes an algorithm through to a finished map and the heights and normals of its vertices, in TerrainPipeline's
+	/// tiled sweep where the algorithm and settings allow and otherwise one pass per step, eroding the map between
+	/// the algorithm and the vertices when asked to, and baking the splat map last. The vertices' grid
+	/// coordinates are left as laid out by BuildPlane. CustomTerrain and BackgroundGenerator both build with it.
+	class SurfaceBuilder
+	{
+		TerrainPipeline pipeline;
+		NormalGenerator normals;
+		ErosionSimulator erosion;
+		SplatMapBaker splatBaker;
+		std::vector<uint16_t> octahedral;
+
+		//counts a finished step, false once the build should stop
+		static bool Step(TerrainProgress *progress)
+		{
+			if (!progress)
+				return true;
+			++progress->done;
+			return !progress->cancelled;
+		}
+
+	public:
+		struct Settings
+		{
+			TerrainGenerator::Algorithm algorithm;
+			float heightScale;
+			float spacingX;
+			float spacingZ;
+			bool tiled; //world continuous algorithms go through TerrainPipeline
+			bool analyticNormals; //Perlin and fBm normals from the noise's slope, these always take the pipeline
+			ErosionSimulator::Settings erosion; //an eroded map takes the separate passes, its normals are differenced
+			std::vector<SplatRule> splatRules; //empty for no splat map
+		};
+
+	private:
+		//the splat map for the finished map, or none when there are no rules
+		void BakeSplat(const Heightfield &map, const Settings &settings, float min, float max, ThreadPool &threadPool, std::vector<uint8_t> &splat)
+		{
+			if (settings.splatRules.empty())
+			{
+				splat.clear();
+				return;
+			}
+
+			splatBaker.rules = settings.splatRules;
+			splat.resize((size_t)map.GetWidth() * map.GetDepth() * 4);
+			splatBaker.Bake(map, settings.heightScale, settings.spacingX, settings.spacingZ, min, max, threadPool, &splat[0]);
+		}
+
+	public:
+		TerrainPipeline &GetPipeline() { return pipeline; }
+		NormalGenerator &GetNormalGenerator() { return normals; }
+		ErosionSimulator &GetErosionSimulator() { return erosion; }
+
+		/// Fills map from generator and writes into whichever of vertices and compactVertices is set, which must
+		/// hold (cellsX + 1) x (cellsZ + 1) vertices. With splat and settings.splatRules, splat is resized to and filled
+		/// with SplatMapBaker's four bytes a sample, without rules it is emptied. With progress it sets progress->total
+		/// and counts towards it, and returns false, the surface part built, if progress->cancelled is raised before it finishes.
+		/// Also false if the map cannot be sized or eroded for want of memory.
+		bool Build(TerrainGenerator &generator, const Settings &settings, Heightfield &map, TerrainVertex *vertices, CompactTerrainVertex *compactVertices,
+			float &min, float &max, std::vector<uint8_t> *splat = nullptr, TerrainProgress *progress = nullptr)
+		{
+			bool baking = splat && !settings.splatRules.empty();
+			pipeline.analyticNormals = settings.analyticNormals;
+			bool tiled = (settings.tiled || pipeline.UseSlopes(settings.algorithm)) && TerrainGenerator::IsWorldContinuous(settings.algorithm) &&
+				!settings.erosion.IsEnabled();
+			if (tiled)
+			{
+				if (progress)
+					progress->total = pipeline.GetTileCount(generator.GetCellsX() + 1, generator.GetCellsZ() + 1) + (baking ? 1 : 0);
+
+				pipeline.progress = progress;
+				bool finished = compactVertices ?
+					pipeline.Generate(generator, settings.algorithm, settings.heightScale, settings.spacingX, settings.spacingZ, map, compactVertices, min, max) :
+					pipeline.Generate(generator, settings.algorithm, settings.heightScale, settings.spacingX, settings.spacingZ, map, vertices, min, max);
+				pipeline.progress = nullptr;
+				if (!finished)
+					return false;
+
+				if (splat)
+					BakeSplat(map, settings, min, max, generator.GetThreadPool(), *splat);
+				return !baking || Step(progress);
+			}
+
+			//the algorithm, the heights, the normals and the splat map count a step each, erosion one an iteration
+			if (progress)
+				progress->total = 3 + (baking ? 1 : 0) + settings.erosion.hydraulicIterations + settings.erosion.thermalIterations;
+
+			if (!generator.Generate(settings.algorithm, map) || !Step(progress))
+				return false;
+
+			erosion.progress = progress;
+			bool eroded = erosion.Erode(map, settings.erosion, settings.heightScale, settings.spacingX, generator.GetThreadPool());
+			erosion.progress = nullptr;
+			if (!eroded)
+				return false;
+
+			return BuildFromMap(settings, map, vertices, compactVertices, min, max, generator.GetThreadPool(), splat, progress);
+		}
+
+		/// Writes the heights and normals of a map that is already there, e.g. decompressed, and bakes its splat map.
+		/// The vertices and splat are as Build takes them. progress is counted towards, but its total is the caller's.
+		bool BuildFromMap(const Settings &settings, const Heightfield &map, TerrainVertex *vertices, CompactTerrainVertex *compactVertices,
+			float &min, float &max, ThreadPool &threadPool, std::vector<uint8_t> *splat = nullptr, TerrainProgress *progress = nullptr)
+		{
+			bool baking = splat && !settings.splatRules.empty();
+			if (compactVertices)
+			{
+				CompactVertexPacker::WriteHeights(map, settings.heightScale, compactVertices, min, max);
+				if (!Step(progress))
+					return false;
+
+				size_t count = (size_t)map.GetWidth() * map.GetDepth();
+				octahedral.resize(count * 2);
+				normals.ComputeOctahedral(map, settings.heightScale, settings.spacingX, settings.spacingZ, &octahedral[0], threadPool);
+				CompactVertexPacker::WriteNormals(&octahedral[0], (int)count, compactVertices);
+			}
+			else
+			{
+				TerrainMeshBuilder::WriteHeights(map, settings.heightScale, vertices, min, max);
+				if (!Step(progress))
+					return false;
+
+				normals.Compute(map, settings.heightScale, settings.spacingX, settings.spacingZ, vertices->normal, sizeof(TerrainVertex) / sizeof(float), threadPool);
+			}
+			if (!Step(progress))
+				return false;
+
+			if (splat)
+				BakeSplat(map, settings, min, max, threadPool, *splat);
+			return !baking || Step(progress);
+		}
+	};
+}
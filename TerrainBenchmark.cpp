@@ -0,0 +1,467 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Microbenchmarks for the terrain generation core. Runs every algorithm, the
+// noise kernels and the mesh passes over a range of map sizes, then measures
+// thread scaling. Prints a table and optionally writes the results as JSON.
+//
+//   TerrainBenchmark --max-size 4097 --json results.json
+//
+
+#include "CompressedHeightfield.h"
+#include "HeightfieldQuery.h"
+#include "SplatMap.h"
+#include "TerrainErosion.h"
+#include "TerrainGenerator.h"
+#include "TerrainMesh.h"
+#include "TerrainNormals.h"
+#include "TerrainPipeline.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#if defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <sys/resource.h>
+#endif
+
+namespace
+{
+	typedef std::chrono::high_resolution_clock Clock;
+
+	struct Result
+	{
+		std::string name;
+		int size;
+		int threads;
+		int iterations;
+		double nsPerSample;
+		double samplesPerSecond;
+		double peakRssBytes;
+	};
+
+	struct Options
+	{
+		int minSize = 129;
+		int maxSize = 8193;
+		int scalingSize = 2049;
+		double minTimeMs = 250.0;
+		int threads = -1;
+		std::string jsonPath;
+	};
+
+	double GetPeakRssBytes()
+	{
+#if defined(_WIN32)
+		PROCESS_MEMORY_COUNTERS counters;
+		if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+			return (double)counters.PeakWorkingSetSize;
+		return 0.0;
+#else
+		rusage usage;
+		if (getrusage(RUSAGE_SELF, &usage) != 0)
+			return 0.0;
+#if defined(__APPLE__)
+		return (double)usage.ru_maxrss;
+#else
+		return (double)usage.ru_maxrss * 1024.0;
+#endif
+#endif
+	}
+
+	/// Repeats body until minTimeMs has passed (at least once) and reports the mean cost per sample.
+	template <class Body>
+	Result Measure(const Options &options, const std::string &name, int size, int threads, double samples, Body body)
+	{
+		//one untimed run to fault in memory and warm the caches
+		body();
+
+		int iterations = 0;
+		Clock::time_point start = Clock::now();
+		double elapsedMs = 0.0;
+		do
+		{
+			body();
+			++iterations;
+			elapsedMs = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+		} while (elapsedMs < options.minTimeMs);
+
+		Result result;
+		result.name = name;
+		result.size = size;
+		result.threads = threads;
+		result.iterations = iterations;
+		result.nsPerSample = elapsedMs * 1e6 / (samples * iterations);
+		result.samplesPerSecond = samples * iterations / (elapsedMs * 1e-3);
+		result.peakRssBytes = GetPeakRssBytes();
+
+		printf("%-34s %6d^2 %3d thr %6d it %10.3f ns/sample %10.2f Msamples/s %9.1f MB peak\n",
+			name.c_str(), size, threads, iterations, result.nsPerSample, result.samplesPerSecond * 1e-6, result.peakRssBytes / (1024.0 * 1024.0));
+		fflush(stdout);
+		return result;
+	}
+
+	const char *algorithmNames[] = { "MidpointDisplacement", "DiamondSquare", "PerlinNoise", "FractionalBrownianMotion", "MultiFractal" };
+
+	void RunSize(const Options &options, int size, std::vector<Result> &results)
+	{
+		int cells = size - 1;
+		double samples = (double)size * size;
+
+		Terrain::TerrainGenerator generator(cells, cells);
+		if (options.threads >= 0)
+			generator.SetWorkerCount(options.threads);
+		generator.SetSeed(1);
+		int threads = generator.GetWorkerCount() + 1;
+
+		Terrain::Heightfield map;
+		for (int algorithm = Terrain::TerrainGenerator::MidpointDisplacement; algorithm <= Terrain::TerrainGenerator::MultiFractal; ++algorithm)
+		{
+			results.push_back(Measure(options, std::string("algorithm.") + algorithmNames[algorithm], size, threads, samples, [&]()
+			{
+				generator.Generate((Terrain::TerrainGenerator::Algorithm)algorithm, map);
+			}));
+		}
+
+		//diamond-square as 256 cell tiles in their own heightfields, the ghost exchange's cost is the difference
+		//from the whole map generated with the same root
+		if (cells >= 256 && cells % 256 == 0)
+		{
+			std::vector<Terrain::Heightfield> tiles((size_t)(cells / 256) * (cells / 256));
+			results.push_back(Measure(options, "diamondSquare.tiles.256", size, threads, samples, [&]()
+			{
+				generator.GenerateDiamondSquareTiles(256, &tiles[0]);
+			}));
+
+			generator.diamondSquareRootCells = 256;
+			results.push_back(Measure(options, "diamondSquare.root.256", size, threads, samples, [&]()
+			{
+				generator.Generate(Terrain::TerrainGenerator::DiamondSquare, map);
+			}));
+			generator.diamondSquareRootCells = 0;
+		}
+
+		//the fractal algorithms again with every requested octave, the sampling limit's saving is the difference
+		generator.maxOctaveFrequency = 0.0f;
+		for (int algorithm = Terrain::TerrainGenerator::FractionalBrownianMotion; algorithm <= Terrain::TerrainGenerator::MultiFractal; ++algorithm)
+		{
+			results.push_back(Measure(options, std::string("octaves.all.") + algorithmNames[algorithm], size, threads, samples, [&]()
+			{
+				generator.Generate((Terrain::TerrainGenerator::Algorithm)algorithm, map);
+			}));
+		}
+		generator.maxOctaveFrequency = 0.5f;
+
+		//noise on its own, single threaded, one sample per cell at the Perlin algorithm's frequency
+		Terrain::PerlinNoiseGenerator noise(1);
+		float frequency = 5.0f / (float)size;
+		results.push_back(Measure(options, "noise.GenerateNoise", size, 1, samples, [&]()
+		{
+			for (int z = 0; z < size; ++z)
+			{
+				float *row = map.GetRow(z);
+				for (int x = 0; x < size; ++x)
+					row[x] = noise.GenerateNoise((float)x * frequency, (float)z * frequency);
+			}
+		}));
+
+		const char *kernelNames[] = { "noise.row.scalar", "noise.row.sse41", "noise.row.avx2" };
+		for (int kernel = Terrain::PerlinNoiseGenerator::Scalar; kernel <= Terrain::PerlinNoiseGenerator::Avx2; ++kernel)
+		{
+			noise.SetKernel((Terrain::PerlinNoiseGenerator::Kernel)kernel);
+			if (noise.GetKernel() != kernel)
+				continue;
+
+			results.push_back(Measure(options, kernelNames[kernel], size, 1, samples, [&]()
+			{
+				for (int z = 0; z < size; ++z)
+					noise.GenerateNoiseRow(0, size, (float)z * frequency, frequency, map.GetRow(z));
+			}));
+		}
+
+		std::vector<Terrain::TerrainVertex> vertices(Terrain::TerrainMeshBuilder::GetVertexCount(cells, cells));
+		std::vector<uint32_t> indices(Terrain::TerrainMeshBuilder::GetIndexCount(cells, cells));
+		results.push_back(Measure(options, "mesh.buildPlane", size, 1, samples, [&]()
+		{
+			Terrain::TerrainMeshBuilder::BuildPlane(cells, cells, 1.0f, 1.0f, &vertices[0], &indices[0]);
+		}));
+
+		generator.Generate(Terrain::TerrainGenerator::FractionalBrownianMotion, map);
+		float min, max;
+		Terrain::TerrainMeshBuilder::WriteHeights(map, 50.0f, &vertices[0], min, max);
+		results.push_back(Measure(options, "mesh.normals", size, 1, samples, [&]()
+		{
+			Terrain::TerrainMeshBuilder::ComputeNormals(cells, cells, &vertices[0]);
+		}));
+
+		Terrain::NormalGenerator normals;
+		const char *normalKernelNames[] = { "normals.scalar", "normals.sse41", "normals.avx2" };
+		for (int kernel = Terrain::NormalGenerator::Scalar; kernel <= Terrain::NormalGenerator::Avx2; ++kernel)
+		{
+			normals.SetKernel((Terrain::NormalGenerator::Kernel)kernel);
+			if (normals.GetKernel() != kernel)
+				continue;
+
+			results.push_back(Measure(options, normalKernelNames[kernel], size, threads, samples, [&]()
+			{
+				normals.Compute(map, 50.0f, 1.0f, 1.0f, vertices[0].normal, 8, generator.GetThreadPool());
+			}));
+		}
+
+		std::vector<uint16_t> octahedral((size_t)size * size * 2);
+		normals.SetKernel(Terrain::NormalGenerator::GetBestKernel());
+		results.push_back(Measure(options, "normals.octahedral", size, threads, samples, [&]()
+		{
+			normals.ComputeOctahedral(map, 50.0f, 1.0f, 1.0f, &octahedral[0], generator.GetThreadPool());
+		}));
+
+		//the default rules, normals included as the bake works them out itself
+		std::vector<uint8_t> splat((size_t)size * size * 4);
+		Terrain::SplatMapBaker splatBaker;
+		results.push_back(Measure(options, "splat.bake", size, threads, samples, [&]()
+		{
+			splatBaker.Bake(map, 50.0f, 1.0f, 1.0f, min, max, generator.GetThreadPool(), &splat[0]);
+		}));
+
+		//the fBm map into a snapshot and back, against regenerating it
+		Terrain::CompressedHeightfield compressed;
+		results.push_back(Measure(options, "heights.compress", size, threads, samples, [&]()
+		{
+			compressed.Compress(map, generator.GetThreadPool());
+		}));
+
+		Terrain::Heightfield decompressed;
+		results.push_back(Measure(options, "heights.decompress", size, threads, samples, [&]()
+		{
+			compressed.Decompress(decompressed, generator.GetThreadPool());
+		}));
+
+		//queries against the fBm map, ns/sample is per query: heights under a spread of points, ground probes
+		//dropped from just above them and 30 sample sight lines between them
+		Terrain::HeightfieldQuery query;
+		results.push_back(Measure(options, "query.build", size, threads, samples, [&]()
+		{
+			query.Build(map, 50.0f, 1.0f, 1.0f, generator.GetThreadPool());
+		}));
+
+		const int queryCount = 4096;
+		std::vector<float> queryX(queryCount), queryZ(queryCount), queryHeights(queryCount);
+		std::vector<Terrain::HeightfieldQuery::Ray> probes(queryCount), sightLines(queryCount);
+		std::vector<Terrain::HeightfieldQuery::RayHit> hits(queryCount);
+		for (int i = 0; i < queryCount; ++i)
+		{
+			//golden ratio steps spread the points evenly without a random generator
+			queryX[i] = std::fmod(i * 0.6180340f, 1.0f) * cells;
+			queryZ[i] = std::fmod(i * 0.7548777f, 1.0f) * cells;
+			float x = queryX[i];
+			float z = queryZ[i];
+			float eye = query.GetHeight(x, z) + 2.0f;
+			Terrain::HeightfieldQuery::Ray probe = { { x, eye, z }, { 0.0f, -1.0f, 0.0f }, 100.0f };
+			probes[i] = probe;
+
+			float targetX = std::min(std::max(x + (i % 2 ? 21.0f : -21.0f), 0.0f), (float)cells);
+			float targetZ = std::min(std::max(z + (i % 4 < 2 ? 21.0f : -21.0f), 0.0f), (float)cells);
+			float target = query.GetHeight(targetX, targetZ) + 2.0f;
+			Terrain::HeightfieldQuery::Ray sightLine = { { x, eye, z }, { targetX - x, target - eye, targetZ - z }, 1.0f };
+			sightLines[i] = sightLine;
+		}
+
+		results.push_back(Measure(options, "query.heights", size, 1, queryCount, [&]()
+		{
+			query.GetHeights(&queryX[0], &queryZ[0], queryCount, &queryHeights[0]);
+		}));
+		results.push_back(Measure(options, "query.probes", size, threads, queryCount, [&]()
+		{
+			query.Raycast(&probes[0], queryCount, &hits[0], generator.GetThreadPool());
+		}));
+		results.push_back(Measure(options, "query.sightLines", size, threads, queryCount, [&]()
+		{
+			query.Raycast(&sightLines[0], queryCount, &hits[0], generator.GetThreadPool());
+		}));
+
+		//noise through to finished vertices, one pass per step against the fused tiled sweep
+		Terrain::TerrainPipeline pipeline;
+		for (int algorithm = Terrain::TerrainGenerator::PerlinNoise; algorithm <= Terrain::TerrainGenerator::MultiFractal; ++algorithm)
+		{
+			Terrain::TerrainGenerator::Algorithm tiledAlgorithm = (Terrain::TerrainGenerator::Algorithm)algorithm;
+			results.push_back(Measure(options, std::string("pipeline.separate.") + algorithmNames[algorithm], size, threads, samples, [&]()
+			{
+				generator.Generate(tiledAlgorithm, map);
+				Terrain::TerrainMeshBuilder::WriteHeights(map, 50.0f, &vertices[0], min, max);
+				normals.Compute(map, 50.0f, 1.0f, 1.0f, vertices[0].normal, 8, generator.GetThreadPool());
+			}));
+
+			pipeline.analyticNormals = false;
+			results.push_back(Measure(options, std::string("pipeline.tiled.") + algorithmNames[algorithm], size, threads, samples, [&]()
+			{
+				pipeline.Generate(generator, tiledAlgorithm, 50.0f, 1.0f, 1.0f, map, &vertices[0], min, max);
+			}));
+
+			//normals from the noise's own slope, no halo and no neighbour reads
+			if (!Terrain::TerrainGenerator::HasAnalyticSlope(tiledAlgorithm))
+				continue;
+			pipeline.analyticNormals = true;
+			results.push_back(Measure(options, std::string("pipeline.analytic.") + algorithmNames[algorithm], size, threads, samples, [&]()
+			{
+				pipeline.Generate(generator, tiledAlgorithm, 50.0f, 1.0f, 1.0f, map, &vertices[0], min, max);
+			}));
+		}
+
+		//ten iterations a run, per sample and iteration, the grids take about 44 bytes a sample so big maps are skipped
+		if (size > 2049)
+			return;
+		Terrain::ErosionSimulator erosion;
+		Terrain::Heightfield eroded;
+		Terrain::ErosionSimulator::Settings hydraulic;
+		hydraulic.hydraulicIterations = 10;
+		Terrain::ErosionSimulator::Settings thermal;
+		thermal.thermalIterations = 10;
+		const char *erosionKernelNames[] = { "erosion.hydraulic.scalar", "erosion.hydraulic.sse41", "erosion.hydraulic.avx2" };
+		for (int kernel = Terrain::ErosionSimulator::Scalar; kernel <= Terrain::ErosionSimulator::Avx2; ++kernel)
+		{
+			erosion.SetKernel((Terrain::ErosionSimulator::Kernel)kernel);
+			if (erosion.GetKernel() != kernel)
+				continue;
+
+			results.push_back(Measure(options, erosionKernelNames[kernel], size, threads, samples * 10.0, [&]()
+			{
+				eroded = map;
+				erosion.Erode(eroded, hydraulic, 50.0f, 1.0f, generator.GetThreadPool());
+			}));
+		}
+
+		erosion.SetKernel(Terrain::ErosionSimulator::GetBestKernel());
+		results.push_back(Measure(options, "erosion.thermal", size, threads, samples * 10.0, [&]()
+		{
+			eroded = map;
+			erosion.Erode(eroded, thermal, 50.0f, 1.0f, generator.GetThreadPool());
+		}));
+	}
+
+	void RunScaling(const Options &options, std::vector<Result> &results)
+	{
+		int cells = options.scalingSize - 1;
+		double samples = (double)options.scalingSize * options.scalingSize;
+		int maxThreads = options.threads >= 0 ? options.threads + 1 : Terrain::ThreadPool::DefaultWorkerCount() + 1;
+
+		Terrain::TerrainGenerator generator(cells, cells);
+		generator.SetSeed(1);
+		Terrain::Heightfield map;
+
+		//powers of two up to the full thread count
+		std::vector<int> threadCounts;
+		for (int threads = 1; threads < maxThreads; threads *= 2)
+			threadCounts.push_back(threads);
+		threadCounts.push_back(maxThreads);
+
+		double singleThreadNs = 0.0;
+		for (size_t i = 0; i < threadCounts.size(); ++i)
+		{
+			int threads = threadCounts[i];
+			generator.SetWorkerCount(threads - 1);
+			Result result = Measure(options, "scaling.FractionalBrownianMotion", options.scalingSize, threads, samples, [&]()
+			{
+				generator.Generate(Terrain::TerrainGenerator::FractionalBrownianMotion, map);
+			});
+			results.push_back(result);
+
+			if (threads == 1)
+				singleThreadNs = result.nsPerSample;
+			printf("  speedup %.2fx, efficiency %.0f%%\n", singleThreadNs / result.nsPerSample, 100.0 * singleThreadNs / (result.nsPerSample * threads));
+		}
+	}
+
+	bool WriteJson(const std::string &path, const std::vector<Result> &results)
+	{
+		FILE *file = fopen(path.c_str(), "w");
+		if (!file)
+			return false;
+
+		const char *kernelNames[] = { "scalar", "sse41", "avx2" };
+		fprintf(file, "{\n  \"noiseKernel\": \"%s\",\n  \"hardwareThreads\": %u,\n  \"results\": [\n",
+			kernelNames[Terrain::PerlinNoiseGenerator::GetBestKernel()], std::thread::hardware_concurrency());
+		for (size_t i = 0; i < results.size(); ++i)
+		{
+			const Result &r = results[i];
+			fprintf(file, "    {\"name\": \"%s\", \"size\": %d, \"threads\": %d, \"iterations\": %d, \"nsPerSample\": %.4f, \"samplesPerSecond\": %.1f, \"peakRssBytes\": %.0f}%s\n",
+				r.name.c_str(), r.size, r.threads, r.iterations, r.nsPerSample, r.samplesPerSecond, r.peakRssBytes, i + 1 < results.size() ? "," : "");
+		}
+		fprintf(file, "  ]\n}\n");
+		return fclose(file) == 0;
+	}
+
+	void PrintUsage()
+	{
+		printf(
+			"usage: TerrainBenchmark [options]\n"
+			"  --min-size <n>       smallest map edge in samples, 2^k+1 (default 129)\n"
+			"  --max-size <n>       largest map edge in samples, 2^k+1 (default 8193)\n"
+			"  --scaling-size <n>   map edge used for the thread scaling run, 0 to skip (default 2049)\n"
+			"  --min-time <ms>      minimum time spent per case (default 250)\n"
+			"  -j, --threads <n>    worker threads on top of the main thread (default all cores)\n"
+			"  --json <file>        write the results as JSON\n");
+	}
+}
+
+int main(int argc, char **argv)
+{
+	Options options;
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string arg = argv[i];
+		const char *value = i + 1 < argc ? argv[i + 1] : nullptr;
+
+		if (arg == "-h" || arg == "--help")
+		{
+			PrintUsage();
+			return 0;
+		}
+		if (!value)
+		{
+			fprintf(stderr, "missing value for %s\n", arg.c_str());
+			return 1;
+		}
+
+		if (arg == "--min-size")
+			options.minSize = atoi(value);
+		else if (arg == "--max-size")
+			options.maxSize = atoi(value);
+		else if (arg == "--scaling-size")
+			options.scalingSize = atoi(value);
+		else if (arg == "--min-time")
+			options.minTimeMs = atof(value);
+		else if (arg == "-j" || arg == "--threads")
+			options.threads = atoi(value);
+		else if (arg == "--json")
+			options.jsonPath = value;
+		else
+		{
+			fprintf(stderr, "unknown option %s\n", arg.c_str());
+			PrintUsage();
+			return 1;
+		}
+		++i;
+	}
+
+	std::vector<Result> results;
+	for (int size = options.minSize; size <= options.maxSize; size = (size - 1) * 2 + 1)
+		RunSize(options, size, results);
+
+	if (options.scalingSize > 1)
+		RunScaling(options, results);
+
+	if (!options.jsonPath.empty() && !WriteJson(options.jsonPath, results))
+	{
+		fprintf(stderr, "failed to write %s\n", options.jsonPath.c_str());
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,212 @@
+#pragma once
+#include "../../octet.h"
+#include "TerrainGenerator.h"
+#include "TerrainMesh.h"
+#include "TerrainNormals.h"
+#include "TileCache.h"
+#if OCTET_BULLET
+#include "TerrainCollision.h"
+#endif
+
+#include <cmath>
+#include <vector>
+
+namespace Terrain
+{
+	/// Streams an unbounded terrain as a grid of square tiles around the camera.
+	/// Tiles are generated on demand from world continuous noise, so neighbours meet without seams, and kept in
+	/// an LRU cache whose meshes are recycled once it is full. Memory stays flat however far the camera travels.
+	/// With a physics world each tile also has a static body of its own, reading the heights the tile was built from.
+	class TerrainChunkManager
+	{
+		struct Chunk
+		{
+			octet::ref<octet::mesh> mesh;
+
+			//the tile with a one sample halo around it, which gives it the same normals its neighbours see
+			Heightfield heights;
+#if OCTET_BULLET
+			TerrainCollisionBody collision; //over the interior of heights
+#endif
+		};
+
+		octet::ref<octet::visual_scene> scene;
+		octet::ref<octet::scene_node> node;
+		octet::ref<octet::material> material;
+		TerrainGenerator &generator;
+
+		int tileCells;
+		float sampleSpacing;
+		int viewRadius;
+		int prefetchRadius;
+
+		TileCache<Chunk> cache;
+		TerrainGenerator::Algorithm algorithm;
+		NormalGenerator normals;
+
+#if OCTET_BULLET
+		btDynamicsWorld *physicsWorld = nullptr;
+#endif
+
+		//scratch shared by every tile
+		std::vector<TerrainVertex> haloVertices;
+		octet::dynarray<octet::mesh::vertex> tileVertices;
+		octet::dynarray<uint16_t> tileIndices; //tiles are small enough for 16-bit indices
+
+		void BuildTile(Chunk &chunk, int tileX, int tileZ)
+		{
+			int originX = tileX * tileCells;
+			int originZ = tileZ * tileCells;
+			int haloCells = tileCells + 2;
+
+			Heightfield &haloHeights = chunk.heights;
+			generator.GenerateRegion(algorithm, originX - 1, originZ - 1, haloCells + 1, haloCells + 1, haloHeights);
+
+			float min, max;
+			TerrainMeshBuilder::BuildPlane(haloCells, haloCells, sampleSpacing, sampleSpacing, &haloVertices[0], nullptr);
+			TerrainMeshBuilder::WriteHeights(haloHeights, heightScale, &haloVertices[0], min, max);
+			normals.Compute(haloHeights, heightScale, sampleSpacing, sampleSpacing, haloVertices[0].normal, sizeof(TerrainVertex) / sizeof(float), generator.GetThreadPool());
+
+			//copy out the interior in world space, with the uv continuing across tiles at the main terrain's tiling
+			float uvStep = TerrainMeshBuilder::GetUvStep(generator.GetCellsX());
+			TerrainVertex *vertex = (TerrainVertex*)tileVertices.data();
+			for (int z = 0; z <= tileCells; ++z)
+			{
+				const TerrainVertex *source = &haloVertices[(z + 1) * (haloCells + 1) + 1];
+				for (int x = 0; x <= tileCells; ++x, ++vertex, ++source)
+				{
+					*vertex = *source;
+					vertex->pos[0] = (float)(originX + x) * sampleSpacing;
+					vertex->pos[2] = (float)(originZ + z) * sampleSpacing;
+					vertex->uv[0] = (float)(originX + x) * uvStep;
+					vertex->uv[1] = (float)(originZ + z) * uvStep;
+				}
+			}
+
+			if (!chunk.mesh)
+			{
+				chunk.mesh = new octet::mesh();
+				chunk.mesh->set_default_attributes();
+				scene->add_mesh_instance(new octet::mesh_instance(node, chunk.mesh, material));
+			}
+
+			float tileSize = tileCells * sampleSpacing;
+			octet::vec3 centre((originX + tileCells * 0.5f) * sampleSpacing, (min + max) * 0.5f, (originZ + tileCells * 0.5f) * sampleSpacing);
+			chunk.mesh->set_aabb(octet::aabb(centre, octet::vec3(tileSize * 0.5f, (max - min) * 0.5f, tileSize * 0.5f)));
+			chunk.mesh->set_vertices(tileVertices);
+			chunk.mesh->set_indices(tileIndices);
+
+#if OCTET_BULLET
+			//the halo's range bounds the interior's, which is all the shape needs of it
+			if (heightScale != 0.0f)
+			{
+				const float *interior = haloHeights.GetData() + haloHeights.GetStride() + 1;
+				chunk.collision.SetOrigin(btVector3(originX * sampleSpacing, 0.0f, originZ * sampleSpacing));
+				chunk.collision.Update(interior, tileCells + 1, tileCells + 1, haloHeights.GetStride(), sampleSpacing, sampleSpacing, heightScale,
+					min / heightScale, max / heightScale);
+				chunk.collision.SetWorld(physicsWorld);
+			}
+#endif
+		}
+
+	public:
+
+		float heightScale = 50.0f;
+
+		/// Tiles generated per Update, bounds the time a frame can spend generating.
+		int maxTilesPerFrame = 2;
+
+		/// Tiles within viewRadius of the camera's tile are generated first, then prefetchRadius more rings ahead of it.
+		/// The cache holds one ring beyond that so stepping back over a tile boundary does not regenerate.
+		TerrainChunkManager(octet::visual_scene *scene, octet::material *material, TerrainGenerator &generator, int tileCells, float sampleSpacing, int viewRadius = 3, int prefetchRadius = 1) :
+			scene(scene),
+			material(material),
+			generator(generator),
+			tileCells(tileCells),
+			sampleSpacing(sampleSpacing),
+			viewRadius(viewRadius),
+			prefetchRadius(prefetchRadius),
+			cache((2 * (viewRadius + prefetchRadius + 1) + 1) * (2 * (viewRadius + prefetchRadius + 1) + 1)),
+			algorithm(TerrainGenerator::FractionalBrownianMotion)
+		{
+			node = new octet::scene_node();
+			scene->add_child(node);
+
+			haloVertices.resize(TerrainMeshBuilder::GetVertexCount(tileCells + 2, tileCells + 2));
+			tileVertices.resize(TerrainMeshBuilder::GetVertexCount(tileCells, tileCells));
+			tileIndices.resize(TerrainMeshBuilder::GetIndexCount(tileCells, tileCells));
+			assert(TerrainMeshBuilder::GetVertexCount(tileCells, tileCells) <= 65536);
+			TerrainMeshBuilder::BuildIndices(tileCells, tileCells, tileIndices.data());
+		}
+
+		TerrainGenerator::Algorithm GetAlgorithm() const { return algorithm; }
+
+		/// Algorithms that are not world continuous cannot be tiled and fall back to fBm.
+		void SetAlgorithm(TerrainGenerator::Algorithm value)
+		{
+			algorithm = TerrainGenerator::IsWorldContinuous(value) ? value : TerrainGenerator::FractionalBrownianMotion;
+			Clear();
+		}
+
+		int GetTileCells() const { return tileCells; }
+		size_t GetResidentTileCount() const { return cache.GetSize(); }
+		size_t GetCapacity() const { return cache.GetCapacity(); }
+
+		/// Drops every tile, e.g. after the seed or algorithm changed. Meshes are kept and refilled by Update.
+		void Clear()
+		{
+			cache.ForEachTile([](Chunk &chunk)
+			{
+				if (chunk.mesh)
+					chunk.mesh->set_num_indices(0);
+#if OCTET_BULLET
+				chunk.collision.SetWorld(nullptr);
+#endif
+			});
+			cache.Clear();
+		}
+
+#if OCTET_BULLET
+		/// Puts every tile's body in world, or takes them out with null. Tiles built later join it as they are made.
+		void SetPhysicsWorld(btDynamicsWorld *world)
+		{
+			physicsWorld = world;
+			cache.ForEachTile([world](Chunk &chunk)
+			{
+				if (chunk.mesh && chunk.mesh->get_num_indices() > 0)
+					chunk.collision.SetWorld(world);
+			});
+		}
+#endif
+
+		/// Call once a frame. Marks the tiles around the camera as used and generates missing ones nearest first.
+		void Update(float cameraX, float cameraZ)
+		{
+			float tileSize = tileCells * sampleSpacing;
+			int centreX = (int)std::floor(cameraX / tileSize);
+			int centreZ = (int)std::floor(cameraZ / tileSize);
+			int budget = maxTilesPerFrame;
+
+			//walk outwards in square rings, so what is under the camera fills in before the prefetch ring
+			for (int ring = 0; ring <= viewRadius + prefetchRadius; ++ring)
+			{
+				for (int dz = -ring; dz <= ring; ++dz)
+				{
+					int step = (dz == -ring || dz == ring) ? 1 : 2 * ring;
+					for (int dx = -ring; dx <= ring; dx += step)
+					{
+						int tileX = centreX + dx;
+						int tileZ = centreZ + dz;
+						if (cache.Find(tileX, tileZ) || budget == 0)
+							continue;
+
+						bool isNew;
+						Chunk &chunk = cache.Acquire(tileX, tileZ, isNew);
+						BuildTile(chunk, tileX, tileZ);
+						--budget;
+					}
+				}
+			}
+		}
+	};
+}
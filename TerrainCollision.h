@@ -0,0 +1,171 @@
+#pragma once
+#include "../../octet.h"
+#include "../../../open_source/bullet/BulletCollision/CollisionShapes/btHeightfieldTerrainShape.h"
+
+#include <memory>
+
+namespace Terrain
+{
+	/// Bullet heightfield reading a terrain's heights where they already are. Bullet asks for heights one at a time
+	/// and each comes straight out of the rows it was given, stride floats apart, so a map's padded rows, a window
+	/// into one or a mapped tile all work and nothing is copied however big the map is.
+	/// The grid is laid out like TerrainMeshBuilder::BuildPlane, y up, and each cell is split along the same
+	/// diagonal as the mesh, so bodies rest on exactly the triangles that are drawn.
+	class HeightfieldCollisionShape : public btHeightfieldTerrainShape
+	{
+		const float *heights;
+		int stride;
+		float minHeight;
+		float maxHeight;
+
+	protected:
+		virtual btScalar getRawHeightFieldValue(int x, int z) const
+		{
+			return heights[(size_t)z * stride + x];
+		}
+
+	public:
+		/// heights are unscaled with min and max their range, also unscaled.
+		HeightfieldCollisionShape(const float *heights, int width, int depth, int stride, float spacingX, float spacingZ, float heightScale, float min, float max) :
+			btHeightfieldTerrainShape(width, depth, heights, 1.0f, min, max, 1, PHY_FLOAT, false)
+		{
+			Refresh(heights, width, depth, stride, spacingX, spacingZ, heightScale, min, max);
+		}
+
+		/// Points the shape at new heights, e.g. after the map was regenerated, swapped or resized. Only the
+		/// bounds are worked out again, the shape stays the same object so bodies using it need not change.
+		void Refresh(const float *heights, int width, int depth, int stride, float spacingX, float spacingZ, float heightScale, float min, float max)
+		{
+			this->heights = heights;
+			this->stride = stride;
+			minHeight = min;
+			maxHeight = max;
+			initialize(width, depth, heights, 1.0f, min, max, 1, PHY_FLOAT, false);
+			setLocalScaling(btVector3(spacingX, heightScale, spacingZ));
+		}
+
+		/// Where the shape's centre is relative to sample (0, 0) at height 0. Bullet centres a heightfield on its
+		/// bounds, so a body has to sit here for the shape to line up with the mesh.
+		btVector3 GetCentre() const
+		{
+			const btVector3 &scaling = getLocalScaling();
+			return btVector3((btScalar)m_width * 0.5f * scaling.x(), (minHeight + maxHeight) * 0.5f * scaling.y(), (btScalar)m_length * 0.5f * scaling.z());
+		}
+	};
+
+	/// A static body on a HeightfieldCollisionShape. Update follows the heights as they change, moving the body
+	/// with the shape's centre and waking whatever sleeps in the world so it settles on the new ground.
+	class TerrainCollisionBody
+	{
+		std::unique_ptr<HeightfieldCollisionShape> shape;
+		std::unique_ptr<btRigidBody> body;
+		btDynamicsWorld *world = nullptr;
+		btVector3 origin;
+
+		TerrainCollisionBody(const TerrainCollisionBody &);
+		TerrainCollisionBody &operator=(const TerrainCollisionBody &);
+
+		void Place()
+		{
+			btTransform transform;
+			transform.setIdentity();
+			transform.setOrigin(origin + shape->GetCentre());
+			body->setWorldTransform(transform);
+			if (!world)
+				return;
+
+			world->updateSingleAabb(body.get());
+			btCollisionObjectArray &objects = world->getCollisionObjectArray();
+			for (int i = 0; i < objects.size(); ++i)
+			{
+				if (!objects[i]->isStaticOrKinematicObject())
+					objects[i]->activate(true);
+			}
+		}
+
+	public:
+		TerrainCollisionBody() : origin(0.0f, 0.0f, 0.0f)
+		{
+		}
+
+		~TerrainCollisionBody()
+		{
+			SetWorld(nullptr);
+		}
+
+		/// Adds the body to world, taking it out of the one it was in. Null only takes it out.
+		/// Nothing is added before the first Update.
+		void SetWorld(btDynamicsWorld *world)
+		{
+			if (world == this->world)
+				return;
+			if (this->world && body)
+				this->world->removeRigidBody(body.get());
+			this->world = world;
+			if (world && body)
+			{
+				world->addRigidBody(body.get());
+				Place();
+			}
+		}
+
+		/// Where sample (0, 0) at height 0 is in the world.
+		void SetOrigin(const btVector3 &origin)
+		{
+			this->origin = origin;
+			if (body)
+				Place();
+		}
+
+		/// Points the body's shape at heights, making both the first time. As HeightfieldCollisionShape takes them.
+		void Update(const float *heights, int width, int depth, int stride, float spacingX, float spacingZ, float heightScale, float min, float max)
+		{
+			if (shape)
+			{
+				shape->Refresh(heights, width, depth, stride, spacingX, spacingZ, heightScale, min, max);
+				Place();
+				return;
+			}
+
+			shape.reset(new HeightfieldCollisionShape(heights, width, depth, stride, spacingX, spacingZ, heightScale, min, max));
+			btRigidBody::btRigidBodyConstructionInfo info(0.0f, nullptr, shape.get());
+			body.reset(new btRigidBody(info));
+			if (world)
+				world->addRigidBody(body.get());
+			Place();
+		}
+
+		const HeightfieldCollisionShape *GetShape() const { return shape.get(); }
+		btRigidBody *GetBody() const { return body.get(); }
+	};
+
+	/// Bullet's default setup, a world for the terrain's bodies and whatever is dropped on them.
+	/// Take the terrain's bodies out before it goes.
+	class TerrainPhysicsWorld
+	{
+		btDefaultCollisionConfiguration configuration;
+		btCollisionDispatcher dispatcher;
+		btDbvtBroadphase broadphase;
+		btSequentialImpulseConstraintSolver solver;
+		btDiscreteDynamicsWorld world;
+
+		TerrainPhysicsWorld(const TerrainPhysicsWorld &);
+		TerrainPhysicsWorld &operator=(const TerrainPhysicsWorld &);
+
+	public:
+		TerrainPhysicsWorld() :
+			dispatcher(&configuration),
+			world(&dispatcher, &broadphase, &solver, &configuration)
+		{
+			world.setGravity(btVector3(0.0f, -9.81f, 0.0f));
+		}
+
+		btDiscreteDynamicsWorld *Get() { return &world; }
+
+		/// Advances by seconds in fixed 60 Hz substeps, at most four a call.
+		void Step(float seconds)
+		{
+			world.stepSimulation(seconds, 4, 1.0f / 60.0f);
+		}
+	};
+}
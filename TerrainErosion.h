@@ -0,0 +1,765 @@
+#pragma once
+#include "CpuFeatures.h"
+#include "Heightfield.h"
+#include "TerrainPipeline.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+
+namespace Terrain
+{
+	/// Weathers a generated map. Hydraulic erosion is the virtual pipe model: rain fills every cell, water flows
+	/// to lower neighbours through pipes whose flux builds up with the height difference, and flowing water
+	/// dissolves ground up to a capacity set by its speed and the slope, carries it along and drops it where it
+	/// slows. Thermal erosion moves ground down any slope steeper than the talus angle until it settles there.
+	/// The simulation works in cells, heights being scaled by heightScale / spacing, so the angles and slopes
+	/// are the ones the terrain is drawn with.
+	/// Every grid has a one cell border so the SIMD kernels treat all samples alike, and each pass reads one copy
+	/// and writes the other, so bands of rows run in parallel without locks. The SIMD kernels give bit-identical
+	/// results to the scalar code.
+	class ErosionSimulator
+	{
+	public:
+		enum Kernel
+		{
+			Scalar,
+			Sse41,
+			Avx2
+		};
+
+		struct Settings
+		{
+			int hydraulicIterations = 0;
+			int thermalIterations = 0; //run after the hydraulic ones
+
+			float timeStep = 0.02f;
+			float rainRate = 0.5f; //water depth a cell gains per unit of time
+			float gravity = 9.81f;
+			float sedimentCapacity = 0.5f; //sediment water can hold per unit of speed on a 90 degree slope
+			float dissolveRate = 0.05f; //fraction of the spare capacity dissolved a step
+			float depositRate = 0.05f; //fraction of the excess sediment dropped a step
+			float evaporationRate = 0.5f; //fraction of the water that evaporates per unit of time
+			float minTilt = 0.05f; //sine of the slope flat ground still erodes as, so pools keep their capacity
+
+			float talusAngle = 35.0f; //degrees, ground steeper than this slides
+			float thermalRate = 0.5f; //fraction of the excess slope removed a step, at most 1
+
+			bool IsEnabled() const { return hydraulicIterations > 0 || thermalIterations > 0; }
+		};
+
+	private:
+		//a row of every grid, x indexes the padded row so x - 1, x + 1, x - stride and x + stride are its neighbours
+		struct Cells
+		{
+			const float *terrain;
+			const float *water;
+			const float *sediment;
+			float *fluxLeft;
+			float *fluxRight;
+			float *fluxUp; //towards the row above
+			float *fluxDown;
+			float *terrainOut;
+			float *waterOut;
+			float *sedimentOut;
+			float *concentration; //sediment per unit of water, what each unit of flux carries
+			int stride;
+		};
+
+		//the settings as each step applies them
+		struct Coefficients
+		{
+			float timeStep;
+			float gravityStep; //timeStep * gravity, the pipe area and length being one cell
+			float rain;
+			float capacity;
+			float dissolve;
+			float deposit;
+			float keep; //1 - evaporation over the step
+			float minTilt;
+			float minDepth; //stops the speed blowing up as a cell dries out
+			float talus; //height difference per cell
+			float slide; //a quarter of the thermal rate, one per neighbour
+		};
+
+		Kernel kernel;
+
+		//front and back copies, each pass writes the back one and they swap
+		Heightfield terrain;
+		Heightfield terrainBack;
+		Heightfield water;
+		Heightfield waterBack;
+		Heightfield sediment;
+		Heightfield sedimentBack;
+		Heightfield fluxLeft;
+		Heightfield fluxRight;
+		Heightfield fluxUp;
+		Heightfield fluxDown;
+		Heightfield concentration;
+
+		static bool Allocate(Heightfield &grid, int width, int depth, bool clear)
+		{
+			if (!grid.Resize(width + 2, depth + 2))
+				return false;
+			if (clear)
+				grid.Fill(0.0f);
+			return true;
+		}
+
+		//the border repeats the edge, so nothing flows or slides over it and the slope along the edge is one-sided
+		static void ReplicateEdges(Heightfield &grid)
+		{
+			int width = grid.GetWidth();
+			int depth = grid.GetDepth();
+			for (int z = 1; z < depth - 1; ++z)
+			{
+				float *row = grid.GetRow(z);
+				row[0] = row[1];
+				row[width - 1] = row[width - 2];
+			}
+			std::copy(grid.GetRow(1), grid.GetRow(1) + width, grid.GetRow(0));
+			std::copy(grid.GetRow(depth - 2), grid.GetRow(depth - 2) + width, grid.GetRow(depth - 1));
+		}
+
+		Cells GetCells(int z)
+		{
+			Cells cells = { terrain.GetRow(z), water.GetRow(z), sediment.GetRow(z), fluxLeft.GetRow(z), fluxRight.GetRow(z), fluxUp.GetRow(z), fluxDown.GetRow(z),
+				terrainBack.GetRow(z), waterBack.GetRow(z), sedimentBack.GetRow(z), concentration.GetRow(z), terrain.GetStride() };
+			return cells;
+		}
+
+		//calls body(z) for every row inside the border, bands of rows in parallel
+		template <class RowBody>
+		void ForEachRow(ThreadPool &threadPool, RowBody body)
+		{
+			int rows = terrain.GetDepth() - 2;
+			threadPool.ParallelFor(1, rows + 1, threadPool.GetGrainSize(rows), [&](int firstRow, int lastRow)
+			{
+				for (int z = firstRow; z < lastRow; ++z)
+					body(z);
+			});
+		}
+
+		/// Rain, then the flux through each pipe, scaled down where it would take more water than the cell holds.
+		void FluxRow(const Cells &cells, int first, int last, const Coefficients &c) const
+		{
+			int x = first;
+#if TERRAIN_SIMD_X86
+			if (kernel == Avx2)
+				x = FluxRowAvx2(cells, x, last, c);
+			else if (kernel == Sse41)
+				x = FluxRowSse41(cells, x, last, c);
+#endif
+			const float *b = cells.terrain;
+			const float *d = cells.water;
+			int stride = cells.stride;
+			for (; x < last; ++x)
+			{
+				float height = b[x] + d[x];
+				float left = cells.fluxLeft[x] + c.gravityStep * (height - (b[x - 1] + d[x - 1]));
+				float right = cells.fluxRight[x] + c.gravityStep * (height - (b[x + 1] + d[x + 1]));
+				float up = cells.fluxUp[x] + c.gravityStep * (height - (b[x - stride] + d[x - stride]));
+				float down = cells.fluxDown[x] + c.gravityStep * (height - (b[x + stride] + d[x + stride]));
+				left = left > 0.0f ? left : 0.0f;
+				right = right > 0.0f ? right : 0.0f;
+				up = up > 0.0f ? up : 0.0f;
+				down = down > 0.0f ? down : 0.0f;
+
+				float scale = (d[x] + c.rain) / (((left + right) + (up + down)) * c.timeStep);
+				scale = scale < 1.0f ? scale : 1.0f;
+				cells.fluxLeft[x] = left * scale;
+				cells.fluxRight[x] = right * scale;
+				cells.fluxUp[x] = up * scale;
+				cells.fluxDown[x] = down * scale;
+			}
+		}
+
+		/// Moves the water by the fluxes, works out its velocity, then dissolves or deposits sediment towards the
+		/// capacity, which grows with the water's speed and depth, and evaporates some of the water.
+		void WaterRow(const Cells &cells, int first, int last, const Coefficients &c) const
+		{
+			int x = first;
+#if TERRAIN_SIMD_X86
+			if (kernel == Avx2)
+				x = WaterRowAvx2(cells, x, last, c);
+			else if (kernel == Sse41)
+				x = WaterRowSse41(cells, x, last, c);
+#endif
+			const float *b = cells.terrain;
+			const float *fl = cells.fluxLeft;
+			const float *fr = cells.fluxRight;
+			const float *fu = cells.fluxUp;
+			const float *fd = cells.fluxDown;
+			int stride = cells.stride;
+			for (; x < last; ++x)
+			{
+				float rained = cells.water[x] + c.rain;
+				float inflow = (fr[x - 1] + fl[x + 1]) + (fd[x - stride] + fu[x + stride]);
+				float outflow = (fl[x] + fr[x]) + (fu[x] + fd[x]);
+				float depth = rained + c.timeStep * (inflow - outflow);
+				depth = depth > 0.0f ? depth : 0.0f;
+
+				float meanDepth = (rained + depth) * 0.5f;
+				meanDepth = meanDepth > c.minDepth ? meanDepth : c.minDepth;
+				float u = (((fr[x - 1] - fl[x]) + (fr[x] - fl[x + 1])) * 0.5f) / meanDepth;
+				float v = (((fd[x - stride] - fu[x]) + (fd[x] - fu[x + stride])) * 0.5f) / meanDepth;
+
+				float slopeX = (b[x + 1] - b[x - 1]) * 0.5f;
+				float slopeZ = (b[x + stride] - b[x - stride]) * 0.5f;
+				float slopeSquared = slopeX * slopeX + slopeZ * slopeZ;
+				float sinTilt = std::sqrt(slopeSquared / (1.0f + slopeSquared));
+				sinTilt = sinTilt > c.minTilt ? sinTilt : c.minTilt;
+
+				float capacity = (c.capacity * sinTilt) * (std::sqrt(u * u + v * v) * depth);
+				float spare = capacity - cells.sediment[x];
+				float moved = (spare > 0.0f ? c.dissolve : c.deposit) * spare;
+
+				float carried = cells.sediment[x] + moved;
+				cells.terrainOut[x] = b[x] - moved;
+				cells.sedimentOut[x] = carried;
+				cells.waterOut[x] = depth * c.keep;
+				cells.concentration[x] = carried / (rained > c.minDepth ? rained : c.minDepth);
+			}
+		}
+
+		/// Carries the sediment with the water through the same pipes, each unit of flux taking its source's
+		/// concentration. What one cell loses its neighbour gains, so no sediment is made or lost on the way.
+		void TransportRow(const Cells &cells, float *out, int first, int last, const Coefficients &c) const
+		{
+			int x = first;
+#if TERRAIN_SIMD_X86
+			if (kernel == Avx2)
+				x = TransportRowAvx2(cells, out, x, last, c);
+			else if (kernel == Sse41)
+				x = TransportRowSse41(cells, out, x, last, c);
+#endif
+			const float *k = cells.concentration;
+			const float *fl = cells.fluxLeft;
+			const float *fr = cells.fluxRight;
+			const float *fu = cells.fluxUp;
+			const float *fd = cells.fluxDown;
+			int stride = cells.stride;
+			for (; x < last; ++x)
+			{
+				float inflow = (fr[x - 1] * k[x - 1] + fl[x + 1] * k[x + 1]) + (fd[x - stride] * k[x - stride] + fu[x + stride] * k[x + stride]);
+				float outflow = ((fl[x] + fr[x]) + (fu[x] + fd[x])) * k[x];
+				float carried = cells.sedimentOut[x] + c.timeStep * (inflow - outflow);
+				out[x] = carried > 0.0f ? carried : 0.0f;
+			}
+		}
+
+		static float Slide(float difference, float talus)
+		{
+			float excess = std::fabs(difference) - talus;
+			excess = excess > 0.0f ? excess : 0.0f;
+			return difference < 0.0f ? -excess : excess;
+		}
+
+		/// Each pair of neighbours swaps the same amount of ground, so none is lost.
+		void ThermalRow(const float *b, float *out, int first, int last, int stride, const Coefficients &c) const
+		{
+			int x = first;
+#if TERRAIN_SIMD_X86
+			if (kernel == Avx2)
+				x = ThermalRowAvx2(b, out, x, last, stride, c);
+			else if (kernel == Sse41)
+				x = ThermalRowSse41(b, out, x, last, stride, c);
+#endif
+			for (; x < last; ++x)
+			{
+				float height = b[x];
+				float left = Slide(b[x - 1] - height, c.talus);
+				float right = Slide(b[x + 1] - height, c.talus);
+				float up = Slide(b[x - stride] - height, c.talus);
+				float down = Slide(b[x + stride] - height, c.talus);
+				out[x] = height + c.slide * ((left + right) + (up + down));
+			}
+		}
+
+		void HydraulicStep(ThreadPool &threadPool, const Coefficients &c)
+		{
+			int width = terrain.GetWidth() - 2;
+			int depth = terrain.GetDepth() - 2;
+			ForEachRow(threadPool, [&](int z)
+			{
+				//the edges are walls, the water and what it carries stay on the map
+				Cells cells = GetCells(z);
+				FluxRow(cells, 1, width + 1, c);
+				cells.fluxLeft[1] = 0.0f;
+				cells.fluxRight[width] = 0.0f;
+				if (z == 1)
+					std::fill(cells.fluxUp + 1, cells.fluxUp + width + 1, 0.0f);
+				if (z == depth)
+					std::fill(cells.fluxDown + 1, cells.fluxDown + width + 1, 0.0f);
+			});
+			ForEachRow(threadPool, [&](int z) { WaterRow(GetCells(z), 1, width + 1, c); });
+			ForEachRow(threadPool, [&](int z) { TransportRow(GetCells(z), sediment.GetRow(z), 1, width + 1, c); });
+
+			std::swap(terrain, terrainBack);
+			std::swap(water, waterBack);
+			ReplicateEdges(terrain);
+		}
+
+		void ThermalStep(ThreadPool &threadPool, const Coefficients &c)
+		{
+			int width = terrain.GetWidth() - 2;
+			int stride = terrain.GetStride();
+			ForEachRow(threadPool, [&](int z) { ThermalRow(terrain.GetRow(z), terrainBack.GetRow(z), 1, width + 1, stride, c); });
+
+			std::swap(terrain, terrainBack);
+			ReplicateEdges(terrain);
+		}
+
+		//false once the run should stop
+		bool Step()
+		{
+			if (!progress)
+				return true;
+			++progress->done;
+			return !progress->cancelled;
+		}
+
+	public:
+		/// When set, every iteration counts one towards progress->done, and Erode stops between iterations once
+		/// progress->cancelled is raised, returning false with the map untouched. total is the caller's to set.
+		TerrainProgress *progress = nullptr;
+
+		ErosionSimulator() : kernel(GetBestKernel())
+		{
+		}
+
+		static Kernel GetBestKernel()
+		{
+			const CpuFeatures &cpu = CpuFeatures::Get();
+			if (cpu.HasAvx2())
+				return Avx2;
+			if (cpu.HasSse41())
+				return Sse41;
+			return Scalar;
+		}
+
+		Kernel GetKernel() const { return kernel; }
+
+		/// Force a kernel, falling back to the best supported one if the CPU lacks it.
+		void SetKernel(Kernel requested)
+		{
+			const CpuFeatures &cpu = CpuFeatures::Get();
+			if ((requested == Avx2 && !cpu.HasAvx2()) || (requested == Sse41 && !cpu.HasSse41()))
+				requested = GetBestKernel();
+			kernel = requested;
+		}
+
+		/// Runs the settings' iterations over map, whose heights are drawn scaled by heightScale with samples
+		/// spacing apart. The grids are kept for the next map of the same size, about 44 bytes a sample with
+		/// hydraulic erosion and 8 with thermal erosion alone. The result does not depend on the thread count.
+		/// False, the map untouched, if the grids cannot be had, and when cancelled through progress.
+		bool Erode(Heightfield &map, const Settings &settings, float heightScale, float spacing, ThreadPool &threadPool)
+		{
+			if (!settings.IsEnabled() || heightScale <= 0.0f || spacing <= 0.0f)
+				return true;
+			TERRAIN_PROFILE_SCOPE("erosion");
+
+			int width = map.GetWidth();
+			int depth = map.GetDepth();
+			bool hydraulic = settings.hydraulicIterations > 0;
+			bool allocated = Allocate(terrain, width, depth, false) && Allocate(terrainBack, width, depth, false);
+			if (hydraulic)
+			{
+				allocated = allocated && Allocate(water, width, depth, true) && Allocate(waterBack, width, depth, true) &&
+					Allocate(sediment, width, depth, true) && Allocate(sedimentBack, width, depth, true) &&
+					Allocate(fluxLeft, width, depth, true) && Allocate(fluxRight, width, depth, true) &&
+					Allocate(fluxUp, width, depth, true) && Allocate(fluxDown, width, depth, true) &&
+					Allocate(concentration, width, depth, true);
+			}
+			if (!allocated)
+				return false;
+
+			float toCells = heightScale / spacing;
+			threadPool.ParallelFor(0, depth, threadPool.GetGrainSize(depth), [&](int firstRow, int lastRow)
+			{
+				for (int z = firstRow; z < lastRow; ++z)
+				{
+					const float *row = map.GetRow(z);
+					float *cells = terrain.GetRow(z + 1) + 1;
+					for (int x = 0; x < width; ++x)
+						cells[x] = row[x] * toCells;
+				}
+			});
+			ReplicateEdges(terrain);
+
+			float thermalRate = settings.thermalRate < 1.0f ? settings.thermalRate : 1.0f;
+			Coefficients c;
+			c.timeStep = settings.timeStep;
+			c.gravityStep = settings.timeStep * settings.gravity;
+			c.rain = settings.rainRate * settings.timeStep;
+			c.capacity = settings.sedimentCapacity;
+			c.dissolve = settings.dissolveRate;
+			c.deposit = settings.depositRate;
+			c.keep = 1.0f - settings.evaporationRate * settings.timeStep;
+			c.keep = c.keep > 0.0f ? c.keep : 0.0f;
+			c.minTilt = settings.minTilt;
+			c.minDepth = 0.001f;
+			c.talus = std::tan(settings.talusAngle * 3.14159265f / 180.0f);
+			c.slide = thermalRate * 0.25f;
+
+			for (int i = 0; i < settings.hydraulicIterations; ++i)
+			{
+				TERRAIN_PROFILE_SCOPE("erosion.hydraulic");
+				HydraulicStep(threadPool, c);
+				if (!Step())
+					return false;
+			}
+
+			//whatever the water still carries settles where it is
+			if (hydraulic)
+			{
+				ForEachRow(threadPool, [&](int z)
+				{
+					float *row = terrain.GetRow(z);
+					const float *carried = sediment.GetRow(z);
+					for (int x = 1; x <= width; ++x)
+						row[x] += carried[x];
+				});
+				ReplicateEdges(terrain);
+			}
+
+			for (int i = 0; i < settings.thermalIterations; ++i)
+			{
+				TERRAIN_PROFILE_SCOPE("erosion.thermal");
+				ThermalStep(threadPool, c);
+				if (!Step())
+					return false;
+			}
+
+			float toMap = spacing / heightScale;
+			threadPool.ParallelFor(0, depth, threadPool.GetGrainSize(depth), [&](int firstRow, int lastRow)
+			{
+				for (int z = firstRow; z < lastRow; ++z)
+				{
+					float *row = map.GetRow(z);
+					const float *cells = terrain.GetRow(z + 1) + 1;
+					for (int x = 0; x < width; ++x)
+						row[x] = cells[x] * toMap;
+				}
+			});
+			return true;
+		}
+
+		/// Water depth left on each sample by the last hydraulic run, border included, e.g. to draw rivers.
+		const Heightfield &GetWater() const { return water; }
+
+	private:
+#if TERRAIN_SIMD_X86
+		TERRAIN_TARGET_SSE41 static int FluxRowSse41(const Cells &cells, int first, int last, const Coefficients &c)
+		{
+			const float *b = cells.terrain;
+			const float *d = cells.water;
+			int stride = cells.stride;
+			__m128 gravityStep = _mm_set1_ps(c.gravityStep);
+			__m128 rain = _mm_set1_ps(c.rain);
+			__m128 timeStep = _mm_set1_ps(c.timeStep);
+			__m128 zero = _mm_setzero_ps();
+			__m128 one = _mm_set1_ps(1.0f);
+
+			int x = first;
+			for (; x + 4 <= last; x += 4)
+			{
+				__m128 water = _mm_loadu_ps(d + x);
+				__m128 height = _mm_add_ps(_mm_loadu_ps(b + x), water);
+				__m128 left = _mm_sub_ps(height, _mm_add_ps(_mm_loadu_ps(b + x - 1), _mm_loadu_ps(d + x - 1)));
+				__m128 right = _mm_sub_ps(height, _mm_add_ps(_mm_loadu_ps(b + x + 1), _mm_loadu_ps(d + x + 1)));
+				__m128 up = _mm_sub_ps(height, _mm_add_ps(_mm_loadu_ps(b + x - stride), _mm_loadu_ps(d + x - stride)));
+				__m128 down = _mm_sub_ps(height, _mm_add_ps(_mm_loadu_ps(b + x + stride), _mm_loadu_ps(d + x + stride)));
+				left = _mm_max_ps(_mm_add_ps(_mm_loadu_ps(cells.fluxLeft + x), _mm_mul_ps(gravityStep, left)), zero);
+				right = _mm_max_ps(_mm_add_ps(_mm_loadu_ps(cells.fluxRight + x), _mm_mul_ps(gravityStep, right)), zero);
+				up = _mm_max_ps(_mm_add_ps(_mm_loadu_ps(cells.fluxUp + x), _mm_mul_ps(gravityStep, up)), zero);
+				down = _mm_max_ps(_mm_add_ps(_mm_loadu_ps(cells.fluxDown + x), _mm_mul_ps(gravityStep, down)), zero);
+
+				__m128 total = _mm_add_ps(_mm_add_ps(left, right), _mm_add_ps(up, down));
+				__m128 scale = _mm_min_ps(_mm_div_ps(_mm_add_ps(water, rain), _mm_mul_ps(total, timeStep)), one);
+				_mm_storeu_ps(cells.fluxLeft + x, _mm_mul_ps(left, scale));
+				_mm_storeu_ps(cells.fluxRight + x, _mm_mul_ps(right, scale));
+				_mm_storeu_ps(cells.fluxUp + x, _mm_mul_ps(up, scale));
+				_mm_storeu_ps(cells.fluxDown + x, _mm_mul_ps(down, scale));
+			}
+			return x;
+		}
+
+		TERRAIN_TARGET_AVX2 static int FluxRowAvx2(const Cells &cells, int first, int last, const Coefficients &c)
+		{
+			const float *b = cells.terrain;
+			const float *d = cells.water;
+			int stride = cells.stride;
+			__m256 gravityStep = _mm256_set1_ps(c.gravityStep);
+			__m256 rain = _mm256_set1_ps(c.rain);
+			__m256 timeStep = _mm256_set1_ps(c.timeStep);
+			__m256 zero = _mm256_setzero_ps();
+			__m256 one = _mm256_set1_ps(1.0f);
+
+			int x = first;
+			for (; x + 8 <= last; x += 8)
+			{
+				__m256 water = _mm256_loadu_ps(d + x);
+				__m256 height = _mm256_add_ps(_mm256_loadu_ps(b + x), water);
+				__m256 left = _mm256_sub_ps(height, _mm256_add_ps(_mm256_loadu_ps(b + x - 1), _mm256_loadu_ps(d + x - 1)));
+				__m256 right = _mm256_sub_ps(height, _mm256_add_ps(_mm256_loadu_ps(b + x + 1), _mm256_loadu_ps(d + x + 1)));
+				__m256 up = _mm256_sub_ps(height, _mm256_add_ps(_mm256_loadu_ps(b + x - stride), _mm256_loadu_ps(d + x - stride)));
+				__m256 down = _mm256_sub_ps(height, _mm256_add_ps(_mm256_loadu_ps(b + x + stride), _mm256_loadu_ps(d + x + stride)));
+				left = _mm256_max_ps(_mm256_add_ps(_mm256_loadu_ps(cells.fluxLeft + x), _mm256_mul_ps(gravityStep, left)), zero);
+				right = _mm256_max_ps(_mm256_add_ps(_mm256_loadu_ps(cells.fluxRight + x), _mm256_mul_ps(gravityStep, right)), zero);
+				up = _mm256_max_ps(_mm256_add_ps(_mm256_loadu_ps(cells.fluxUp + x), _mm256_mul_ps(gravityStep, up)), zero);
+				down = _mm256_max_ps(_mm256_add_ps(_mm256_loadu_ps(cells.fluxDown + x), _mm256_mul_ps(gravityStep, down)), zero);
+
+				__m256 total = _mm256_add_ps(_mm256_add_ps(left, right), _mm256_add_ps(up, down));
+				__m256 scale = _mm256_min_ps(_mm256_div_ps(_mm256_add_ps(water, rain), _mm256_mul_ps(total, timeStep)), one);
+				_mm256_storeu_ps(cells.fluxLeft + x, _mm256_mul_ps(left, scale));
+				_mm256_storeu_ps(cells.fluxRight + x, _mm256_mul_ps(right, scale));
+				_mm256_storeu_ps(cells.fluxUp + x, _mm256_mul_ps(up, scale));
+				_mm256_storeu_ps(cells.fluxDown + x, _mm256_mul_ps(down, scale));
+			}
+			_mm256_zeroupper();
+			return x;
+		}
+
+		TERRAIN_TARGET_SSE41 static int WaterRowSse41(const Cells &cells, int first, int last, const Coefficients &c)
+		{
+			const float *b = cells.terrain;
+			const float *fl = cells.fluxLeft;
+			const float *fr = cells.fluxRight;
+			const float *fu = cells.fluxUp;
+			const float *fd = cells.fluxDown;
+			int stride = cells.stride;
+			__m128 rain = _mm_set1_ps(c.rain);
+			__m128 timeStep = _mm_set1_ps(c.timeStep);
+			__m128 minDepth = _mm_set1_ps(c.minDepth);
+			__m128 minTilt = _mm_set1_ps(c.minTilt);
+			__m128 capacityScale = _mm_set1_ps(c.capacity);
+			__m128 dissolve = _mm_set1_ps(c.dissolve);
+			__m128 deposit = _mm_set1_ps(c.deposit);
+			__m128 keep = _mm_set1_ps(c.keep);
+			__m128 zero = _mm_setzero_ps();
+			__m128 half = _mm_set1_ps(0.5f);
+			__m128 one = _mm_set1_ps(1.0f);
+
+			int x = first;
+			for (; x + 4 <= last; x += 4)
+			{
+				__m128 rained = _mm_add_ps(_mm_loadu_ps(cells.water + x), rain);
+				__m128 leftOut = _mm_loadu_ps(fl + x);
+				__m128 rightOut = _mm_loadu_ps(fr + x);
+				__m128 upOut = _mm_loadu_ps(fu + x);
+				__m128 downOut = _mm_loadu_ps(fd + x);
+				__m128 fromLeft = _mm_loadu_ps(fr + x - 1);
+				__m128 fromRight = _mm_loadu_ps(fl + x + 1);
+				__m128 fromAbove = _mm_loadu_ps(fd + x - stride);
+				__m128 fromBelow = _mm_loadu_ps(fu + x + stride);
+
+				__m128 inflow = _mm_add_ps(_mm_add_ps(fromLeft, fromRight), _mm_add_ps(fromAbove, fromBelow));
+				__m128 outflow = _mm_add_ps(_mm_add_ps(leftOut, rightOut), _mm_add_ps(upOut, downOut));
+				__m128 depth = _mm_add_ps(rained, _mm_mul_ps(timeStep, _mm_sub_ps(inflow, outflow)));
+				depth = _mm_max_ps(depth, zero);
+
+				__m128 meanDepth = _mm_max_ps(_mm_mul_ps(_mm_add_ps(rained, depth), half), minDepth);
+				__m128 u = _mm_div_ps(_mm_mul_ps(_mm_add_ps(_mm_sub_ps(fromLeft, leftOut), _mm_sub_ps(rightOut, fromRight)), half), meanDepth);
+				__m128 v = _mm_div_ps(_mm_mul_ps(_mm_add_ps(_mm_sub_ps(fromAbove, upOut), _mm_sub_ps(downOut, fromBelow)), half), meanDepth);
+
+				__m128 height = _mm_loadu_ps(b + x);
+				__m128 slopeX = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(b + x + 1), _mm_loadu_ps(b + x - 1)), half);
+				__m128 slopeZ = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(b + x + stride), _mm_loadu_ps(b + x - stride)), half);
+				__m128 slopeSquared = _mm_add_ps(_mm_mul_ps(slopeX, slopeX), _mm_mul_ps(slopeZ, slopeZ));
+				__m128 sinTilt = _mm_sqrt_ps(_mm_div_ps(slopeSquared, _mm_add_ps(one, slopeSquared)));
+				sinTilt = _mm_max_ps(sinTilt, minTilt);
+
+				__m128 speed = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(u, u), _mm_mul_ps(v, v)));
+				__m128 capacity = _mm_mul_ps(_mm_mul_ps(capacityScale, sinTilt), _mm_mul_ps(speed, depth));
+				__m128 carried = _mm_loadu_ps(cells.sediment + x);
+				__m128 spare = _mm_sub_ps(capacity, carried);
+				__m128 rate = _mm_blendv_ps(deposit, dissolve, _mm_cmpgt_ps(spare, zero));
+				__m128 moved = _mm_mul_ps(rate, spare);
+
+				carried = _mm_add_ps(carried, moved);
+				_mm_storeu_ps(cells.terrainOut + x, _mm_sub_ps(height, moved));
+				_mm_storeu_ps(cells.sedimentOut + x, carried);
+				_mm_storeu_ps(cells.waterOut + x, _mm_mul_ps(depth, keep));
+				_mm_storeu_ps(cells.concentration + x, _mm_div_ps(carried, _mm_max_ps(rained, minDepth)));
+			}
+			return x;
+		}
+
+		TERRAIN_TARGET_AVX2 static int WaterRowAvx2(const Cells &cells, int first, int last, const Coefficients &c)
+		{
+			const float *b = cells.terrain;
+			const float *fl = cells.fluxLeft;
+			const float *fr = cells.fluxRight;
+			const float *fu = cells.fluxUp;
+			const float *fd = cells.fluxDown;
+			int stride = cells.stride;
+			__m256 rain = _mm256_set1_ps(c.rain);
+			__m256 timeStep = _mm256_set1_ps(c.timeStep);
+			__m256 minDepth = _mm256_set1_ps(c.minDepth);
+			__m256 minTilt = _mm256_set1_ps(c.minTilt);
+			__m256 capacityScale = _mm256_set1_ps(c.capacity);
+			__m256 dissolve = _mm256_set1_ps(c.dissolve);
+			__m256 deposit = _mm256_set1_ps(c.deposit);
+			__m256 keep = _mm256_set1_ps(c.keep);
+			__m256 zero = _mm256_setzero_ps();
+			__m256 half = _mm256_set1_ps(0.5f);
+			__m256 one = _mm256_set1_ps(1.0f);
+
+			int x = first;
+			for (; x + 8 <= last; x += 8)
+			{
+				__m256 rained = _mm256_add_ps(_mm256_loadu_ps(cells.water + x), rain);
+				__m256 leftOut = _mm256_loadu_ps(fl + x);
+				__m256 rightOut = _mm256_loadu_ps(fr + x);
+				__m256 upOut = _mm256_loadu_ps(fu + x);
+				__m256 downOut = _mm256_loadu_ps(fd + x);
+				__m256 fromLeft = _mm256_loadu_ps(fr + x - 1);
+				__m256 fromRight = _mm256_loadu_ps(fl + x + 1);
+				__m256 fromAbove = _mm256_loadu_ps(fd + x - stride);
+				__m256 fromBelow = _mm256_loadu_ps(fu + x + stride);
+
+				__m256 inflow = _mm256_add_ps(_mm256_add_ps(fromLeft, fromRight), _mm256_add_ps(fromAbove, fromBelow));
+				__m256 outflow = _mm256_add_ps(_mm256_add_ps(leftOut, rightOut), _mm256_add_ps(upOut, downOut));
+				__m256 depth = _mm256_add_ps(rained, _mm256_mul_ps(timeStep, _mm256_sub_ps(inflow, outflow)));
+				depth = _mm256_max_ps(depth, zero);
+
+				__m256 meanDepth = _mm256_max_ps(_mm256_mul_ps(_mm256_add_ps(rained, depth), half), minDepth);
+				__m256 u = _mm256_div_ps(_mm256_mul_ps(_mm256_add_ps(_mm256_sub_ps(fromLeft, leftOut), _mm256_sub_ps(rightOut, fromRight)), half), meanDepth);
+				__m256 v = _mm256_div_ps(_mm256_mul_ps(_mm256_add_ps(_mm256_sub_ps(fromAbove, upOut), _mm256_sub_ps(downOut, fromBelow)), half), meanDepth);
+
+				__m256 height = _mm256_loadu_ps(b + x);
+				__m256 slopeX = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(b + x + 1), _mm256_loadu_ps(b + x - 1)), half);
+				__m256 slopeZ = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(b + x + stride), _mm256_loadu_ps(b + x - stride)), half);
+				__m256 slopeSquared = _mm256_add_ps(_mm256_mul_ps(slopeX, slopeX), _mm256_mul_ps(slopeZ, slopeZ));
+				__m256 sinTilt = _mm256_sqrt_ps(_mm256_div_ps(slopeSquared, _mm256_add_ps(one, slopeSquared)));
+				sinTilt = _mm256_max_ps(sinTilt, minTilt);
+
+				__m256 speed = _mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(u, u), _mm256_mul_ps(v, v)));
+				__m256 capacity = _mm256_mul_ps(_mm256_mul_ps(capacityScale, sinTilt), _mm256_mul_ps(speed, depth));
+				__m256 carried = _mm256_loadu_ps(cells.sediment + x);
+				__m256 spare = _mm256_sub_ps(capacity, carried);
+				__m256 rate = _mm256_blendv_ps(deposit, dissolve, _mm256_cmp_ps(spare, zero, _CMP_GT_OQ));
+				__m256 moved = _mm256_mul_ps(rate, spare);
+
+				carried = _mm256_add_ps(carried, moved);
+				_mm256_storeu_ps(cells.terrainOut + x, _mm256_sub_ps(height, moved));
+				_mm256_storeu_ps(cells.sedimentOut + x, carried);
+				_mm256_storeu_ps(cells.waterOut + x, _mm256_mul_ps(depth, keep));
+				_mm256_storeu_ps(cells.concentration + x, _mm256_div_ps(carried, _mm256_max_ps(rained, minDepth)));
+			}
+			_mm256_zeroupper();
+			return x;
+		}
+
+		TERRAIN_TARGET_SSE41 static int TransportRowSse41(const Cells &cells, float *out, int first, int last, const Coefficients &c)
+		{
+			const float *k = cells.concentration;
+			const float *fl = cells.fluxLeft;
+			const float *fr = cells.fluxRight;
+			const float *fu = cells.fluxUp;
+			const float *fd = cells.fluxDown;
+			int stride = cells.stride;
+			__m128 timeStep = _mm_set1_ps(c.timeStep);
+			__m128 zero = _mm_setzero_ps();
+
+			int x = first;
+			for (; x + 4 <= last; x += 4)
+			{
+				__m128 fromLeft = _mm_mul_ps(_mm_loadu_ps(fr + x - 1), _mm_loadu_ps(k + x - 1));
+				__m128 fromRight = _mm_mul_ps(_mm_loadu_ps(fl + x + 1), _mm_loadu_ps(k + x + 1));
+				__m128 fromAbove = _mm_mul_ps(_mm_loadu_ps(fd + x - stride), _mm_loadu_ps(k + x - stride));
+				__m128 fromBelow = _mm_mul_ps(_mm_loadu_ps(fu + x + stride), _mm_loadu_ps(k + x + stride));
+				__m128 inflow = _mm_add_ps(_mm_add_ps(fromLeft, fromRight), _mm_add_ps(fromAbove, fromBelow));
+				__m128 total = _mm_add_ps(_mm_add_ps(_mm_loadu_ps(fl + x), _mm_loadu_ps(fr + x)), _mm_add_ps(_mm_loadu_ps(fu + x), _mm_loadu_ps(fd + x)));
+				__m128 outflow = _mm_mul_ps(total, _mm_loadu_ps(k + x));
+				__m128 carried = _mm_add_ps(_mm_loadu_ps(cells.sedimentOut + x), _mm_mul_ps(timeStep, _mm_sub_ps(inflow, outflow)));
+				_mm_storeu_ps(out + x, _mm_max_ps(carried, zero));
+			}
+			return x;
+		}
+
+		TERRAIN_TARGET_AVX2 static int TransportRowAvx2(const Cells &cells, float *out, int first, int last, const Coefficients &c)
+		{
+			const float *k = cells.concentration;
+			const float *fl = cells.fluxLeft;
+			const float *fr = cells.fluxRight;
+			const float *fu = cells.fluxUp;
+			const float *fd = cells.fluxDown;
+			int stride = cells.stride;
+			__m256 timeStep = _mm256_set1_ps(c.timeStep);
+			__m256 zero = _mm256_setzero_ps();
+
+			int x = first;
+			for (; x + 8 <= last; x += 8)
+			{
+				__m256 fromLeft = _mm256_mul_ps(_mm256_loadu_ps(fr + x - 1), _mm256_loadu_ps(k + x - 1));
+				__m256 fromRight = _mm256_mul_ps(_mm256_loadu_ps(fl + x + 1), _mm256_loadu_ps(k + x + 1));
+				__m256 fromAbove = _mm256_mul_ps(_mm256_loadu_ps(fd + x - stride), _mm256_loadu_ps(k + x - stride));
+				__m256 fromBelow = _mm256_mul_ps(_mm256_loadu_ps(fu + x + stride), _mm256_loadu_ps(k + x + stride));
+				__m256 inflow = _mm256_add_ps(_mm256_add_ps(fromLeft, fromRight), _mm256_add_ps(fromAbove, fromBelow));
+				__m256 total = _mm256_add_ps(_mm256_add_ps(_mm256_loadu_ps(fl + x), _mm256_loadu_ps(fr + x)), _mm256_add_ps(_mm256_loadu_ps(fu + x), _mm256_loadu_ps(fd + x)));
+				__m256 outflow = _mm256_mul_ps(total, _mm256_loadu_ps(k + x));
+				__m256 carried = _mm256_add_ps(_mm256_loadu_ps(cells.sedimentOut + x), _mm256_mul_ps(timeStep, _mm256_sub_ps(inflow, outflow)));
+				_mm256_storeu_ps(out + x, _mm256_max_ps(carried, zero));
+			}
+			_mm256_zeroupper();
+			return x;
+		}
+
+		TERRAIN_TARGET_SSE41 static __m128 SlideSse41(__m128 difference, __m128 talus)
+		{
+			__m128 sign = _mm_set1_ps(-0.0f);
+			__m128 excess = _mm_max_ps(_mm_sub_ps(_mm_andnot_ps(sign, difference), talus), _mm_setzero_ps());
+			return _mm_or_ps(excess, _mm_and_ps(difference, sign));
+		}
+
+		TERRAIN_TARGET_SSE41 static int ThermalRowSse41(const float *b, float *out, int first, int last, int stride, const Coefficients &c)
+		{
+			__m128 talus = _mm_set1_ps(c.talus);
+			__m128 slide = _mm_set1_ps(c.slide);
+
+			int x = first;
+			for (; x + 4 <= last; x += 4)
+			{
+				__m128 height = _mm_loadu_ps(b + x);
+				__m128 left = SlideSse41(_mm_sub_ps(_mm_loadu_ps(b + x - 1), height), talus);
+				__m128 right = SlideSse41(_mm_sub_ps(_mm_loadu_ps(b + x + 1), height), talus);
+				__m128 up = SlideSse41(_mm_sub_ps(_mm_loadu_ps(b + x - stride), height), talus);
+				__m128 down = SlideSse41(_mm_sub_ps(_mm_loadu_ps(b + x + stride), height), talus);
+				__m128 total = _mm_add_ps(_mm_add_ps(left, right), _mm_add_ps(up, down));
+				_mm_storeu_ps(out + x, _mm_add_ps(height, _mm_mul_ps(slide, total)));
+			}
+			return x;
+		}
+
+		TERRAIN_TARGET_AVX2 static __m256 SlideAvx2(__m256 difference, __m256 talus)
+		{
+			__m256 sign = _mm256_set1_ps(-0.0f);
+			__m256 excess = _mm256_max_ps(_mm256_sub_ps(_mm256_andnot_ps(sign, difference), talus), _mm256_setzero_ps());
+			return _mm256_or_ps(excess, _mm256_and_ps(difference, sign));
+		}
+
+		TERRAIN_TARGET_AVX2 static int ThermalRowAvx2(const float *b, float *out, int first, int last, int stride, const Coefficients &c)
+		{
+			__m256 talus = _mm256_set1_ps(c.talus);
+			__m256 slide = _mm256_set1_ps(c.slide);
+
+			int x = first;
+			for (; x + 8 <= last; x += 8)
+			{
+				__m256 height = _mm256_loadu_ps(b + x);
+				__m256 left = SlideAvx2(_mm256_sub_ps(_mm256_loadu_ps(b + x - 1), height), talus);
+				__m256 right = SlideAvx2(_mm256_sub_ps(_mm256_loadu_ps(b + x + 1), height), talus);
+				__m256 up = SlideAvx2(_mm256_sub_ps(_mm256_loadu_ps(b + x - stride), height), talus);
+				__m256 down = SlideAvx2(_mm256_sub_ps(_mm256_loadu_ps(b + x + stride), height), talus);
+				__m256 total = _mm256_add_ps(_mm256_add_ps(left, right), _mm256_add_ps(up, down));
+				_mm256_storeu_ps(out + x, _mm256_add_ps(height, _mm256_mul_ps(slide, total)));
+			}
+			_mm256_zeroupper();
+			return x;
+		}
+#endif
+	};
+}
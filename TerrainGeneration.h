@@ -1,4 +1,5 @@
 #include "CustomTerrain.h"
+#include "TerrainChunks.h"
 
 namespace Terrain
 {
@@ -8,14 +9,74 @@ namespace Terrain
 		// scene for drawing box
 		octet::ref<octet::visual_scene> app_scene;
 		CustomTerrain* terrain;
+		octet::scene_node *terrainNode;
 		octet::camera_instance *camera; /// main camera instance 
 
 		octet::mouse_look mouseLookHelper;
 		CustomTerrain::Algorithm genAlgorithm = CustomTerrain::Algorithm::MidpointDisplacement;
+
+		//--stream replaces the single terrain with tiles streamed around the camera
+		bool streamTerrain = false;
+		TerrainChunkManager *chunks = nullptr;
+
+		//--compact draws the terrain with eight byte vertices, the streamed tiles keep the float layout
+		bool compactVertices = false;
+
+		//--tiled generates noise maps with the fused tile by tile pipeline
+		bool tiledPipeline = false;
+
+		//--sync regenerates on the render thread, freezing until the map is done, instead of in the background
+		bool syncGenerate = false;
+		int generateQuarterShown = -1;
+
+		//--tile-store <file> shows the first tile of a store written by HeightmapTool
+		const char *tileStorePath = nullptr;
+
+		//--texture-pack <file> loads the texture layers from a pack, written there the first time they are decoded
+		const char *texturePackPath = CustomTerrain::GetDefaultTexturePackPath();
+
+		//--snapshot <file> shows a compressed map saved with V, or written by HeightmapTool -f thc
+		const char *snapshotPath = nullptr;
+
+		//vertical, in degrees, turns the LOD's geometric error into pixels
+		float lodFieldOfView = 45.0f;
+
+#if OCTET_BULLET
+		//the terrain's static body, or each streamed tile's, for anything dropped on them
+		TerrainPhysicsWorld physics;
+#endif
+
 	public:
 		/// this is called when we construct the class before everything is initialised.
 		TerrainGeneration(int argc, char **argv) : app(argc, argv)
 		{
+			for (int i = 1; i < argc; ++i)
+			{
+				if (strcmp(argv[i], "--stream") == 0)
+					streamTerrain = true;
+				else if (strcmp(argv[i], "--compact") == 0)
+					compactVertices = true;
+				else if (strcmp(argv[i], "--tiled") == 0)
+					tiledPipeline = true;
+				else if (strcmp(argv[i], "--sync") == 0)
+					syncGenerate = true;
+				else if (strcmp(argv[i], "--tile-store") == 0 && i + 1 < argc)
+					tileStorePath = argv[++i];
+				else if (strcmp(argv[i], "--texture-pack") == 0 && i + 1 < argc)
+					texturePackPath = argv[++i];
+				else if (strcmp(argv[i], "--snapshot") == 0 && i + 1 < argc)
+					snapshotPath = argv[++i];
+			}
+		}
+
+		~TerrainGeneration()
+		{
+			//the bodies leave the world before it goes
+			delete chunks;
+#if OCTET_BULLET
+			if (terrain)
+				terrain->SetPhysicsWorld(nullptr, octet::vec3(0.0f, 0.0f, 0.0f));
+#endif
 		}
 
 		/// this is called once OpenGL is initialized
@@ -41,17 +102,75 @@ namespace Terrain
 			camera->get_node()->rotate(-35, octet::vec3(1, 0, 0));
 			camera->get_node()->translate(octet::vec3(size.x(), -size.z(), 400.0f));
 			
-			terrain = new CustomTerrain(size, dimensions, genAlgorithm);
+			//the chunks share the terrain's material, so its shader has to take their float vertices
+			terrain = new CustomTerrain(size, dimensions, genAlgorithm, compactVertices && !streamTerrain, texturePackPath);
+			terrain->useTiledPipeline = tiledPipeline;
+			//a chunk's model positions are its own, not the map's, so chunks use the shader's height bands instead
+			terrain->useSplatMap = !streamTerrain;
+			terrain->uploadSplat();
+
+			if (tileStorePath && !(terrain->OpenTileStore(tileStorePath) && terrain->LoadTile(0, 0)))
+				printf("Could not load a tile from %s\n", tileStorePath);
+			if (snapshotPath && !streamTerrain)
+			{
+				if (terrain->LoadSnapshot(snapshotPath))
+					genAlgorithm = terrain->algorithmType;
+				else
+					printf("Could not load a snapshot from %s\n", snapshotPath);
+			}
 
 			app_scene->add_child(node);
-			app_scene->add_mesh_instance(new octet::mesh_instance(node, terrain, terrain->GetMaterial()));
+			terrainNode = node;
+
+			if (streamTerrain)
+			{
+				chunks = new TerrainChunkManager(app_scene, terrain->GetMaterial(), terrain->GetGenerator(), 64, terrain->GetSampleSpacing());
+				chunks->heightScale = terrain->heightScale;
+#if OCTET_BULLET
+				chunks->SetPhysicsWorld(physics.Get());
+#endif
+				Generate(genAlgorithm);
+			}
+			else
+			{
+				app_scene->add_mesh_instance(new octet::mesh_instance(node, terrain, terrain->GetMaterial()));
+#if OCTET_BULLET
+				octet::vec4 origin = node->access_nodeToParent().w();
+				terrain->SetPhysicsWorld(physics.Get(), octet::vec3(origin.x(), origin.y(), origin.z()));
+#endif
+			}
 		}
 
 
 		void Generate(CustomTerrain::Algorithm algorithm)
 		{
+			//tiles can only be cut from world continuous algorithms
+			if (chunks && !TerrainGenerator::IsWorldContinuous(algorithm))
+				algorithm = CustomTerrain::Algorithm::FractionalBrownianMotion;
+
+			//fresh terrain on every request, the seed is printed so a map can be reproduced
+			terrain->SetSeed(terrain->GetSeed() + 1);
+			printf("Seed:%u\n", terrain->GetSeed());
+
 			terrain->algorithmType = algorithm;
-			terrain->generate();
+			Regenerate();
+
+			TerrainGenerator::OctavePlan plan = terrain->GetGenerator().GetOctavePlan(algorithm);
+			if (plan.skipped > 0)
+				printf("%u octaves, %u past the sampling limit skipped\n", plan.count, plan.skipped);
+
+			//the tiles share the terrain's material, so its height range keeps their colouring in line with it
+			if (chunks)
+				chunks->SetAlgorithm(algorithm);
+		}
+
+		/// Regenerates the terrain with its current settings, in the background unless --sync was given.
+		void Regenerate()
+		{
+			if (syncGenerate)
+				terrain->generate();
+			else
+				terrain->generateAsync();
 		}
 
 		/// this is called to draw the world
@@ -78,6 +197,43 @@ namespace Terrain
 			octet::scene_node *camera_node = camera->get_node();
 			octet::mat4t &camera_to_world = camera_node->access_nodeToParent();
 			mouseLookHelper.update(camera_to_world);
+
+			//a finished background map is swapped in between frames, one still running is only polled
+			if (terrain->applyGenerated())
+			{
+				generateQuarterShown = -1;
+			}
+			else if (terrain->IsGenerating())
+			{
+				int quarter = (int)(terrain->GetGenerateProgress() * 4.0f);
+				if (quarter != generateQuarterShown)
+					printf("Generating %d%%\n", quarter * 25);
+				generateQuarterShown = quarter;
+			}
+
+			if (terrain->useLod)
+			{
+				int vx = 0, vy = 0;
+				get_viewport_size(vx, vy);
+				float pixelsPerRadian = vy / (2.0f * tanf(lodFieldOfView * 0.5f * 3.14159265f / 180.0f));
+
+				//the terrain node is only translated, so its local space is the world shifted by its position
+				octet::vec4 eye = camera_to_world.w();
+				octet::vec4 origin = terrainNode->access_nodeToParent().w();
+				terrain->UpdateLod(octet::vec3(eye.x() - origin.x(), eye.y() - origin.y(), eye.z() - origin.z()), pixelsPerRadian);
+			}
+
+			//generate what the camera is about to see, a few tiles per frame
+			if (chunks)
+			{
+				octet::vec4 position = camera_to_world.w();
+				chunks->Update(position.x(), position.z());
+			}
+
+#if OCTET_BULLET
+			//at the rate the scene is updated
+			physics.Step(1.0f / 30);
+#endif
 		}
 
 		void HandleKeyboardControl()
@@ -106,6 +262,96 @@ namespace Terrain
 				terrain->usePerlinRandom = !terrain->usePerlinRandom;
 			}
 
+			if (is_key_going_down('G'))
+			{
+				terrain->useLod = !terrain->useLod;
+				printf("LOD %s\n", terrain->useLod ? "on" : "off");
+				Regenerate();
+			}
+
+			//analytic against differenced normals, for comparing the two on the same map
+			if (is_key_going_down('N'))
+			{
+				terrain->useAnalyticNormals = !terrain->useAnalyticNormals;
+				printf("Analytic normals %s\n", terrain->useAnalyticNormals ? "on" : "off");
+				Regenerate();
+			}
+
+			//erodes every map from here on, or stops eroding them
+			if (is_key_going_down('H'))
+			{
+				bool erode = !terrain->erosion.IsEnabled();
+				terrain->erosion.hydraulicIterations = erode ? 100 : 0;
+				terrain->erosion.thermalIterations = erode ? 20 : 0;
+				printf("Erosion %s\n", erode ? "on" : "off");
+				Regenerate();
+			}
+
+			//switches the multifractal between ridged and hybrid, each with the offset and H that suit it
+			if (is_key_going_down('M'))
+			{
+				TerrainGenerator &generator = terrain->GetGenerator();
+				bool hybrid = generator.multiFractalType == TerrainGenerator::RidgedMultiFractal;
+				generator.multiFractalType = hybrid ? TerrainGenerator::HybridMultiFractal : TerrainGenerator::RidgedMultiFractal;
+				generator.multiFractalOffset = hybrid ? 0.7f : 1.0f;
+				generator.multiFractalH = hybrid ? 0.25f : 1.0f;
+				printf("%s multifractal\n", hybrid ? "Hybrid" : "Ridged");
+
+				if (genAlgorithm == CustomTerrain::Algorithm::MultiFractal)
+					Generate(genAlgorithm);
+			}
+
+			//back through the maps shown before, each kept compressed, and saving the one on show
+			if (is_key_going_down('B') && !chunks)
+			{
+				if (terrain->ShowPrevious())
+				{
+					genAlgorithm = terrain->algorithmType;
+					printf("Seed:%u\n", terrain->GetSeed());
+				}
+				else
+				{
+					printf("No earlier map to go back to\n");
+				}
+			}
+
+			//where the camera is looking meets the ground, through the terrain's query quadtree
+			if (is_key_going_down('T') && !chunks)
+			{
+				octet::mat4t &camera_to_world = camera->get_node()->access_nodeToParent();
+				octet::vec4 eye = camera_to_world.w();
+				octet::vec4 forward = camera_to_world.z();
+				octet::vec4 origin = terrainNode->access_nodeToParent().w();
+
+				//out to the far plane, the camera looks down its -z
+				HeightfieldQuery::RayHit hit;
+				octet::vec3 start(eye.x() - origin.x(), eye.y() - origin.y(), eye.z() - origin.z());
+				if (terrain->Raycast(start, octet::vec3(-forward.x(), -forward.y(), -forward.z()), 1000.0f, hit))
+					printf("Looking at (%.1f, %.1f, %.1f), %.1f away\n", hit.position[0], hit.position[1], hit.position[2], hit.distance);
+				else
+					printf("Not looking at the ground\n");
+			}
+
+			if (is_key_going_down('V') && !chunks)
+			{
+				if (terrain->SaveSnapshot("terrain_snapshot.thc"))
+					printf("Wrote terrain_snapshot.thc\n");
+				else
+					printf("Could not write terrain_snapshot.thc\n");
+			}
+
+#if TERRAIN_PROFILING
+			//prints the time and allocations of every stage so far and dumps them for chrome://tracing, then starts over
+			if (is_key_going_down('P'))
+			{
+				Profiler &profiler = Profiler::Get();
+				profiler.Print(stdout);
+				if (profiler.WriteJson("terrain_profile.json") && profiler.WriteChromeTrace("terrain_trace.json"))
+					printf("Wrote terrain_profile.json and terrain_trace.json\n");
+				profiler.Reset();
+			}
+#endif
+
 			for (int i = 0; i <= CustomTerrain::Algorithm::MultiFractal; i++)
 			{
 				if (is_key_going_down(49 + i))
@@ -0,0 +1,803 @@
+#pragma once
+#include "PerlinNoiseGenerator.h"
+#include "MultiFractal.h"
+#include "Heightfield.h"
+#include "HashRandom.h"
+#include "ThreadPool.h"
+
+#include <cassert>
+#include <cmath>
+#include <unordered_map>
+#include <vector>
+
+namespace Terrain
+{
+	/// The height generation algorithms, free of any rendering code so they can run headless.
+	/// Fills a (cellsX + 1) x (cellsZ + 1) heightfield with unscaled heights.
+	class TerrainGenerator
+	{
+		typedef void (TerrainGenerator::*pMemberFunc_t)(Heightfield &map);
+
+	public:
+		enum Algorithm
+		{
+			MidpointDisplacement,
+			DiamondSquare,
+			PerlinNoise,
+			FractionalBrownianMotion,
+			MultiFractal
+		};
+
+		enum MultiFractalType
+		{
+			RidgedMultiFractal,
+			HybridMultiFractal
+		};
+
+		/// The octaves a fractal algorithm evaluates at the current resolution.
+		struct OctavePlan
+		{
+			unsigned count;
+			unsigned skipped; //requested octaves above maxOctaveFrequency, which are not evaluated
+			float lastWeight; //scales the last evaluated octave, below one while it fades out
+		};
+
+	private:
+		//the strips of a tile's ghosts, one sample along the edge per entry
+		enum GhostSide
+		{
+			GhostLeft,
+			GhostRight,
+			GhostTop,
+			GhostBottom
+		};
+
+		//the mean of the neighbours a sample has, added up in a fixed order so that tiles sharing a sample
+		//both come to the same float
+		struct NeighbourSum
+		{
+			float sum = 0.0f;
+			int count = 0;
+
+			void Add(float value)
+			{
+				sum += value;
+				++count;
+			}
+
+			float GetMean() const { return sum / (float)count; }
+		};
+
+		HashRandom random;
+		PerlinNoiseGenerator noise;
+		ThreadPool threadPool;
+
+		int cellsX;
+		int cellsZ;
+
+		//world sample coordinate of map(0, 0), only the noise based algorithms take it into account
+		int regionX = 0;
+		int regionZ = 0;
+
+		std::unordered_map<Algorithm, pMemberFunc_t> algorithmToFunction;
+
+		//GenerateDiamondSquareTiles' ghost strips, four per tile
+		std::vector<float> ghosts;
+
+	public:
+
+		bool usePerlinRandom = false;
+
+		//spacing of the random corners diamond-square refines between, a power of two. Zero takes the largest that
+		//fits the map, GenerateDiamondSquareTiles always uses the tile size
+		int diamondSquareRootCells = 0;
+
+		//fractional brownian motion parameters
+		unsigned octaves = 16;
+		float gain = 0.65f;
+		float lacunarity = 2.0f;
+
+		//multifractal parameters, after Musgrave. The defaults suit the ridged variant, hybrid looks best
+		//with an offset around 0.7 and H around 0.25
+		MultiFractalType multiFractalType = RidgedMultiFractal;
+		unsigned multiFractalOctaves = 8;
+		float multiFractalLacunarity = 2.0f;
+		float multiFractalGain = 2.0f; //ridged only, how strongly a ridge weights the octaves above it
+		float multiFractalOffset = 1.0f;
+		float multiFractalH = 1.0f; //amplitude falls by lacunarity^-H an octave
+
+		//a sample stops taking octaves once its weight falls below this, octaves are skipped when every sample has
+		float multiFractalThreshold = 0.001f;
+
+		//octaves finer than this many noise lattice cells a sample alias instead of adding detail and are not
+		//evaluated, 0.5 keeps two samples across a cell. Zero or less evaluates every octave
+		float maxOctaveFrequency = 0.5f;
+
+		//fades the last evaluated octave out as its frequency nears maxOctaveFrequency, so detail comes and goes
+		//smoothly as the resolution changes instead of a whole octave at a time
+		bool fadeLastOctave = false;
+
+		TerrainGenerator(int cellsX, int cellsZ, int workerCount = ThreadPool::DefaultWorkerCount()) :
+			threadPool(workerCount),
+			cellsX(cellsX),
+			cellsZ(cellsZ)
+		{
+			InitialiseAlgorithmDispatchMap();
+		}
+
+		/// Takes the dimensions, seed and algorithm parameters of another generator, everything that decides the
+		/// map but not the threads it is made with. Two generators with the same settings make the same maps.
+		void CopySettings(const TerrainGenerator &source)
+		{
+			cellsX = source.cellsX;
+			cellsZ = source.cellsZ;
+			random.SetSeed(source.random.GetSeed());
+
+			usePerlinRandom = source.usePerlinRandom;
+			diamondSquareRootCells = source.diamondSquareRootCells;
+			octaves = source.octaves;
+			gain = source.gain;
+			lacunarity = source.lacunarity;
+			multiFractalType = source.multiFractalType;
+			multiFractalOctaves = source.multiFractalOctaves;
+			multiFractalLacunarity = source.multiFractalLacunarity;
+			multiFractalGain = source.multiFractalGain;
+			multiFractalOffset = source.multiFractalOffset;
+			multiFractalH = source.multiFractalH;
+			multiFractalThreshold = source.multiFractalThreshold;
+			maxOctaveFrequency = source.maxOctaveFrequency;
+			fadeLastOctave = source.fadeLastOctave;
+		}
+
+		void InitialiseAlgorithmDispatchMap()
+		{
+			algorithmToFunction[Algorithm::MidpointDisplacement] = &TerrainGenerator::MidpointDisplacementAlgorithm;
+			algorithmToFunction[Algorithm::DiamondSquare] = &TerrainGenerator::DiamondSquareAlgorithm;
+			algorithmToFunction[Algorithm::PerlinNoise] = &TerrainGenerator::PerlinNoiseAlgorithm;
+			algorithmToFunction[Algorithm::FractionalBrownianMotion] = &TerrainGenerator::FractionalBrownianMotionAlgorithm;
+			algorithmToFunction[Algorithm::MultiFractal] = &TerrainGenerator::MultiFractalAlgorithm;
+		}
+
+		int GetCellsX() const { return cellsX; }
+		int GetCellsZ() const { return cellsZ; }
+
+		void SetDimensions(int newCellsX, int newCellsZ)
+		{
+			cellsX = newCellsX;
+			cellsZ = newCellsZ;
+		}
+
+		/// Seeds every generator, the same seed always produces the same map.
+		unsigned GetSeed() const { return random.GetSeed(); }
+		void SetSeed(unsigned seed) { random.SetSeed(seed); }
+
+		/// Worker threads used by the generators, on top of the calling thread. Output does not depend on it.
+		int GetWorkerCount() const { return threadPool.GetWorkerCount(); }
+		void SetWorkerCount(int workerCount) { threadPool.SetWorkerCount(workerCount); }
+
+		ThreadPool &GetThreadPool() { return threadPool; }
+
+		/// False, the map left as it was, if it could not be sized for the generator's cells.
+		bool Generate(Algorithm algorithm, Heightfield &map)
+		{
+			TERRAIN_PROFILE_SCOPE("algorithm");
+			if (!map.Resize(cellsX + 1, cellsZ + 1))
+				return false;
+			map.Fill(0.0f);
+
+			//restart the permutation sequence so the noise based algorithms follow the seed too
+			noise.SetSeed(random.GetSeed());
+
+			//dispatch to correct algorithm
+			regionX = 0;
+			regionZ = 0;
+			pMemberFunc_t algFunc = algorithmToFunction[algorithm];
+			(this->*algFunc)(map);
+			return true;
+		}
+
+		/// True for algorithms that are a function of world position, so separately generated regions line up.
+		static bool IsWorldContinuous(Algorithm algorithm)
+		{
+			return algorithm == PerlinNoise || algorithm == FractionalBrownianMotion || algorithm == MultiFractal;
+		}
+
+		/// True for algorithms GenerateRow can also give the exact slope of, see the overload below.
+		static bool HasAnalyticSlope(Algorithm algorithm)
+		{
+			return algorithm == PerlinNoise || algorithm == FractionalBrownianMotion;
+		}
+
+		/// The octaves the fBm or multifractal algorithm evaluates for a cellsX wide map, see maxOctaveFrequency.
+		/// The plan depends on nothing but the resolution, so every region and tile of a map shares it.
+		OctavePlan GetOctavePlan(Algorithm algorithm) const
+		{
+			if (algorithm == FractionalBrownianMotion)
+				return PlanOctaves(octaves, GetFbmBaseFrequency(), lacunarity);
+			if (algorithm == MultiFractal)
+				return PlanOctaves(multiFractalOctaves, GetMultiFractalBaseFrequency(), multiFractalLacunarity);
+
+			OctavePlan plan = { 0, 0, 1.0f };
+			return plan;
+		}
+
+		/// Fills map with width x depth samples starting at world sample (originX, originZ), at the same
+		/// feature scale Generate uses for a cellsX x cellsZ map. Regions that share an edge share its
+		/// samples exactly, which is what lets the terrain be streamed as an unbounded grid of tiles.
+		/// Only valid for world continuous algorithms. False, the map left as it was, if it could not be sized.
+		bool GenerateRegion(Algorithm algorithm, int originX, int originZ, int width, int depth, Heightfield &map)
+		{
+			assert(IsWorldContinuous(algorithm));
+			TERRAIN_PROFILE_SCOPE("algorithm.region");
+
+			if (!map.Resize(width, depth))
+				return false;
+			noise.SetSeed(random.GetSeed());
+
+			regionX = originX;
+			regionZ = originZ;
+			pMemberFunc_t algFunc = algorithmToFunction[algorithm];
+			(this->*algFunc)(map);
+			return true;
+		}
+
+		/// Prepares the noise for GenerateRow the way Generate would, after which rows may be generated on any thread.
+		/// For callers that split the map up themselves, e.g. TerrainPipeline. Only valid for world continuous algorithms.
+		void BeginRows(Algorithm algorithm)
+		{
+			assert(IsWorldContinuous(algorithm));
+
+			noise.SetSeed(random.GetSeed());
+			noise.RandomisePermutations();
+		}
+
+		/// Writes width samples of world row worldZ starting at worldX, the same values Generate and GenerateRegion give.
+		void GenerateRow(Algorithm algorithm, int worldX, int worldZ, int width, float *row) const
+		{
+			if (algorithm == PerlinNoise)
+				PerlinNoiseRow(worldX, worldZ, width, row);
+			else if (algorithm == MultiFractal)
+				MultiFractalRow(worldX, worldZ, width, row);
+			else
+				FractionalBrownianMotionRow(worldX, worldZ, width, row);
+		}
+
+		/// GenerateRow that also writes the analytic slope of the heights per sample step, along the row to slopeX
+		/// and across rows to slopeZ. The heights are the same floats. Only valid where HasAnalyticSlope.
+		void GenerateRow(Algorithm algorithm, int worldX, int worldZ, int width, float *row, float *slopeX, float *slopeZ) const
+		{
+			assert(HasAnalyticSlope(algorithm));
+
+			if (algorithm == PerlinNoise)
+				PerlinNoiseRow(worldX, worldZ, width, row, slopeX, slopeZ);
+			else
+				FractionalBrownianMotionRow(worldX, worldZ, width, row, slopeX, slopeZ);
+		}
+
+		/// Spacing of the random corners midpoint displacement refines between, the largest power of two both sides fit.
+		int GetMidpointRootCells() const
+		{
+			int shorter = cellsX < cellsZ ? cellsX : cellsZ;
+			int rootCells = 1;
+			while (rootCells * 2 <= shorter)
+				rootCells *= 2;
+			return rootCells;
+		}
+
+		/// Midpoint displacement on a grid of any size. Corners are seeded every GetMidpointRootCells() samples and,
+		/// as in DiamondSquareAlgorithm, samples past the edge of the map are left out of the averages.
+		void MidpointDisplacementAlgorithm(Heightfield &map)
+		{
+			int gridSize = GetMidpointRootCells();
+			int offset = gridSize / 2;//offset is the width of the square we're working on
+			float rangeModifier = 0.7f; //modifier on the range to smooth
+			float randomScale = 1.0f;
+
+			if (usePerlinRandom)
+				noise.RandomisePermutations();
+
+			//set the four corners
+			for (int i = 0; i < cellsZ + 1; i += gridSize)
+			{
+				for (int j = 0; j < cellsX + 1; j += gridSize)
+				{
+					map(j, i) = random.Get(j, i, gridSize, -1.0f, 1.0f);//GetRandom(i,j);
+				}
+			}
+
+			while (offset > 0)
+			{
+				TERRAIN_PROFILE_SCOPE_DETAIL("midpoint.level", offset);
+
+				//every point set at this level only reads points from earlier levels, so the rows can run in parallel
+				int rows = cellsZ / offset + 1;
+				threadPool.ParallelFor(0, rows, threadPool.GetGrainSize(rows), [&](int firstRow, int lastRow)
+				{
+					for (int row = firstRow; row < lastRow; row++)
+					{
+						int y = row * offset;
+						bool isOddY = (row & 1) != 0; //these are used to tell if we're working with a side or center
+						bool isOddX = false;
+
+						for (int x = 0; x < cellsX + 1; x += offset, isOddX = !isOddX)
+						{
+							if (isOddX || isOddY)
+							{
+								float height = 0.0f;
+
+								//neighbours before this one are always on the map, the ones after it may not be
+								bool hasRight = x + offset <= cellsX;
+								bool hasBelow = y + offset <= cellsZ;
+								NeighbourSum neighbours;
+
+								// center
+								if (isOddX && isOddY)
+								{
+									//average the four corners plus a small random amount (error)
+									neighbours.Add(map(x - offset, y - offset));
+									if (hasRight)
+										neighbours.Add(map(x + offset, y - offset));
+									if (hasBelow)
+										neighbours.Add(map(x - offset, y + offset));
+									if (hasRight && hasBelow)
+										neighbours.Add(map(x + offset, y + offset));
+								}
+								else
+								{
+									//side 
+									if (isOddX)
+									{
+										//average horizontal sides corners plus small random amount (error)
+										neighbours.Add(map(x - offset, y));
+										if (hasRight)
+											neighbours.Add(map(x + offset, y));
+									}
+									else
+									{
+										//average this vertical side corners plus small random amount (error)
+										neighbours.Add(map(x, y - offset));
+										if (hasBelow)
+											neighbours.Add(map(x, y + offset));
+									}
+								}
+								height = neighbours.GetMean() + GetRandom(x, y, offset) * randomScale;
+
+								//set the value
+								map(x, y) = height;
+							}
+						}
+					}
+				});
+
+				//adjust the range and offset
+				randomScale *= rangeModifier;
+				offset /= 2;
+			}
+		}
+
+		/// Spacing of the random corners diamond-square refines between, diamondSquareRootCells rounded down to a
+		/// power of two and to what fits the map. Zero takes the largest power of two both sides fit.
+		int GetDiamondSquareRootCells() const
+		{
+			int shorter = cellsX < cellsZ ? cellsX : cellsZ;
+			int limit = diamondSquareRootCells > 0 && diamondSquareRootCells < shorter ? diamondSquareRootCells : shorter;
+			int rootCells = 1;
+			while (rootCells * 2 <= limit)
+				rootCells *= 2;
+			return rootCells;
+		}
+
+		/// Diamond-square straight into map, on a grid of any size. Corners are seeded every GetDiamondSquareRootCells()
+		/// samples and refined between, and samples past the edge of the map are left out of the averages rather
+		/// than wrapped round, so rectangular maps come out without seams or repeats.
+		void DiamondSquareAlgorithm(Heightfield &map)
+		{
+			int rootCells = GetDiamondSquareRootCells();
+
+			if (usePerlinRandom)
+				noise.RandomisePermutations();
+
+			for (int z = 0; z <= cellsZ; z += rootCells)
+			{
+				float *row = map.GetRow(z);
+				for (int x = 0; x <= cellsX; x += rootCells)
+					row[x] = GetRandom(x, z, rootCells);
+			}
+
+			for (int stepSize = rootCells; stepSize > 1; stepSize /= 2)
+				DiamondSquareCore(stepSize, (float)stepSize / (float)rootCells, map);
+		}
+
+		void DiamondSquareCore(int stepSize, float scale, Heightfield &map)
+		{
+			TERRAIN_PROFILE_SCOPE_DETAIL("diamondSquare.level", stepSize);
+			int halfStep = stepSize / 2;
+
+			//squares only read corners from earlier levels while diamonds only read those corners and this level's
+			//squares, so both steps can be split into parallel bands of rows
+			int squareRows = (cellsZ - halfStep) / stepSize + 1;
+			threadPool.ParallelFor(0, squareRows, threadPool.GetGrainSize(squareRows), [&](int firstRow, int lastRow)
+			{
+				for (int row = firstRow; row < lastRow; ++row)
+				{
+					int z = halfStep + row * stepSize;
+					const float *above = map.GetRow(z - halfStep);
+					const float *below = z + halfStep <= cellsZ ? map.GetRow(z + halfStep) : nullptr;
+					float *centres = map.GetRow(z);
+					for (int x = halfStep; x <= cellsX; x += stepSize)
+					{
+						bool hasRight = x + halfStep <= cellsX;
+						NeighbourSum corners;
+						corners.Add(above[x - halfStep]);
+						if (hasRight)
+							corners.Add(above[x + halfStep]);
+						if (below)
+						{
+							corners.Add(below[x - halfStep]);
+							if (hasRight)
+								corners.Add(below[x + halfStep]);
+						}
+						centres[x] = corners.GetMean() + GetRandom(x, z, stepSize) * scale;
+					}
+				}
+			});
+
+			//rows half a step apart, alternating between the diamonds between corners and the ones between squares
+			int diamondRows = cellsZ / halfStep + 1;
+			threadPool.ParallelFor(0, diamondRows, threadPool.GetGrainSize(diamondRows), [&](int firstRow, int lastRow)
+			{
+				for (int row = firstRow; row < lastRow; ++row)
+				{
+					int z = row * halfStep;
+					const float *above = z >= halfStep ? map.GetRow(z - halfStep) : nullptr;
+					const float *below = z + halfStep <= cellsZ ? map.GetRow(z + halfStep) : nullptr;
+					float *diamonds = map.GetRow(z);
+					for (int x = (row & 1) ? 0 : halfStep; x <= cellsX; x += stepSize)
+					{
+						NeighbourSum sides;
+						if (x >= halfStep)
+							sides.Add(diamonds[x - halfStep]);
+						if (x + halfStep <= cellsX)
+							sides.Add(diamonds[x + halfStep]);
+						if (above)
+							sides.Add(above[x]);
+						if (below)
+							sides.Add(below[x]);
+						diamonds[x] = sides.GetMean() + GetRandom(x, z, stepSize) * scale;
+					}
+				}
+			});
+		}
+
+		/// Diamond-square over a world of (cellsX / tileCells) x (cellsZ / tileCells) tiles, each written straight into
+		/// its own heightfield of (tileCells + 1)^2 samples, tiles[tileZ * tilesX + tileX], so a world too big for one
+		/// allocation can still be made in one go. The tiles run in parallel a level at a time. Between the square and
+		/// diamond steps of a level every tile copies the square centres just across its edges from its neighbours
+		/// into ghost strips, which is all a diamond on an edge needs from the other side, so both tiles sharing an
+		/// edge work its samples out to the same float. The result matches Generate with diamondSquareRootCells set
+		/// to tileCells, sample for sample. tileCells must be a power of two dividing both sides and the tiles must fit in
+		/// memory, false otherwise.
+		bool GenerateDiamondSquareTiles(int tileCells, Heightfield *tiles)
+		{
+			if (tileCells < 2 || (tileCells & (tileCells - 1)) != 0 || cellsX % tileCells != 0 || cellsZ % tileCells != 0)
+				return false;
+
+			int tilesX = cellsX / tileCells;
+			int tilesZ = cellsZ / tileCells;
+			int tileCount = tilesX * tilesZ;
+			int edgeSamples = tileCells + 1;
+			ghosts.resize((size_t)tileCount * 4 * edgeSamples);
+
+			noise.SetSeed(random.GetSeed());
+			regionX = 0;
+			regionZ = 0;
+			if (usePerlinRandom)
+				noise.RandomisePermutations();
+
+			for (int tile = 0; tile < tileCount; ++tile)
+			{
+				int originX = (tile % tilesX) * tileCells;
+				int originZ = (tile / tilesX) * tileCells;
+				Heightfield &map = tiles[tile];
+				if (!map.Resize(edgeSamples, edgeSamples))
+					return false;
+				map(0, 0) = GetRandom(originX, originZ, tileCells);
+				map(tileCells, 0) = GetRandom(originX + tileCells, originZ, tileCells);
+				map(0, tileCells) = GetRandom(originX, originZ + tileCells, tileCells);
+				map(tileCells, tileCells) = GetRandom(originX + tileCells, originZ + tileCells, tileCells);
+			}
+
+			for (int stepSize = tileCells; stepSize > 1; stepSize /= 2)
+				DiamondSquareTilesCore(stepSize, (float)stepSize / (float)tileCells, tileCells, tilesX, tilesZ, tiles);
+			return true;
+		}
+
+		void DiamondSquareTilesCore(int stepSize, float scale, int tileCells, int tilesX, int tilesZ, Heightfield *tiles)
+		{
+			TERRAIN_PROFILE_SCOPE_DETAIL("diamondSquare.level", stepSize);
+			int halfStep = stepSize / 2;
+			int tileCount = tilesX * tilesZ;
+			int edgeSamples = tileCells + 1;
+
+			//rows of every tile in one range, so a handful of big tiles still spread over the threads
+			int squareRows = tileCells / stepSize;
+			int squareTotal = tileCount * squareRows;
+			threadPool.ParallelFor(0, squareTotal, threadPool.GetGrainSize(squareTotal), [&](int first, int last)
+			{
+				for (int i = first; i < last; ++i)
+				{
+					int tile = i / squareRows;
+					int originX = (tile % tilesX) * tileCells;
+					int originZ = (tile / tilesX) * tileCells;
+					Heightfield &map = tiles[tile];
+
+					int z = halfStep + (i % squareRows) * stepSize;
+					const float *above = map.GetRow(z - halfStep);
+					const float *below = map.GetRow(z + halfStep);
+					float *centres = map.GetRow(z);
+					for (int x = halfStep; x < tileCells; x += stepSize)
+					{
+						NeighbourSum corners;
+						corners.Add(above[x - halfStep]);
+						corners.Add(above[x + halfStep]);
+						corners.Add(below[x - halfStep]);
+						corners.Add(below[x + halfStep]);
+						centres[x] = corners.GetMean() + GetRandom(originX + x, originZ + z, stepSize) * scale;
+					}
+				}
+			});
+
+			//the ghost exchange, every square centre half a step across an edge, left as is where the world ends
+			threadPool.ParallelFor(0, tileCount, threadPool.GetGrainSize(tileCount), [&](int firstTile, int lastTile)
+			{
+				for (int tile = firstTile; tile < lastTile; ++tile)
+				{
+					int tileX = tile % tilesX;
+					int tileZ = tile / tilesX;
+					float *ghost = &ghosts[(size_t)tile * 4 * edgeSamples];
+					for (int along = halfStep; along < tileCells; along += stepSize)
+					{
+						if (tileX > 0)
+							ghost[GhostLeft * edgeSamples + along] = tiles[tile - 1](tileCells - halfStep, along);
+						if (tileX + 1 < tilesX)
+							ghost[GhostRight * edgeSamples + along] = tiles[tile + 1](halfStep, along);
+						if (tileZ > 0)
+							ghost[GhostTop * edgeSamples + along] = tiles[tile - tilesX](along, tileCells - halfStep);
+						if (tileZ + 1 < tilesZ)
+							ghost[GhostBottom * edgeSamples + along] = tiles[tile + tilesX](along, halfStep);
+					}
+				}
+			});
+
+			//the same sums as DiamondSquareCore takes over the whole map, with the ghosts standing in across an edge
+			int diamondRows = tileCells / halfStep + 1;
+			int diamondTotal = tileCount * diamondRows;
+			threadPool.ParallelFor(0, diamondTotal, threadPool.GetGrainSize(diamondTotal), [&](int first, int last)
+			{
+				for (int i = first; i < last; ++i)
+				{
+					int tile = i / diamondRows;
+					int row = i % diamondRows;
+					int tileX = tile % tilesX;
+					int tileZ = tile / tilesX;
+					const float *ghost = &ghosts[(size_t)tile * 4 * edgeSamples];
+					Heightfield &map = tiles[tile];
+
+					int z = row * halfStep;
+					const float *above = z >= halfStep ? map.GetRow(z - halfStep) : nullptr;
+					const float *below = z + halfStep <= tileCells ? map.GetRow(z + halfStep) : nullptr;
+					float *diamonds = map.GetRow(z);
+					for (int x = (row & 1) ? 0 : halfStep; x <= tileCells; x += stepSize)
+					{
+						NeighbourSum sides;
+						if (x >= halfStep)
+							sides.Add(diamonds[x - halfStep]);
+						else if (tileX > 0)
+							sides.Add(ghost[GhostLeft * edgeSamples + z]);
+						if (x + halfStep <= tileCells)
+							sides.Add(diamonds[x + halfStep]);
+						else if (tileX + 1 < tilesX)
+							sides.Add(ghost[GhostRight * edgeSamples + z]);
+						if (above)
+							sides.Add(above[x]);
+						else if (tileZ > 0)
+							sides.Add(ghost[GhostTop * edgeSamples + x]);
+						if (below)
+							sides.Add(below[x]);
+						else if (tileZ + 1 < tilesZ)
+							sides.Add(ghost[GhostBottom * edgeSamples + x]);
+						diamonds[x] = sides.GetMean() + GetRandom(tileX * tileCells + x, tileZ * tileCells + z, stepSize) * scale;
+					}
+				}
+			});
+		}
+
+		void PerlinNoiseAlgorithm(Heightfield &map)
+		{
+			noise.RandomisePermutations();
+
+			//every row only depends on its own coordinates, so bands of rows can run on any thread
+			int rows = map.GetDepth();
+			threadPool.ParallelFor(0, rows, threadPool.GetGrainSize(rows), [&](int firstRow, int lastRow)
+			{
+				for (int y = firstRow; y < lastRow; y++)
+				{
+					PerlinNoiseRow(regionX, regionZ + y, map.GetWidth(), map.GetRow(y));
+				}
+			});
+		}
+
+		void PerlinNoiseRow(int worldX, int worldZ, int width, float *row) const
+		{
+			float frequency = 5.0f / (float)(cellsX + 1);
+			noise.GenerateNoiseRow(worldX, width, (float)worldZ * frequency, frequency, row);
+		}
+
+		void PerlinNoiseRow(int worldX, int worldZ, int width, float *row, float *slopeX, float *slopeZ) const
+		{
+			float frequency = 5.0f / (float)(cellsX + 1);
+			noise.GenerateNoiseRow(worldX, width, (float)worldZ * frequency, frequency, row, slopeX, slopeZ);
+		}
+
+		void FractionalBrownianMotionAlgorithm(Heightfield &map)
+		{
+			noise.RandomisePermutations();
+
+			int rows = map.GetDepth();
+			int width = map.GetWidth();
+			threadPool.ParallelFor(0, rows, threadPool.GetGrainSize(rows), [&](int firstRow, int lastRow)
+			{
+				for (int y = firstRow; y < lastRow; y++)
+				{
+					FractionalBrownianMotionRow(regionX, regionZ + y, width, map.GetRow(y));
+				}
+			});
+		}
+
+		void FractionalBrownianMotionRow(int worldX, int worldZ, int width, float *row) const
+		{
+			//accumulate a whole row per octave so the batch noise kernels see contiguous samples
+			std::fill(row, row + width, 0.0f);
+
+			OctavePlan plan = PlanOctaves(octaves, GetFbmBaseFrequency(), lacunarity);
+			float frequency = GetFbmBaseFrequency();
+			float amplitude = gain;
+
+			for (unsigned i = 0; i < plan.count; ++i)
+			{
+				float weight = i + 1 == plan.count ? plan.lastWeight : 1.0f;
+				noise.AccumulateNoiseRow(worldX, width, (float)worldZ * frequency, frequency, amplitude * weight, row);
+				frequency *= lacunarity;
+				amplitude *= gain;
+			}
+		}
+
+		void FractionalBrownianMotionRow(int worldX, int worldZ, int width, float *row, float *slopeX, float *slopeZ) const
+		{
+			std::fill(row, row + width, 0.0f);
+			std::fill(slopeX, slopeX + width, 0.0f);
+			std::fill(slopeZ, slopeZ + width, 0.0f);
+
+			OctavePlan plan = PlanOctaves(octaves, GetFbmBaseFrequency(), lacunarity);
+			float frequency = GetFbmBaseFrequency();
+			float amplitude = gain;
+
+			//the slope of a sum is the sum of the octaves' slopes, each scaled by its frequency as well as its amplitude
+			for (unsigned i = 0; i < plan.count; ++i)
+			{
+				float weight = i + 1 == plan.count ? plan.lastWeight : 1.0f;
+				noise.AccumulateNoiseRow(worldX, width, (float)worldZ * frequency, frequency, amplitude * weight, row, slopeX, slopeZ);
+				frequency *= lacunarity;
+				amplitude *= gain;
+			}
+		}
+
+		void MultiFractalAlgorithm(Heightfield &map)
+		{
+			noise.RandomisePermutations();
+
+			int rows = map.GetDepth();
+			int width = map.GetWidth();
+			threadPool.ParallelFor(0, rows, threadPool.GetGrainSize(rows), [&](int firstRow, int lastRow)
+			{
+				for (int y = firstRow; y < lastRow; y++)
+				{
+					MultiFractalRow(regionX, regionZ + y, width, map.GetRow(y));
+				}
+			});
+		}
+
+		/// Ridged or hybrid multifractal for a row. The row is taken in chunks so the batch noise kernels see
+		/// contiguous samples while the weights stay in L1, and a chunk stops once none of its samples take
+		/// further octaves. Whether a sample stops depends on nothing but its own weight, so the result does
+		/// not depend on where the row or chunk starts.
+		void MultiFractalRow(int worldX, int worldZ, int width, float *row) const
+		{
+			const int chunkSize = 64;
+			float noiseValues[chunkSize];
+			float weight[chunkSize];
+
+			bool ridged = multiFractalType == RidgedMultiFractal;
+			MultiFractal::Parameters parameters = { multiFractalOffset, multiFractalGain, multiFractalThreshold };
+			MultiFractal::Kernel kernel = noise.GetKernel();
+			float amplitudeStep = std::pow(multiFractalLacunarity, -multiFractalH);
+			float baseFrequency = GetMultiFractalBaseFrequency();
+			OctavePlan plan = PlanOctaves(multiFractalOctaves, baseFrequency, multiFractalLacunarity);
+
+			for (int start = 0; start < width; start += chunkSize)
+			{
+				int count = width - start < chunkSize ? width - start : chunkSize;
+				float *out = row + start;
+
+				float frequency = baseFrequency;
+				noise.GenerateNoiseRow(worldX + start, count, (float)worldZ * frequency, frequency, noiseValues);
+				bool active = ridged ?
+					MultiFractal::RidgedFirst(noiseValues, count, parameters, out, weight, kernel) :
+					MultiFractal::HybridFirst(noiseValues, count, parameters, out, weight, kernel);
+
+				float amplitude = 1.0f;
+				for (unsigned octave = 1; octave < plan.count && active; ++octave)
+				{
+					frequency *= multiFractalLacunarity;
+					amplitude *= amplitudeStep;
+					float octaveAmplitude = octave + 1 == plan.count ? amplitude * plan.lastWeight : amplitude;
+
+					noise.GenerateNoiseRow(worldX + start, count, (float)worldZ * frequency, frequency, noiseValues);
+					active = ridged ?
+						MultiFractal::RidgedOctave(noiseValues, count, octaveAmplitude, parameters, out, weight, kernel) :
+						MultiFractal::HybridOctave(noiseValues, count, octaveAmplitude, parameters, out, weight, kernel);
+				}
+			}
+		}
+
+		//noise lattice cells a sample at each algorithm's first octave
+		float GetFbmBaseFrequency() const { return 1.0f / (float)(cellsX + 1); }
+		float GetMultiFractalBaseFrequency() const { return 2.0f / (float)(cellsX + 1); }
+
+		/// Counts the octaves up to maxOctaveFrequency by stepping through the same float frequencies the rows do.
+		/// Past the sampling limit an octave's features are smaller than a sample, so it only adds aliasing, and the
+		/// octaves get dearer as they go while their amplitude falls away. The first octave is always kept.
+		OctavePlan PlanOctaves(unsigned requested, float baseFrequency, float octaveLacunarity) const
+		{
+			OctavePlan plan = { requested, 0, 1.0f };
+			if (maxOctaveFrequency <= 0.0f || requested == 0)
+				return plan;
+
+			unsigned count = 1;
+			float lastFrequency = baseFrequency;
+			float frequency = baseFrequency * octaveLacunarity;
+			while (count < requested && frequency <= maxOctaveFrequency)
+			{
+				++count;
+				lastFrequency = frequency;
+				frequency *= octaveLacunarity;
+			}
+
+			//band limit: the octave's weight falls linearly in log frequency from one an octave below the limit to
+			//zero at it, an octave that lands on the limit drops out altogether
+			if (fadeLastOctave && count > 1 && octaveLacunarity > 1.0f)
+			{
+				float weight = std::log(maxOctaveFrequency / lastFrequency) / std::log(octaveLacunarity);
+				if (weight <= 0.0f)
+					--count;
+				else if (weight < 1.0f)
+					plan.lastWeight = weight;
+			}
+
+			plan.count = count;
+			plan.skipped = requested - count;
+			return plan;
+		}
+
+		/// Displacement for sample (x, y) at the given refinement level, depends on nothing but the seed.
+		float GetRandom(int x, int y, int level) const
+		{
+			float frequency = 7.0f / (float)(cellsX + 1);
+
+			if (usePerlinRandom)
+				return noise.GenerateNoise((float)x * frequency, (float)y * frequency);
+			else
+				return random.Get(x, y, level, -1.0f, 1.0f);
+		}
+	};
+}
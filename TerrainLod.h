@@ -0,0 +1,320 @@
+#pragma once
+#include "Heightfield.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+namespace Terrain
+{
+	/// Geomipmapping over a terrain grid laid out like TerrainMeshBuilder::BuildPlane.
+	/// The map is split into square patches of patchCells cells. Level l of a patch draws every 2^l th vertex of
+	/// the full resolution grid, so all levels share one vertex buffer and only the indices change.
+	/// Neighbouring patches are kept within one level of each other. Where a neighbour is coarser, the odd vertices
+	/// along that edge are snapped onto the even ones, so both sides draw the same edge and no cracks open.
+	class GeoMipmap
+	{
+	public:
+		enum Side
+		{
+			North = 1, //z = 0
+			East = 2, //x = patchCells
+			South = 4, //z = patchCells
+			West = 8 //x = 0
+		};
+
+		static const int sideCombinations = 16;
+
+	private:
+		int cellsX = 0;
+		int cellsZ = 0;
+		int patchCells = 0;
+		int patchesX = 0;
+		int patchesZ = 0;
+		int levelCount = 0;
+		float sampleSpacing = 1.0f;
+		float heightScale = 1.0f;
+
+		//index patterns relative to a patch's first vertex, [level * sideCombinations + coarserSides]
+		std::vector<std::vector<uint32_t> > patterns;
+
+		//per patch, unscaled
+		std::vector<float> errors; //[patch * levelCount + level], never decreasing with level
+		std::vector<float> minHeights;
+		std::vector<float> maxHeights;
+
+		std::vector<int> levels;
+
+		//height the triangles of a level interpolate at (x, z), split along the same diagonal BuildPlane uses
+		static float Interpolate(const Heightfield &map, int x, int z, int x0, int z0, int step)
+		{
+			float u = (float)(x - x0) / step;
+			float v = (float)(z - z0) / step;
+			float h00 = map(x0, z0);
+			float h10 = map(x0 + step, z0);
+			float h01 = map(x0, z0 + step);
+			float h11 = map(x0 + step, z0 + step);
+			if (u + v <= 1.0f)
+				return h00 + u * (h10 - h00) + v * (h01 - h00);
+			return h11 + (1.0f - u) * (h01 - h11) + (1.0f - v) * (h10 - h11);
+		}
+
+		void MeasurePatch(const Heightfield &map, int patchX, int patchZ)
+		{
+			int patch = patchZ * patchesX + patchX;
+			int originX = patchX * patchCells;
+			int originZ = patchZ * patchCells;
+
+			float min = 999999.0f;
+			float max = -999999.0f;
+			for (int z = originZ; z <= originZ + patchCells; ++z)
+			{
+				const float *row = map.GetRow(z);
+				for (int x = originX; x <= originX + patchCells; ++x)
+				{
+					min = row[x] < min ? row[x] : min;
+					max = row[x] > max ? row[x] : max;
+				}
+			}
+			minHeights[patch] = min;
+			maxHeights[patch] = max;
+
+			float *patchErrors = &errors[(size_t)patch * levelCount];
+			patchErrors[0] = 0.0f;
+			for (int level = 1; level < levelCount; ++level)
+			{
+				int step = 1 << level;
+				float error = patchErrors[level - 1];
+				for (int z = originZ; z <= originZ + patchCells; ++z)
+				{
+					int z0 = z == originZ + patchCells ? z - step : originZ + (z - originZ) / step * step;
+					for (int x = originX; x <= originX + patchCells; ++x)
+					{
+						int x0 = x == originX + patchCells ? x - step : originX + (x - originX) / step * step;
+						float difference = std::fabs(map(x, z) - Interpolate(map, x, z, x0, z0, step));
+						error = difference > error ? difference : error;
+					}
+				}
+				patchErrors[level] = error;
+			}
+		}
+
+		/// Distance from the eye to the patch's bounding box in world units.
+		float GetDistance(int patchX, int patchZ, const float eye[3]) const
+		{
+			int patch = patchZ * patchesX + patchX;
+			float extent = patchCells * sampleSpacing;
+			float minBound[3] = { patchX * extent, minHeights[patch] * heightScale, patchZ * extent };
+			float maxBound[3] = { minBound[0] + extent, maxHeights[patch] * heightScale, minBound[2] + extent };
+			if (minBound[1] > maxBound[1])
+				std::swap(minBound[1], maxBound[1]);
+
+			float distanceSquared = 0.0f;
+			for (int i = 0; i < 3; ++i)
+			{
+				float outside = eye[i] < minBound[i] ? minBound[i] - eye[i] : (eye[i] > maxBound[i] ? eye[i] - maxBound[i] : 0.0f);
+				distanceSquared += outside * outside;
+			}
+			return std::sqrt(distanceSquared);
+		}
+
+	public:
+		/// Number of levels a patch of patchCells cells can have, down to two triangles.
+		static int GetLevelCount(int patchCells)
+		{
+			int count = 1;
+			while ((patchCells >> count) << count == patchCells && (patchCells >> count) > 0)
+				++count;
+			return count;
+		}
+
+		/// Indices for one patch at the given level with its first vertex at 0 and rows rowStride vertices apart.
+		/// coarserSides is a mask of Side values whose neighbour draws one level coarser.
+		static void BuildPatchIndices(int patchCells, int rowStride, int level, int coarserSides, std::vector<uint32_t> &out)
+		{
+			int step = 1 << level;
+			out.clear();
+
+			struct Corner
+			{
+				int x;
+				int z;
+			};
+
+			for (int z = 0; z < patchCells; z += step)
+			{
+				for (int x = 0; x < patchCells; x += step)
+				{
+					// 01 11
+					// 00 10
+					Corner corners[6] =
+					{
+						{ x, z }, { x, z + step }, { x + step, z },
+						{ x + step, z }, { x, z + step }, { x + step, z + step }
+					};
+
+					for (int triangle = 0; triangle < 2; ++triangle)
+					{
+						Corner *c = corners + triangle * 3;
+						for (int i = 0; i < 3; ++i)
+						{
+							//odd vertices on an edge shared with a coarser patch move onto the previous even one
+							bool oddX = (c[i].x / step) & 1;
+							bool oddZ = (c[i].z / step) & 1;
+							if (((coarserSides & North) && c[i].z == 0 && oddX) || ((coarserSides & South) && c[i].z == patchCells && oddX))
+								c[i].x -= step;
+							if (((coarserSides & West) && c[i].x == 0 && oddZ) || ((coarserSides & East) && c[i].x == patchCells && oddZ))
+								c[i].z -= step;
+						}
+
+						//snapping collapses some triangles onto a point pair, drop those. Triangles that are only flat in
+						//the xz plane stay, they close the vertical gap where a vertex sits on a snapped edge
+						bool degenerate = (c[0].x == c[1].x && c[0].z == c[1].z) || (c[1].x == c[2].x && c[1].z == c[2].z) || (c[0].x == c[2].x && c[0].z == c[2].z);
+						if (degenerate)
+							continue;
+
+						for (int i = 0; i < 3; ++i)
+							out.push_back((uint32_t)(c[i].z * rowStride + c[i].x));
+					}
+				}
+			}
+		}
+
+		/// Measures every patch of a (cellsX + 1) x (cellsZ + 1) map. Both cell counts must be multiples of patchCells.
+		/// Spacing and height scale are those the mesh is drawn with, they turn errors and bounds into world units.
+		bool Build(const Heightfield &map, int patchCells, float sampleSpacing, float heightScale, ThreadPool &threadPool)
+		{
+			TERRAIN_PROFILE_SCOPE("lod");
+			int newCellsX = map.GetWidth() - 1;
+			int newCellsZ = map.GetDepth() - 1;
+			if (patchCells <= 0 || newCellsX < patchCells || newCellsZ < patchCells || newCellsX % patchCells != 0 || newCellsZ % patchCells != 0)
+				return false;
+
+			//the patterns only depend on the layout, keep them while it stays the same
+			if (newCellsX != cellsX || patchCells != this->patchCells)
+			{
+				levelCount = GetLevelCount(patchCells);
+				patterns.resize(levelCount * sideCombinations);
+				for (int level = 0; level < levelCount; ++level)
+				{
+					for (int sides = 0; sides < sideCombinations; ++sides)
+						BuildPatchIndices(patchCells, newCellsX + 1, level, level + 1 < levelCount ? sides : 0, patterns[level * sideCombinations + sides]);
+				}
+			}
+
+			cellsX = newCellsX;
+			cellsZ = newCellsZ;
+			this->patchCells = patchCells;
+			this->sampleSpacing = sampleSpacing;
+			this->heightScale = heightScale;
+			patchesX = cellsX / patchCells;
+			patchesZ = cellsZ / patchCells;
+
+			int patchCount = patchesX * patchesZ;
+			errors.resize((size_t)patchCount * levelCount);
+			minHeights.resize(patchCount);
+			maxHeights.resize(patchCount);
+			levels.assign(patchCount, 0);
+
+			threadPool.ParallelFor(0, patchCount, threadPool.GetGrainSize(patchCount), [&](int first, int last)
+			{
+				for (int patch = first; patch < last; ++patch)
+					MeasurePatch(map, patch % patchesX, patch / patchesX);
+			});
+			return true;
+		}
+
+		int GetPatchesX() const { return patchesX; }
+		int GetPatchesZ() const { return patchesZ; }
+		int GetPatchCells() const { return patchCells; }
+		int GetLevelCount() const { return levelCount; }
+
+		/// Largest vertical distance between a level's surface and the full resolution one, unscaled.
+		float GetError(int patchX, int patchZ, int level) const { return errors[(size_t)(patchZ * patchesX + patchX) * levelCount + level]; }
+
+		int GetLevel(int patchX, int patchZ) const { return levels[patchZ * patchesX + patchX]; }
+		const std::vector<int> &GetLevels() const { return levels; }
+
+		/// Picks the coarsest level per patch whose projected error stays within maxPixelError, with the eye
+		/// in the mesh's local space. pixelsPerRadian is viewportHeight / (2 tan(fovY / 2)).
+		/// Returns true when any level changed.
+		bool SelectLevels(const float eye[3], float pixelsPerRadian, float maxPixelError)
+		{
+			std::vector<int> previous(levels);
+
+			for (int patchZ = 0; patchZ < patchesZ; ++patchZ)
+			{
+				for (int patchX = 0; patchX < patchesX; ++patchX)
+				{
+					float distance = GetDistance(patchX, patchZ, eye);
+					float scale = heightScale * pixelsPerRadian / (distance > 1e-3f ? distance : 1e-3f);
+
+					int level = 0;
+					while (level + 1 < levelCount && GetError(patchX, patchZ, level + 1) * std::fabs(scale) <= maxPixelError)
+						++level;
+					levels[patchZ * patchesX + patchX] = level;
+				}
+			}
+
+			//refine until no neighbours are more than one level apart, refining never breaks a pair that was fine
+			bool changed = true;
+			while (changed)
+			{
+				changed = false;
+				for (int patchZ = 0; patchZ < patchesZ; ++patchZ)
+				{
+					for (int patchX = 0; patchX < patchesX; ++patchX)
+					{
+						int &level = levels[patchZ * patchesX + patchX];
+						int finest = level;
+						if (patchX > 0) finest = std::min(finest, levels[patchZ * patchesX + patchX - 1] + 1);
+						if (patchX + 1 < patchesX) finest = std::min(finest, levels[patchZ * patchesX + patchX + 1] + 1);
+						if (patchZ > 0) finest = std::min(finest, levels[(patchZ - 1) * patchesX + patchX] + 1);
+						if (patchZ + 1 < patchesZ) finest = std::min(finest, levels[(patchZ + 1) * patchesX + patchX] + 1);
+						if (finest != level)
+						{
+							level = finest;
+							changed = true;
+						}
+					}
+				}
+			}
+
+			return levels != previous;
+		}
+
+		/// Directly sets a patch's level, e.g. to test stitching. Neighbours must stay within one level.
+		void SetLevel(int patchX, int patchZ, int level) { levels[patchZ * patchesX + patchX] = level; }
+
+		/// Sides of a patch whose neighbour is one level coarser.
+		int GetCoarserSides(int patchX, int patchZ) const
+		{
+			int level = GetLevel(patchX, patchZ);
+			int sides = 0;
+			if (patchZ > 0 && GetLevel(patchX, patchZ - 1) > level) sides |= North;
+			if (patchX + 1 < patchesX && GetLevel(patchX + 1, patchZ) > level) sides |= East;
+			if (patchZ + 1 < patchesZ && GetLevel(patchX, patchZ + 1) > level) sides |= South;
+			if (patchX > 0 && GetLevel(patchX - 1, patchZ) > level) sides |= West;
+			return sides;
+		}
+
+		/// Concatenates the selected pattern of every patch into an index buffer for the whole map.
+		void BuildIndices(std::vector<uint32_t> &out) const
+		{
+			out.clear();
+			uint32_t rowStride = cellsX + 1;
+			for (int patchZ = 0; patchZ < patchesZ; ++patchZ)
+			{
+				for (int patchX = 0; patchX < patchesX; ++patchX)
+				{
+					const std::vector<uint32_t> &pattern = patterns[GetLevel(patchX, patchZ) * sideCombinations + GetCoarserSides(patchX, patchZ)];
+					uint32_t base = (uint32_t)(patchZ * patchCells) * rowStride + (uint32_t)(patchX * patchCells);
+					for (size_t i = 0; i < pattern.size(); ++i)
+						out.push_back(base + pattern[i]);
+				}
+			}
+		}
+	};
+}
@@ -0,0 +1,173 @@
+#pragma once
+#include "Heightfield.h"
+
+#include <cstdint>
+
+namespace Terrain
+{
+	/// Position, normal and uv, the same layout as octet::mesh::vertex so arrays can be shared with the mesh.
+	struct TerrainVertex
+	{
+		float pos[3];
+		float normal[3];
+		float uv[2];
+	};
+
+	/// Builds the terrain grid mesh. Vertices are laid out row by row (x contiguous) to match the heightfield.
+	/// Kept free of octet so the headless tools can run the same passes as CustomTerrain.
+	class TerrainMeshBuilder
+	{
+		static void Sub(const float *a, const float *b, float *out)
+		{
+			out[0] = a[0] - b[0];
+			out[1] = a[1] - b[1];
+			out[2] = a[2] - b[2];
+		}
+
+		static void Cross(const float *a, const float *b, float *out)
+		{
+			out[0] = a[1] * b[2] - a[2] * b[1];
+			out[1] = a[2] * b[0] - a[0] * b[2];
+			out[2] = a[0] * b[1] - a[1] * b[0];
+		}
+
+	public:
+		static int GetVertexCount(int cellsX, int cellsZ) { return (cellsX + 1) * (cellsZ + 1); }
+		static int GetIndexCount(int cellsX, int cellsZ) { return cellsX * cellsZ * 6; }
+
+		/// Change in uv between neighbouring samples, the textures tile every tenth of the map.
+		static float GetUvStep(int cells)
+		{
+			float tiling = 0.1f;
+			return 1.0f / (cells * tiling);
+		}
+
+		/// Flat grid spaced deltaX/deltaZ apart, with the uv tiling the textures every tenth of the map.
+		/// indices may be null when only the vertices are wanted.
+		static void BuildPlane(int cellsX, int cellsZ, float deltaX, float deltaZ, TerrainVertex *vertices, uint32_t *indices)
+		{
+			TERRAIN_PROFILE_SCOPE("plane");
+			float fTextureUStep = GetUvStep(cellsX);
+			float fTextureVStep = GetUvStep(cellsZ);
+
+			TerrainVertex *vertex = vertices;
+			for (int z = 0; z <= cellsZ; ++z)
+			{
+				for (int x = 0; x <= cellsX; ++x, ++vertex)
+				{
+					vertex->pos[0] = (float)x * deltaX;
+					vertex->pos[1] = 0.0f;
+					vertex->pos[2] = (float)z * deltaZ;
+					vertex->normal[0] = 0.0f;
+					vertex->normal[1] = 1.0f;
+					vertex->normal[2] = 0.0f;
+					vertex->uv[0] = x * fTextureUStep;
+					vertex->uv[1] = z * fTextureVStep;
+				}
+			}
+
+			if (indices)
+				BuildIndices(cellsX, cellsZ, indices);
+		}
+
+		/// Two triangles per cell. 16-bit indices are fine while GetVertexCount is at most 65536.
+		template <class Index>
+		static void BuildIndices(int cellsX, int cellsZ, Index *indices)
+		{
+			Index *index = indices;
+			uint32_t stride = cellsX + 1;
+			for (uint32_t x = 0; x < (uint32_t)cellsX; ++x)
+			{
+				for (uint32_t z = 0; z < (uint32_t)cellsZ; ++z)
+				{
+					// 01 11
+					// 00 10
+					*index++ = (Index)((x + 0) + (z + 0)*stride);
+					*index++ = (Index)((x + 0) + (z + 1)*stride);
+					*index++ = (Index)((x + 1) + (z + 0)*stride);
+					*index++ = (Index)((x + 1) + (z + 0)*stride);
+					*index++ = (Index)((x + 0) + (z + 1)*stride);
+					*index++ = (Index)((x + 1) + (z + 1)*stride);
+				}
+			}
+		}
+
+		/// Copies scaled heights into the vertex positions and returns their range.
+		static void WriteHeights(const Heightfield &map, float heightScale, TerrainVertex *vertices, float &min, float &max)
+		{
+			WriteHeights(map.GetData(), map.GetWidth(), map.GetDepth(), map.GetStride(), heightScale, vertices, min, max);
+		}
+
+		/// As above for rows of heights stride floats apart that are not held in a Heightfield, e.g. a mapped tile.
+		static void WriteHeights(const float *heights, int width, int depth, int stride, float heightScale, TerrainVertex *vertices, float &min, float &max)
+		{
+			//the range is found in the same pass, so it is timed as part of the heights here
+			TERRAIN_PROFILE_SCOPE("heights");
+			min = 999999.0f;
+			max = -999999.0f;
+
+			TerrainVertex *vertex = vertices;
+			for (int z = 0; z < depth; ++z)
+			{
+				const float *row = heights + (size_t)z * stride;
+
+				for (int x = 0; x < width; ++x, ++vertex)
+				{
+					float height = row[x] * heightScale;
+					vertex->pos[1] = height;
+
+					min = height < min ? height : min;
+					max = height > max ? height : max;
+				}
+			}
+		}
+
+		/// Copies precomputed normals, three floats per vertex.
+		static void WriteNormals(const float *normals, int count, TerrainVertex *vertices)
+		{
+			for (int i = 0; i < count; ++i, normals += 3)
+			{
+				vertices[i].normal[0] = normals[0];
+				vertices[i].normal[1] = normals[1];
+				vertices[i].normal[2] = normals[2];
+			}
+		}
+
+		/// Unnormalised sum of the four face normals around each vertex, clamped at the edges.
+		static void ComputeNormals(int cellsX, int cellsZ, TerrainVertex *vertices)
+		{
+			//cheaper alternative based on nearest neighbouring heights
+			//http://www.flipcode.com/archives/Calculating_Vertex_Normals_for_Height_Maps.shtml
+			int rowStride = cellsX + 1;
+			for (int z = 0; z <= cellsZ; ++z)
+			{
+				for (int x = 0; x <= cellsX; ++x)
+				{
+					int centre = z * rowStride + x;
+					int east = z * rowStride + (x < cellsX ? x + 1 : x);
+					int south = (z < cellsZ ? z + 1 : z) * rowStride + x;
+					int west = z * rowStride + (x > 0 ? x - 1 : x);
+					int north = (z > 0 ? z - 1 : z) * rowStride + x;
+
+					//Averaged Normals
+					const float *centrePos = vertices[centre].pos;
+					float toNorth[3], toEast[3], toSouth[3], toWest[3];
+					Sub(vertices[north].pos, centrePos, toNorth);
+					Sub(vertices[east].pos, centrePos, toEast);
+					Sub(vertices[south].pos, centrePos, toSouth);
+					Sub(vertices[west].pos, centrePos, toWest);
+
+					float ne[3], se[3], sw[3], nw[3];
+					Cross(toNorth, toEast, ne);
+					Cross(toEast, toSouth, se);
+					Cross(toSouth, toWest, sw);
+					Cross(toNorth, toWest, nw);
+
+					float *norm = vertices[centre].normal;
+					for (int i = 0; i < 3; ++i)
+						norm[i] = ne[i] + nw[i] + se[i] + sw[i];
+				}
+			}
+		}
+	};
+}
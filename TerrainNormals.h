@@ -0,0 +1,413 @@
+#pragma once
+#include "CpuFeatures.h"
+#include "Heightfield.h"
+#include "ThreadPool.h"
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+namespace Terrain
+{
+	/// Unit surface normals straight from a heightfield using central differences, one-sided along the edges.
+	/// Normals point up (+y) for a grid laid out like TerrainMeshBuilder::BuildPlane. Bands of rows run in parallel
+	/// and each row is vectorised, the SIMD kernels give bit-identical results to the scalar code.
+	class NormalGenerator
+	{
+	public:
+		enum Kernel
+		{
+			Scalar,
+			Sse41,
+			Avx2
+		};
+
+		/// One row of normals split by component, indexed like the row of heights they came from.
+		struct Row
+		{
+			std::vector<float> x;
+			std::vector<float> y;
+			std::vector<float> z;
+
+			void Resize(int width)
+			{
+				x.resize(width);
+				y.resize(width);
+				z.resize(width);
+			}
+		};
+
+	private:
+		Kernel kernel;
+
+		static void NormalScalar(float dx, float dz, float *nx, float *ny, float *nz)
+		{
+			float inverseLength = 1.0f / std::sqrt(dx * dx + 1.0f + dz * dz);
+			*nx = -dx * inverseLength;
+			*ny = inverseLength;
+			*nz = -dz * inverseLength;
+		}
+
+		/// Normals for samples [first, last) of an interior part of the row, returns where the SIMD kernel stopped.
+		int NormalRow(const float *above, const float *row, const float *below, int first, int last, float scaleX, float scaleZ, Row &out) const
+		{
+			int x = first;
+#if TERRAIN_SIMD_X86
+			if (kernel == Avx2)
+				x = NormalRowAvx2(above, row, below, x, last, scaleX, scaleZ, out);
+			else if (kernel == Sse41)
+				x = NormalRowSse41(above, row, below, x, last, scaleX, scaleZ, out);
+#endif
+			for (; x < last; ++x)
+			{
+				float dx = (row[x + 1] - row[x - 1]) * scaleX;
+				float dz = (below[x] - above[x]) * scaleZ;
+				NormalScalar(dx, dz, &out.x[x], &out.y[x], &out.z[x]);
+			}
+			return x;
+		}
+
+		void ComputeRow(const Heightfield &map, int z, float heightScale, float spacingX, float spacingZ, Row &out) const
+		{
+			int depth = map.GetDepth();
+			const float *above = map.GetRow(z > 0 ? z - 1 : z);
+			const float *below = map.GetRow(z + 1 < depth ? z + 1 : z);
+			ComputeSpan(above, map.GetRow(z), below, map.GetWidth(), 0, map.GetWidth(), z > 0 && z + 1 < depth, heightScale, spacingX, spacingZ, out);
+		}
+
+		static uint16_t Quantise(float value)
+		{
+			return (uint16_t)(int)((value * 0.5f + 0.5f) * 65535.0f + 0.5f);
+		}
+
+
+	public:
+		NormalGenerator() : kernel(GetBestKernel())
+		{
+		}
+
+		static Kernel GetBestKernel()
+		{
+			const CpuFeatures &cpu = CpuFeatures::Get();
+			if (cpu.HasAvx2())
+				return Avx2;
+			if (cpu.HasSse41())
+				return Sse41;
+			return Scalar;
+		}
+
+		Kernel GetKernel() const { return kernel; }
+
+		/// Force a kernel, falling back to the best supported one if the CPU lacks it.
+		void SetKernel(Kernel requested)
+		{
+			const CpuFeatures &cpu = CpuFeatures::Get();
+			if ((requested == Avx2 && !cpu.HasAvx2()) || (requested == Sse41 && !cpu.HasSse41()))
+				requested = GetBestKernel();
+			kernel = requested;
+		}
+
+		/// Normals for samples [first, last) of a row of width heights. above and below are the neighbouring rows,
+		/// or the row itself along the map's edges, with centralZ saying whether both are real neighbours.
+		/// Samples at either end of the row get one-sided differences, so a window cut from a larger map with a
+		/// one sample halo gives exactly the normals the whole map would.
+		void ComputeSpan(const float *above, const float *row, const float *below, int width, int first, int last, bool centralZ, float heightScale, float spacingX, float spacingZ, Row &out) const
+		{
+			//central differences span two cells, the one-sided ones along the edges span one
+			float scaleZ = heightScale / (spacingZ * (centralZ ? 2.0f : 1.0f));
+
+			if (width == 1)
+			{
+				NormalScalar(0.0f, (below[0] - above[0]) * scaleZ, &out.x[0], &out.y[0], &out.z[0]);
+				return;
+			}
+
+			float edgeScaleX = heightScale / spacingX;
+			int x = first;
+			if (x == 0)
+			{
+				NormalScalar((row[1] - row[0]) * edgeScaleX, (below[0] - above[0]) * scaleZ, &out.x[0], &out.y[0], &out.z[0]);
+				++x;
+			}
+
+			int interiorEnd = last < width - 1 ? last : width - 1;
+			if (x < interiorEnd)
+				NormalRow(above, row, below, x, interiorEnd, heightScale / (2.0f * spacingX), scaleZ, out);
+
+			if (last == width)
+			{
+				int end = width - 1;
+				NormalScalar((row[end] - row[end - 1]) * edgeScaleX, (below[end] - above[end]) * scaleZ, &out.x[end], &out.y[end], &out.z[end]);
+			}
+		}
+
+		/// Normals for samples [first, last) from the slope of the unscaled heights per sample step, e.g. the analytic
+		/// slopes TerrainGenerator::GenerateRow gives. Nothing but the sample itself is read, so edges need no care.
+		void ComputeSpanFromSlopes(const float *slopeX, const float *slopeZ, int first, int last, float heightScale, float spacingX, float spacingZ, Row &out) const
+		{
+			float scaleX = heightScale / spacingX;
+			float scaleZ = heightScale / spacingZ;
+
+			int x = first;
+#if TERRAIN_SIMD_X86
+			if (kernel == Avx2)
+				x = SlopeRowAvx2(slopeX, slopeZ, x, last, scaleX, scaleZ, out);
+			else if (kernel == Sse41)
+				x = SlopeRowSse41(slopeX, slopeZ, x, last, scaleX, scaleZ, out);
+#endif
+			for (; x < last; ++x)
+				NormalScalar(slopeX[x] * scaleX, slopeZ[x] * scaleZ, &out.x[x], &out.y[x], &out.z[x]);
+		}
+
+		/// Octahedral encoding of normals [first, last) of a row, known to point up. out receives sample first.
+		void EncodeSpan(const Row &normals, int first, int last, uint16_t *out) const
+		{
+			int x = first;
+#if TERRAIN_SIMD_X86
+			if (kernel == Avx2)
+				x = EncodeRowAvx2(normals, first, last, out);
+			else if (kernel == Sse41)
+				x = EncodeRowSse41(normals, first, last, out);
+#endif
+			for (; x < last; ++x)
+			{
+				float normal[3] = { normals.x[x], normals.y[x], normals.z[x] };
+				EncodeOctahedral(normal, out + (x - first) * 2);
+			}
+		}
+
+		/// Calls writer(z, normals) with every row's normals, bands of rows in parallel, for passes that use the
+		/// normals on the way rather than storing them.
+		template <class RowWriter>
+		void Run(const Heightfield &map, float heightScale, float spacingX, float spacingZ, ThreadPool &threadPool, RowWriter writer) const
+		{
+			int rows = map.GetDepth();
+			threadPool.ParallelFor(0, rows, threadPool.GetGrainSize(rows), [&](int firstRow, int lastRow)
+			{
+				Row scratch;
+				scratch.Resize(map.GetWidth());
+				for (int z = firstRow; z < lastRow; ++z)
+				{
+					ComputeRow(map, z, heightScale, spacingX, spacingZ, scratch);
+					writer(z, scratch);
+				}
+			});
+		}
+
+		/// Writes three floats per sample at out + (z * width + x) * outStride, e.g. a stride of 8 fills the
+		/// normal of an interleaved TerrainVertex array. spacingX/Z are the world distances between samples.
+		void Compute(const Heightfield &map, float heightScale, float spacingX, float spacingZ, float *out, int outStride, ThreadPool &threadPool) const
+		{
+			TERRAIN_PROFILE_SCOPE("normals");
+			int width = map.GetWidth();
+			Run(map, heightScale, spacingX, spacingZ, threadPool, [&](int z, const Row &normals)
+			{
+				float *normal = out + (size_t)z * width * outStride;
+				for (int x = 0; x < width; ++x, normal += outStride)
+				{
+					normal[0] = normals.x[x];
+					normal[1] = normals.y[x];
+					normal[2] = normals.z[x];
+				}
+			});
+		}
+
+		/// Writes two 16-bit octahedral components per sample at out + (z * width + x) * 2, a quarter of the float size.
+		void ComputeOctahedral(const Heightfield &map, float heightScale, float spacingX, float spacingZ, uint16_t *out, ThreadPool &threadPool) const
+		{
+			TERRAIN_PROFILE_SCOPE("normals");
+			int width = map.GetWidth();
+			Run(map, heightScale, spacingX, spacingZ, threadPool, [&](int z, const Row &normals)
+			{
+				EncodeSpan(normals, 0, width, out + (size_t)z * width * 2);
+			});
+		}
+
+		/// Projects a unit normal onto the octahedron |x| + |y| + |z| = 1 and unfolds it into the xz square,
+		/// folding the lower half over the diagonals. Each component is stored in 16 bits.
+		static void EncodeOctahedral(const float normal[3], uint16_t out[2])
+		{
+			float inverseSum = 1.0f / (std::fabs(normal[0]) + std::fabs(normal[1]) + std::fabs(normal[2]));
+			float u = normal[0] * inverseSum;
+			float v = normal[2] * inverseSum;
+			if (normal[1] < 0.0f)
+			{
+				float foldedU = (1.0f - std::fabs(v)) * (u >= 0.0f ? 1.0f : -1.0f);
+				float foldedV = (1.0f - std::fabs(u)) * (v >= 0.0f ? 1.0f : -1.0f);
+				u = foldedU;
+				v = foldedV;
+			}
+			out[0] = Quantise(u);
+			out[1] = Quantise(v);
+		}
+
+		static void DecodeOctahedral(const uint16_t in[2], float normal[3])
+		{
+			float u = in[0] / 65535.0f * 2.0f - 1.0f;
+			float v = in[1] / 65535.0f * 2.0f - 1.0f;
+			float y = 1.0f - std::fabs(u) - std::fabs(v);
+			if (y < 0.0f)
+			{
+				float unfoldedU = (1.0f - std::fabs(v)) * (u >= 0.0f ? 1.0f : -1.0f);
+				float unfoldedV = (1.0f - std::fabs(u)) * (v >= 0.0f ? 1.0f : -1.0f);
+				u = unfoldedU;
+				v = unfoldedV;
+			}
+
+			float inverseLength = 1.0f / std::sqrt(u * u + y * y + v * v);
+			normal[0] = u * inverseLength;
+			normal[1] = y * inverseLength;
+			normal[2] = v * inverseLength;
+		}
+
+	private:
+#if TERRAIN_SIMD_X86
+		TERRAIN_TARGET_SSE41 static int NormalRowSse41(const float *above, const float *row, const float *below, int first, int last, float scaleX, float scaleZ, Row &out)
+		{
+			__m128 sx = _mm_set1_ps(scaleX);
+			__m128 sz = _mm_set1_ps(scaleZ);
+			__m128 one = _mm_set1_ps(1.0f);
+			__m128 sign = _mm_set1_ps(-0.0f);
+
+			int x = first;
+			for (; x + 4 <= last; x += 4)
+			{
+				__m128 dx = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(row + x + 1), _mm_loadu_ps(row + x - 1)), sx);
+				__m128 dz = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(below + x), _mm_loadu_ps(above + x)), sz);
+				__m128 lengthSquared = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), one), _mm_mul_ps(dz, dz));
+				__m128 inverseLength = _mm_div_ps(one, _mm_sqrt_ps(lengthSquared));
+				_mm_storeu_ps(&out.x[x], _mm_mul_ps(_mm_xor_ps(dx, sign), inverseLength));
+				_mm_storeu_ps(&out.y[x], inverseLength);
+				_mm_storeu_ps(&out.z[x], _mm_mul_ps(_mm_xor_ps(dz, sign), inverseLength));
+			}
+			return x;
+		}
+
+		TERRAIN_TARGET_AVX2 static int NormalRowAvx2(const float *above, const float *row, const float *below, int first, int last, float scaleX, float scaleZ, Row &out)
+		{
+			__m256 sx = _mm256_set1_ps(scaleX);
+			__m256 sz = _mm256_set1_ps(scaleZ);
+			__m256 one = _mm256_set1_ps(1.0f);
+			__m256 sign = _mm256_set1_ps(-0.0f);
+
+			int x = first;
+			for (; x + 8 <= last; x += 8)
+			{
+				__m256 dx = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(row + x + 1), _mm256_loadu_ps(row + x - 1)), sx);
+				__m256 dz = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(below + x), _mm256_loadu_ps(above + x)), sz);
+				__m256 lengthSquared = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), one), _mm256_mul_ps(dz, dz));
+				__m256 inverseLength = _mm256_div_ps(one, _mm256_sqrt_ps(lengthSquared));
+				_mm256_storeu_ps(&out.x[x], _mm256_mul_ps(_mm256_xor_ps(dx, sign), inverseLength));
+				_mm256_storeu_ps(&out.y[x], inverseLength);
+				_mm256_storeu_ps(&out.z[x], _mm256_mul_ps(_mm256_xor_ps(dz, sign), inverseLength));
+			}
+			_mm256_zeroupper();
+			return x;
+		}
+
+		TERRAIN_TARGET_SSE41 static int SlopeRowSse41(const float *slopeX, const float *slopeZ, int first, int last, float scaleX, float scaleZ, Row &out)
+		{
+			__m128 sx = _mm_set1_ps(scaleX);
+			__m128 sz = _mm_set1_ps(scaleZ);
+			__m128 one = _mm_set1_ps(1.0f);
+			__m128 sign = _mm_set1_ps(-0.0f);
+
+			int x = first;
+			for (; x + 4 <= last; x += 4)
+			{
+				__m128 dx = _mm_mul_ps(_mm_loadu_ps(slopeX + x), sx);
+				__m128 dz = _mm_mul_ps(_mm_loadu_ps(slopeZ + x), sz);
+				__m128 lengthSquared = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), one), _mm_mul_ps(dz, dz));
+				__m128 inverseLength = _mm_div_ps(one, _mm_sqrt_ps(lengthSquared));
+				_mm_storeu_ps(&out.x[x], _mm_mul_ps(_mm_xor_ps(dx, sign), inverseLength));
+				_mm_storeu_ps(&out.y[x], inverseLength);
+				_mm_storeu_ps(&out.z[x], _mm_mul_ps(_mm_xor_ps(dz, sign), inverseLength));
+			}
+			return x;
+		}
+
+		TERRAIN_TARGET_AVX2 static int SlopeRowAvx2(const float *slopeX, const float *slopeZ, int first, int last, float scaleX, float scaleZ, Row &out)
+		{
+			__m256 sx = _mm256_set1_ps(scaleX);
+			__m256 sz = _mm256_set1_ps(scaleZ);
+			__m256 one = _mm256_set1_ps(1.0f);
+			__m256 sign = _mm256_set1_ps(-0.0f);
+
+			int x = first;
+			for (; x + 8 <= last; x += 8)
+			{
+				__m256 dx = _mm256_mul_ps(_mm256_loadu_ps(slopeX + x), sx);
+				__m256 dz = _mm256_mul_ps(_mm256_loadu_ps(slopeZ + x), sz);
+				__m256 lengthSquared = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), one), _mm256_mul_ps(dz, dz));
+				__m256 inverseLength = _mm256_div_ps(one, _mm256_sqrt_ps(lengthSquared));
+				_mm256_storeu_ps(&out.x[x], _mm256_mul_ps(_mm256_xor_ps(dx, sign), inverseLength));
+				_mm256_storeu_ps(&out.y[x], inverseLength);
+				_mm256_storeu_ps(&out.z[x], _mm256_mul_ps(_mm256_xor_ps(dz, sign), inverseLength));
+			}
+			_mm256_zeroupper();
+			return x;
+		}
+
+		//heightfield normals always have y > 0, so the lower hemisphere fold of EncodeOctahedral never applies
+		TERRAIN_TARGET_SSE41 static __m128i QuantiseSse41(__m128 value)
+		{
+			__m128 half = _mm_set1_ps(0.5f);
+			__m128 scaled = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(value, half), half), _mm_set1_ps(65535.0f));
+			return _mm_cvttps_epi32(_mm_add_ps(scaled, half));
+		}
+
+		TERRAIN_TARGET_SSE41 static int EncodeRowSse41(const Row &normals, int first, int last, uint16_t *out)
+		{
+			__m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+			__m128 one = _mm_set1_ps(1.0f);
+
+			int x = first;
+			for (; x + 4 <= last; x += 4)
+			{
+				__m128 nx = _mm_loadu_ps(&normals.x[x]);
+				__m128 ny = _mm_loadu_ps(&normals.y[x]);
+				__m128 nz = _mm_loadu_ps(&normals.z[x]);
+				__m128 sum = _mm_add_ps(_mm_add_ps(_mm_and_ps(nx, absMask), _mm_and_ps(ny, absMask)), _mm_and_ps(nz, absMask));
+				__m128 inverseSum = _mm_div_ps(one, sum);
+				__m128i u = QuantiseSse41(_mm_mul_ps(nx, inverseSum));
+				__m128i v = QuantiseSse41(_mm_mul_ps(nz, inverseSum));
+
+				//u in the low half and v in the high half of each 32 bits gives the interleaved pairs
+				__m128i packed = _mm_or_si128(u, _mm_slli_epi32(v, 16));
+				_mm_storeu_si128((__m128i*)(out + (x - first) * 2), packed);
+			}
+			return x;
+		}
+
+		TERRAIN_TARGET_AVX2 static __m256i QuantiseAvx2(__m256 value)
+		{
+			__m256 half = _mm256_set1_ps(0.5f);
+			__m256 scaled = _mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(value, half), half), _mm256_set1_ps(65535.0f));
+			return _mm256_cvttps_epi32(_mm256_add_ps(scaled, half));
+		}
+
+		TERRAIN_TARGET_AVX2 static int EncodeRowAvx2(const Row &normals, int first, int last, uint16_t *out)
+		{
+			__m256 absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+			__m256 one = _mm256_set1_ps(1.0f);
+
+			int x = first;
+			for (; x + 8 <= last; x += 8)
+			{
+				__m256 nx = _mm256_loadu_ps(&normals.x[x]);
+				__m256 ny = _mm256_loadu_ps(&normals.y[x]);
+				__m256 nz = _mm256_loadu_ps(&normals.z[x]);
+				__m256 sum = _mm256_add_ps(_mm256_add_ps(_mm256_and_ps(nx, absMask), _mm256_and_ps(ny, absMask)), _mm256_and_ps(nz, absMask));
+				__m256 inverseSum = _mm256_div_ps(one, sum);
+				__m256i u = QuantiseAvx2(_mm256_mul_ps(nx, inverseSum));
+				__m256i v = QuantiseAvx2(_mm256_mul_ps(nz, inverseSum));
+
+				__m256i packed = _mm256_or_si256(u, _mm256_slli_epi32(v, 16));
+				_mm256_storeu_si256((__m256i*)(out + (x - first) * 2), packed);
+			}
+			_mm256_zeroupper();
+			return x;
+		}
+#endif
+	};
+}
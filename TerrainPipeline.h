@@ -0,0 +1,278 @@
+#pragma once
+#include "CompactVertex.h"
+#include "TerrainGenerator.h"
+#include "TerrainMesh.h"
+#include "TerrainNormals.h"
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+namespace Terrain
+{
+	/// Shared with another thread to follow a long generate or abandon it part way. done counts up to total
+	/// in whatever units the work is split into, e.g. TerrainPipeline's tiles.
+	struct TerrainProgress
+	{
+		std::atomic<bool> cancelled;
+		std::atomic<int> done;
+		std::atomic<int> total;
+
+		TerrainProgress() : cancelled(false), done(0), total(0)
+		{
+		}
+
+		float GetFraction() const
+		{
+			int count = total;
+			return count > 0 ? (float)done / (float)count : 0.0f;
+		}
+	};
+
+	/// Generates a map tile by tile, taking each cache sized tile through noise, scaling, the min/max reduction,
+	/// normals and vertex packing in one sweep instead of streaming the whole map through cache once per pass.
+	/// Tiles run in parallel and their ranges are merged at the end. Only world continuous algorithms can be cut
+	/// into tiles, and the heights are bit for bit what Generate and WriteHeights give. So are the normals when
+	/// they come from NormalGenerator's differences, rather than the analytic slope of the noise.
+	class TerrainPipeline
+	{
+		struct TileRange
+		{
+			float min;
+			float max;
+		};
+
+		//per task scratch, heights of a tile plus its one sample halo, or a row of slopes when there is no halo
+		struct Scratch
+		{
+			std::vector<float> heights;
+			NormalGenerator::Row normals;
+			std::vector<uint16_t> octahedral;
+			std::vector<float> slopeX;
+			std::vector<float> slopeZ;
+		};
+
+		NormalGenerator normals;
+		std::vector<TileRange> ranges;
+
+		struct Job
+		{
+			TerrainGenerator *generator;
+			TerrainGenerator::Algorithm algorithm;
+			Heightfield *map;
+			float heightScale;
+			float spacingX;
+			float spacingZ;
+			TerrainVertex *vertices;
+			CompactTerrainVertex *compactVertices;
+			bool slopeNormals;
+		};
+
+		//scaled range of samples [first, last) of a row, then their vertices from the heights and scratch's normals
+		void WriteRow(const Job &job, int z, int x0, const float *row, int first, int last, Scratch &scratch, float &min, float &max) const
+		{
+			for (int x = first; x < last; ++x)
+			{
+				float height = row[x] * job.heightScale;
+				min = height < min ? height : min;
+				max = height > max ? height : max;
+			}
+
+			size_t rowStart = (size_t)z * job.map->GetWidth() + x0;
+			if (job.vertices)
+			{
+				TerrainVertex *vertex = job.vertices + rowStart;
+				for (int x = first; x < last; ++x, ++vertex)
+				{
+					vertex->pos[1] = row[x] * job.heightScale;
+					vertex->normal[0] = scratch.normals.x[x];
+					vertex->normal[1] = scratch.normals.y[x];
+					vertex->normal[2] = scratch.normals.z[x];
+				}
+			}
+			else
+			{
+				//heights wait for the merged range, the normals can go in now
+				normals.EncodeSpan(scratch.normals, first, last, &scratch.octahedral[0]);
+				CompactVertexPacker::WriteNormals(&scratch.octahedral[0], last - first, job.compactVertices + rowStart);
+			}
+		}
+
+		//with the analytic slope every sample's normal is its own, so rows go straight into the map with no halo
+		void RunTileFromSlopes(const Job &job, int x0, int z0, int x1, int z1, Scratch &scratch, TileRange &range) const
+		{
+			float min = 999999.0f;
+			float max = -999999.0f;
+			int count = x1 - x0;
+
+			for (int z = z0; z < z1; ++z)
+			{
+				float *row = job.map->GetRow(z) + x0;
+				job.generator->GenerateRow(job.algorithm, x0, z, count, row, &scratch.slopeX[0], &scratch.slopeZ[0]);
+				normals.ComputeSpanFromSlopes(&scratch.slopeX[0], &scratch.slopeZ[0], 0, count, job.heightScale, job.spacingX, job.spacingZ, scratch.normals);
+				WriteRow(job, z, x0, row, 0, count, scratch, min, max);
+			}
+
+			range.min = min;
+			range.max = max;
+		}
+
+		void RunTile(const Job &job, int tileX, int tileZ, Scratch &scratch, TileRange &range) const
+		{
+			int width = job.map->GetWidth();
+			int depth = job.map->GetDepth();
+
+			int x0 = tileX * tileSamplesX;
+			int z0 = tileZ * tileSamplesZ;
+			int x1 = x0 + tileSamplesX < width ? x0 + tileSamplesX : width;
+			int z1 = z0 + tileSamplesZ < depth ? z0 + tileSamplesZ : depth;
+
+			if (job.slopeNormals)
+			{
+				RunTileFromSlopes(job, x0, z0, x1, z1, scratch, range);
+				return;
+			}
+
+			//the halo stops at the map's edges, where the normals turn one-sided as they do for the whole map
+			int haloX0 = x0 > 0 ? x0 - 1 : 0;
+			int haloZ0 = z0 > 0 ? z0 - 1 : 0;
+			int haloX1 = x1 < width ? x1 + 1 : width;
+			int haloZ1 = z1 < depth ? z1 + 1 : depth;
+			int haloWidth = haloX1 - haloX0;
+			int stride = tileSamplesX + 2;
+
+			for (int z = haloZ0; z < haloZ1; ++z)
+				job.generator->GenerateRow(job.algorithm, haloX0, z, haloWidth, &scratch.heights[(z - haloZ0) * stride]);
+
+			float min = 999999.0f;
+			float max = -999999.0f;
+			int first = x0 - haloX0;
+			int last = x1 - haloX0;
+
+			for (int z = z0; z < z1; ++z)
+			{
+				const float *row = &scratch.heights[(z - haloZ0) * stride];
+				const float *above = &scratch.heights[((z > 0 ? z - 1 : z) - haloZ0) * stride];
+				const float *below = &scratch.heights[((z + 1 < depth ? z + 1 : z) - haloZ0) * stride];
+
+				std::copy(row + first, row + last, job.map->GetRow(z) + x0);
+				normals.ComputeSpan(above, row, below, haloWidth, first, last, z > 0 && z + 1 < depth, job.heightScale, job.spacingX, job.spacingZ, scratch.normals);
+				WriteRow(job, z, x0, row, first, last, scratch, min, max);
+			}
+
+			range.min = min;
+			range.max = max;
+		}
+
+		bool Run(const Job &job, float &min, float &max)
+		{
+			if (!TerrainGenerator::IsWorldContinuous(job.algorithm))
+				return false;
+
+			TERRAIN_PROFILE_SCOPE("pipeline");
+			TerrainGenerator &generator = *job.generator;
+			if (!job.map->Resize(generator.GetCellsX() + 1, generator.GetCellsZ() + 1))
+				return false;
+
+			int width = job.map->GetWidth();
+			int depth = job.map->GetDepth();
+			int tilesX = (width + tileSamplesX - 1) / tileSamplesX;
+			int tileCount = GetTileCount(width, depth);
+			ranges.resize(tileCount);
+
+			generator.BeginRows(job.algorithm);
+
+			ThreadPool &threadPool = generator.GetThreadPool();
+			threadPool.ParallelFor(0, tileCount, threadPool.GetGrainSize(tileCount), [&](int firstTile, int lastTile)
+			{
+				Scratch scratch;
+				scratch.normals.Resize(tileSamplesX + 2);
+				scratch.octahedral.resize((size_t)tileSamplesX * 2);
+				if (job.slopeNormals)
+				{
+					scratch.slopeX.resize(tileSamplesX);
+					scratch.slopeZ.resize(tileSamplesX);
+				}
+				else
+					scratch.heights.resize((size_t)(tileSamplesX + 2) * (tileSamplesZ + 2));
+
+				for (int tile = firstTile; tile < lastTile; ++tile)
+				{
+					if (progress && progress->cancelled)
+						return;
+					RunTile(job, tile % tilesX, tile / tilesX, scratch, ranges[tile]);
+					if (progress)
+						++progress->done;
+				}
+			});
+
+			if (progress && progress->cancelled)
+				return false;
+
+			TERRAIN_PROFILE_SCOPE("range");
+			min = 999999.0f;
+			max = -999999.0f;
+			for (int tile = 0; tile < tileCount; ++tile)
+			{
+				min = ranges[tile].min < min ? ranges[tile].min : min;
+				max = ranges[tile].max > max ? ranges[tile].max : max;
+			}
+
+			//compact heights are fractions of the whole map's range, a short pass over the freshly written map
+			if (job.compactVertices)
+			{
+				float range = max - min;
+				float toUnit = range > 0.0f ? 65535.0f / range : 0.0f;
+				threadPool.ParallelFor(0, depth, threadPool.GetGrainSize(depth), [&](int firstRow, int lastRow)
+				{
+					for (int z = firstRow; z < lastRow; ++z)
+						CompactVertexPacker::QuantiseRow(job.map->GetRow(z), width, job.heightScale, min, toUnit, job.compactVertices + (size_t)z * width);
+				});
+			}
+			return true;
+		}
+
+	public:
+		/// Samples along each edge of a tile. Wide tiles keep the noise kernels on long rows and regenerate little
+		/// halo, 512 x 64 with its halo is about 136KB of heights, which stays in L2 while the normals and vertices
+		/// are written.
+		int tileSamplesX = 512;
+		int tileSamplesZ = 64;
+
+		/// Perlin and fBm normals come from the noise's analytic slope, which is exact, reads no neighbouring
+		/// samples and needs no halo. Off, every algorithm takes central differences of the heights.
+		bool analyticNormals = true;
+
+		/// When set, every finished tile counts one towards progress->done, and a run stops starting tiles once
+		/// progress->cancelled is raised, returning false with the map part written. total is the caller's to set.
+		TerrainProgress *progress = nullptr;
+
+		int GetTileCount(int width, int depth) const
+		{
+			return ((width + tileSamplesX - 1) / tileSamplesX) * ((depth + tileSamplesZ - 1) / tileSamplesZ);
+		}
+
+		NormalGenerator &GetNormalGenerator() { return normals; }
+
+		bool UseSlopes(TerrainGenerator::Algorithm algorithm) const { return analyticNormals && TerrainGenerator::HasAnalyticSlope(algorithm); }
+
+		/// Fills map with the algorithm's (cellsX + 1) x (cellsZ + 1) unscaled heights, as Generate would, and
+		/// writes the scaled height and normal of every vertex. The vertices' x, z and uv are left as laid out by
+		/// TerrainMeshBuilder::BuildPlane. Returns false, having done nothing, when the algorithm cannot be tiled or the
+		/// map cannot be sized, and also when cancelled through progress.
+		bool Generate(TerrainGenerator &generator, TerrainGenerator::Algorithm algorithm, float heightScale, float spacingX, float spacingZ,
+			Heightfield &map, TerrainVertex *vertices, float &min, float &max)
+		{
+			Job job = { &generator, algorithm, &map, heightScale, spacingX, spacingZ, vertices, nullptr, UseSlopes(algorithm) };
+			return Run(job, min, max);
+		}
+
+		/// As above for the CompactTerrainVertex layout laid out by CompactVertexPacker::BuildPlane.
+		bool Generate(TerrainGenerator &generator, TerrainGenerator::Algorithm algorithm, float heightScale, float spacingX, float spacingZ,
+			Heightfield &map, CompactTerrainVertex *vertices, float &min, float &max)
+		{
+			Job job = { &generator, algorithm, &map, heightScale, spacingX, spacingZ, nullptr, vertices, UseSlopes(algorithm) };
+			return Run(job, min, max);
+		}
+	};
+}
@@ -0,0 +1,397 @@
+#pragma once
+
+//0 compiles every profiling scope and allocation count out, the macros below then expand to nothing
+#ifndef TERRAIN_PROFILING
+#define TERRAIN_PROFILING 1
+#endif
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <vector>
+
+namespace Terrain
+{
+	/// Running totals for one stage, e.g. "normals", or one level of it, e.g. "diamondSquare.level" 64.
+	/// Allocations are the ones made on any thread while a scope of the stage was open.
+	struct ProfileStage
+	{
+		const char *name;
+		int detail; //-1 when the stage has no levels
+		unsigned count;
+		double totalMs;
+		double lastMs;
+		double minMs;
+		double maxMs;
+		uint64_t allocations;
+		uint64_t allocatedBytes;
+	};
+
+	/// One closed scope, as the Chrome trace shows it.
+	struct ProfileEvent
+	{
+		const char *name;
+		int detail;
+		unsigned thread; //small index in the order threads were first seen
+		double startUs;
+		double durationUs;
+		uint64_t allocations;
+		uint64_t allocatedBytes;
+	};
+
+	//zero before any constructor runs, so allocations can be counted during static initialisation too
+	template <class Tag>
+	struct AllocationCounters
+	{
+		static std::atomic<unsigned long long> count;
+		static std::atomic<unsigned long long> bytes;
+	};
+
+	template <class Tag> std::atomic<unsigned long long> AllocationCounters<Tag>::count;
+	template <class Tag> std::atomic<unsigned long long> AllocationCounters<Tag>::bytes;
+
+	/// Collects the scopes TERRAIN_PROFILE_SCOPE opens around each generation stage. Every stage keeps totals for
+	/// the in-app query, and the latest maxEvents scopes are kept for a Chrome trace (chrome://tracing or Perfetto).
+	/// Scopes are meant for whole stages, a handful per generate, recording one takes a lock.
+	class Profiler
+	{
+		typedef std::chrono::high_resolution_clock Clock;
+		typedef AllocationCounters<Profiler> Counters;
+
+		Clock::time_point origin;
+		std::atomic<bool> enabled;
+
+		mutable std::mutex lock;
+		std::vector<ProfileStage> stages;
+		std::vector<ProfileEvent> events;
+		size_t nextEvent = 0; //where the next event goes once events is full
+		std::vector<std::thread::id> threads;
+
+		//reserved up front so recording never allocates inside the scopes still open around it
+		Profiler() : origin(Clock::now()), enabled(true)
+		{
+			stages.reserve(64);
+			events.reserve(maxEvents);
+			threads.reserve(64);
+		}
+
+		Profiler(const Profiler &);
+		Profiler &operator=(const Profiler &);
+
+		unsigned GetThreadIndex(std::thread::id id)
+		{
+			for (size_t i = 0; i < threads.size(); ++i)
+			{
+				if (threads[i] == id)
+					return (unsigned)i;
+			}
+			threads.push_back(id);
+			return (unsigned)threads.size() - 1;
+		}
+
+		ProfileStage &GetStage(const char *name, int detail)
+		{
+			for (size_t i = 0; i < stages.size(); ++i)
+			{
+				if (stages[i].detail == detail && (stages[i].name == name || strcmp(stages[i].name, name) == 0))
+					return stages[i];
+			}
+
+			ProfileStage stage = { name, detail, 0, 0.0, 0.0, 0.0, 0.0, 0, 0 };
+			stages.push_back(stage);
+			return stages.back();
+		}
+
+		//events oldest first
+		std::vector<ProfileEvent> GetEventsInOrder() const
+		{
+			std::vector<ProfileEvent> ordered;
+			ordered.reserve(events.size());
+			for (size_t i = 0; i < events.size(); ++i)
+				ordered.push_back(events[(nextEvent + i) % events.size()]);
+			return ordered;
+		}
+
+		//returns the characters written
+		static int PrintName(FILE *file, const ProfileStage &stage)
+		{
+			if (stage.detail >= 0)
+				return fprintf(file, "%s %d", stage.name, stage.detail);
+			return fprintf(file, "%s", stage.name);
+		}
+
+	public:
+		static const size_t maxEvents = 16384;
+
+		static Profiler &Get()
+		{
+			static Profiler profiler;
+			return profiler;
+		}
+
+		/// Scopes opened while disabled are not recorded, allocations are always counted.
+		bool IsEnabled() const { return enabled; }
+		void SetEnabled(bool enable) { enabled = enable; }
+
+		/// Microseconds since the profiler was created, the time base of the trace.
+		double GetTimeUs() const
+		{
+			return std::chrono::duration<double, std::micro>(Clock::now() - origin).count();
+		}
+
+		static void CountAllocation(size_t bytes)
+		{
+			++Counters::count;
+			Counters::bytes += bytes;
+		}
+
+		static uint64_t GetAllocationCount() { return Counters::count; }
+		static uint64_t GetAllocatedBytes() { return Counters::bytes; }
+
+		void Record(const char *name, int detail, double startUs, double endUs, uint64_t allocations, uint64_t allocatedBytes)
+		{
+			double ms = (endUs - startUs) / 1000.0;
+
+			std::lock_guard<std::mutex> guard(lock);
+			ProfileStage &stage = GetStage(name, detail);
+			stage.minMs = stage.count == 0 || ms < stage.minMs ? ms : stage.minMs;
+			stage.maxMs = stage.count == 0 || ms > stage.maxMs ? ms : stage.maxMs;
+			stage.lastMs = ms;
+			stage.totalMs += ms;
+			stage.allocations += allocations;
+			stage.allocatedBytes += allocatedBytes;
+			++stage.count;
+
+			ProfileEvent event = { name, detail, GetThreadIndex(std::this_thread::get_id()), startUs, endUs - startUs, allocations, allocatedBytes };
+			if (events.size() < maxEvents)
+				events.push_back(event);
+			else
+			{
+				events[nextEvent] = event;
+				nextEvent = (nextEvent + 1) % maxEvents;
+			}
+		}
+
+		/// Totals for a stage, false if it has not run since the last Reset.
+		bool GetStage(const char *name, int detail, ProfileStage &out) const
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			for (size_t i = 0; i < stages.size(); ++i)
+			{
+				if (stages[i].detail == detail && strcmp(stages[i].name, name) == 0)
+				{
+					out = stages[i];
+					return true;
+				}
+			}
+			return false;
+		}
+
+		bool GetStage(const char *name, ProfileStage &out) const { return GetStage(name, -1, out); }
+
+		/// Every stage in the order it first ran.
+		std::vector<ProfileStage> GetStages() const
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			return stages;
+		}
+
+		/// Forgets the stages and events, the allocation counters keep running.
+		void Reset()
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			stages.clear();
+			events.clear();
+			nextEvent = 0;
+		}
+
+		/// A table of the stages.
+		void Print(FILE *file) const
+		{
+			std::vector<ProfileStage> snapshot = GetStages();
+			fprintf(file, "%-28s %6s %10s %10s %10s %10s %10s %12s\n", "stage", "count", "last ms", "mean ms", "min ms", "max ms", "allocs", "bytes");
+			for (size_t i = 0; i < snapshot.size(); ++i)
+			{
+				const ProfileStage &stage = snapshot[i];
+				int written = PrintName(file, stage);
+				fprintf(file, "%*s %6u %10.3f %10.3f %10.3f %10.3f %10llu %12llu\n", written < 28 ? 28 - written : 0, "", stage.count, stage.lastMs, stage.totalMs / stage.count,
+					stage.minMs, stage.maxMs, (unsigned long long)stage.allocations, (unsigned long long)stage.allocatedBytes);
+			}
+		}
+
+		/// The stage totals as JSON, for comparing runs against each other.
+		bool WriteJson(const char *path) const
+		{
+			FILE *file = fopen(path, "w");
+			if (!file)
+				return false;
+
+			std::vector<ProfileStage> snapshot = GetStages();
+			fprintf(file, "{\n  \"allocations\": %llu,\n  \"allocatedBytes\": %llu,\n  \"stages\": [\n",
+				(unsigned long long)GetAllocationCount(), (unsigned long long)GetAllocatedBytes());
+			for (size_t i = 0; i < snapshot.size(); ++i)
+			{
+				const ProfileStage &stage = snapshot[i];
+				fprintf(file, "    { \"name\": \"%s\", \"detail\": %d, \"count\": %u, \"totalMs\": %.6f, \"lastMs\": %.6f, \"minMs\": %.6f, \"maxMs\": %.6f, "
+					"\"allocations\": %llu, \"allocatedBytes\": %llu }%s\n",
+					stage.name, stage.detail, stage.count, stage.totalMs, stage.lastMs, stage.minMs, stage.maxMs,
+					(unsigned long long)stage.allocations, (unsigned long long)stage.allocatedBytes, i + 1 < snapshot.size() ? "," : "");
+			}
+			fprintf(file, "  ]\n}\n");
+			return fclose(file) == 0;
+		}
+
+		/// The kept events in the Chrome trace event format, complete events nested by time on each thread.
+		bool WriteChromeTrace(const char *path) const
+		{
+			FILE *file = fopen(path, "w");
+			if (!file)
+				return false;
+
+			std::vector<ProfileEvent> ordered;
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				ordered = GetEventsInOrder();
+			}
+
+			fprintf(file, "{\"traceEvents\":[\n");
+			for (size_t i = 0; i < ordered.size(); ++i)
+			{
+				const ProfileEvent &event = ordered[i];
+				fprintf(file, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"allocations\":%llu,\"bytes\":%llu",
+					event.name, event.thread, event.startUs, event.durationUs, (unsigned long long)event.allocations, (unsigned long long)event.allocatedBytes);
+				if (event.detail >= 0)
+					fprintf(file, ",\"level\":%d", event.detail);
+				fprintf(file, "}}%s\n", i + 1 < ordered.size() ? "," : "");
+			}
+			fprintf(file, "],\"displayTimeUnit\":\"ms\"}\n");
+			return fclose(file) == 0;
+		}
+	};
+
+	/// Times its own lifetime into the profiler as the named stage. name must outlive the profiler, a literal.
+	class ProfileScope
+	{
+		const char *name;
+		int detail;
+		bool recording;
+		double startUs;
+		uint64_t startAllocations;
+		uint64_t startBytes;
+
+		ProfileScope(const ProfileScope &);
+		ProfileScope &operator=(const ProfileScope &);
+
+	public:
+		explicit ProfileScope(const char *name, int detail = -1) : name(name), detail(detail), recording(Profiler::Get().IsEnabled()),
+			startUs(0.0), startAllocations(0), startBytes(0)
+		{
+			if (!recording)
+				return;
+			startAllocations = Profiler::GetAllocationCount();
+			startBytes = Profiler::GetAllocatedBytes();
+			startUs = Profiler::Get().GetTimeUs();
+		}
+
+		~ProfileScope()
+		{
+			if (!recording)
+				return;
+			Profiler &profiler = Profiler::Get();
+			double endUs = profiler.GetTimeUs();
+			profiler.Record(name, detail, startUs, endUs, Profiler::GetAllocationCount() - startAllocations, Profiler::GetAllocatedBytes() - startBytes);
+		}
+	};
+}
+
+#define TERRAIN_PROFILE_JOIN_INNER(a, b) a##b
+#define TERRAIN_PROFILE_JOIN(a, b) TERRAIN_PROFILE_JOIN_INNER(a, b)
+
+#if TERRAIN_PROFILING
+/// Times the rest of the enclosing block as a stage.
+#define TERRAIN_PROFILE_SCOPE(name) ::Terrain::ProfileScope TERRAIN_PROFILE_JOIN(profileScope, __LINE__)(name)
+/// As above for one level of a stage, e.g. the step size of a refinement pass.
+#define TERRAIN_PROFILE_SCOPE_DETAIL(name, detail) ::Terrain::ProfileScope TERRAIN_PROFILE_JOIN(profileScope, __LINE__)(name, detail)
+/// Counts an allocation that does not go through operator new, e.g. an aligned one.
+#define TERRAIN_PROFILE_ALLOCATION(bytes) ::Terrain::Profiler::CountAllocation(bytes)
+#else
+#define TERRAIN_PROFILE_SCOPE(name) ((void)0)
+#define TERRAIN_PROFILE_SCOPE_DETAIL(name, detail) ((void)0)
+#define TERRAIN_PROFILE_ALLOCATION(bytes) ((void)0)
+#endif
+
+//Defined in exactly one source file of a program, before this header is included, this replaces the global
+//operator new and delete so every heap allocation is counted, not only the aligned ones the terrain makes itself.
+#if TERRAIN_PROFILING && defined(TERRAIN_PROFILE_COUNT_NEW)
+//GCC inlines these deletes and, not seeing that new is replaced too, takes free for the wrong deallocator
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void *operator new(size_t size)
+{
+	::Terrain::Profiler::CountAllocation(size);
+	void *ptr = malloc(size ? size : 1);
+	if (!ptr)
+		throw std::bad_alloc();
+	return ptr;
+}
+
+void *operator new[](size_t size)
+{
+	return operator new(size);
+}
+
+void *operator new(size_t size, const std::nothrow_t &)
+{
+	::Terrain::Profiler::CountAllocation(size);
+	return malloc(size ? size : 1);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &nothrow)
+{
+	return operator new(size, nothrow);
+}
+
+void operator delete(void *ptr)
+{
+	free(ptr);
+}
+
+void operator delete[](void *ptr)
+{
+	free(ptr);
+}
+
+void operator delete(void *ptr, const std::nothrow_t &)
+{
+	free(ptr);
+}
+
+void operator delete[](void *ptr, const std::nothrow_t &)
+{
+	free(ptr);
+}
+
+//the sized forms C++14 calls when it knows the size, which would otherwise go to the library's delete
+void operator delete(void *ptr, size_t)
+{
+	free(ptr);
+}
+
+void operator delete[](void *ptr, size_t)
+{
+	free(ptr);
+}
+
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic pop
+#endif
+#endif
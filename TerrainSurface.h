@@ -0,0 +1,168 @@
+#pragma once
+#include "BackgroundGenerator.h"
+#include "CompressedHeightfield.h"
+#include "HeightfieldQuery.h"
+#include "SurfaceBuilder.h"
+#include "TerrainLod.h"
+#if OCTET_BULLET
+#include "TerrainCollision.h"
+#endif
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace Terrain
+{
+	/// The map a terrain shows and what is kept over it: the query, the geomipmap, the splat texels and with Bullet
+	/// the static body. However the map arrives, built, swapped in from the background, decoded from a snapshot or
+	/// read from a stored tile, they are all pointed at it together, at the scale and spacing it was built with.
+	/// CustomTerrain draws one, it needs no window so TerrainTests drives the same code headless.
+	class TerrainSurface
+	{
+		Heightfield map;
+		HeightfieldQuery query; //over map, empty while a stored tile is shown
+		GeoMipmap lod;
+		bool lodBuilt = false;
+		std::vector<uint8_t> splat; //four bytes a sample, empty without splat rules and for a stored tile
+		bool mapShown = false; //map is what is on show, not stale from before a ShowTile
+
+		//what the heights on show are scaled by and how far apart they are
+		float heightScale = 0.0f;
+		float spacingX = 0.0f;
+		float spacingZ = 0.0f;
+
+		//what the map was generated from, which the terrain's settings may have moved on from
+		unsigned seed = 0;
+		TerrainGenerator::Algorithm algorithm = TerrainGenerator::MidpointDisplacement;
+
+#if OCTET_BULLET
+		//reads the heights on show where they are, map or a mapped tile
+		TerrainCollisionBody collision;
+#endif
+
+		TerrainSurface(const TerrainSurface &);
+		TerrainSurface &operator=(const TerrainSurface &);
+
+		//min and max are the heights' range scaled by heightScale, as the mesh got it
+		void UpdateCollision(const float *heights, int width, int depth, int stride, float min, float max)
+		{
+#if OCTET_BULLET
+			if (heightScale != 0.0f)
+				collision.Update(heights, width, depth, stride, spacingX, spacingZ, heightScale, min / heightScale, max / heightScale);
+#else
+			(void)heights, (void)width, (void)depth, (void)stride, (void)min, (void)max;
+#endif
+		}
+
+		//the query, geomipmap and body over a map just built or decoded with settings from seed
+		void Follow(const SurfaceBuilder::Settings &settings, unsigned seed, int lodPatchCells, float min, float max, ThreadPool &threadPool)
+		{
+			mapShown = true;
+			this->seed = seed;
+			algorithm = settings.algorithm;
+			heightScale = settings.heightScale;
+			spacingX = settings.spacingX;
+			spacingZ = settings.spacingZ;
+			query.Build(map, heightScale, spacingX, spacingZ, threadPool);
+			lodBuilt = lodPatchCells > 0 && lod.Build(map, lodPatchCells, spacingX, heightScale, threadPool);
+			UpdateCollision(map.GetData(), map.GetWidth(), map.GetDepth(), map.GetStride(), min, max);
+		}
+
+	public:
+		TerrainSurface()
+		{
+		}
+
+		/// Builds the map from generator and its vertices as SurfaceBuilder::Build does, then what is kept over it.
+		/// lodPatchCells of 0 builds no geomipmap.
+		void Build(SurfaceBuilder &builder, TerrainGenerator &generator, const SurfaceBuilder::Settings &settings, int lodPatchCells,
+			TerrainVertex *vertices, CompactTerrainVertex *compactVertices, float &min, float &max)
+		{
+			builder.Build(generator, settings, map, vertices, compactVertices, min, max, &splat);
+			Follow(settings, generator.GetSeed(), lodPatchCells, min, max, generator.GetThreadPool());
+		}
+
+		/// Decodes a snapshot in place of the map, false and the map untouched if it does not decode. Call
+		/// BuildFromMap straight after, until then nothing over the map follows it.
+		bool Decompress(const CompressedHeightfield &snapshot, ThreadPool &threadPool)
+		{
+			Heightfield decoded;
+			if (!snapshot.Decompress(decoded, threadPool))
+				return false;
+			std::swap(map, decoded);
+			return true;
+		}
+
+		/// Writes the vertices of the map Decompress left as SurfaceBuilder::BuildFromMap does, then what is kept over it.
+		/// seed and settings.algorithm are what the map was generated from, as the snapshot has them.
+		void BuildFromMap(SurfaceBuilder &builder, const SurfaceBuilder::Settings &settings, unsigned seed, int lodPatchCells,
+			TerrainVertex *vertices, CompactTerrainVertex *compactVertices, float &min, float &max, ThreadPool &threadPool)
+		{
+			builder.BuildFromMap(settings, map, vertices, compactVertices, min, max, threadPool, &splat);
+			Follow(settings, seed, lodPatchCells, min, max, threadPool);
+		}
+
+		/// Takes the map a BackgroundGenerator built with its query, geomipmap and splat texels, giving the old ones
+		/// to surface for the next job to reuse. The body follows at the scale and spacing surface was built with.
+		void Take(GeneratedSurface &surface)
+		{
+			std::swap(map, surface.map);
+			query.Swap(surface.query);
+			query.Attach(map);
+			surface.query.Attach(surface.map);
+			std::swap(lod, surface.lod);
+			splat.swap(surface.splat);
+			lodBuilt = surface.lodBuilt;
+			mapShown = true;
+
+			heightScale = surface.heightScale;
+			spacingX = surface.spacingX;
+			spacingZ = surface.spacingZ;
+			seed = surface.seed;
+			algorithm = surface.algorithm;
+			UpdateCollision(map.GetData(), map.GetWidth(), map.GetDepth(), map.GetStride(), surface.min, surface.max);
+		}
+
+		/// Shows a stored tile's size x size heights where they are, rows stride floats apart, leaving the map stale.
+		/// There is no query, geomipmap or splat map for a tile, only the body follows. min and max are the
+		/// heights' range scaled by heightScale.
+		void ShowTile(const float *heights, int size, int stride, float spacing, float heightScale, float min, float max)
+		{
+			mapShown = false;
+			query.Clear();
+			lodBuilt = false;
+			splat.clear();
+
+			this->heightScale = heightScale;
+			spacingX = spacing;
+			spacingZ = spacing;
+			UpdateCollision(heights, size, size, stride, min, max);
+		}
+
+		/// The last map built, decoded or taken, stale after ShowTile.
+		const Heightfield &GetMap() const { return map; }
+		bool IsMapShown() const { return mapShown; }
+
+		/// What the heights on show are scaled by, which a background surface's may differ from the terrain's now.
+		float GetHeightScale() const { return heightScale; }
+		float GetSpacingX() const { return spacingX; }
+		float GetSpacingZ() const { return spacingZ; }
+
+		/// What the map was generated from, for a snapshot of it. The terrain's seed and algorithm may be the next map's.
+		unsigned GetSeed() const { return seed; }
+		TerrainGenerator::Algorithm GetAlgorithm() const { return algorithm; }
+
+		const HeightfieldQuery &GetQuery() const { return query; }
+		GeoMipmap &GetLod() { return lod; }
+		const GeoMipmap &GetLod() const { return lod; }
+		bool IsLodBuilt() const { return lodBuilt; }
+		const std::vector<uint8_t> &GetSplat() const { return splat; }
+
+#if OCTET_BULLET
+		/// The body over the heights on show. Its shape is the same object for the surface's lifetime.
+		TerrainCollisionBody &GetCollision() { return collision; }
+		const TerrainCollisionBody &GetCollision() const { return collision; }
+#endif
+	};
+}
@@ -0,0 +1,1964 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Headless checks for the terrain core. Each test runs the real code on small
+// maps and holds it to what it promises: exact round trips, bounded error, the
+// same bits whichever path or thread count produced them. Prints a line per
+// test and exits non-zero if any check failed. Built with OCTET_BULLET, as
+// its project is, it also drops bodies on the terrain's Bullet heightfield.
+//
+//   TerrainTests               run every test
+//   TerrainTests compact       run the tests whose name starts with compact
+//
+
+#include "BackgroundGenerator.h"
+#include "CompactVertex.h"
+#include "CompressedHeightfield.h"
+#include "CpuFeatures.h"
+#include "HeightfieldQuery.h"
+#include "MultiFractal.h"
+#include "SplatMap.h"
+#include "TexturePack.h"
+#include "TerrainErosion.h"
+#include "TerrainGenerator.h"
+#include "TerrainLod.h"
+#include "TerrainMesh.h"
+#include "TerrainNormals.h"
+#include "TerrainPipeline.h"
+#include "TerrainSurface.h"
+#include "TileStore.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <climits>
+#include <cstddef>
+#include <chrono>
+#include <cmath>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <string>
+#include <utility>
+#include <thread>
+#include <vector>
+
+using namespace Terrain;
+
+namespace
+{
+	struct Test
+	{
+		const char *name;
+		void (*run)();
+	};
+
+	int failures = 0;
+
+	/// Counts a failed check and prints what failed, printf style. Returns passed so a test can stop early.
+	bool Check(bool passed, const char *format, ...)
+	{
+		if (passed)
+			return true;
+
+		++failures;
+		va_list args;
+		va_start(args, format);
+		printf("    ");
+		vprintf(format, args);
+		printf("\n");
+		va_end(args);
+		return false;
+	}
+
+	/// Whether this CPU runs a kernel. The kernel enums all go Scalar, Sse41, Avx2.
+	bool IsSupported(int kernel)
+	{
+		const CpuFeatures &cpu = CpuFeatures::Get();
+		return kernel == 0 || (kernel == 1 && cpu.HasSse41()) || (kernel == 2 && cpu.HasAvx2());
+	}
+
+	/// Samples of a width x depth window at (ax, az) in a whose bits differ from the window at (bx, bz) in b.
+	int CountDifferences(const Heightfield &a, int ax, int az, const Heightfield &b, int bx, int bz, int width, int depth)
+	{
+		int differ = 0;
+		for (int z = 0; z < depth; ++z)
+		{
+			const float *rowA = a.GetRow(az + z) + ax;
+			const float *rowB = b.GetRow(bz + z) + bx;
+			for (int x = 0; x < width; ++x)
+				differ += memcmp(rowA + x, rowB + x, sizeof(float)) != 0;
+		}
+		return differ;
+	}
+
+	bool ReadFile(const char *path, std::vector<uint8_t> &bytes)
+	{
+		FILE *file = fopen(path, "rb");
+		if (!file)
+			return false;
+		bytes.clear();
+		uint8_t buffer[65536];
+		size_t read;
+		while ((read = fread(buffer, 1, sizeof(buffer), file)) > 0)
+			bytes.insert(bytes.end(), buffer, buffer + read);
+		fclose(file);
+		return true;
+	}
+
+	bool WriteFile(const char *path, const std::vector<uint8_t> &bytes)
+	{
+		FILE *file = fopen(path, "wb");
+		if (!file)
+			return false;
+		bool written = bytes.empty() || fwrite(&bytes[0], 1, bytes.size(), file) == bytes.size();
+		return fclose(file) == 0 && written;
+	}
+
+	template <class Value>
+	void Poke(std::vector<uint8_t> &bytes, size_t offset, Value value)
+	{
+		memcpy(&bytes[offset], &value, sizeof(value));
+	}
+
+	//angle between two unit normals in degrees, from the cross product as well as the dot so that hundredths of a
+	//degree are not lost to the normals' float lengths
+	double AngleBetween(const float a[3], const float b[3])
+	{
+		double dot = (double)a[0] * b[0] + (double)a[1] * b[1] + (double)a[2] * b[2];
+		double crossX = (double)a[1] * b[2] - (double)a[2] * b[1];
+		double crossY = (double)a[2] * b[0] - (double)a[0] * b[2];
+		double crossZ = (double)a[0] * b[1] - (double)a[1] * b[0];
+		return atan2(sqrt(crossX * crossX + crossY * crossY + crossZ * crossZ), dot) * 57.29577951;
+	}
+
+	/// A size that cannot be had is refused and leaves the heightfield as it was, for Resize and the generators alike.
+	void TestHeightfieldResize()
+	{
+		TerrainGenerator generator(16, 16);
+		generator.SetSeed(3);
+		Heightfield map;
+		generator.Generate(TerrainGenerator::FractionalBrownianMotion, map);
+		Heightfield before = map;
+
+		const int sizes[][2] = { { -1, 4 }, { 4, -1 }, { INT_MAX, 1 }, { INT_MAX - 8, 2 } };
+		for (const int *size : sizes)
+		{
+			Check(!map.Resize(size[0], size[1]), "%dx%d: resized", size[0], size[1]);
+			Check(!generator.GenerateRegion(TerrainGenerator::FractionalBrownianMotion, 0, 0, size[0], size[1], map), "%dx%d: region generated",
+				size[0], size[1]);
+		}
+		Check(map.GetWidth() == before.GetWidth() && map.GetDepth() == before.GetDepth() && map.GetStride() == before.GetStride() &&
+			memcmp(map.GetData(), before.GetData(), map.GetSizeInBytes()) == 0, "the map changed");
+
+		Check(map.Resize(0, 0) && map.GetData() == nullptr && map.Resize(3, 2) && map.GetStride() == Heightfield::floatsPerLine, "small sizes refused");
+	}
+
+	/// Packs a generated map both ways and unpacks the compact vertices again. Positions and uvs come back exactly,
+	/// heights to within half a quantisation step and normals to within the 8-bit octahedral encoding's error.
+	void TestCompactRoundTrip()
+	{
+		const int sizes[][2] = { { 128, 128 }, { 37, 100 }, { 1, 1 } };
+		for (const int *size : sizes)
+		{
+			int cellsX = size[0];
+			int cellsZ = size[1];
+			float spacingX = 200.0f / cellsX;
+			float spacingZ = 150.0f / cellsZ;
+			float heightScale = 50.0f;
+
+			TerrainGenerator generator(cellsX, cellsZ);
+			generator.SetSeed(5);
+			Heightfield map;
+			generator.Generate(TerrainGenerator::FractionalBrownianMotion, map);
+
+			int count = (cellsX + 1) * (cellsZ + 1);
+			std::vector<TerrainVertex> vertices(count);
+			float min, max;
+			TerrainMeshBuilder::BuildPlane(cellsX, cellsZ, spacingX, spacingZ, &vertices[0], nullptr);
+			TerrainMeshBuilder::WriteHeights(map, heightScale, &vertices[0], min, max);
+			NormalGenerator normals;
+			normals.Compute(map, heightScale, spacingX, spacingZ, vertices[0].normal, sizeof(TerrainVertex) / sizeof(float), generator.GetThreadPool());
+
+			std::vector<CompactTerrainVertex> compact(count);
+			std::vector<uint16_t> octahedral(count * 2);
+			float compactMin, compactMax;
+			CompactVertexPacker::BuildPlane(cellsX, cellsZ, &compact[0]);
+			CompactVertexPacker::WriteHeights(map, heightScale, &compact[0], compactMin, compactMax);
+			normals.ComputeOctahedral(map, heightScale, spacingX, spacingZ, &octahedral[0], generator.GetThreadPool());
+			CompactVertexPacker::WriteNormals(&octahedral[0], count, &compact[0]);
+			if (!Check(compactMin == min && compactMax == max, "%dx%d: range %g..%g, float layout gives %g..%g", cellsX, cellsZ, compactMin, compactMax, min, max))
+				continue;
+
+			//encoding the float normals must give the same bytes as narrowing the 16-bit ones
+			std::vector<CompactTerrainVertex> fromFloats(compact);
+			for (int i = 0; i < count; ++i)
+				CompactVertexPacker::WriteNormals(vertices[i].normal, 1, &fromFloats[i]);
+
+			float halfStep = (max - min) / 65535.0f * 0.5f + 4.0f * FLT_EPSILON * std::max(fabsf(min), fabsf(max));
+			float uvStepX = TerrainMeshBuilder::GetUvStep(cellsX);
+			float uvStepZ = TerrainMeshBuilder::GetUvStep(cellsZ);
+			int positionErrors = 0, uvErrors = 0, normalMismatches = 0;
+			float heightError = 0.0f;
+			double normalError = 0.0;
+			for (int i = 0; i < count; ++i)
+			{
+				TerrainVertex unpacked;
+				CompactVertexPacker::Unpack(compact[i], spacingX, spacingZ, uvStepX, uvStepZ, min, max, unpacked);
+				const TerrainVertex &expected = vertices[i];
+				positionErrors += unpacked.pos[0] != expected.pos[0] || unpacked.pos[2] != expected.pos[2];
+				uvErrors += unpacked.uv[0] != expected.uv[0] || unpacked.uv[1] != expected.uv[1];
+				heightError = std::max(heightError, fabsf(unpacked.pos[1] - expected.pos[1]));
+				normalError = std::max(normalError, AngleBetween(unpacked.normal, expected.normal));
+				normalMismatches += memcmp(fromFloats[i].normal, compact[i].normal, sizeof(compact[i].normal)) != 0;
+			}
+
+			Check(positionErrors == 0, "%dx%d: %d positions differ", cellsX, cellsZ, positionErrors);
+			Check(uvErrors == 0, "%dx%d: %d uvs differ", cellsX, cellsZ, uvErrors);
+			Check(heightError <= halfStep, "%dx%d: height off by %g, half a step is %g", cellsX, cellsZ, heightError, halfStep);
+			Check(normalError < 1.5, "%dx%d: normal off by %g degrees", cellsX, cellsZ, normalError);
+			Check(normalMismatches == 0, "%dx%d: %d normals encode differently from floats", cellsX, cellsZ, normalMismatches);
+		}
+	}
+
+	/// QuantiseRow maps the range onto 0..65535 and clamps what lies above it, and a flat map quantises to 0.
+	void TestCompactQuantise()
+	{
+		const float row[] = { 0.0f, 0.5f, 1.0f, 1.0001f, 2.0f, 1000.0f };
+		const uint16_t expected[] = { 0, 32768, 65535, 65535, 65535, 65535 };
+		const int width = sizeof(row) / sizeof(row[0]);
+		CompactTerrainVertex vertices[width];
+		CompactVertexPacker::QuantiseRow(row, width, 1.0f, 0.0f, 65535.0f, vertices);
+		for (int x = 0; x < width; ++x)
+			Check(vertices[x].height == expected[x], "%g quantised to %u, expected %u", row[x], vertices[x].height, expected[x]);
+
+		Heightfield flat(3, 3);
+		flat.Fill(2.0f);
+		CompactTerrainVertex flatVertices[9];
+		float min, max;
+		CompactVertexPacker::WriteHeights(flat, 1.0f, flatVertices, min, max);
+		Check(min == 2.0f && max == 2.0f, "flat map range %g..%g", min, max);
+		for (int i = 0; i < 9; ++i)
+			Check(flatVertices[i].height == 0, "flat map sample %d quantised to %u", i, flatVertices[i].height);
+	}
+
+	/// Midpoint displacement on grids that are not a power of two across, or not square. Every sample is set
+	/// and finite, and the map does not depend on the thread count.
+	void TestMidpointSizes()
+	{
+		const int sizes[][2] = { { 2, 2 }, { 3, 3 }, { 5, 5 }, { 129, 129 }, { 37, 100 }, { 100, 37 }, { 1, 7 } };
+		for (const int *size : sizes)
+		{
+			Heightfield maps[2];
+			for (int i = 0; i < 2; ++i)
+			{
+				TerrainGenerator generator(size[0], size[1]);
+				generator.SetSeed(3);
+				generator.SetWorkerCount(i * 3);
+				generator.Generate(TerrainGenerator::MidpointDisplacement, maps[i]);
+			}
+
+			int unset = 0, infinite = 0, differ = 0;
+			for (int z = 0; z < maps[0].GetDepth(); ++z)
+			{
+				for (int x = 0; x < maps[0].GetWidth(); ++x)
+				{
+					float height = maps[0](x, z);
+					unset += height == 0.0f;
+					infinite += !std::isfinite(height);
+					differ += memcmp(&height, &maps[1](x, z), sizeof(float)) != 0;
+				}
+			}
+			Check(unset == 0, "%dx%d: %d samples left at 0", size[0], size[1], unset);
+			Check(infinite == 0, "%dx%d: %d samples not finite", size[0], size[1], infinite);
+			Check(differ == 0, "%dx%d: %d samples differ with 3 worker threads", size[0], size[1], differ);
+		}
+	}
+
+	/// The SSE4.1 and AVX2 multifractal steps against the scalar one on random noise, every count up to 64 so
+	/// the vector bodies and the scalar tails both run, with samples retiring part way.
+	void TestMultiFractalKernels()
+	{
+		std::mt19937 random(14);
+		std::uniform_real_distribution<float> noiseValue(-1.1f, 1.1f);
+		for (int kernel = PerlinNoiseGenerator::Sse41; kernel <= PerlinNoiseGenerator::Avx2; ++kernel)
+		{
+			if (!IsSupported(kernel))
+			{
+				printf("    kernel %d not supported here, skipped\n", kernel);
+				continue;
+			}
+
+			int differ = 0;
+			for (int trial = 0; trial < 1000; ++trial)
+			{
+				int count = trial % 64 + 1;
+				bool ridged = (trial & 1) != 0;
+				MultiFractal::Parameters parameters = { (trial % 3) * 0.4f + 0.2f, 2.0f * (trial / 3 % 3), (trial / 9 % 3) * 0.05f };
+				float noise[5][64];
+				for (int octave = 0; octave < 5; ++octave)
+				{
+					for (int i = 0; i < count; ++i)
+						noise[octave][i] = noiseValue(random);
+				}
+
+				float out[2][64], weight[2][64];
+				bool active[2];
+				MultiFractal::Kernel kernels[2] = { PerlinNoiseGenerator::Scalar, (MultiFractal::Kernel)kernel };
+				for (int k = 0; k < 2; ++k)
+				{
+					active[k] = ridged ? MultiFractal::RidgedFirst(noise[0], count, parameters, out[k], weight[k], kernels[k]) :
+						MultiFractal::HybridFirst(noise[0], count, parameters, out[k], weight[k], kernels[k]);
+					for (int octave = 1; octave < 5; ++octave)
+					{
+						float amplitude = 1.0f / (float)(1 << octave);
+						active[k] = ridged ? MultiFractal::RidgedOctave(noise[octave], count, amplitude, parameters, out[k], weight[k], kernels[k]) :
+							MultiFractal::HybridOctave(noise[octave], count, amplitude, parameters, out[k], weight[k], kernels[k]);
+					}
+				}
+				differ += active[0] != active[1] || memcmp(out[0], out[1], count * sizeof(float)) != 0 || memcmp(weight[0], weight[1], count * sizeof(float)) != 0;
+			}
+			Check(differ == 0, "kernel %d: %d of 1000 runs differ from scalar", kernel, differ);
+		}
+	}
+
+	/// Ridged and hybrid multifractal maps are world continuous: a region overlapping the map, including off its
+	/// edge, gives the same bits where they overlap, and the tiled pipeline gives the same map as Generate.
+	void TestMultiFractalContinuity()
+	{
+		for (int type = TerrainGenerator::RidgedMultiFractal; type <= TerrainGenerator::HybridMultiFractal; ++type)
+		{
+			TerrainGenerator generator(256, 256);
+			generator.SetSeed(4);
+			generator.multiFractalType = (TerrainGenerator::MultiFractalType)type;
+			if (type == TerrainGenerator::HybridMultiFractal)
+			{
+				generator.multiFractalOffset = 0.7f;
+				generator.multiFractalH = 0.25f;
+			}
+
+			Heightfield full;
+			generator.Generate(TerrainGenerator::MultiFractal, full);
+
+			Heightfield region;
+			generator.GenerateRegion(TerrainGenerator::MultiFractal, 37, -5, 100, 90, region);
+			int differ = CountDifferences(region, 0, 5, full, 37, 0, 100, 85);
+			Check(differ == 0, "type %d: %d region samples differ from the full map", type, differ);
+
+			TerrainPipeline pipeline;
+			std::vector<TerrainVertex> vertices(257 * 257);
+			Heightfield piped;
+			float min, max;
+			TerrainMeshBuilder::BuildPlane(256, 256, 1.0f, 1.0f, &vertices[0], nullptr);
+			if (!Check(pipeline.Generate(generator, TerrainGenerator::MultiFractal, 50.0f, 1.0f, 1.0f, piped, &vertices[0], min, max), "type %d: pipeline failed", type))
+				continue;
+			differ = CountDifferences(piped, 0, 0, full, 0, 0, 257, 257);
+			Check(differ == 0, "type %d: %d pipeline samples differ from Generate", type, differ);
+		}
+	}
+
+	/// The noise's analytic slope against central differences of the noise itself, and the value it comes with
+	/// against the plain evaluation.
+	void TestNoiseDerivatives()
+	{
+		PerlinNoiseGenerator noise(5);
+		const float step = 1e-3f;
+		double worst = 0.0;
+		int valueErrors = 0;
+		for (int i = 0; i < 100000; ++i)
+		{
+			float x = (i % 997) * 0.0371f - 13.0f;
+			float y = (i / 997) * 0.0533f - 2.0f;
+			float dx, dy;
+			float value = noise.GenerateNoise(x, y, dx, dy);
+			valueErrors += value != noise.GenerateNoise(x, y);
+
+			double numericX = (noise.GenerateNoise(x + step, y) - noise.GenerateNoise(x - step, y)) / (2.0 * step);
+			double numericY = (noise.GenerateNoise(x, y + step) - noise.GenerateNoise(x, y - step)) / (2.0 * step);
+			worst = std::max(worst, std::max(fabs(numericX - dx), fabs(numericY - dy)));
+		}
+		Check(valueErrors == 0, "%d values differ from GenerateNoise", valueErrors);
+		Check(worst < 1e-3, "slope off central differences by %g", worst);
+	}
+
+	/// The SSE4.1 and AVX2 rows of noise with slopes against the scalar row, accumulating into existing values over a
+	/// width that leaves a scalar tail, and the value against the row without slopes. Then each kernel's batch, row
+	/// and accumulated row without slopes against GenerateNoise, at negative and large positions and on grid lines.
+	void TestNoiseDerivativeKernels()
+	{
+		const int width = 1037;
+		PerlinNoiseGenerator noise(5);
+		std::vector<float> values[3], dx[3], dy[3];
+
+		//positions either side of zero, on grid lines and far out, a count that leaves a tail for both kernels
+		std::vector<float> xs, ys;
+		const float offsets[] = { 0.0f, -0.0f, 0.37f, -0.37f, -1.0f, -255.5f, 256.0f, -4096.25f, 70000.75f, -70000.75f, 1.0e6f, -1.0e6f };
+		for (int i = 0; i < 12; ++i)
+		{
+			for (int j = 0; j < 7; ++j)
+			{
+				xs.push_back(offsets[i] + 0.173f * j);
+				ys.push_back(offsets[(i + j) % 12] - 0.291f * j);
+			}
+		}
+		const int count = (int)xs.size() - 3;
+		const int starts[] = { -300, -1, 0, 65537, -65537 };
+		const float rowYs[] = { 7.3f, -7.3f, -2.0f, 5000.5f };
+		for (int kernel = PerlinNoiseGenerator::Scalar; kernel <= PerlinNoiseGenerator::Avx2; ++kernel)
+		{
+			if (!IsSupported(kernel))
+			{
+				printf("    kernel %d not supported here, skipped\n", kernel);
+				continue;
+			}
+
+			noise.SetKernel((PerlinNoiseGenerator::Kernel)kernel);
+			values[kernel].assign(width, 0.5f);
+			dx[kernel].assign(width, 0.25f);
+			dy[kernel].assign(width, 0.1f);
+			noise.AccumulateNoiseRow(-300, width, 7.3f, 0.0137f, 0.6f, &values[kernel][0], &dx[kernel][0], &dy[kernel][0]);
+
+			std::vector<float> plain(width, 0.5f);
+			noise.AccumulateNoiseRow(-300, width, 7.3f, 0.0137f, 0.6f, &plain[0]);
+			Check(plain == values[kernel], "kernel %d: values differ from the row without slopes", kernel);
+			if (kernel != PerlinNoiseGenerator::Scalar)
+				Check(values[kernel] == values[0] && dx[kernel] == dx[0] && dy[kernel] == dy[0], "kernel %d: differs from scalar", kernel);
+
+			std::vector<float> batch(count, 2.0f);
+			noise.GenerateNoiseBatch(&xs[0], &ys[0], &batch[0], count);
+			int batchErrors = 0;
+			for (int i = 0; i < count; ++i)
+				batchErrors += batch[i] != noise.GenerateNoise(xs[i], ys[i]);
+			Check(batchErrors == 0, "kernel %d: %d batch samples differ from GenerateNoise", kernel, batchErrors);
+
+			int rowErrors = 0, accumulateErrors = 0;
+			for (int s = 0; s < 5; ++s)
+			{
+				for (int r = 0; r < 4; ++r)
+				{
+					std::vector<float> row(width, 2.0f), accumulated(width, 0.5f);
+					noise.GenerateNoiseRow(starts[s], width, rowYs[r], 0.0137f, &row[0]);
+					noise.AccumulateNoiseRow(starts[s], width, rowYs[r], 0.0137f, 0.6f, &accumulated[0]);
+					for (int i = 0; i < width; ++i)
+					{
+						float expected = noise.GenerateNoise((float)(starts[s] + i) * 0.0137f, rowYs[r]);
+						rowErrors += row[i] != expected;
+						accumulateErrors += accumulated[i] != 0.5f + expected * 0.6f;
+					}
+				}
+			}
+			Check(rowErrors == 0, "kernel %d: %d row samples differ from GenerateNoise", kernel, rowErrors);
+			Check(accumulateErrors == 0, "kernel %d: %d accumulated samples differ from GenerateNoise", kernel, accumulateErrors);
+		}
+	}
+
+	/// The pipeline with normals from the noise's slope against differenced normals. Heights are the same either way,
+	/// and Perlin noise, smooth at the grid spacing, gives close to the same normals.
+	void TestAnalyticNormals()
+	{
+		const int cells = 300;
+		const int count = (cells + 1) * (cells + 1);
+		for (int algorithm = TerrainGenerator::PerlinNoise; algorithm <= TerrainGenerator::FractionalBrownianMotion; ++algorithm)
+		{
+			TerrainGenerator generator(cells, cells);
+			generator.SetSeed(9);
+			Heightfield reference;
+			generator.Generate((TerrainGenerator::Algorithm)algorithm, reference);
+
+			TerrainPipeline pipeline;
+			Heightfield maps[2];
+			std::vector<TerrainVertex> vertices[2];
+			float min[2], max[2];
+			for (int i = 0; i < 2; ++i)
+			{
+				pipeline.analyticNormals = i == 0;
+				vertices[i].resize(count);
+				TerrainMeshBuilder::BuildPlane(cells, cells, 1.0f, 1.0f, &vertices[i][0], nullptr);
+				pipeline.Generate(generator, (TerrainGenerator::Algorithm)algorithm, 50.0f, 1.0f, 1.0f, maps[i], &vertices[i][0], min[i], max[i]);
+			}
+
+			int differ = CountDifferences(maps[0], 0, 0, reference, 0, 0, cells + 1, cells + 1) + CountDifferences(maps[1], 0, 0, reference, 0, 0, cells + 1, cells + 1);
+			int heightErrors = 0;
+			double normalError = 0.0;
+			for (int i = 0; i < count; ++i)
+			{
+				heightErrors += vertices[0][i].pos[1] != vertices[1][i].pos[1];
+				normalError = std::max(normalError, AngleBetween(vertices[0][i].normal, vertices[1][i].normal));
+			}
+			Check(differ == 0, "algorithm %d: %d map samples differ from Generate", algorithm, differ);
+			Check(heightErrors == 0 && min[0] == min[1] && max[0] == max[1], "algorithm %d: %d vertex heights differ", algorithm, heightErrors);
+			if (algorithm == TerrainGenerator::PerlinNoise)
+				Check(normalError < 1.0, "algorithm %d: normals off differencing by %g degrees", algorithm, normalError);
+		}
+	}
+
+	/// The SSE4.1 and AVX2 normal rows against the scalar ones, floats, octahedral pairs and normals from slopes, over
+	/// odd sizes that leave scalar tails and single sample rows and columns. The scalar normals are held to
+	/// differences worked out here in double, one-sided along every edge, with different spacings along x and z.
+	void TestNormalKernels()
+	{
+		const int sizes[][2] = { { 1, 1 }, { 2, 1 }, { 1, 3 }, { 3, 2 }, { 5, 7 }, { 8, 3 }, { 9, 9 }, { 13, 5 }, { 17, 2 }, { 31, 33 }, { 257, 257 } };
+		const float heightScale = 37.5f, spacingX = 0.7f, spacingZ = 1.9f;
+		std::mt19937 random(16);
+		std::uniform_real_distribution<float> height(-1.0f, 1.0f);
+		ThreadPool threadPool(3);
+		NormalGenerator normals;
+		for (int s = 0; s < 11; ++s)
+		{
+			int width = sizes[s][0], depth = sizes[s][1];
+			Heightfield map;
+			map.Resize(width, depth);
+			for (int z = 0; z < depth; ++z)
+			{
+				for (int x = 0; x < width; ++x)
+					map.GetRow(z)[x] = height(random);
+			}
+			std::vector<float> slopeX(width), slopeZ(width);
+			for (int x = 0; x < width; ++x)
+			{
+				slopeX[x] = height(random) * 3.0f;
+				slopeZ[x] = height(random) * 3.0f;
+			}
+
+			int count = width * depth;
+			std::vector<float> floats[3];
+			std::vector<uint16_t> octahedral[3];
+			NormalGenerator::Row fromSlopes[3];
+			for (int kernel = NormalGenerator::Scalar; kernel <= NormalGenerator::Avx2; ++kernel)
+			{
+				if (!IsSupported(kernel))
+				{
+					if (s == 0)
+						printf("    kernel %d not supported here, skipped\n", kernel);
+					continue;
+				}
+
+				normals.SetKernel((NormalGenerator::Kernel)kernel);
+				floats[kernel].assign(count * 3, 2.0f);
+				octahedral[kernel].assign(count * 2, 0);
+				fromSlopes[kernel].Resize(width);
+				normals.Compute(map, heightScale, spacingX, spacingZ, &floats[kernel][0], 3, threadPool);
+				normals.ComputeOctahedral(map, heightScale, spacingX, spacingZ, &octahedral[kernel][0], threadPool);
+				normals.ComputeSpanFromSlopes(&slopeX[0], &slopeZ[0], 0, width, heightScale, spacingX, spacingZ, fromSlopes[kernel]);
+				if (kernel == NormalGenerator::Scalar)
+					continue;
+
+				Check(memcmp(&floats[kernel][0], &floats[0][0], count * 3 * sizeof(float)) == 0, "%dx%d kernel %d: normals differ from scalar", width, depth, kernel);
+				Check(octahedral[kernel] == octahedral[0], "%dx%d kernel %d: octahedral normals differ from scalar", width, depth, kernel);
+				Check(memcmp(&fromSlopes[kernel].x[0], &fromSlopes[0].x[0], width * sizeof(float)) == 0
+					&& memcmp(&fromSlopes[kernel].y[0], &fromSlopes[0].y[0], width * sizeof(float)) == 0
+					&& memcmp(&fromSlopes[kernel].z[0], &fromSlopes[0].z[0], width * sizeof(float)) == 0,
+					"%dx%d kernel %d: normals from slopes differ from scalar", width, depth, kernel);
+			}
+
+			double worst = 0.0;
+			for (int z = 0; z < depth; ++z)
+			{
+				for (int x = 0; x < width; ++x)
+				{
+					//one-sided at the edges, nothing to difference along a single sample
+					int left = std::max(x - 1, 0), right = std::min(x + 1, width - 1);
+					int above = std::max(z - 1, 0), below = std::min(z + 1, depth - 1);
+					double dx = right > left ? ((double)map.GetRow(z)[right] - map.GetRow(z)[left]) * heightScale / ((right - left) * (double)spacingX) : 0.0;
+					double dz = below > above ? ((double)map.GetRow(below)[x] - map.GetRow(above)[x]) * heightScale / ((below - above) * (double)spacingZ) : 0.0;
+					double length = sqrt(dx * dx + 1.0 + dz * dz);
+					const float *normal = &floats[0][(z * width + x) * 3];
+					worst = std::max(worst, std::max(fabs(normal[0] + dx / length), std::max(fabs(normal[1] - 1.0 / length), fabs(normal[2] + dz / length))));
+				}
+			}
+			Check(worst < 1e-5, "%dx%d: normals off the differences by %g", width, depth, worst);
+		}
+	}
+
+	/// Any unit normal, up or down, decodes from its 16-bit octahedral pair within 0.005 degrees of where it was,
+	/// well inside the 0.04 it was first checked to.
+	void TestNormalOctahedral()
+	{
+		std::mt19937 random(17);
+		std::normal_distribution<float> component(0.0f, 1.0f);
+		double worst = 0.0;
+		for (int i = 0; i < 200000; ++i)
+		{
+			float normal[3];
+			if (i < 27)
+			{
+				//the axes, diagonals and their folds, where the encoding has its corners and creases
+				normal[0] = (float)(i % 3 - 1);
+				normal[1] = (float)(i / 3 % 3 - 1);
+				normal[2] = (float)(i / 9 - 1);
+				if (i == 13)
+					continue;
+			}
+			else
+			{
+				for (int c = 0; c < 3; ++c)
+					normal[c] = component(random);
+			}
+			float inverseLength = 1.0f / std::sqrt(normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2]);
+			for (int c = 0; c < 3; ++c)
+				normal[c] *= inverseLength;
+
+			uint16_t encoded[2];
+			float decoded[3];
+			NormalGenerator::EncodeOctahedral(normal, encoded);
+			NormalGenerator::DecodeOctahedral(encoded, decoded);
+			worst = std::max(worst, AngleBetween(normal, decoded));
+		}
+		Check(worst < 0.005, "octahedral round trip off by %g degrees", worst);
+	}
+
+	//fBm with the default splat rules, taken through the tiled pipeline or, eroded, the separate passes
+	BackgroundGenerator::Job GetBackgroundJob(bool compactVertices, bool eroded)
+	{
+		BackgroundGenerator::Job job;
+		job.settings.algorithm = TerrainGenerator::FractionalBrownianMotion;
+		job.settings.heightScale = 40.0f;
+		job.settings.spacingX = 0.8f;
+		job.settings.spacingZ = 1.2f;
+		job.settings.tiled = true;
+		job.settings.analyticNormals = true;
+		job.settings.erosion.hydraulicIterations = eroded ? 20 : 0;
+		job.settings.erosion.thermalIterations = eroded ? 5 : 0;
+		job.settings.splatRules = SplatMapBaker::GetDefaultRules();
+		job.compactVertices = compactVertices;
+		job.lodPatchCells = 32;
+		return job;
+	}
+
+	/// A surface built in the background, after requests that superseded each other, against the same surface built
+	/// synchronously by SurfaceBuilder from the last request's settings.
+	void TestBackgroundMatchesSync()
+	{
+		const int cells = 256;
+		BackgroundGenerator background(2);
+		GeneratedSurface surface;
+		for (int i = 0; i < 4; ++i)
+		{
+			bool compactVertices = (i & 1) != 0;
+			bool eroded = (i & 2) != 0;
+			BackgroundGenerator::Job job = GetBackgroundJob(compactVertices, eroded);
+			TerrainGenerator generator(cells, cells);
+			unsigned last = 0;
+			for (unsigned seed = 0; seed < 5; ++seed)
+			{
+				generator.SetSeed(seed);
+				last = background.Request(generator, job);
+			}
+			background.Wait();
+			if (!Check(background.TakeResult(surface), "job %d: no result", i))
+				continue;
+			Check(surface.request == last, "job %d: result for request %u, the last was %u", i, surface.request, last);
+			Check(!background.TakeResult(surface), "job %d: a superseded request also delivered", i);
+
+			SurfaceBuilder builder;
+			Heightfield map;
+			size_t vertexCount = (size_t)TerrainMeshBuilder::GetVertexCount(cells, cells);
+			std::vector<TerrainVertex> vertices(compactVertices ? 0 : vertexCount);
+			std::vector<CompactTerrainVertex> compact(compactVertices ? vertexCount : 0);
+			if (compactVertices)
+				CompactVertexPacker::BuildPlane(cells, cells, &compact[0]);
+			else
+				TerrainMeshBuilder::BuildPlane(cells, cells, job.settings.spacingX, job.settings.spacingZ, &vertices[0], nullptr);
+			std::vector<uint8_t> splat;
+			float min, max;
+			builder.Build(generator, job.settings, map, compactVertices ? nullptr : &vertices[0], compactVertices ? &compact[0] : nullptr, min, max, &splat);
+
+			bool sameVertices = compactVertices ?
+				memcmp(&compact[0], &surface.compactVertices[0], vertexCount * sizeof(CompactTerrainVertex)) == 0 :
+				memcmp(&vertices[0], &surface.vertices[0], vertexCount * sizeof(TerrainVertex)) == 0;
+			Check(CountDifferences(map, 0, 0, surface.map, 0, 0, cells + 1, cells + 1) == 0, "job %d: maps differ", i);
+			Check(sameVertices, "job %d: vertices differ", i);
+			Check(min == surface.min && max == surface.max, "job %d: range %g..%g, synchronously %g..%g", i, surface.min, surface.max, min, max);
+			Check(!splat.empty() && splat == surface.splat, "job %d: splat maps differ", i);
+			Check(surface.lodBuilt, "job %d: no geomipmap", i);
+		}
+	}
+
+	/// Cancelling abandons the request in flight and leaves nothing to take, and a generator destroyed part way
+	/// through a request stops rather than finishing it.
+	void TestBackgroundCancel()
+	{
+		BackgroundGenerator::Job job = GetBackgroundJob(false, true);
+		job.settings.erosion.hydraulicIterations = 2000;
+		TerrainGenerator generator(512, 512);
+		GeneratedSurface surface;
+		{
+			BackgroundGenerator background(2);
+			background.Request(generator, job);
+			std::this_thread::sleep_for(std::chrono::milliseconds(20));
+			background.Cancel();
+			background.Wait();
+			Check(!background.IsBusy(), "busy after cancelling");
+			Check(!background.TakeResult(surface), "a cancelled request delivered");
+			Check(background.GetProgress() == 0.0f, "progress %g after cancelling", background.GetProgress());
+
+			//a request after a cancel still goes through
+			job.settings.erosion.hydraulicIterations = 0;
+			unsigned request = background.Request(TerrainGenerator(64, 64), job);
+			background.Wait();
+			Check(background.TakeResult(surface) && surface.request == request, "no result after cancelling");
+		}
+		{
+			job.settings.erosion.hydraulicIterations = 2000;
+			BackgroundGenerator background(2);
+			background.Request(generator, job);
+			std::this_thread::sleep_for(std::chrono::milliseconds(20));
+		}
+	}
+
+	//sum of a map's heights, and of their magnitudes to judge it against
+	double SumHeights(const Heightfield &map, double &magnitude)
+	{
+		double sum = 0.0;
+		magnitude = 0.0;
+		for (int z = 0; z < map.GetDepth(); ++z)
+		{
+			for (int x = 0; x < map.GetWidth(); ++x)
+			{
+				sum += map(x, z);
+				magnitude += fabs(map(x, z));
+			}
+		}
+		return sum;
+	}
+
+	/// Hydraulic then thermal erosion with each kernel and with more threads, all of which must give the scalar
+	/// kernel's bits on one thread, and each of which only moves ground about: the heights' sum stays put.
+	void TestErosion()
+	{
+		const int cellSizes[][2] = { { 128, 128 }, { 45, 70 } };
+		for (const int *cells : cellSizes)
+		{
+			TerrainGenerator generator(cells[0], cells[1], 0);
+			generator.SetSeed(3);
+			Heightfield base;
+			generator.Generate(TerrainGenerator::FractionalBrownianMotion, base);
+
+			ErosionSimulator::Settings settings;
+			settings.hydraulicIterations = 60;
+			settings.thermalIterations = 20;
+			float heightScale = 50.0f;
+			float spacing = 200.0f / cells[0];
+
+			Heightfield reference = base;
+			ErosionSimulator erosion;
+			erosion.SetKernel(ErosionSimulator::Scalar);
+			erosion.Erode(reference, settings, heightScale, spacing, generator.GetThreadPool());
+			Check(CountDifferences(reference, 0, 0, base, 0, 0, base.GetWidth(), base.GetDepth()) > 0, "%dx%d: erosion changed nothing", cells[0], cells[1]);
+
+			for (int kernel = ErosionSimulator::Sse41; kernel <= ErosionSimulator::Avx2; ++kernel)
+			{
+				if (!IsSupported(kernel))
+				{
+					printf("    kernel %d not supported here, skipped\n", kernel);
+					continue;
+				}
+				Heightfield map = base;
+				erosion.SetKernel((ErosionSimulator::Kernel)kernel);
+				erosion.Erode(map, settings, heightScale, spacing, generator.GetThreadPool());
+				int differ = CountDifferences(map, 0, 0, reference, 0, 0, map.GetWidth(), map.GetDepth());
+				Check(differ == 0, "%dx%d kernel %d: %d samples differ from scalar", cells[0], cells[1], kernel, differ);
+			}
+
+			Heightfield threaded = base;
+			generator.SetWorkerCount(3);
+			erosion.SetKernel(ErosionSimulator::GetBestKernel());
+			erosion.Erode(threaded, settings, heightScale, spacing, generator.GetThreadPool());
+			int differ = CountDifferences(threaded, 0, 0, reference, 0, 0, base.GetWidth(), base.GetDepth());
+			Check(differ == 0, "%dx%d: %d samples differ with 3 worker threads", cells[0], cells[1], differ);
+
+			double magnitude;
+			double before = SumHeights(base, magnitude);
+			double after = SumHeights(reference, magnitude);
+			Check(fabs(after - before) <= 1e-5 * magnitude, "%dx%d: heights summed to %.9g, %.9g before", cells[0], cells[1], after, before);
+
+			Heightfield thermal = base;
+			ErosionSimulator::Settings thermalOnly;
+			thermalOnly.thermalIterations = 50;
+			erosion.Erode(thermal, thermalOnly, heightScale, spacing, generator.GetThreadPool());
+			after = SumHeights(thermal, magnitude);
+			Check(fabs(after - before) <= 1e-5 * magnitude, "%dx%d: thermal erosion summed to %.9g, %.9g before", cells[0], cells[1], after, before);
+		}
+	}
+
+	/// Diamond-square generated tile by tile against the whole map with the tile size as its root spacing, over
+	/// several layouts, with and without Perlin displacement and with 0 and 2 worker threads.
+	void TestDiamondSquareTiles()
+	{
+		const int layouts[][3] = { { 64, 3, 2 }, { 64, 1, 4 }, { 16, 5, 3 }, { 2, 7, 5 } }; //tile cells, tiles across, tiles down
+		for (int perlin = 0; perlin < 2; ++perlin)
+		{
+			for (const int *layout : layouts)
+			{
+				int tileCells = layout[0];
+				int tilesX = layout[1];
+				int tilesZ = layout[2];
+				for (int workers = 0; workers <= 2; workers += 2)
+				{
+					TerrainGenerator generator(tilesX * tileCells, tilesZ * tileCells, workers);
+					generator.SetSeed(77);
+					generator.usePerlinRandom = perlin != 0;
+					std::vector<Heightfield> tiles(tilesX * tilesZ);
+					if (!Check(generator.GenerateDiamondSquareTiles(tileCells, &tiles[0]), "%d tiles of %d cells refused", tilesX * tilesZ, tileCells))
+						continue;
+
+					Heightfield map;
+					generator.diamondSquareRootCells = tileCells;
+					generator.Generate(TerrainGenerator::DiamondSquare, map);
+					int differ = 0;
+					for (int tile = 0; tile < tilesX * tilesZ; ++tile)
+						differ += CountDifferences(tiles[tile], 0, 0, map, (tile % tilesX) * tileCells, (tile / tilesX) * tileCells, tileCells + 1, tileCells + 1);
+					Check(differ == 0, "%dx%d tiles of %d cells, perlin %d, %d workers: %d samples differ from the map", tilesX, tilesZ, tileCells, perlin, workers, differ);
+				}
+			}
+		}
+
+		TerrainGenerator generator(64, 64, 0);
+		Check(!generator.GenerateDiamondSquareTiles(3, nullptr), "tile cells of 3 accepted");
+		Check(!generator.GenerateDiamondSquareTiles(128, nullptr), "tiles larger than the map accepted");
+	}
+
+	/// Diamond-square on grids of any size sets every sample, and does not depend on the thread count.
+	void TestDiamondSquareSizes()
+	{
+		int unset = 0, differ = 0, grids = 0;
+		for (int cellsX = 1; cellsX < 70; cellsX += 3)
+		{
+			for (int cellsZ = 1; cellsZ < 40; cellsZ += 5, ++grids)
+			{
+				Heightfield maps[2];
+				for (int i = 0; i < 2; ++i)
+				{
+					TerrainGenerator generator(cellsX, cellsZ, i * 2);
+					generator.Generate(TerrainGenerator::DiamondSquare, maps[i]);
+				}
+				for (int z = 0; z <= cellsZ; ++z)
+				{
+					for (int x = 0; x <= cellsX; ++x)
+						unset += maps[0](x, z) == 0.0f || !std::isfinite(maps[0](x, z));
+				}
+				differ += CountDifferences(maps[0], 0, 0, maps[1], 0, 0, cellsX + 1, cellsZ + 1);
+			}
+		}
+		Check(unset == 0, "%d samples left unset over %d grids", unset, grids);
+		Check(differ == 0, "%d samples differ with 2 worker threads over %d grids", differ, grids);
+	}
+
+	/// Perlin, fBm and multifractal maps have the same bits on the calling thread alone, one worker and more workers
+	/// than some maps have rows, over widths that leave the kernels scalar tails.
+	void TestGenerateThreads()
+	{
+		const int cellSizes[][2] = { { 256, 256 }, { 301, 77 }, { 1000, 2 }, { 2, 300 } };
+		const int workerCounts[] = { 0, 1, 7 };
+		for (const int *cells : cellSizes)
+		{
+			for (int algorithm = TerrainGenerator::PerlinNoise; algorithm <= TerrainGenerator::MultiFractal; ++algorithm)
+			{
+				TerrainGenerator generator(cells[0], cells[1], 0);
+				generator.SetSeed(12);
+				Heightfield maps[3];
+				for (int i = 0; i < 3; ++i)
+				{
+					generator.SetWorkerCount(workerCounts[i]);
+					generator.Generate((TerrainGenerator::Algorithm)algorithm, maps[i]);
+				}
+
+				for (int i = 1; i < 3; ++i)
+				{
+					int differ = 0;
+					for (int z = 0; z <= cells[1]; ++z)
+						differ += memcmp(maps[i].GetRow(z), maps[0].GetRow(z), (cells[0] + 1) * sizeof(float)) != 0;
+					Check(differ == 0, "%dx%d algorithm %d: %d rows differ with %d workers", cells[0], cells[1], algorithm, differ, workerCounts[i]);
+				}
+			}
+		}
+	}
+
+	/// On flat ground the default rules give the even height bands MultilayerTerrain.fs blends by when there is no
+	/// splat map, and on steep ground rock takes over.
+	void TestSplatDefaultBands()
+	{
+		SplatMapBaker baker;
+		double worst = 0.0;
+		for (int i = 0; i <= 1000; ++i)
+		{
+			float height = i / 1000.0f;
+			float weights[SplatMapBaker::layerCount];
+			baker.Weigh(height, 0.0f, weights);
+
+			//the shader's max(1.0 - abs(heightPercentage * 4.0 - vec4(1.0, 2.0, 3.0, 4.0)), 0.0)
+			float shader[SplatMapBaker::layerCount];
+			float sum = 0.0f;
+			for (int layer = 1; layer < SplatMapBaker::layerCount; ++layer)
+			{
+				shader[layer] = std::max(1.0f - fabsf(height * 4.0f - layer), 0.0f);
+				sum += shader[layer];
+			}
+			shader[0] = std::max(1.0f - sum, 0.0f);
+			for (int layer = 0; layer < SplatMapBaker::layerCount; ++layer)
+				worst = std::max(worst, (double)fabsf(weights[layer] - shader[layer]));
+		}
+		Check(worst < 1e-5, "default weights off the shader's bands by %g", worst);
+
+		for (int i = 0; i <= 10; ++i)
+		{
+			float weights[SplatMapBaker::layerCount];
+			baker.Weigh(i / 10.0f, 0.5f, weights);
+			Check(weights[3] >= 2.0f / 3.0f - 1e-6f, "rock weighs %g on a steep slope at height %g", weights[3], i / 10.0f);
+		}
+	}
+
+	/// Quantised weights: the implicit layer 0 is 255 less the four bytes, and every layer lands within a step of
+	/// its weight, whatever the weights.
+	void TestSplatQuantise()
+	{
+		std::mt19937 random(21);
+		std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+		int overflows = 0;
+		double worst = 0.0;
+		for (int trial = 0; trial < 100000; ++trial)
+		{
+			float weights[SplatMapBaker::layerCount];
+			float sum = 0.0f;
+			for (int layer = 0; layer < SplatMapBaker::layerCount; ++layer)
+			{
+				//a third of the layers empty, so zeros and ones turn up as well as mixtures
+				weights[layer] = trial % 3 == layer % 3 ? 0.0f : unit(random);
+				sum += weights[layer];
+			}
+			if (sum <= 0.0f)
+				continue;
+			for (int layer = 0; layer < SplatMapBaker::layerCount; ++layer)
+				weights[layer] /= sum;
+
+			uint8_t texel[4];
+			SplatMapBaker::Quantise(weights, texel);
+			int bytes = texel[0] + texel[1] + texel[2] + texel[3];
+			overflows += bytes > 255;
+			worst = std::max(worst, fabs((255 - bytes) - weights[0] * 255.0));
+			for (int layer = 1; layer < SplatMapBaker::layerCount; ++layer)
+				worst = std::max(worst, fabs(texel[layer - 1] - weights[layer] * 255.0));
+		}
+		Check(overflows == 0, "%d texels add up to more than 255", overflows);
+		Check(worst <= 1.0 + 1e-3, "a layer is %g steps off its weight", worst);
+	}
+
+	/// A baked splat map does not depend on the thread count.
+	void TestSplatThreads()
+	{
+		const int cellsX = 200, cellsZ = 77;
+		std::vector<uint8_t> splats[2];
+		for (int i = 0; i < 2; ++i)
+		{
+			TerrainGenerator generator(cellsX, cellsZ, i * 3);
+			generator.SetSeed(21);
+			Heightfield map;
+			generator.Generate(TerrainGenerator::FractionalBrownianMotion, map);
+			std::vector<TerrainVertex> vertices(TerrainMeshBuilder::GetVertexCount(cellsX, cellsZ));
+			float min, max;
+			TerrainMeshBuilder::WriteHeights(map, 50.0f, &vertices[0], min, max);
+
+			SplatMapBaker baker;
+			splats[i].resize((size_t)map.GetWidth() * map.GetDepth() * 4);
+			baker.Bake(map, 50.0f, 1.0f, 1.0f, min, max, generator.GetThreadPool(), &splats[i][0]);
+		}
+		Check(splats[0] == splats[1], "splat maps differ with 3 worker threads");
+	}
+
+	//opens path as a texture pack and, if it opens, touches every texel of every level
+	bool OpenTexturePack(const char *path, int &texelSum)
+	{
+		TexturePack pack;
+		if (!pack.Open(path))
+			return false;
+		for (int layer = 0; layer < pack.GetLayerCount(); ++layer)
+		{
+			TexturePack::Level level;
+			for (int i = 0; pack.GetLevel(layer, i, level); ++i)
+			{
+				for (size_t texel = 0; texel < level.size; ++texel)
+					texelSum += level.texels[texel];
+			}
+		}
+		return true;
+	}
+
+	/// A texture pack reads back what was written, and a damaged one is refused rather than read out of bounds:
+	/// offsets that wrap past 2^64, a layer or index past the end, every truncation and random byte flips.
+	void TestTexturePackCorrupt()
+	{
+		const char *path = "TerrainTests.ttp";
+		const int sizes[][3] = { { 37, 20, 4 }, { 8, 8, 3 } };
+		{
+			TexturePackWriter writer;
+			Check(writer.Open(path, 2), "could not create %s", path);
+			for (int layer = 0; layer < 2; ++layer)
+			{
+				const int *size = sizes[layer];
+				std::vector<uint8_t> texels((size_t)size[0] * size[1] * size[2]);
+				for (size_t i = 0; i < texels.size(); ++i)
+					texels[i] = (uint8_t)(i * 7 + layer);
+				std::vector<uint8_t> block;
+				TexturePackLayout::BuildMipChain(&texels[0], size[0], size[1], size[2], block);
+				writer.WriteLayer(layer, block, size[0], size[1], size[2], "");
+			}
+			if (!Check(writer.Close(), "could not write %s", path))
+				return;
+		}
+
+		std::vector<uint8_t> original;
+		ReadFile(path, original);
+		{
+			TexturePack pack;
+			if (!Check(pack.Open(path), "a good pack refused"))
+				return;
+			TexturePack::Level level;
+			Check(pack.GetLayerCount() == 2 && pack.GetLevel(0, 0, level) && level.width == 37 && level.height == 20 && level.texels[5] == 35,
+				"layer 0 read back wrong");
+			Check(pack.GetLevel(1, 3, level) && level.width == 1 && level.height == 1 && !pack.GetLevel(1, 4, level), "layer 1's mip chain read back wrong");
+		}
+
+		const TexturePackHeader &header = *(const TexturePackHeader*)&original[0];
+		size_t layerOffset = (size_t)header.indexOffset;
+		struct Damage
+		{
+			const char *what;
+			size_t offset;
+			uint64_t value;
+		};
+		const Damage damages[] =
+		{
+			{ "index offset wrapping", offsetof(TexturePackHeader, indexOffset), ~0ull - 7 },
+			{ "index offset past the end", offsetof(TexturePackHeader, indexOffset), original.size() },
+			{ "layer offset wrapping", layerOffset + offsetof(TexturePackLayer, offset), ~0ull - 63 },
+			{ "layer offset past the end", layerOffset + offsetof(TexturePackLayer, offset), (original.size() + 63) / 64 * 64 },
+		};
+		int texelSum = 0;
+		for (const Damage &damage : damages)
+		{
+			std::vector<uint8_t> bytes(original);
+			Poke(bytes, damage.offset, damage.value);
+			WriteFile(path, bytes);
+			Check(!OpenTexturePack(path, texelSum), "%s accepted", damage.what);
+		}
+
+		for (size_t size = 0; size < original.size(); size += 16)
+		{
+			WriteFile(path, std::vector<uint8_t>(original.begin(), original.begin() + size));
+			Check(!OpenTexturePack(path, texelSum), "truncated to %d bytes accepted", (int)size);
+		}
+
+		std::mt19937 random(22);
+		for (int trial = 0; trial < 500; ++trial)
+		{
+			std::vector<uint8_t> bytes(original);
+			size_t headerAndIndex = layerOffset + 2 * sizeof(TexturePackLayer);
+			for (int flip = 0; flip < 1 + trial % 4; ++flip)
+				bytes[random() % headerAndIndex] ^= (uint8_t)(1 << random() % 8);
+			WriteFile(path, bytes);
+			OpenTexturePack(path, texelSum);
+		}
+		remove(path);
+	}
+
+	//loads path as a snapshot and, if it loads, decodes it
+	bool LoadSnapshot(const char *path, ThreadPool &threadPool)
+	{
+		CompressedHeightfield snapshot;
+		if (!snapshot.Load(path))
+			return false;
+		Heightfield map;
+		snapshot.Decompress(map, threadPool);
+		return true;
+	}
+
+	/// A snapshot comes back within GetMaxError of what was saved, white noise included, and a damaged one is
+	/// refused without reading out of bounds or allocating what a corrupt header asks for: tile offsets that wrap
+	/// past 2^64, sizes past the end of the file, every truncation and random byte flips.
+	void TestSnapshotCorrupt()
+	{
+		const char *path = "TerrainTests.thc";
+		TerrainGenerator generator(200, 77);
+		generator.SetSeed(23);
+		Heightfield map;
+		generator.Generate(TerrainGenerator::FractionalBrownianMotion, map);
+
+		//white noise codes to the longest streams there are
+		Heightfield noise(300, 260);
+		std::mt19937 random(23);
+		for (int z = 0; z < noise.GetDepth(); ++z)
+		{
+			for (int x = 0; x < noise.GetWidth(); ++x)
+				noise(x, z) = (float)(random() % 65536);
+		}
+
+		const Heightfield *maps[] = { &noise, &map };
+		const int tileSizes[] = { CompressedHeightfield::maxTileSize, 64 };
+		for (int i = 0; i < 2; ++i)
+		{
+			CompressedHeightfield snapshot;
+			snapshot.Compress(*maps[i], generator.GetThreadPool(), tileSizes[i]);
+			CompressedHeightfield loaded;
+			Heightfield decoded;
+			if (!Check(snapshot.Save(path) && loaded.Load(path) && loaded.Decompress(decoded, generator.GetThreadPool()), "map %d did not round trip", i))
+				return;
+
+			float worst = 0.0f, largest = 0.0f;
+			for (int z = 0; z < decoded.GetDepth(); ++z)
+			{
+				for (int x = 0; x < decoded.GetWidth(); ++x)
+				{
+					worst = std::max(worst, fabsf(decoded(x, z) - (*maps[i])(x, z)));
+					largest = std::max(largest, fabsf((*maps[i])(x, z)));
+				}
+			}
+			float allowed = loaded.GetMaxError() + 4.0f * FLT_EPSILON * largest;
+			Check(worst <= allowed, "map %d off by %g, at most %g", i, worst, allowed);
+		}
+
+		std::vector<uint8_t> original;
+		ReadFile(path, original);
+		const CompressedHeightfieldHeader &header = *(const CompressedHeightfieldHeader*)&original[0];
+		size_t entry = (size_t)header.indexOffset;
+		uint64_t dataSize = header.dataSize;
+		struct Damage
+		{
+			const char *what;
+			size_t offset;
+			uint64_t value;
+			int bytes;
+		};
+		const Damage damages[] =
+		{
+			{ "tile offset wrapping", entry + offsetof(CompressedTileEntry, offset), ~0ull - 15, 8 },
+			{ "tile offset past the data", entry + offsetof(CompressedTileEntry, offset), dataSize, 8 },
+			{ "tile size past the data", entry + offsetof(CompressedTileEntry, size), dataSize + 1, 4 },
+			{ "stream size of 4 GB", entry + offsetof(CompressedTileEntry, streamSize), 0xffffffffull, 4 },
+			{ "data size of 512 GB", offsetof(CompressedHeightfieldHeader, dataSize), 1ull << 39, 8 },
+			{ "data offset wrapping", offsetof(CompressedHeightfieldHeader, dataOffset), ~0ull - 15, 8 },
+			{ "index offset past the end", offsetof(CompressedHeightfieldHeader, indexOffset), original.size(), 8 },
+			{ "2^40 tiles", offsetof(CompressedHeightfieldHeader, width), 1u << 20, 4 },
+		};
+		for (const Damage &damage : damages)
+		{
+			std::vector<uint8_t> bytes(original);
+			if (damage.bytes == 8)
+				Poke(bytes, damage.offset, damage.value);
+			else
+				Poke(bytes, damage.offset, (uint32_t)damage.value);
+			if (strcmp(damage.what, "2^40 tiles") == 0)
+			{
+				Poke(bytes, offsetof(CompressedHeightfieldHeader, depth), 1u << 20);
+				Poke(bytes, offsetof(CompressedHeightfieldHeader, tileSize), 1u);
+			}
+			WriteFile(path, bytes);
+			Check(!LoadSnapshot(path, generator.GetThreadPool()), "%s accepted", damage.what);
+		}
+
+		for (size_t size = 0; size < original.size(); size += 16)
+		{
+			WriteFile(path, std::vector<uint8_t>(original.begin(), original.begin() + size));
+			Check(!LoadSnapshot(path, generator.GetThreadPool()), "truncated to %d bytes accepted", (int)size);
+		}
+
+		//flips in the header and index, then anywhere, only need to be survived
+		size_t index = (size_t)header.dataOffset;
+		for (int trial = 0; trial < 1000; ++trial)
+		{
+			std::vector<uint8_t> bytes(original);
+			size_t range = trial < 500 ? index : bytes.size();
+			for (int flip = 0; flip < 1 + trial % 4; ++flip)
+				bytes[random() % range] ^= (uint8_t)(1 << random() % 8);
+			WriteFile(path, bytes);
+			LoadSnapshot(path, generator.GetThreadPool());
+		}
+		remove(path);
+	}
+
+	//writes a tileCells store of fBm tiles tiles x tiles from tile (-1, 2), all but the last one
+	bool WriteTileStore(const char *path, int tileCells, int mipLevels, int tiles, float spacing, float heightScale, TerrainGenerator &generator)
+	{
+		TileStoreWriter writer;
+		if (!writer.Open(path, tileCells, mipLevels, -1, 2, tiles, tiles, spacing, heightScale))
+			return false;
+		for (int tile = 0; tile + 1 < tiles * tiles; ++tile)
+		{
+			if (!writer.GenerateTile(generator, TerrainGenerator::FractionalBrownianMotion, tile % tiles - 1, tile / tiles + 2))
+				return false;
+		}
+		return writer.Close();
+	}
+
+	//opens a store and reads every level of every tile it says it has, false if it would not open
+	bool OpenTileStore(const char *path)
+	{
+		TileStore store;
+		if (!store.Open(path))
+			return false;
+		const TileStoreHeader &header = store.GetHeader();
+		volatile float sum = 0.0f;
+		for (int z = 0; z < (int)header.tilesZ; ++z)
+		{
+			for (int x = 0; x < (int)header.tilesX; ++x)
+			{
+				TileStore::Level level;
+				for (int l = 0; store.GetLevel(header.firstTileX + x, header.firstTileZ + z, l, level); ++l)
+				{
+					for (int i = 0; i < level.size; ++i)
+						sum = sum + level.GetRow(i)[level.size - 1] + level.normals[((size_t)i * level.size + level.size - 1) * 3 + 2];
+				}
+			}
+		}
+		return true;
+	}
+
+	/// A store written tile by tile reads back through the mapping with the heights GenerateRegion gives over each
+	/// tile at every level, normals differenced from the border at the level's spacing, the heights' range, and
+	/// the edges shared with the next tile the same bits from both sides. The tile never written is not there.
+	void TestTileStore()
+	{
+		const char *path = "TerrainTests.tts";
+		const int tileCells = 32, mipLevels = 3, tiles = 3, border = 1 << (mipLevels - 1);
+		const float spacing = 1.5f, heightScale = 40.0f;
+		TerrainGenerator generator(64, 64);
+		generator.SetSeed(25);
+		if (!Check(WriteTileStore(path, tileCells, mipLevels, tiles, spacing, heightScale, generator), "store not written"))
+			return;
+
+		TileStore store;
+		if (!Check(store.Open(path), "store did not open"))
+			return;
+		const TileStoreHeader &header = store.GetHeader();
+		Check(header.tileCells == tileCells && header.mipLevels == mipLevels && header.firstTileX == -1 && header.firstTileZ == 2 &&
+			header.tilesX == tiles && header.tilesZ == tiles && header.seed == 25 && header.algorithm == TerrainGenerator::FractionalBrownianMotion &&
+			header.sampleSpacing == spacing && header.heightScale == heightScale, "header differs from what was written");
+
+		TileStore::Level level;
+		Check(!store.HasTile(1, 4) && !store.GetLevel(1, 4, 0, level), "the tile never written is there");
+		Check(!store.GetLevel(-2, 2, 0, level) && !store.GetLevel(-1, 5, 0, level) && !store.GetLevel(-1, 2, mipLevels, level) && !store.GetLevel(-1, 2, -1, level),
+			"a level outside the store is there");
+
+		for (int tile = 0; tile + 1 < tiles * tiles; ++tile)
+		{
+			int tileX = tile % tiles - 1, tileZ = tile / tiles + 2;
+			Heightfield region, bordered;
+			int samples = tileCells + 1 + border * 2;
+			generator.GenerateRegion(TerrainGenerator::FractionalBrownianMotion, tileX * tileCells, tileZ * tileCells, tileCells + 1, tileCells + 1, region);
+			generator.GenerateRegion(TerrainGenerator::FractionalBrownianMotion, tileX * tileCells - border, tileZ * tileCells - border, samples, samples, bordered);
+
+			float minHeight = FLT_MAX, maxHeight = -FLT_MAX;
+			for (int z = 0; z <= tileCells; ++z)
+			{
+				for (int x = 0; x <= tileCells; ++x)
+				{
+					minHeight = std::min(minHeight, region(x, z));
+					maxHeight = std::max(maxHeight, region(x, z));
+				}
+			}
+
+			for (int l = 0; l < mipLevels; ++l)
+			{
+				if (!Check(store.GetLevel(tileX, tileZ, l, level), "tile (%d, %d) level %d missing", tileX, tileZ, l))
+					continue;
+				int step = 1 << l, heightErrors = 0;
+				double worst = 0.0;
+				Check(level.size == (tileCells >> l) + 1 && level.stride >= level.size, "tile (%d, %d) level %d: %d samples a side", tileX, tileZ, l, level.size);
+				Check(level.minHeight == minHeight && level.maxHeight == maxHeight, "tile (%d, %d) level %d: range differs", tileX, tileZ, l);
+				for (int z = 0; z < level.size; ++z)
+				{
+					for (int x = 0; x < level.size; ++x)
+					{
+						heightErrors += memcmp(&level.GetRow(z)[x], &region(x * step, z * step), sizeof(float)) != 0;
+
+						int bx = border + x * step, bz = border + z * step;
+						double dx = ((double)bordered(bx + step, bz) - bordered(bx - step, bz)) * heightScale / (2.0 * step * spacing);
+						double dz = ((double)bordered(bx, bz + step) - bordered(bx, bz - step)) * heightScale / (2.0 * step * spacing);
+						double length = sqrt(dx * dx + 1.0 + dz * dz);
+						const float *normal = level.normals + ((size_t)z * level.size + x) * 3;
+						worst = std::max(worst, std::max(fabs(normal[0] + dx / length), std::max(fabs(normal[1] - 1.0 / length), fabs(normal[2] + dz / length))));
+					}
+				}
+				Check(heightErrors == 0, "tile (%d, %d) level %d: %d heights differ from GenerateRegion", tileX, tileZ, l, heightErrors);
+				Check(worst < 1e-5, "tile (%d, %d) level %d: normals off the differences by %g", tileX, tileZ, l, worst);
+
+				//the right and bottom edges against the next tiles' left and top ones
+				TileStore::Level next;
+				int differ = 0;
+				if (store.GetLevel(tileX + 1, tileZ, l, next))
+				{
+					for (int z = 0; z < level.size; ++z)
+					{
+						differ += memcmp(&level.GetRow(z)[level.size - 1], &next.GetRow(z)[0], sizeof(float)) != 0;
+						differ += memcmp(level.normals + ((size_t)z * level.size + level.size - 1) * 3, next.normals + (size_t)z * level.size * 3, 3 * sizeof(float)) != 0;
+					}
+				}
+				if (store.GetLevel(tileX, tileZ + 1, l, next))
+				{
+					differ += memcmp(level.GetRow(level.size - 1), next.GetRow(0), level.size * sizeof(float)) != 0;
+					differ += memcmp(level.normals + (size_t)(level.size - 1) * level.size * 3, next.normals, level.size * 3 * sizeof(float)) != 0;
+				}
+				Check(differ == 0, "tile (%d, %d) level %d: %d shared edge samples differ", tileX, tileZ, l, differ);
+			}
+		}
+		store.Close();
+		remove(path);
+	}
+
+	/// A damaged store is refused without reading outside the mapping: no magic, a bad version or header size, tile
+	/// sizes and mip counts that do not fit, tile counts and index offsets that run past the file, tile offsets that
+	/// are misaligned, wrap or run past it, every truncation, and random byte flips.
+	void TestTileStoreCorrupt()
+	{
+		const char *path = "TerrainTests.tts";
+		TerrainGenerator generator(64, 64);
+		generator.SetSeed(26);
+		if (!Check(WriteTileStore(path, 16, 2, 2, 1.0f, 30.0f, generator) && OpenTileStore(path), "store did not round trip"))
+			return;
+
+		std::vector<uint8_t> original;
+		ReadFile(path, original);
+		const TileStoreHeader &header = *(const TileStoreHeader*)&original[0];
+		size_t entry = (size_t)header.indexOffset;
+		uint64_t blockSize = TileStoreLayout::GetBlockSize(16, 2);
+		struct Damage
+		{
+			const char *what;
+			size_t offset;
+			uint64_t value;
+			int bytes;
+		};
+		const Damage damages[] =
+		{
+			{ "no magic", offsetof(TileStoreHeader, magic), 0, 4 },
+			{ "version 2", offsetof(TileStoreHeader, version), 2, 4 },
+			{ "header size too small", offsetof(TileStoreHeader, headerSize), sizeof(TileStoreHeader) - 4, 4 },
+			{ "no cells a tile", offsetof(TileStoreHeader, tileCells), 0, 4 },
+			{ "tile cells past the largest", offsetof(TileStoreHeader, tileCells), (TileStore::maxTileCells + 1) * 2, 4 },
+			{ "tile cells not halving", offsetof(TileStoreHeader, tileCells), 17, 4 },
+			{ "no mip levels", offsetof(TileStoreHeader, mipLevels), 0, 4 },
+			{ "17 mip levels", offsetof(TileStoreHeader, mipLevels), 17, 4 },
+			{ "2^31 tiles across", offsetof(TileStoreHeader, tilesX), 1u << 31, 4 },
+			{ "more tiles than the file holds", offsetof(TileStoreHeader, tilesZ), 1u << 20, 4 },
+			{ "index offset misaligned", offsetof(TileStoreHeader, indexOffset), header.indexOffset + 4, 8 },
+			{ "index offset past the end", offsetof(TileStoreHeader, indexOffset), original.size(), 8 },
+			{ "index offset wrapping", offsetof(TileStoreHeader, indexOffset), ~0ull - 7, 8 },
+			{ "tile offset misaligned", entry + offsetof(TileStoreEntry, offset), 64 + 8, 8 },
+			{ "tile offset past the end", entry + offsetof(TileStoreEntry, offset), (original.size() + 63) / 64 * 64, 8 },
+			{ "tile offset wrapping", entry + offsetof(TileStoreEntry, offset), ~0ull - 63, 8 },
+			{ "tile size not a block", entry + offsetof(TileStoreEntry, size), blockSize * 2, 8 },
+		};
+		for (const Damage &damage : damages)
+		{
+			std::vector<uint8_t> bytes(original);
+			if (damage.bytes == 8)
+				Poke(bytes, damage.offset, damage.value);
+			else
+				Poke(bytes, damage.offset, (uint32_t)damage.value);
+			WriteFile(path, bytes);
+			Check(!OpenTileStore(path), "%s accepted", damage.what);
+		}
+
+		for (size_t size = 0; size < original.size(); size += 16)
+		{
+			WriteFile(path, std::vector<uint8_t>(original.begin(), original.begin() + size));
+			Check(!OpenTileStore(path), "truncated to %d bytes accepted", (int)size);
+		}
+
+		//flips in the header and index, then anywhere, only need to be survived
+		std::mt19937 random(26);
+		size_t tilesStart = (size_t)TileStoreLayout::Align(entry + 4 * sizeof(TileStoreEntry));
+		for (int trial = 0; trial < 1000; ++trial)
+		{
+			std::vector<uint8_t> bytes(original);
+			size_t range = trial < 500 ? tilesStart : bytes.size();
+			for (int flip = 0; flip < 1 + trial % 4; ++flip)
+				bytes[random() % range] ^= (uint8_t)(1 << random() % 8);
+			WriteFile(path, bytes);
+			OpenTileStore(path);
+		}
+		remove(path);
+	}
+
+	//distance along ray to the first point at or under the surface, marched in steps of step, -1 for none. Only the
+	//part of the ray over the map is marched, off it there is no ground.
+	float MarchRay(const HeightfieldQuery &query, const HeightfieldQuery::Ray &ray, float sizeX, float sizeZ, float step)
+	{
+		float enter = 0.0f, exit = ray.maxDistance;
+		const float size[3] = { sizeX, 0.0f, sizeZ };
+		for (int axis = 0; axis < 3; axis += 2)
+		{
+			if (ray.direction[axis] == 0.0f)
+			{
+				if (ray.origin[axis] < 0.0f || ray.origin[axis] > size[axis])
+					return -1.0f;
+				continue;
+			}
+			float t0 = (0.0f - ray.origin[axis]) / ray.direction[axis];
+			float t1 = (size[axis] - ray.origin[axis]) / ray.direction[axis];
+			enter = std::max(enter, std::min(t0, t1));
+			exit = std::min(exit, std::max(t0, t1));
+		}
+
+		for (float t = enter; t <= exit; t += step)
+		{
+			float x = std::min(std::max(ray.origin[0] + ray.direction[0] * t, 0.0f), sizeX);
+			float z = std::min(std::max(ray.origin[2] + ray.direction[2] * t, 0.0f), sizeZ);
+			if (ray.origin[1] + ray.direction[1] * t <= query.GetHeight(x, z))
+				return t;
+		}
+		return -1.0f;
+	}
+
+	/// Heights, normals and rays over maps of several sizes down to a single cell. The batch heights are
+	/// GetHeight's bits, heights at the samples are the map's, and every ray hits where a fine march along it first
+	/// goes under the surface, or misses where the march does. The batch raycast gives the single one's hits.
+	void TestHeightfieldQuery()
+	{
+		const int sizes[][2] = { { 64, 50 }, { 37, 5 }, { 2, 2 }, { 1, 1 }, { 1, 7 }, { 7, 1 } };
+		const float heightScale = 50.0f, spacingX = 1.5f, spacingZ = 0.75f;
+		std::mt19937 random(24);
+		std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+		for (const int *cells : sizes)
+		{
+			int cellsX = cells[0], cellsZ = cells[1];
+			TerrainGenerator generator(cellsX, cellsZ, 0);
+			generator.SetSeed(7);
+			Heightfield map;
+			generator.Generate(TerrainGenerator::FractionalBrownianMotion, map);
+			HeightfieldQuery query;
+			if (!Check(query.Build(map, heightScale, spacingX, spacingZ, generator.GetThreadPool()), "%dx%d: build failed", cellsX, cellsZ))
+				continue;
+			float sizeX = cellsX * spacingX, sizeZ = cellsZ * spacingZ;
+
+			const int count = 4001;
+			std::vector<float> xs(count), zs(count), heights(count);
+			for (int i = 0; i < count; ++i)
+			{
+				xs[i] = (unit(random) * 1.2f - 0.1f) * sizeX;
+				zs[i] = (unit(random) * 1.2f - 0.1f) * sizeZ;
+			}
+			query.GetHeights(&xs[0], &zs[0], count, &heights[0]);
+			int batchErrors = 0, sampleErrors = 0, normalErrors = 0;
+			for (int i = 0; i < count; ++i)
+			{
+				float height = query.GetHeight(xs[i], zs[i]);
+				batchErrors += memcmp(&height, &heights[i], sizeof(float)) != 0;
+			}
+			for (int z = 0; z <= cellsZ; ++z)
+			{
+				for (int x = 0; x <= cellsX; ++x)
+				{
+					sampleErrors += fabsf(query.GetHeight(x * spacingX, z * spacingZ) - map(x, z) * heightScale) > 1e-4f * heightScale;
+					float normal[3];
+					query.GetNormal(x * spacingX, z * spacingZ, normal);
+					normalErrors += !(normal[1] > 0.0f) || fabsf(normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2] - 1.0f) > 1e-4f;
+				}
+			}
+			Check(batchErrors == 0, "%dx%d: %d batch heights differ from GetHeight", cellsX, cellsZ, batchErrors);
+			Check(sampleErrors == 0, "%dx%d: %d heights at samples differ from the map", cellsX, cellsZ, sampleErrors);
+			Check(normalErrors == 0, "%dx%d: %d normals not unit and up", cellsX, cellsZ, normalErrors);
+
+			const int rayCount = 600;
+			const float step = 0.002f;
+			std::vector<HeightfieldQuery::Ray> rays(rayCount);
+			std::vector<HeightfieldQuery::RayHit> hits(rayCount);
+			int rayErrors = 0, hitCount = 0;
+			for (int i = 0; i < rayCount; ++i)
+			{
+				HeightfieldQuery::Ray &ray = rays[i];
+				ray.origin[0] = (unit(random) * 1.4f - 0.2f) * sizeX;
+				ray.origin[1] = heightScale * (unit(random) * 1.5f - 0.25f);
+				ray.origin[2] = (unit(random) * 1.4f - 0.2f) * sizeZ;
+				float yaw = unit(random) * 6.2832f;
+				float pitch = i % 10 == 0 ? 0.0f : -unit(random) * 1.2f;
+				ray.direction[0] = i % 13 == 0 ? 0.0f : cosf(yaw) * cosf(pitch);
+				ray.direction[1] = sinf(pitch);
+				ray.direction[2] = i % 19 == 0 ? 0.0f : sinf(yaw) * cosf(pitch);
+				if (i % 23 == 0)
+				{
+					ray.direction[0] = ray.direction[2] = 0.0f;
+					ray.direction[1] = -1.0f;
+				}
+				ray.maxDistance = 200.0f;
+
+				HeightfieldQuery::RayHit &hit = hits[i];
+				query.Raycast(ray, hit);
+				float marched = MarchRay(query, ray, sizeX, sizeZ, step);
+				bool agrees = marched < 0.0f ? !hit.hit : hit.hit && fabsf(hit.distance - marched) <= step + 1e-3f;
+				hitCount += hit.hit;
+				if (!agrees && ++rayErrors <= 3)
+					printf("    %dx%d ray %d: hit %g, marched %g\n", cellsX, cellsZ, i, hit.hit ? hit.distance : -1.0f, marched);
+			}
+			Check(rayErrors == 0, "%dx%d: %d of %d rays disagree with marching", cellsX, cellsZ, rayErrors, rayCount);
+			Check(hitCount > 0 && hitCount < rayCount, "%dx%d: %d of %d rays hit", cellsX, cellsZ, hitCount, rayCount);
+
+			std::vector<HeightfieldQuery::RayHit> batch(rayCount);
+			generator.SetWorkerCount(3);
+			query.Raycast(&rays[0], rayCount, &batch[0], generator.GetThreadPool());
+			int batchDiffer = 0;
+			for (int i = 0; i < rayCount; ++i)
+			{
+				const HeightfieldQuery::RayHit &a = batch[i], &b = hits[i];
+				batchDiffer += a.hit != b.hit || (b.hit && (memcmp(&a.distance, &b.distance, sizeof(float)) != 0 ||
+					memcmp(a.position, b.position, sizeof(a.position)) != 0 || memcmp(a.normal, b.normal, sizeof(a.normal)) != 0));
+			}
+			Check(batchDiffer == 0, "%dx%d: %d batch raycasts differ", cellsX, cellsZ, batchDiffer);
+		}
+	}
+
+	/// Whether every patch is within one level of the patches beside it, and every level is one the patch has.
+	bool IsLevelConstrained(const GeoMipmap &lod)
+	{
+		for (int patchZ = 0; patchZ < lod.GetPatchesZ(); ++patchZ)
+		{
+			for (int patchX = 0; patchX < lod.GetPatchesX(); ++patchX)
+			{
+				int level = lod.GetLevel(patchX, patchZ);
+				if (level < 0 || level >= lod.GetLevelCount())
+					return false;
+				if (patchX + 1 < lod.GetPatchesX() && std::abs(level - lod.GetLevel(patchX + 1, patchZ)) > 1)
+					return false;
+				if (patchZ + 1 < lod.GetPatchesZ() && std::abs(level - lod.GetLevel(patchX, patchZ + 1)) > 1)
+					return false;
+			}
+		}
+		return true;
+	}
+
+	/// Checks the index buffer for the levels lod has selected over a cellsX x cellsZ grid. No triangle faces down,
+	/// the triangles cover the whole grid once, and every edge is drawn at most once each way, with the edges inside
+	/// the grid drawn both ways so no crack opens between patches.
+	void CheckStitching(const GeoMipmap &lod, int cellsX, int cellsZ, const char *what)
+	{
+		std::vector<uint32_t> indices;
+		lod.BuildIndices(indices);
+		int rowStride = cellsX + 1;
+		int backFaces = 0;
+		long long doubleArea = 0;
+		std::vector<std::pair<uint32_t, uint32_t>> edges;
+		edges.reserve(indices.size());
+		for (size_t i = 0; i + 2 < indices.size(); i += 3)
+		{
+			int x[3], z[3];
+			for (int corner = 0; corner < 3; ++corner)
+			{
+				x[corner] = (int)(indices[i + corner] % rowStride);
+				z[corner] = (int)(indices[i + corner] / rowStride);
+				edges.push_back(std::make_pair(indices[i + corner], indices[i + (corner + 1) % 3]));
+			}
+
+			//BuildPlane's winding has a negative cross product in the xz plane, zero for the triangles that only close gaps
+			long long cross = (long long)(x[1] - x[0]) * (z[2] - z[0]) - (long long)(z[1] - z[0]) * (x[2] - x[0]);
+			backFaces += cross > 0;
+			doubleArea -= cross;
+		}
+
+		std::sort(edges.begin(), edges.end());
+		int repeated = 0, unmatched = 0;
+		for (size_t i = 0; i < edges.size(); ++i)
+		{
+			if (i > 0 && edges[i] == edges[i - 1])
+			{
+				++repeated;
+				continue;
+			}
+
+			int x0 = (int)(edges[i].first % rowStride), z0 = (int)(edges[i].first / rowStride);
+			int x1 = (int)(edges[i].second % rowStride), z1 = (int)(edges[i].second / rowStride);
+			bool outside = (x0 == x1 && (x0 == 0 || x0 == cellsX)) || (z0 == z1 && (z0 == 0 || z0 == cellsZ));
+			if (!outside && !std::binary_search(edges.begin(), edges.end(), std::make_pair(edges[i].second, edges[i].first)))
+				++unmatched;
+		}
+
+		Check(indices.size() % 3 == 0 && !indices.empty(), "%s: %u indices", what, (unsigned)indices.size());
+		Check(backFaces == 0, "%s: %d triangles face down", what, backFaces);
+		Check(doubleArea == 2LL * cellsX * cellsZ, "%s: triangles cover %g cells of %d", what, doubleArea * 0.5, cellsX * cellsZ);
+		Check(repeated == 0, "%s: %d edges drawn twice the same way", what, repeated);
+		Check(unmatched == 0, "%s: %d inner edges drawn one way only", what, unmatched);
+	}
+
+	/// Geomipmap level selection and stitching: from eyes near, far and overhead the selected levels stay within one
+	/// of their neighbours', and for those and for hand-set steps between levels the index buffer is crack free,
+	/// covers the map once and keeps the mesh's winding.
+	void TestLodStitching()
+	{
+		const int cellsX = 128, cellsZ = 96, patchCells = 16;
+		const float spacing = 2.0f, heightScale = 50.0f;
+		TerrainGenerator generator(cellsX, cellsZ);
+		generator.SetSeed(5);
+		Heightfield map;
+		generator.Generate(TerrainGenerator::FractionalBrownianMotion, map);
+		GeoMipmap lod;
+		if (!Check(lod.Build(map, patchCells, spacing, heightScale, generator.GetThreadPool()), "build failed"))
+			return;
+		Check(lod.GetLevelCount() == GeoMipmap::GetLevelCount(patchCells) && lod.GetLevelCount() == 5, "%d levels", lod.GetLevelCount());
+
+		CheckStitching(lod, cellsX, cellsZ, "full resolution");
+		const float eyes[][3] = { { 0.0f, 30.0f, 0.0f }, { 128.0f, 400.0f, 96.0f }, { 250.0f, 20.0f, 10.0f }, { -500.0f, 60.0f, 90.0f }, { 128.0f, 5.0f, 96.0f } };
+		const float pixelErrors[] = { 0.5f, 2.0f, 8.0f, 50.0f };
+		int coarsest = 0;
+		for (const float *eye : eyes)
+		{
+			for (float pixelError : pixelErrors)
+			{
+				char what[96];
+				sprintf(what, "eye (%g, %g, %g) at %g pixels", eye[0], eye[1], eye[2], pixelError);
+				lod.SelectLevels(eye, 1000.0f, pixelError);
+				Check(IsLevelConstrained(lod), "%s: neighbouring levels more than one apart", what);
+				CheckStitching(lod, cellsX, cellsZ, what);
+				coarsest = std::max(coarsest, *std::max_element(lod.GetLevels().begin(), lod.GetLevels().end()));
+			}
+		}
+		Check(coarsest > 1, "no eye selected more than level %d", coarsest);
+
+		//every step between a level and the next, on every side, with a patch between coarser ones on both sides
+		for (int level = 0; level + 1 < lod.GetLevelCount(); ++level)
+		{
+			for (int patchZ = 0; patchZ < lod.GetPatchesZ(); ++patchZ)
+			{
+				for (int patchX = 0; patchX < lod.GetPatchesX(); ++patchX)
+					lod.SetLevel(patchX, patchZ, level + ((patchX + patchZ) & 1));
+			}
+			char what[64];
+			sprintf(what, "levels %d and %d checkered", level, level + 1);
+			CheckStitching(lod, cellsX, cellsZ, what);
+		}
+	}
+
+	/// Heights a TerrainSurface should have on show, as whoever showed them worked them out.
+	struct ShownHeights
+	{
+		const char *what;
+		const float *heights;
+		int width;
+		int depth;
+		int stride;
+		float spacingX;
+		float spacingZ;
+		float heightScale;
+		bool map; //the surface's map rather than a tile
+		unsigned seed; //and what it was generated from
+		TerrainGenerator::Algorithm algorithm;
+	};
+
+	/// Takes surface through each way a terrain's map arrives, at a different scale and spacing every time: built,
+	/// taken from the background, decoded from a smaller snapshot and a stored tile's window into a halo map.
+	/// Calls check after each with the heights that should then be on show.
+	template <typename CheckShown> void ShowEach(TerrainSurface &surface, CheckShown check)
+	{
+		const int cells = 128;
+		TerrainGenerator generator(cells, cells);
+		SurfaceBuilder builder;
+		std::vector<TerrainVertex> vertices(TerrainMeshBuilder::GetVertexCount(cells, cells));
+		const Heightfield &map = surface.GetMap();
+		float min, max;
+
+		BackgroundGenerator::Job job = GetBackgroundJob(false, false);
+		SurfaceBuilder::Settings settings = job.settings;
+		settings.heightScale = 50.0f;
+		settings.spacingX = settings.spacingZ = 1.5f;
+		generator.SetSeed(1);
+		surface.Build(builder, generator, settings, job.lodPatchCells, &vertices[0], nullptr, min, max);
+		ShownHeights built = { "built", map.GetData(), map.GetWidth(), map.GetDepth(), map.GetStride(), 1.5f, 1.5f, 50.0f, true, 1,
+			settings.algorithm };
+		check(built);
+
+		//the terrain's scale is 50 again by the time the job's map at 40 lands
+		BackgroundGenerator background(2);
+		GeneratedSurface generated;
+		generator.SetSeed(2);
+		background.Request(generator, job);
+		background.Wait();
+		if (Check(background.TakeResult(generated), "no background result"))
+		{
+			surface.Take(generated);
+			ShownHeights taken = { "taken", map.GetData(), map.GetWidth(), map.GetDepth(), map.GetStride(), job.settings.spacingX, job.settings.spacingZ,
+				job.settings.heightScale, true, 2, job.settings.algorithm };
+			check(taken);
+		}
+
+		Heightfield smaller;
+		TerrainGenerator(96, 64).Generate(TerrainGenerator::FractionalBrownianMotion, smaller);
+		CompressedHeightfield snapshot;
+		snapshot.Compress(smaller, generator.GetThreadPool());
+		settings.algorithm = TerrainGenerator::MultiFractal;
+		settings.heightScale = 30.0f;
+		settings.spacingX = settings.spacingZ = 2.0f;
+		if (Check(surface.Decompress(snapshot, generator.GetThreadPool()), "snapshot did not decode"))
+		{
+			surface.BuildFromMap(builder, settings, 3, job.lodPatchCells, &vertices[0], nullptr, min, max, generator.GetThreadPool());
+			ShownHeights decoded = { "decoded", map.GetData(), map.GetWidth(), map.GetDepth(), map.GetStride(), 2.0f, 2.0f, 30.0f, true, 3,
+				settings.algorithm };
+			check(decoded);
+		}
+
+		//the interior of a halo map, one sample in from its edges, as TileStore and TerrainChunkManager hand them out
+		const int tileCells = 64;
+		Heightfield halo;
+		generator.GenerateRegion(TerrainGenerator::FractionalBrownianMotion, tileCells - 1, tileCells - 1, tileCells + 3, tileCells + 3, halo);
+		const float *interior = halo.GetData() + halo.GetStride() + 1;
+		min = max = interior[0];
+		for (int z = 0; z <= tileCells; ++z)
+		{
+			const float *row = interior + (size_t)z * halo.GetStride();
+			min = std::min(min, *std::min_element(row, row + tileCells + 1));
+			max = std::max(max, *std::max_element(row, row + tileCells + 1));
+		}
+		surface.ShowTile(interior, tileCells + 1, halo.GetStride(), 1.0f, 60.0f, min * 60.0f, max * 60.0f);
+		ShownHeights tile = { "tile", interior, tileCells + 1, tileCells + 1, halo.GetStride(), 1.0f, 1.0f, 60.0f, false, 0,
+			settings.algorithm };
+		check(tile);
+	}
+
+	/// The query, geomipmap and splat map over a surface follow its map wherever it comes from, and a tile has none.
+	void TestTerrainSurface()
+	{
+		TerrainSurface surface;
+		ShowEach(surface, [&](const ShownHeights &shown)
+		{
+			Check(surface.IsMapShown() == shown.map, "%s: map %s on show", shown.what, shown.map ? "not" : "still");
+			Check(surface.GetHeightScale() == shown.heightScale, "%s: scale %g, shown at %g", shown.what, surface.GetHeightScale(), shown.heightScale);
+			Check(!shown.map || (surface.GetSeed() == shown.seed && surface.GetAlgorithm() == shown.algorithm), "%s: seed %u algorithm %d, made from %u and %d",
+				shown.what, surface.GetSeed(), (int)surface.GetAlgorithm(), shown.seed, (int)shown.algorithm);
+			if (!shown.map)
+			{
+				Check(surface.GetQuery().GetLevelCount() == 0 && !surface.IsLodBuilt() && surface.GetSplat().empty(),
+					"%s: a query, geomipmap or splat map left over a tile", shown.what);
+				return;
+			}
+
+			int errors = 0;
+			for (int z = 0; z < shown.depth; ++z)
+			{
+				for (int x = 0; x < shown.width; ++x)
+				{
+					float expected = shown.heights[(size_t)z * shown.stride + x] * shown.heightScale;
+					errors += fabsf(surface.GetQuery().GetHeight(x * shown.spacingX, z * shown.spacingZ) - expected) > 1e-4f * shown.heightScale;
+				}
+			}
+			Check(errors == 0, "%s: %d query heights off the map", shown.what, errors);
+
+			const GeoMipmap &lod = surface.GetLod();
+			Check(surface.IsLodBuilt() && lod.GetPatchesX() * lod.GetPatchCells() == shown.width - 1 && lod.GetPatchesZ() * lod.GetPatchCells() == shown.depth - 1,
+				"%s: no geomipmap over the map", shown.what);
+			Check(surface.GetSplat().size() == (size_t)shown.width * shown.depth * 4, "%s: splat map of %u bytes", shown.what, (unsigned)surface.GetSplat().size());
+		});
+	}
+
+#if OCTET_BULLET
+	/// Height of the triangle under world (x, z) on heights laid out as HeightfieldCollisionShape takes them with
+	/// sample (0, 0) at origin, split along the mesh's diagonal. Clamped to the grid.
+	float GetTriangleHeight(const ShownHeights &shown, const btVector3 &origin, float x, float z)
+	{
+		float gridX = std::min(std::max((x - origin.x()) / shown.spacingX, 0.0f), (float)(shown.width - 1));
+		float gridZ = std::min(std::max((z - origin.z()) / shown.spacingZ, 0.0f), (float)(shown.depth - 1));
+		int cellX = std::min((int)gridX, shown.width - 2);
+		int cellZ = std::min((int)gridZ, shown.depth - 2);
+		float u = gridX - cellX;
+		float v = gridZ - cellZ;
+
+		int stride = shown.stride;
+		const float *row = shown.heights + (size_t)cellZ * stride + cellX;
+		float h00 = row[0], h10 = row[1], h01 = row[stride], h11 = row[stride + 1];
+		float height = u + v <= 1.0f ? h00 + u * (h10 - h00) + v * (h01 - h00) : h11 + (1.0f - u) * (h01 - h11) + (1.0f - v) * (h10 - h11);
+		return origin.y() + height * shown.heightScale;
+	}
+
+	/// Drops a grid of spheres on ground, lets them settle and returns the largest distance of a contact they make
+	/// from the triangle under it, or -1 if a sphere never landed.
+	float DropSpheres(TerrainPhysicsWorld &physics, const TerrainCollisionBody &ground, const ShownHeights &shown, const btVector3 &origin)
+	{
+		const int across = 8;
+		const float radius = 0.5f;
+		btSphereShape sphere(radius);
+		btVector3 inertia(0.0f, 0.0f, 0.0f);
+		sphere.calculateLocalInertia(1.0f, inertia);
+
+		//away from the edges, far enough apart not to meet
+		std::vector<std::unique_ptr<btRigidBody>> bodies;
+		for (int i = 0; i < across * across; ++i)
+		{
+			float x = origin.x() + (0.1f + 0.8f * (i % across) / (across - 1)) * (shown.width - 1) * shown.spacingX;
+			float z = origin.z() + (0.1f + 0.8f * (i / across) / (across - 1)) * (shown.depth - 1) * shown.spacingZ;
+			float y = GetTriangleHeight(shown, origin, x, z) + radius + 2.0f;
+
+			btTransform transform;
+			transform.setIdentity();
+			transform.setOrigin(btVector3(x, y, z));
+			btRigidBody::btRigidBodyConstructionInfo info(1.0f, nullptr, &sphere, inertia);
+			info.m_startWorldTransform = transform;
+			info.m_rollingFriction = 0.1f;
+			bodies.emplace_back(new btRigidBody(info));
+			physics.Get()->addRigidBody(bodies.back().get());
+		}
+
+		for (int step = 0; step < 120; ++step)
+			physics.Step(1.0f / 60.0f);
+
+		std::vector<bool> landed(bodies.size(), false);
+		float maxError = 0.0f;
+		btDispatcher *dispatcher = physics.Get()->getDispatcher();
+		for (int i = 0; i < dispatcher->getNumManifolds(); ++i)
+		{
+			const btPersistentManifold *manifold = dispatcher->getManifoldByIndexInternal(i);
+			bool groundIsA = manifold->getBody0() == ground.GetBody();
+			if (!groundIsA && manifold->getBody1() != ground.GetBody())
+				continue;
+
+			const btCollisionObject *other = groundIsA ? manifold->getBody1() : manifold->getBody0();
+			for (size_t b = 0; b < bodies.size(); ++b)
+			{
+				if (bodies[b].get() == other && manifold->getNumContacts() > 0)
+					landed[b] = true;
+			}
+
+			for (int c = 0; c < manifold->getNumContacts(); ++c)
+			{
+				const btManifoldPoint &point = manifold->getContactPoint(c);
+				const btVector3 &position = groundIsA ? point.getPositionWorldOnA() : point.getPositionWorldOnB();
+				maxError = std::max(maxError, std::fabs(position.y() - GetTriangleHeight(shown, origin, position.x(), position.z())));
+			}
+		}
+
+		for (size_t b = 0; b < bodies.size(); ++b)
+			physics.Get()->removeRigidBody(bodies[b].get());
+		return std::find(landed.begin(), landed.end(), false) == landed.end() ? maxError : -1.0f;
+	}
+
+	/// Spheres dropped on a surface's body rest on the triangles on show, whichever way they arrived, at spacings
+	/// that differ along x and z and at each arrival's scale. The body keeps the one shape throughout and sits where
+	/// Bullet's centring on the bounds puts sample (0, 0) at the terrain's origin.
+	void TestTerrainCollision()
+	{
+		const float tolerance = 0.01f;
+		const btVector3 origin(-40.0f, 7.5f, 25.0f);
+		TerrainPhysicsWorld physics;
+		TerrainSurface surface;
+		surface.GetCollision().SetOrigin(origin);
+		surface.GetCollision().SetWorld(physics.Get());
+		const btHeightfieldTerrainShape *shape = nullptr;
+		ShowEach(surface, [&](const ShownHeights &shown)
+		{
+			if (!shape)
+				shape = surface.GetCollision().GetShape();
+			Check(shape && surface.GetCollision().GetShape() == shape, "%s: the body's shape was replaced", shown.what);
+
+			float low = shown.heights[0], high = shown.heights[0];
+			for (int z = 0; z < shown.depth; ++z)
+			{
+				const float *row = shown.heights + (size_t)z * shown.stride;
+				low = std::min(low, *std::min_element(row, row + shown.width));
+				high = std::max(high, *std::max_element(row, row + shown.width));
+			}
+			btVector3 centre = origin + btVector3((shown.width - 1) * 0.5f * shown.spacingX, (low + high) * 0.5f * shown.heightScale,
+				(shown.depth - 1) * 0.5f * shown.spacingZ);
+			btVector3 placed = surface.GetCollision().GetBody()->getWorldTransform().getOrigin();
+			Check((placed - centre).length() <= 1e-3f, "%s: body at (%g, %g, %g), the bounds centre at (%g, %g, %g)", shown.what,
+				placed.x(), placed.y(), placed.z(), centre.x(), centre.y(), centre.z());
+
+			float error = DropSpheres(physics, surface.GetCollision(), shown, origin);
+			Check(error >= 0.0f && error <= tolerance, "%s: contacts %g off the surface, -1 if a sphere fell through", shown.what, error);
+		});
+		surface.GetCollision().SetWorld(nullptr);
+	}
+#endif
+
+	const Test tests[] =
+	{
+		{ "heightfield-resize", TestHeightfieldResize },
+		{ "compact-round-trip", TestCompactRoundTrip },
+		{ "compact-quantise", TestCompactQuantise },
+		{ "midpoint-sizes", TestMidpointSizes },
+		{ "multifractal-kernels", TestMultiFractalKernels },
+		{ "multifractal-continuity", TestMultiFractalContinuity },
+		{ "noise-derivatives", TestNoiseDerivatives },
+		{ "noise-derivative-kernels", TestNoiseDerivativeKernels },
+		{ "analytic-normals", TestAnalyticNormals },
+		{ "normal-kernels", TestNormalKernels },
+		{ "normal-octahedral", TestNormalOctahedral },
+		{ "background-matches-sync", TestBackgroundMatchesSync },
+		{ "background-cancel", TestBackgroundCancel },
+		{ "erosion", TestErosion },
+		{ "diamond-square-tiles", TestDiamondSquareTiles },
+		{ "diamond-square-sizes", TestDiamondSquareSizes },
+		{ "generate-threads", TestGenerateThreads },
+		{ "splat-default-bands", TestSplatDefaultBands },
+		{ "splat-quantise", TestSplatQuantise },
+		{ "splat-threads", TestSplatThreads },
+		{ "texture-pack-corrupt", TestTexturePackCorrupt },
+		{ "snapshot-corrupt", TestSnapshotCorrupt },
+		{ "tile-store", TestTileStore },
+		{ "tile-store-corrupt", TestTileStoreCorrupt },
+		{ "heightfield-query", TestHeightfieldQuery },
+		{ "lod-stitching", TestLodStitching },
+		{ "terrain-surface", TestTerrainSurface },
+#if OCTET_BULLET
+		{ "terrain-collision", TestTerrainCollision },
+#endif
+	};
+
+	void PrintUsage()
+	{
+		printf(
+			"usage: TerrainTests [name...]\n"
+			"  runs the tests whose names start with any of the given names, or all of them\n"
+			"  -l, --list           list the tests\n");
+	}
+
+	bool Selected(const Test &test, const std::vector<std::string> &names)
+	{
+		if (names.empty())
+			return true;
+		for (const std::string &name : names)
+		{
+			if (strncmp(test.name, name.c_str(), name.size()) == 0)
+				return true;
+		}
+		return false;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	std::vector<std::string> names;
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string arg = argv[i];
+		if (arg == "-h" || arg == "--help")
+		{
+			PrintUsage();
+			return 0;
+		}
+		if (arg == "-l" || arg == "--list")
+		{
+			for (const Test &test : tests)
+				printf("%s\n", test.name);
+			return 0;
+		}
+		names.push_back(arg);
+	}
+
+	int run = 0, failed = 0;
+	for (const Test &test : tests)
+	{
+		if (!Selected(test, names))
+			continue;
+
+		printf("%s\n", test.name);
+		fflush(stdout);
+		int before = failures;
+		test.run();
+		bool passed = failures == before;
+		printf("  %s\n", passed ? "passed" : "FAILED");
+		++run;
+		failed += passed ? 0 : 1;
+	}
+
+	if (run == 0)
+	{
+		fprintf(stderr, "no tests match\n");
+		return 1;
+	}
+	printf("%d of %d tests passed\n", run - failed, run);
+	return failed ? 1 : 0;
+}
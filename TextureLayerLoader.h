@@ -0,0 +1,172 @@
+#pragma once
+#include "../../octet.h"
+#include "TexturePack.h"
+#include "TerrainProfiler.h"
+
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace Terrain
+{
+	/// Gets the terrain's texture layers ready while the first map generates. With a current texture pack the
+	/// layers come straight out of its mapping, mip chains included, and nothing is decoded. Otherwise every image
+	/// is decoded on a thread of its own, which also builds its mip chain for the pack Finish then writes, so only
+	/// the first launch, or one after a source image changed, pays for decoding.
+	class TextureLayerLoader
+	{
+		struct Layer
+		{
+			std::string path;
+			octet::ref<octet::image> image;
+			std::vector<uint8_t> mips; //the layer's pack block, only while a pack is to be written
+			int width;
+			int height;
+			int channels;
+		};
+
+		std::vector<Layer> layers;
+		std::vector<std::thread> threads;
+		std::string packPath;
+		TexturePack pack;
+		bool fromPack = false;
+		bool wrotePack = false;
+
+		static unsigned GetFormat(int channels) { return channels == 4 ? GL_RGBA : GL_RGB; }
+
+		//runs on the layer's own thread, the image is not shared with anything until Finish has joined it
+		void Decode(int index)
+		{
+			TERRAIN_PROFILE_SCOPE("textures.decode");
+			Layer &layer = layers[index];
+			layer.image = new octet::image(layer.path.c_str());
+			if (packPath.empty())
+				return;
+
+			//only byte RGB and RGBA go in a pack, anything else leaves the pack unwritten
+			unsigned format = layer.image->get_format();
+			int channels = format == GL_RGBA ? 4 : (format == GL_RGB ? 3 : 0);
+			int width = (int)layer.image->get_width();
+			int height = (int)layer.image->get_height();
+			const octet::dynarray<uint8_t> &bytes = layer.image->get_bytes();
+			if (channels == 0 || width == 0 || height == 0 || bytes.size() != (unsigned)(width * height * channels))
+				return;
+
+			TexturePackLayout::BuildMipChain(&bytes[0], width, height, channels, layer.mips);
+			layer.width = width;
+			layer.height = height;
+			layer.channels = channels;
+		}
+
+		bool OpenPack(int count)
+		{
+			if (packPath.empty() || !pack.Open(packPath.c_str()))
+				return false;
+
+			bool usable = pack.GetLayerCount() == count;
+			for (int i = 0; usable && i < count; ++i)
+				usable = pack.GetLayer(i).channels >= 3 && pack.IsCurrent(i, layers[i].path.c_str());
+			if (!usable)
+				pack.Close();
+			return usable;
+		}
+
+		//level 0 goes through the image like a decoded one would, the levels below replace the mipmaps GL generates
+		void LoadFromPack(int index)
+		{
+			Layer &layer = layers[index];
+			TexturePack::Level level;
+			pack.GetLevel(index, 0, level);
+			layer.image = new octet::image(level.texels, (unsigned)level.size, level.width, level.height, GetFormat(level.channels), GL_UNSIGNED_BYTE);
+
+			glBindTexture(GL_TEXTURE_2D, layer.image->get_gl_texture());
+			glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+			for (int mip = 1; pack.GetLevel(index, mip, level); ++mip)
+				glTexImage2D(GL_TEXTURE_2D, mip, GetFormat(level.channels), level.width, level.height, 0, GetFormat(level.channels), GL_UNSIGNED_BYTE, level.texels);
+			glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+		}
+
+		bool WritePack()
+		{
+			for (size_t i = 0; i < layers.size(); ++i)
+			{
+				if (layers[i].mips.empty())
+					return false;
+			}
+
+			TexturePackWriter writer;
+			bool ok = writer.Open(packPath.c_str(), (int)layers.size());
+			for (size_t i = 0; ok && i < layers.size(); ++i)
+			{
+				const Layer &layer = layers[i];
+				ok = writer.WriteLayer((int)i, layer.mips, layer.width, layer.height, layer.channels, layer.path.c_str());
+			}
+			return writer.Close() && ok;
+		}
+
+		void Join()
+		{
+			for (size_t i = 0; i < threads.size(); ++i)
+				threads[i].join();
+			threads.clear();
+		}
+
+	public:
+		TextureLayerLoader()
+		{
+		}
+
+		~TextureLayerLoader()
+		{
+			Join();
+		}
+
+		/// Starts on count images. packPath is the texture pack to load them from, or write once they are decoded,
+		/// null for neither. Opening a pack maps it and reads only its index.
+		void Start(const char *const *paths, int count, const char *packPath)
+		{
+			TERRAIN_PROFILE_SCOPE("textures");
+			Join();
+			Layer empty;
+			empty.width = empty.height = empty.channels = 0;
+			layers.assign(count, empty);
+			for (int i = 0; i < count; ++i)
+				layers[i].path = paths[i];
+			this->packPath = packPath ? packPath : "";
+			wrotePack = false;
+
+			fromPack = OpenPack(count);
+			if (fromPack)
+				return;
+
+			for (int i = 0; i < count; ++i)
+				threads.push_back(std::thread(&TextureLayerLoader::Decode, this, i));
+		}
+
+		/// Waits for the decoding threads, or uploads the pack's layers, then writes the pack if one was decoded for.
+		/// Needs the GL context, the images are ready for samplers afterwards.
+		void Finish()
+		{
+			TERRAIN_PROFILE_SCOPE("textures");
+			Join();
+			if (fromPack)
+			{
+				for (int i = 0; i < (int)layers.size(); ++i)
+					LoadFromPack(i);
+				pack.Close();
+				return;
+			}
+
+			if (!packPath.empty())
+				wrotePack = WritePack();
+			for (size_t i = 0; i < layers.size(); ++i)
+				std::vector<uint8_t>().swap(layers[i].mips);
+		}
+
+		octet::image *GetImage(int layer) const { return layers[layer].image; }
+
+		/// Whether the layers came from the pack, and whether Finish wrote a new one instead.
+		bool IsFromPack() const { return fromPack; }
+		bool WrotePack() const { return wrotePack; }
+	};
+}
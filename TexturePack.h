@@ -0,0 +1,349 @@
+#pragma once
+#include "MappedFile.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+namespace Terrain
+{
+	/// On-disk layout of a texture pack. The header and index are the structs below as the writing host lays them
+	/// out, byte order included, and a host of the other order fails the version check rather than misreading them.
+	///
+	///   TexturePackHeader
+	///   TexturePackLayer[layerCount]
+	///   layer blocks, each 64 byte aligned, one mip level after another:
+	///     texels   uint8[width * height * channels]   rows tightly packed, each level 64 byte aligned
+	///
+	/// Level l is max(width >> l, 1) by max(height >> l, 1), every layer goes down to 1x1. The texels are what
+	/// the image decoder produced, so the pack uploads exactly what decoding the sources would have.
+	struct TexturePackHeader
+	{
+		char magic[4];
+		uint32_t version;
+		uint32_t headerSize;
+		uint32_t layerCount;
+		uint64_t indexOffset;
+	};
+
+	struct TexturePackLayer
+	{
+		uint64_t offset;
+		uint64_t size;
+		uint32_t width;
+		uint32_t height;
+		uint32_t channels;
+		uint32_t mipLevels;
+
+		//the file the layer was decoded from, as it was then, so a changed source can be noticed
+		uint64_t sourceSize;
+		int64_t sourceTime;
+	};
+
+	/// Where each mip level sits inside a layer block.
+	struct TexturePackLayout
+	{
+		static const uint32_t alignment = 64;
+
+		static uint64_t Align(uint64_t offset) { return (offset + alignment - 1) / alignment * alignment; }
+
+		static int GetLevelCount(int width, int height)
+		{
+			int levels = 1;
+			while (width > 1 || height > 1)
+			{
+				width = width > 1 ? width >> 1 : 1;
+				height = height > 1 ? height >> 1 : 1;
+				++levels;
+			}
+			return levels;
+		}
+
+		static int GetLevelWidth(int width, int level) { return width >> level > 0 ? width >> level : 1; }
+		static int GetLevelHeight(int height, int level) { return height >> level > 0 ? height >> level : 1; }
+
+		static uint64_t GetLevelBytes(int width, int height, int channels, int level)
+		{
+			return (uint64_t)GetLevelWidth(width, level) * GetLevelHeight(height, level) * channels;
+		}
+
+		/// Offset of the level's texels from the start of the block.
+		static uint64_t GetLevelOffset(int width, int height, int channels, int level)
+		{
+			uint64_t offset = 0;
+			for (int i = 0; i < level; ++i)
+				offset += Align(GetLevelBytes(width, height, channels, i));
+			return offset;
+		}
+
+		static uint64_t GetBlockSize(int width, int height, int channels)
+		{
+			return GetLevelOffset(width, height, channels, GetLevelCount(width, height));
+		}
+
+		/// Lays the whole mip chain out in a block from level 0's texels, each level a 2x2 box filter of the one above.
+		/// A level one texel wide or high averages the pair along the other axis only.
+		static void BuildMipChain(const uint8_t *texels, int width, int height, int channels, std::vector<uint8_t> &block)
+		{
+			block.assign((size_t)GetBlockSize(width, height, channels), 0);
+			memcpy(&block[0], texels, (size_t)GetLevelBytes(width, height, channels, 0));
+
+			int levels = GetLevelCount(width, height);
+			for (int level = 1; level < levels; ++level)
+			{
+				int sourceWidth = GetLevelWidth(width, level - 1);
+				int sourceHeight = GetLevelHeight(height, level - 1);
+				int levelWidth = GetLevelWidth(width, level);
+				int levelHeight = GetLevelHeight(height, level);
+				const uint8_t *source = &block[(size_t)GetLevelOffset(width, height, channels, level - 1)];
+				uint8_t *destination = &block[(size_t)GetLevelOffset(width, height, channels, level)];
+
+				//odd sizes drop their last row or column, as GL's own mipmaps do
+				int stepX = sourceWidth > 1 ? 1 : 0;
+				int stepZ = sourceHeight > 1 ? 1 : 0;
+				int sourceRowBytes = sourceWidth * channels;
+				for (int z = 0; z < levelHeight; ++z)
+				{
+					const uint8_t *row0 = source + (size_t)(z << stepZ) * sourceRowBytes;
+					const uint8_t *row1 = row0 + stepZ * sourceRowBytes;
+					uint8_t *out = destination + (size_t)z * levelWidth * channels;
+					for (int x = 0; x < levelWidth; ++x)
+					{
+						int left = (x << stepX) * channels;
+						int right = left + stepX * channels;
+						for (int c = 0; c < channels; ++c)
+							out[x * channels + c] = (uint8_t)((row0[left + c] + row0[right + c] + row1[left + c] + row1[right + c] + 2) >> 2);
+					}
+				}
+			}
+		}
+
+		/// Size and modification time of a file, zero for both when it cannot be read.
+		static void GetSourceStamp(const char *path, uint64_t &size, int64_t &time)
+		{
+			struct stat status;
+			if (stat(path, &status) != 0)
+			{
+				size = 0;
+				time = 0;
+				return;
+			}
+			size = (uint64_t)status.st_size;
+			time = (int64_t)status.st_mtime;
+		}
+	};
+
+	/// Read-only view of a texture pack. The file is memory mapped and levels point straight into the mapping,
+	/// so loading one costs the page faults of the texels actually uploaded and no decoding at all.
+	class TexturePack
+	{
+	public:
+		static const uint32_t version = 1;
+
+		/// One mip level of one layer, pointing into the mapping. Valid until the pack is closed.
+		struct Level
+		{
+			const uint8_t *texels;
+			int width;
+			int height;
+			int channels;
+			size_t size;
+		};
+
+	private:
+		MappedFile file;
+		const TexturePackHeader *header = nullptr;
+		const TexturePackLayer *layers = nullptr;
+
+		bool Validate() const
+		{
+			const unsigned char *mapping = file.GetData();
+			uint64_t mappingSize = file.GetSize();
+			if (mappingSize < sizeof(TexturePackHeader))
+				return false;
+			if (memcmp(header->magic, "TTXP", 4) != 0 || header->version != version || header->headerSize < sizeof(TexturePackHeader))
+				return false;
+
+			uint64_t indexSize = (uint64_t)header->layerCount * sizeof(TexturePackLayer);
+			if (header->layerCount > 64 || header->indexOffset % sizeof(uint64_t) != 0)
+				return false;
+			if (header->indexOffset > mappingSize || indexSize > mappingSize - header->indexOffset)
+				return false;
+
+			//every layer must lie inside the file and be aligned so its levels are too
+			const TexturePackLayer *index = (const TexturePackLayer*)(mapping + header->indexOffset);
+			for (uint32_t i = 0; i < header->layerCount; ++i)
+			{
+				const TexturePackLayer &layer = index[i];
+				if (layer.width == 0 || layer.height == 0 || layer.width > 32768 || layer.height > 32768 || layer.channels == 0 || layer.channels > 4)
+					return false;
+				if (layer.mipLevels != (uint32_t)TexturePackLayout::GetLevelCount(layer.width, layer.height))
+					return false;
+				if (layer.size != TexturePackLayout::GetBlockSize(layer.width, layer.height, layer.channels))
+					return false;
+				if (layer.offset % TexturePackLayout::alignment != 0 || layer.offset > mappingSize || layer.size > mappingSize - layer.offset)
+					return false;
+			}
+			return true;
+		}
+
+	public:
+		TexturePack()
+		{
+		}
+
+		~TexturePack()
+		{
+			Close();
+		}
+
+		bool Open(const char *path)
+		{
+			Close();
+			if (!file.Open(path, false))
+				return false;
+
+			header = (const TexturePackHeader*)file.GetData();
+			if (!Validate())
+			{
+				Close();
+				return false;
+			}
+
+			layers = (const TexturePackLayer*)(file.GetData() + header->indexOffset);
+			return true;
+		}
+
+		void Close()
+		{
+			file.Close();
+			header = nullptr;
+			layers = nullptr;
+		}
+
+		bool IsOpen() const { return file.IsOpen(); }
+		int GetLayerCount() const { return header ? (int)header->layerCount : 0; }
+		const TexturePackLayer &GetLayer(int layer) const { return layers[layer]; }
+
+		/// Whether the layer was built from the file at path as it is now. A missing source counts as unchanged,
+		/// so a pack can be shipped without the images it was made from.
+		bool IsCurrent(int layer, const char *sourcePath) const
+		{
+			uint64_t size;
+			int64_t time;
+			TexturePackLayout::GetSourceStamp(sourcePath, size, time);
+			return size == 0 || (size == layers[layer].sourceSize && time == layers[layer].sourceTime);
+		}
+
+		/// Points level at the layer's texels inside the mapping, no copy is made.
+		bool GetLevel(int layer, int level, Level &out) const
+		{
+			if (layer < 0 || layer >= GetLayerCount() || level < 0 || level >= (int)layers[layer].mipLevels)
+				return false;
+
+			const TexturePackLayer &entry = layers[layer];
+			out.texels = file.GetData() + entry.offset + TexturePackLayout::GetLevelOffset(entry.width, entry.height, entry.channels, level);
+			out.width = TexturePackLayout::GetLevelWidth(entry.width, level);
+			out.height = TexturePackLayout::GetLevelHeight(entry.height, level);
+			out.channels = entry.channels;
+			out.size = (size_t)TexturePackLayout::GetLevelBytes(entry.width, entry.height, entry.channels, level);
+			return true;
+		}
+	};
+
+	/// Writes a texture pack a layer at a time from blocks laid out by TexturePackLayout::BuildMipChain,
+	/// which can be built on any thread. The header and index are written by Close.
+	class TexturePackWriter
+	{
+		FILE *file = nullptr;
+		TexturePackHeader header;
+		std::vector<TexturePackLayer> index;
+		uint64_t end = 0;
+
+		bool WriteAt(uint64_t offset, const void *data, size_t size)
+		{
+#if defined(_WIN32)
+			bool seeked = _fseeki64(file, (__int64)offset, SEEK_SET) == 0;
+#else
+			bool seeked = fseeko(file, (off_t)offset, SEEK_SET) == 0;
+#endif
+			return seeked && fwrite(data, 1, size, file) == size;
+		}
+
+	public:
+		TexturePackWriter()
+		{
+			memset(&header, 0, sizeof(header));
+		}
+
+		~TexturePackWriter()
+		{
+			Close();
+		}
+
+		bool Open(const char *path, int layerCount)
+		{
+			Close();
+			if (layerCount <= 0 || layerCount > 64)
+				return false;
+
+			file = fopen(path, "wb");
+			if (!file)
+				return false;
+
+			memset(&header, 0, sizeof(header));
+			memcpy(header.magic, "TTXP", 4);
+			header.version = TexturePack::version;
+			header.headerSize = sizeof(TexturePackHeader);
+			header.layerCount = layerCount;
+			header.indexOffset = TexturePackLayout::Align(sizeof(TexturePackHeader));
+
+			TexturePackLayer empty;
+			memset(&empty, 0, sizeof(empty));
+			index.assign(layerCount, empty);
+			end = TexturePackLayout::Align(header.indexOffset + index.size() * sizeof(TexturePackLayer));
+			return true;
+		}
+
+		/// Appends a layer's mip chain. sourcePath is the image it was decoded from, stamped so IsCurrent can check it.
+		bool WriteLayer(int layer, const std::vector<uint8_t> &block, int width, int height, int channels, const char *sourcePath)
+		{
+			if (!file || layer < 0 || layer >= (int)header.layerCount || block.size() != TexturePackLayout::GetBlockSize(width, height, channels))
+				return false;
+			if (!WriteAt(end, &block[0], block.size()))
+				return false;
+
+			TexturePackLayer &entry = index[layer];
+			entry.offset = end;
+			entry.size = block.size();
+			entry.width = width;
+			entry.height = height;
+			entry.channels = channels;
+			entry.mipLevels = TexturePackLayout::GetLevelCount(width, height);
+			TexturePackLayout::GetSourceStamp(sourcePath, entry.sourceSize, entry.sourceTime);
+			end = TexturePackLayout::Align(end + block.size());
+			return true;
+		}
+
+		/// Writes the header and index. A pack missing any layer is left unreadable rather than half valid.
+		bool Close()
+		{
+			if (!file)
+				return true;
+
+			bool complete = true;
+			for (size_t i = 0; i < index.size(); ++i)
+				complete = complete && index[i].size != 0;
+
+			bool ok = complete && WriteAt(header.indexOffset, &index[0], index.size() * sizeof(TexturePackLayer));
+			ok = ok && WriteAt(0, &header, sizeof(header));
+			ok = fclose(file) == 0 && ok;
+			file = nullptr;
+			return ok;
+		}
+	};
+}
@@ -0,0 +1,206 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Terrain
+{
+	/// Fixed set of worker threads, each with its own task deque.
+	/// Workers pop their own work LIFO and steal FIFO from the others when they run dry.
+	/// The thread calling ParallelFor works through the queues too, so zero workers simply runs inline.
+	class ThreadPool
+	{
+		typedef std::function<void()> Task;
+
+		struct WorkQueue
+		{
+			std::mutex lock;
+			std::deque<Task> tasks;
+		};
+
+		std::vector<std::thread> workers;
+
+		//one queue per worker plus a shared one at the end for external callers
+		std::vector<std::unique_ptr<WorkQueue>> queues;
+
+		std::mutex sleepLock;
+		std::condition_variable wake;
+		std::atomic<int> queuedTasks;
+		bool stopping = false;
+
+		bool PopOwn(int index, Task &task)
+		{
+			WorkQueue &queue = *queues[index];
+			std::lock_guard<std::mutex> guard(queue.lock);
+			if (queue.tasks.empty())
+				return false;
+			task = std::move(queue.tasks.back());
+			queue.tasks.pop_back();
+			return true;
+		}
+
+		bool Steal(int thief, Task &task)
+		{
+			int count = (int)queues.size();
+			for (int i = 1; i < count; ++i)
+			{
+				WorkQueue &queue = *queues[(thief + i) % count];
+				std::lock_guard<std::mutex> guard(queue.lock);
+				if (!queue.tasks.empty())
+				{
+					task = std::move(queue.tasks.front());
+					queue.tasks.pop_front();
+					return true;
+				}
+			}
+			return false;
+		}
+
+		bool RunOne(int index)
+		{
+			Task task;
+			if (!PopOwn(index, task) && !Steal(index, task))
+				return false;
+
+			--queuedTasks;
+			task();
+			return true;
+		}
+
+		void WorkerLoop(int index)
+		{
+			for (;;)
+			{
+				if (RunOne(index))
+					continue;
+
+				std::unique_lock<std::mutex> guard(sleepLock);
+				wake.wait(guard, [this] { return stopping || queuedTasks > 0; });
+				if (stopping)
+					return;
+			}
+		}
+
+		void Start(int workerCount)
+		{
+			stopping = false;
+			queuedTasks = 0;
+
+			queues.clear();
+			for (int i = 0; i <= workerCount; ++i)
+				queues.push_back(std::unique_ptr<WorkQueue>(new WorkQueue()));
+
+			for (int i = 0; i < workerCount; ++i)
+				workers.push_back(std::thread(&ThreadPool::WorkerLoop, this, i));
+		}
+
+		void Stop()
+		{
+			{
+				std::lock_guard<std::mutex> guard(sleepLock);
+				stopping = true;
+			}
+			wake.notify_all();
+
+			for (size_t i = 0; i < workers.size(); ++i)
+				workers[i].join();
+			workers.clear();
+		}
+
+	public:
+		/// All hardware threads less one, as the calling thread takes part in the work.
+		static int DefaultWorkerCount()
+		{
+			int hardwareThreads = (int)std::thread::hardware_concurrency();
+			return hardwareThreads > 1 ? hardwareThreads - 1 : 0;
+		}
+
+		explicit ThreadPool(int workerCount = DefaultWorkerCount())
+		{
+			Start(workerCount);
+		}
+
+		~ThreadPool()
+		{
+			Stop();
+		}
+
+		int GetWorkerCount() const { return (int)workers.size(); }
+
+		/// Threads that execute a ParallelFor, including the caller.
+		int GetConcurrency() const { return (int)workers.size() + 1; }
+
+		/// Must not be called while a ParallelFor is running.
+		void SetWorkerCount(int workerCount)
+		{
+			if (workerCount < 0)
+				workerCount = 0;
+			if (workerCount == GetWorkerCount())
+				return;
+
+			Stop();
+			Start(workerCount);
+		}
+
+		/// Calls body(first, last) over [begin, end) in chunks of at most grainSize and returns once all have run.
+		void ParallelFor(int begin, int end, int grainSize, const std::function<void(int, int)> &body)
+		{
+			if (end <= begin)
+				return;
+
+			grainSize = std::max(grainSize, 1);
+			if (workers.empty() || end - begin <= grainSize)
+			{
+				body(begin, end);
+				return;
+			}
+
+			//the chunks are handed out round robin so each worker starts with its own share
+			std::atomic<int> remaining((end - begin + grainSize - 1) / grainSize);
+			int queue = 0;
+			for (int first = begin; first < end; first += grainSize)
+			{
+				int last = std::min(first + grainSize, end);
+				Task task = [&body, &remaining, first, last]()
+				{
+					body(first, last);
+					--remaining;
+				};
+
+				WorkQueue &target = *queues[queue];
+				{
+					std::lock_guard<std::mutex> guard(target.lock);
+					target.tasks.push_back(std::move(task));
+				}
+				++queuedTasks;
+				queue = (queue + 1) % (int)queues.size();
+			}
+
+			{
+				std::lock_guard<std::mutex> guard(sleepLock);
+			}
+			wake.notify_all();
+
+			int callerQueue = (int)queues.size() - 1;
+			while (remaining > 0)
+			{
+				if (!RunOne(callerQueue))
+					std::this_thread::yield();
+			}
+		}
+
+		/// Splits [0, count) into about four chunks per thread, never smaller than minGrain.
+		int GetGrainSize(int count, int minGrain = 1) const
+		{
+			int chunks = GetConcurrency() * 4;
+			return std::max((count + chunks - 1) / chunks, minGrain);
+		}
+	};
+}
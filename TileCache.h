@@ -0,0 +1,114 @@
+#pragma once
+
+#include <cstddef>
+#include <list>
+#include <unordered_map>
+
+namespace Terrain
+{
+	/// Least recently used cache of tiles keyed by integer tile coordinate.
+	/// Tile objects are never freed while the cache lives: once it is full the oldest tile is handed back
+	/// for reuse, so memory stays flat however many different tiles are requested.
+	template <class Tile>
+	class TileCache
+	{
+	public:
+		struct Entry
+		{
+			int tileX;
+			int tileZ;
+			Tile tile;
+		};
+
+	private:
+		typedef std::list<Entry> EntryList;
+
+		//most recently used at the front
+		EntryList entries;
+
+		//cleared entries kept around for reuse
+		EntryList spare;
+
+		std::unordered_map<unsigned long long, typename EntryList::iterator> lookup;
+		size_t capacity;
+
+		static unsigned long long GetKey(int tileX, int tileZ)
+		{
+			return ((unsigned long long)(unsigned)tileX << 32) | (unsigned)tileZ;
+		}
+
+	public:
+		explicit TileCache(size_t capacity) : capacity(capacity > 0 ? capacity : 1)
+		{
+		}
+
+		size_t GetCapacity() const { return capacity; }
+		size_t GetSize() const { return entries.size(); }
+
+		bool Contains(int tileX, int tileZ) const
+		{
+			return lookup.find(GetKey(tileX, tileZ)) != lookup.end();
+		}
+
+		/// Returns the resident tile and marks it most recently used, or null if it is not cached.
+		Tile *Find(int tileX, int tileZ)
+		{
+			auto found = lookup.find(GetKey(tileX, tileZ));
+			if (found == lookup.end())
+				return nullptr;
+
+			entries.splice(entries.begin(), entries, found->second);
+			return &found->second->tile;
+		}
+
+		/// Returns the tile for (tileX, tileZ). When it was not resident, isNew is set and the returned
+		/// tile is either freshly constructed or a recycled one still holding another tile's contents.
+		Tile &Acquire(int tileX, int tileZ, bool &isNew)
+		{
+			Tile *resident = Find(tileX, tileZ);
+			isNew = resident == nullptr;
+			if (resident)
+				return *resident;
+
+			if (!spare.empty())
+			{
+				entries.splice(entries.begin(), spare, spare.begin());
+			}
+			else if (entries.size() < capacity)
+			{
+				//built in place, tiles need not be copyable
+				entries.emplace_front();
+			}
+			else
+			{
+				//recycle the least recently used tile
+				Entry &oldest = entries.back();
+				lookup.erase(GetKey(oldest.tileX, oldest.tileZ));
+				entries.splice(entries.begin(), entries, std::prev(entries.end()));
+			}
+
+			Entry &entry = entries.front();
+			entry.tileX = tileX;
+			entry.tileZ = tileZ;
+			lookup[GetKey(tileX, tileZ)] = entries.begin();
+			return entry.tile;
+		}
+
+		/// Forgets every tile but keeps the objects for reuse.
+		void Clear()
+		{
+			lookup.clear();
+			spare.splice(spare.end(), entries);
+		}
+
+		/// Visits resident and spare tiles alike, e.g. to release resources they hold.
+		template <class Visitor>
+		void ForEachTile(Visitor visitor)
+		{
+			for (auto it = entries.begin(); it != entries.end(); ++it)
+				visitor(it->tile);
+			for (auto it = spare.begin(); it != spare.end(); ++it)
+				visitor(it->tile);
+		}
+	};
+}
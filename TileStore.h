@@ -0,0 +1,396 @@
+#pragma once
+#include "MappedFile.h"
+#include "TerrainGenerator.h"
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+namespace Terrain
+{
+	/// On-disk layout of a tile store, in the writing host's byte order since tiles are read straight from the
+	/// mapping. A store from a host of the other order fails the version check.
+	///
+	///   TileStoreHeader
+	///   TileStoreEntry[tilesX * tilesZ]     row major, entry (0, 0) is tile (firstTileX, firstTileZ)
+	///   tile blocks, each 64 byte aligned, one mip level after another:
+	///     heights  float[size * stride]     size = (tileCells >> level) + 1, rows padded like Heightfield
+	///     normals  float[size * size * 3]   unit length, padded to 64 bytes
+	///
+	/// Level l keeps every 2^l th sample of level 0. Its normals come from central differences at that spacing,
+	/// taken from a border generated around the tile, so they match the neighbouring tiles' normals exactly.
+	struct TileStoreHeader
+	{
+		char magic[4];
+		uint32_t version;
+		uint32_t headerSize;
+		uint32_t tileCells;
+		uint32_t mipLevels;
+		int32_t firstTileX;
+		int32_t firstTileZ;
+		uint32_t tilesX;
+		uint32_t tilesZ;
+		uint32_t seed;
+		uint32_t algorithm;
+		float sampleSpacing;
+		float heightScale;
+		uint32_t reserved;
+		uint64_t indexOffset;
+	};
+
+	struct TileStoreEntry
+	{
+		uint64_t offset; //0 until the tile has been written
+		uint64_t size;
+		float minHeight;
+		float maxHeight;
+	};
+
+	/// Where each mip level sits inside a tile block, the same for every tile in a store.
+	struct TileStoreLayout
+	{
+		static const uint32_t alignment = 64;
+		static const int floatsPerLine = (int)(alignment / sizeof(float));
+
+		static uint64_t Align(uint64_t offset) { return (offset + alignment - 1) / alignment * alignment; }
+
+		static int GetSize(int tileCells, int level) { return (tileCells >> level) + 1; }
+		static int GetStride(int size) { return (size + floatsPerLine - 1) / floatsPerLine * floatsPerLine; }
+		static uint64_t GetHeightsBytes(int size) { return (uint64_t)size * GetStride(size) * sizeof(float); }
+		static uint64_t GetNormalsBytes(int size) { return Align((uint64_t)size * size * 3 * sizeof(float)); }
+
+		/// Offset of the level's heights from the start of the block, normals follow the heights.
+		static uint64_t GetLevelOffset(int tileCells, int level)
+		{
+			uint64_t offset = 0;
+			for (int i = 0; i < level; ++i)
+			{
+				int size = GetSize(tileCells, i);
+				offset += GetHeightsBytes(size) + GetNormalsBytes(size);
+			}
+			return offset;
+		}
+
+		static uint64_t GetBlockSize(int tileCells, int mipLevels) { return GetLevelOffset(tileCells, mipLevels); }
+	};
+
+	/// Read-only view of a tile store. The file is memory mapped and tiles are served straight from the mapping,
+	/// so opening a store costs nothing up front and untouched tiles are never read from disk.
+	class TileStore
+	{
+	public:
+		static const uint32_t version = 1;
+
+		/// Largest tile a store may hold, which keeps every level's size and stride in an int.
+		static const uint32_t maxTileCells = 1u << 16;
+
+		/// One mip level of one tile, pointing into the mapping. Valid until the store is closed.
+		struct Level
+		{
+			const float *heights;
+			const float *normals;
+			int size;
+			int stride;
+			float minHeight;
+			float maxHeight;
+
+			const float *GetRow(int z) const { return heights + (size_t)z * stride; }
+		};
+
+	private:
+		MappedFile file;
+		const unsigned char *mapping = nullptr;
+		uint64_t mappingSize = 0;
+		const TileStoreHeader *header = nullptr;
+		const TileStoreEntry *entries = nullptr;
+
+		bool Validate() const
+		{
+			if (mappingSize < sizeof(TileStoreHeader))
+				return false;
+			if (memcmp(header->magic, "TTSH", 4) != 0 || header->version != version || header->headerSize < sizeof(TileStoreHeader))
+				return false;
+			if (header->tileCells == 0 || header->mipLevels == 0 || header->mipLevels > 16 || header->tileCells % (1u << (header->mipLevels - 1)) != 0)
+				return false;
+
+			//sizes and offsets come from the file, so they are checked by subtraction where a sum could wrap
+			if (header->tileCells > maxTileCells || header->tilesX > (uint32_t)INT32_MAX || header->tilesZ > (uint32_t)INT32_MAX)
+				return false;
+			uint64_t tileCount = (uint64_t)header->tilesX * header->tilesZ;
+			if (tileCount > mappingSize / sizeof(TileStoreEntry))
+				return false;
+			uint64_t indexSize = tileCount * sizeof(TileStoreEntry);
+			if (header->indexOffset % sizeof(uint64_t) != 0 || header->indexOffset > mappingSize || indexSize > mappingSize - header->indexOffset)
+				return false;
+
+			//every written tile must lie inside the file and be aligned so the views are too
+			uint64_t blockSize = TileStoreLayout::GetBlockSize(header->tileCells, header->mipLevels);
+			const TileStoreEntry *index = (const TileStoreEntry*)(mapping + header->indexOffset);
+			for (uint64_t i = 0; i < tileCount; ++i)
+			{
+				if (index[i].offset == 0)
+					continue;
+				if (index[i].offset % TileStoreLayout::alignment != 0 || index[i].size != blockSize ||
+					index[i].offset > mappingSize || blockSize > mappingSize - index[i].offset)
+					return false;
+			}
+			return true;
+		}
+
+	public:
+		TileStore()
+		{
+		}
+
+		~TileStore()
+		{
+			Close();
+		}
+
+		bool Open(const char *path)
+		{
+			Close();
+			if (!file.Open(path))
+				return false;
+
+			mapping = file.GetData();
+			mappingSize = file.GetSize();
+			header = (const TileStoreHeader*)mapping;
+			if (!Validate())
+			{
+				Close();
+				return false;
+			}
+
+			entries = (const TileStoreEntry*)(mapping + header->indexOffset);
+			return true;
+		}
+
+		void Close()
+		{
+			file.Close();
+			mapping = nullptr;
+			mappingSize = 0;
+			header = nullptr;
+			entries = nullptr;
+		}
+
+		bool IsOpen() const { return mapping != nullptr; }
+		const TileStoreHeader &GetHeader() const { return *header; }
+
+		bool HasTile(int tileX, int tileZ) const
+		{
+			const TileStoreEntry *entry = GetEntry(tileX, tileZ);
+			return entry && entry->offset != 0;
+		}
+
+		const TileStoreEntry *GetEntry(int tileX, int tileZ) const
+		{
+			if (!header)
+				return nullptr;
+			int x = tileX - header->firstTileX;
+			int z = tileZ - header->firstTileZ;
+			if (x < 0 || z < 0 || x >= (int)header->tilesX || z >= (int)header->tilesZ)
+				return nullptr;
+			return &entries[(size_t)z * header->tilesX + x];
+		}
+
+		/// Points level at the tile's data inside the mapping, no copy is made.
+		bool GetLevel(int tileX, int tileZ, int level, Level &out) const
+		{
+			const TileStoreEntry *entry = GetEntry(tileX, tileZ);
+			if (!entry || entry->offset == 0 || level < 0 || level >= (int)header->mipLevels)
+				return false;
+
+			int size = TileStoreLayout::GetSize(header->tileCells, level);
+			const unsigned char *block = mapping + entry->offset + TileStoreLayout::GetLevelOffset(header->tileCells, level);
+			out.heights = (const float*)block;
+			out.normals = (const float*)(block + TileStoreLayout::GetHeightsBytes(size));
+			out.size = size;
+			out.stride = TileStoreLayout::GetStride(size);
+			out.minHeight = entry->minHeight;
+			out.maxHeight = entry->maxHeight;
+			return true;
+		}
+	};
+
+	/// Writes a tile store one tile at a time. Only the index and the tile being written are held in memory,
+	/// so maps far larger than RAM can be generated. The index is rewritten by Flush, which Close calls.
+	class TileStoreWriter
+	{
+		FILE *file = nullptr;
+		TileStoreHeader header;
+		std::vector<TileStoreEntry> index;
+		uint64_t end = 0;
+
+		//scratch for one tile
+		Heightfield haloHeights;
+		std::vector<unsigned char> block;
+
+		static bool Seek(FILE *stream, uint64_t offset)
+		{
+#if defined(_WIN32)
+			return _fseeki64(stream, (__int64)offset, SEEK_SET) == 0;
+#else
+			return fseeko(stream, (off_t)offset, SEEK_SET) == 0;
+#endif
+		}
+
+		bool WriteAt(uint64_t offset, const void *data, size_t size)
+		{
+			return Seek(file, offset) && fwrite(data, 1, size, file) == size;
+		}
+
+	public:
+		TileStoreWriter()
+		{
+			memset(&header, 0, sizeof(header));
+		}
+
+		~TileStoreWriter()
+		{
+			Close();
+		}
+
+		/// Border of samples generated around every tile, enough for central differences on the coarsest level.
+		int GetBorder() const { return 1 << (header.mipLevels - 1); }
+
+		/// Creates the file covering tilesX x tilesZ tiles of tileCells cells, starting at tile (firstTileX, firstTileZ).
+		/// tileCells must be divisible by 2^(mipLevels - 1). Normals are built for the given height scale and spacing.
+		bool Open(const char *path, int tileCells, int mipLevels, int firstTileX, int firstTileZ, int tilesX, int tilesZ, float sampleSpacing, float heightScale)
+		{
+			Close();
+			if (tileCells <= 0 || (uint32_t)tileCells > TileStore::maxTileCells || mipLevels <= 0 || mipLevels > 16 || tileCells % (1 << (mipLevels - 1)) != 0 ||
+				tilesX <= 0 || tilesZ <= 0)
+				return false;
+
+			file = fopen(path, "wb");
+			if (!file)
+				return false;
+
+			memset(&header, 0, sizeof(header));
+			memcpy(header.magic, "TTSH", 4);
+			header.version = TileStore::version;
+			header.headerSize = sizeof(TileStoreHeader);
+			header.tileCells = tileCells;
+			header.mipLevels = mipLevels;
+			header.firstTileX = firstTileX;
+			header.firstTileZ = firstTileZ;
+			header.tilesX = tilesX;
+			header.tilesZ = tilesZ;
+			header.sampleSpacing = sampleSpacing;
+			header.heightScale = heightScale;
+			header.indexOffset = TileStoreLayout::Align(sizeof(TileStoreHeader));
+
+			TileStoreEntry empty = { 0, 0, 0.0f, 0.0f };
+			index.assign((size_t)tilesX * tilesZ, empty);
+			end = TileStoreLayout::Align(header.indexOffset + index.size() * sizeof(TileStoreEntry));
+
+			block.resize((size_t)TileStoreLayout::GetBlockSize(tileCells, mipLevels));
+			return Flush();
+		}
+
+		/// Generates a tile with a world continuous algorithm and appends it to the file.
+		bool GenerateTile(TerrainGenerator &generator, TerrainGenerator::Algorithm algorithm, int tileX, int tileZ)
+		{
+			if (!file || !TerrainGenerator::IsWorldContinuous(algorithm))
+				return false;
+
+			header.seed = generator.GetSeed();
+			header.algorithm = (uint32_t)algorithm;
+
+			int border = GetBorder();
+			int samples = header.tileCells + 1 + border * 2;
+			return generator.GenerateRegion(algorithm, tileX * (int)header.tileCells - border, tileZ * (int)header.tileCells - border, samples, samples, haloHeights) &&
+				WriteTile(tileX, tileZ, haloHeights);
+		}
+
+		/// Appends a tile from heights covering it plus GetBorder() samples on every side.
+		/// Writing a tile again appends a fresh copy and points the index at it.
+		bool WriteTile(int tileX, int tileZ, const Heightfield &bordered)
+		{
+			int x = tileX - header.firstTileX;
+			int z = tileZ - header.firstTileZ;
+			int border = GetBorder();
+			int tileCells = (int)header.tileCells;
+			if (!file || x < 0 || z < 0 || x >= (int)header.tilesX || z >= (int)header.tilesZ)
+				return false;
+			if (bordered.GetWidth() != tileCells + 1 + border * 2 || bordered.GetDepth() != tileCells + 1 + border * 2)
+				return false;
+
+			memset(&block[0], 0, block.size());
+
+			float minHeight = 999999.0f;
+			float maxHeight = -999999.0f;
+			for (int level = 0; level < (int)header.mipLevels; ++level)
+			{
+				int step = 1 << level;
+				int size = TileStoreLayout::GetSize(tileCells, level);
+				int stride = TileStoreLayout::GetStride(size);
+				unsigned char *levelData = &block[(size_t)TileStoreLayout::GetLevelOffset(tileCells, level)];
+				float *heights = (float*)levelData;
+				float *normals = (float*)(levelData + TileStoreLayout::GetHeightsBytes(size));
+
+				float slopeScale = header.heightScale / (2.0f * step * header.sampleSpacing);
+				for (int lz = 0; lz < size; ++lz)
+				{
+					int sz = border + lz * step;
+					for (int lx = 0; lx < size; ++lx)
+					{
+						int sx = border + lx * step;
+						float height = bordered(sx, sz);
+						heights[lz * stride + lx] = height;
+
+						if (level == 0)
+						{
+							minHeight = height < minHeight ? height : minHeight;
+							maxHeight = height > maxHeight ? height : maxHeight;
+						}
+
+						float dx = (bordered(sx + step, sz) - bordered(sx - step, sz)) * slopeScale;
+						float dz = (bordered(sx, sz + step) - bordered(sx, sz - step)) * slopeScale;
+						float length = std::sqrt(dx * dx + 1.0f + dz * dz);
+
+						float *normal = normals + ((size_t)lz * size + lx) * 3;
+						normal[0] = -dx / length;
+						normal[1] = 1.0f / length;
+						normal[2] = -dz / length;
+					}
+				}
+			}
+
+			if (!WriteAt(end, &block[0], block.size()))
+				return false;
+
+			TileStoreEntry &entry = index[(size_t)z * header.tilesX + x];
+			entry.offset = end;
+			entry.size = block.size();
+			entry.minHeight = minHeight;
+			entry.maxHeight = maxHeight;
+			end += block.size();
+			return true;
+		}
+
+		/// Writes the header and index so the tiles written so far can be read, generation can carry on afterwards.
+		bool Flush()
+		{
+			if (!file)
+				return false;
+			bool ok = WriteAt(0, &header, sizeof(header));
+			ok = ok && WriteAt(header.indexOffset, &index[0], index.size() * sizeof(TileStoreEntry));
+			return fflush(file) == 0 && ok;
+		}
+
+		bool Close()
+		{
+			if (!file)
+				return true;
+			bool ok = Flush();
+			ok = fclose(file) == 0 && ok;
+			file = nullptr;
+			return ok;
+		}
+	};
+}
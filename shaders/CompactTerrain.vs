@@ -0,0 +1,52 @@
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// vertex shader for the compact terrain vertex, rebuilds what default.vs gets as floats
+//
+
+// matrices
+uniform mat4 modelToProjection;
+uniform mat4 modelToCamera;
+
+// heights are quantised against the map's range
+uniform vec2 heightRange;
+
+// x and z: distance between samples, z and w: uv change per sample
+uniform vec4 gridScale;
+
+// grid x, quantised height, grid z
+attribute vec3 pos;
+
+// octahedral normal, each component normalised to [0, 1]
+attribute vec2 normal;
+
+// outputs
+varying vec2 uv_;
+varying vec3 normal_;
+varying vec3 camera_pos_;
+varying vec4 color_;
+varying vec3 model_pos_;
+
+vec3 decodeNormal(vec2 encoded)
+{
+  vec2 e = encoded * 2.0 - 1.0;
+  vec3 n = vec3(e.x, 1.0 - abs(e.x) - abs(e.y), e.y);
+  if (n.y < 0.0)
+  {
+    vec2 s = vec2(e.x >= 0.0 ? 1.0 : -1.0, e.y >= 0.0 ? 1.0 : -1.0);
+    n.xz = (1.0 - abs(e.yx)) * s;
+  }
+  return normalize(n);
+}
+
+void main()
+{
+  float height = heightRange.x + pos.y / 65535.0 * (heightRange.y - heightRange.x);
+  vec4 model_pos = vec4(pos.x * gridScale.x, height, pos.z * gridScale.y, 1.0);
+
+  gl_Position = modelToProjection * model_pos;
+  normal_ = (modelToCamera * vec4(decodeNormal(normal), 0.0)).xyz;
+  camera_pos_ = (modelToCamera * model_pos).xyz;
+  uv_ = pos.xz * gridScale.zw;
+  color_ = vec4(1.0, 1.0, 1.0, 1.0);
+  model_pos_ = model_pos.xyz;
+}
@@ -23,16 +23,17 @@ uniform sampler2D layer2;
 uniform sampler2D layer3;
 uniform sampler2D layer4;
 
+// weights of layers 1 to 4 per sample, layer 0 takes what they leave
+uniform sampler2D splat;
+
+// x and y: splat texture coordinate per unit of model x and z, z and w: half a texel
+// zero turns the splat map off and the layers are blended by height instead
+uniform vec4 splatScale;
+
 void main() 
 {
   vec3 nnormal = normalize(normal_);
 
-  float fRange1 = 0.25;
-  float fRange2 = 0.5;  
-  float fRange3 = 0.75;
-
-  float range = heightRange.y - heightRange.x;
-  
   vec3 npos = camera_pos_;
   vec3 diffuse_light = lighting[0].xyz;
   for (int i = 0; i != num_lights; ++i) 
@@ -45,32 +46,24 @@ void main()
     diffuse_light += diffuse_factor * light_color;
   }
 
-  vec4 colourDiffuse;
-  float heightPercentage = (model_pos_.y - heightRange.x) / range;
-  if(heightPercentage < fRange1)
-  {
-    vec4 cRange0 = vec4(texture2D(layer0, vec2(uv_)).xyz, 1.0);
-    vec4 cRange1 = vec4(texture2D(layer1, vec2(uv_)).xyz, 1.0);
-    colourDiffuse = mix(cRange0, cRange1, (heightPercentage - 0.0) / (fRange1 - 0.0));
-  }
-  else if(heightPercentage < fRange2)
+  // the same for every fragment of a draw, so neither side diverges
+  vec4 weights;
+  if (splatScale.x > 0.0)
   {
-    vec4 cRange1 = vec4(texture2D(layer1, vec2(uv_)).xyz, 1.0);
-    vec4 cRange2 = vec4(texture2D(layer2, vec2(uv_)).xyz, 1.0);
-    colourDiffuse = mix(cRange1, cRange2, (heightPercentage - fRange1) / (fRange2 - fRange1));
-  }
-  else if(heightPercentage < fRange3)
-  {
-    vec4 cRange2 = vec4(texture2D(layer2, vec2(uv_)).xyz, 1.0);
-    vec4 cRange3 = vec4(texture2D(layer3, vec2(uv_)).xyz, 1.0);
-    colourDiffuse = mix(cRange2, cRange3, (heightPercentage - fRange2) / (fRange3 - fRange2));
+    weights = texture2D(splat, model_pos_.xz * splatScale.xy + splatScale.zw);
   }
   else
   {
-    vec4 cRange3 = vec4(texture2D(layer3, vec2(uv_)).xyz, 1.0);
-    vec4 cRange4 = vec4(texture2D(layer4, vec2(uv_)).xyz, 1.0);
-    colourDiffuse = mix(cRange3, cRange4, (heightPercentage - fRange3) / (1.0 - fRange3));      
+    // even bands, each layer peaking a quarter of the range above the last and fading into its neighbours
+    float heightPercentage = clamp((model_pos_.y - heightRange.x) / (heightRange.y - heightRange.x), 0.0, 1.0);
+    weights = max(1.0 - abs(heightPercentage * 4.0 - vec4(1.0, 2.0, 3.0, 4.0)), 0.0);
   }
-  gl_FragColor = vec4(colourDiffuse.xyz * diffuse_light, 1.0);
-}
+  float baseWeight = max(1.0 - dot(weights, vec4(1.0)), 0.0);
 
+  vec3 colourDiffuse = texture2D(layer0, uv_).xyz * baseWeight +
+    texture2D(layer1, uv_).xyz * weights.x +
+    texture2D(layer2, uv_).xyz * weights.y +
+    texture2D(layer3, uv_).xyz * weights.z +
+    texture2D(layer4, uv_).xyz * weights.w;
+  gl_FragColor = vec4(colourDiffuse * diffuse_light, 1.0);
+}